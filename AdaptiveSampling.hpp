@@ -0,0 +1,138 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include <Eigen/Dense>
+#include "PathTracer.hpp"
+
+// Adaptive anti-aliasing: more than one ray through each pixel, averaged, but only as many
+// as the pixel needs.
+//
+// Every pixel starts with a few samples. Then, in rounds, the pixels that look least
+// converged get more: pixels whose samples disagree (their mean has a large standard
+// error), or that sit on an edge in the image so far (a big jump in brightness relative
+// to their neighbours either side). Most of an image is flat, so the rays end up along
+// silhouettes, shadow edges and reflections, rather than 16 times over everywhere. A
+// pixel's samples double each round, up to maxSamples, and the rounds stop when
+// every pixel is good enough or the frame's budget of rays is spent.
+//
+// Errors are judged on roughly gamma-encoded values (the square root of the colour), so
+// dark and bright pixels are treated alike, as they are once they're 8-bit.
+//
+// Where the samples go in each pixel is fixed (see samplePosition), and the planning is
+// done on one thread in pixel order, so the image doesn't depend on threads or tiles.
+
+/// <summary>
+/// How to anti-alias a frame.
+/// </summary>
+struct AdaptiveSampling {
+	int minSamples = 0;       // Samples every pixel starts with; 0 for one ray through each pixel's corner.
+	int maxSamples = 16;      // Most samples any one pixel gets.
+	float budget = 4.f;       // Most samples per pixel on average, over the rows being rendered.
+	float threshold = 0.002f; // Pixels whose estimated error is below this get no more samples.
+};
+
+/// <summary>
+/// The samples a pixel has had so far.
+/// </summary>
+struct PixelSamples {
+	Eigen::Vector3f sum = Eigen::Vector3f::Zero();
+	Eigen::Vector3f encodedSum = Eigen::Vector3f::Zero(), encodedSumSquares = Eigen::Vector3f::Zero();
+	int n = 0;
+
+	void add(const Eigen::Vector3f& colour)
+	{
+		Eigen::Vector3f encoded = colour.cwiseMax(0.f).cwiseMin(1.f).cwiseSqrt();
+		sum += colour;
+		encodedSum += encoded;
+		encodedSumSquares += encoded.cwiseProduct(encoded);
+		++n;
+	}
+
+	Eigen::Vector3f mean() const
+	{
+		return sum / static_cast<float>(n);
+	}
+
+	Eigen::Vector3f encodedMean() const
+	{
+		return encodedSum / static_cast<float>(n);
+	}
+
+	/// <summary>
+	/// Standard error of the (encoded) mean, in the worst channel.
+	/// </summary>
+	float standardError() const
+	{
+		if (n < 2) return 0.f;
+		Eigen::Vector3f variance = (encodedSumSquares - encodedSum.cwiseProduct(encodedSum) / static_cast<float>(n)) / static_cast<float>(n - 1);
+		return sqrtf(std::max(0.f, variance.maxCoeff()) / n);
+	}
+};
+
+/// <summary>
+/// Where sample number sample of a pixel (numbered across the whole image) goes, from its
+/// corner, in [0, 1) x [0, 1). The samples follow the R2 sequence, so however many the pixel
+/// gets they're spread evenly over it, shifted by a different amount in each pixel so the
+/// pattern doesn't line up from pixel to pixel.
+/// </summary>
+Eigen::Vector2f samplePosition(uint64_t pixel, int sample)
+{
+	uint64_t bits = mixBits(pixel);
+	float shiftX = static_cast<float>(bits >> 40) * (1.f / 16777216.f);
+	float shiftY = static_cast<float>((bits >> 8) & 0xFFFFFF) * (1.f / 16777216.f);
+	float x = shiftX + sample * 0.7548776662f, y = shiftY + sample * 0.5698402910f;
+	return Eigen::Vector2f(x - floorf(x), y - floorf(y));
+}
+
+/// <summary>
+/// Plans the next round of samples for a width x height block of pixels: extra[i] is set to
+/// the number of samples pixel i should get next (pixels are in rows, as in pixels). The
+/// pixels with the largest errors go first, each doubling its samples (up to
+/// settings.maxSamples), until budget samples have been handed out.
+/// </summary>
+/// <returns>The number of samples handed out (0 when every pixel is good enough).</returns>
+int64_t planSamples(const std::vector<PixelSamples>& pixels, int width, int height, const AdaptiveSampling& settings,
+	int64_t budget, std::vector<int>& extra)
+{
+	int nPixels = width * height;
+	extra.assign(nPixels, 0);
+	if (budget <= 0) return 0;
+
+	thread_local std::vector<Eigen::Vector3f> means;
+	thread_local std::vector<std::pair<float, int>> candidates; // Error, then pixel.
+	means.resize(nPixels);
+	for (int i = 0; i < nPixels; ++i) means[i] = pixels[i].encodedMean();
+
+	candidates.clear();
+	for (int y = 0; y < height; ++y)
+		for (int x = 0; x < width; ++x) {
+			int i = y * width + x;
+			const PixelSamples& pixel = pixels[i];
+			if (pixel.n >= settings.maxSamples) continue;
+
+			// An edge shows up as a jump away from the straight line through the neighbours
+			// either side. Half a jump across the pixel is about what its samples' spread
+			// would be if it were split between the two sides.
+			float jump = 0.f;
+			if (x > 0 && x + 1 < width) jump = std::max(jump, (means[i - 1] + means[i + 1] - 2.f * means[i]).cwiseAbs().maxCoeff());
+			if (y > 0 && y + 1 < height) jump = std::max(jump, (means[i - width] + means[i + width] - 2.f * means[i]).cwiseAbs().maxCoeff());
+			float error = std::max(pixel.standardError(), 0.5f * jump / sqrtf(static_cast<float>(pixel.n)));
+			if (error > settings.threshold) candidates.push_back({ error, i });
+		}
+	std::sort(candidates.begin(), candidates.end(), [](const std::pair<float, int>& a, const std::pair<float, int>& b) {
+		return a.first > b.first || (a.first == b.first && a.second < b.second);
+	});
+
+	int64_t handedOut = 0;
+	for (const std::pair<float, int>& candidate : candidates) {
+		const PixelSamples& pixel = pixels[candidate.second];
+		int64_t samples = std::min<int64_t>(std::min(pixel.n, settings.maxSamples - pixel.n), budget - handedOut);
+		extra[candidate.second] = static_cast<int>(samples);
+		handedOut += samples;
+		if (handedOut == budget) break;
+	}
+	return handedOut;
+}
@@ -0,0 +1,345 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <future>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <Eigen/Dense>
+#include <lodepng.h>
+#include "Denoise.hpp"
+#include "Framebuffer.hpp"
+#include "ParallelDeflate.hpp"
+#include "Render.hpp"
+#include "Scene.hpp"
+#include "Sphere.hpp"
+#include "ThreadPool.hpp"
+
+// Rendering a sequence of frames, with the camera and spheres moving between them, in one
+// run, rather than starting the program (and loading the scene and building the BVH) once
+// per frame.
+//
+// The motion comes from a text file of keyframes, one per line, with # to the end of a line
+// a comment and angles in degrees, like a scene file (see SceneFile.hpp):
+//
+//   frames N                                           how many frames to render (0 to N-1)
+//   camera FRAME  px py pz  dx dy dz  ux uy uz  fov    where the camera is at FRAME
+//   sphere FRAME INDEX  x y z  radius                  where sphere INDEX is at FRAME
+//
+// FRAME can be fractional. Between keyframes things move in a straight line (and the
+// camera's direction and up are renormalized); before the first and after the last they
+// stay put. A sphere without keyframes doesn't move, and nor does the camera if it has
+// none. Spheres keep their materials and colours from the scene.
+//
+// Each frame, the spheres are moved and the BVH refitted to them (see Scene::refitBVH),
+// then the frame is rendered. Its PNG is compressed and saved on the pool while the next
+// frame renders.
+
+/// <summary>
+/// The camera at one keyframe.
+/// </summary>
+struct CameraKey {
+	float frame;
+	Camera camera;
+};
+
+/// <summary>
+/// A sphere's centre and radius at one keyframe.
+/// </summary>
+struct SphereKey {
+	float frame;
+	Eigen::Vector3f centre;
+	float radius;
+};
+
+/// <summary>
+/// The keyframes of one sphere, in order.
+/// </summary>
+struct SphereTrack {
+	int sphere; // Index into Scene::spheres.
+	std::vector<SphereKey> keys;
+};
+
+/// <summary>
+/// Where keys surrounding frame are: before (the last at or before frame) and after (the
+/// first after it), and how far frame is from one to the other. Keys must be in order.
+/// Before the first key, or from the last on, both are the same key.
+/// </summary>
+template<typename Key>
+void findKeys(const std::vector<Key>& keys, float frame, size_t& before, size_t& after, float& t)
+{
+	auto later = std::upper_bound(keys.begin(), keys.end(), frame, [](float f, const Key& key) { return f < key.frame; });
+	after = std::min(static_cast<size_t>(later - keys.begin()), keys.size() - 1);
+	before = later == keys.begin() ? 0 : static_cast<size_t>(later - keys.begin()) - 1;
+	t = before == after ? 0.f : (frame - keys[before].frame) / (keys[after].frame - keys[before].frame);
+}
+
+/// <summary>
+/// The keyframes read from an animation file (see the top of this file).
+/// </summary>
+struct Animation {
+	int nFrames = 0;
+	std::vector<CameraKey> cameraKeys; // In order.
+	std::vector<SphereTrack> sphereTracks; // In order of sphere, each with its keys in order.
+
+	/// <summary>
+	/// The camera at frame, or still if there are no camera keyframes. A frame that's on a
+	/// keyframe gets exactly that keyframe's camera.
+	/// </summary>
+	Camera cameraAt(float frame, const Camera& still) const
+	{
+		if (cameraKeys.empty()) return still;
+		size_t before, after;
+		float t;
+		findKeys(cameraKeys, frame, before, after, t);
+		if (t == 0.f) return cameraKeys[before].camera;
+		const Camera& a = cameraKeys[before].camera;
+		const Camera& b = cameraKeys[after].camera;
+		Camera camera;
+		camera.position = a.position + t * (b.position - a.position);
+		camera.direction = (a.direction + t * (b.direction - a.direction)).normalized();
+		camera.up = (a.up + t * (b.up - a.up)).normalized();
+		camera.horzFov = a.horzFov + t * (b.horzFov - a.horzFov);
+		return camera;
+	}
+
+	/// <summary>
+	/// Moves the spheres that have keyframes to where they are at frame.
+	/// </summary>
+	/// <returns>True if any of them moved or changed size.</returns>
+	bool moveSpheres(float frame, std::vector<Sphere>& spheres) const
+	{
+		bool moved = false;
+		for (const SphereTrack& track : sphereTracks) {
+			size_t before, after;
+			float t;
+			findKeys(track.keys, frame, before, after, t);
+			const SphereKey& a = track.keys[before];
+			const SphereKey& b = track.keys[after];
+			Eigen::Vector3f centre = t == 0.f ? a.centre : Eigen::Vector3f(a.centre + t * (b.centre - a.centre));
+			float radius = t == 0.f ? a.radius : a.radius + t * (b.radius - a.radius);
+			Sphere& sphere = spheres[track.sphere];
+			if (sphere.centre != centre || sphere.radius != radius) {
+				sphere.centre = centre;
+				sphere.radius = radius;
+				moved = true;
+			}
+		}
+		return moved;
+	}
+};
+
+/// <summary>
+/// Reads an animation file's text (see the top of this file). Throws std::runtime_error,
+/// saying which line is wrong, if it isn't one.
+/// </summary>
+void readAnimationText(std::istream& in, Animation& animation)
+{
+	const float degrees = 3.14159265358979f / 180.f;
+	animation = Animation();
+	std::map<int, std::vector<SphereKey>> sphereKeys;
+	std::string line;
+	for (int lineNumber = 1; std::getline(in, line); ++lineNumber) {
+		size_t comment = line.find('#');
+		if (comment != std::string::npos) line.erase(comment);
+		std::istringstream fields(line);
+		std::string keyword;
+		if (!(fields >> keyword)) continue;
+
+		auto fail = [&](const std::string& problem) {
+			return std::runtime_error("Animation line " + std::to_string(lineNumber) + ": " + problem);
+		};
+		auto readFloat = [&]() {
+			float value;
+			if (!(fields >> value)) throw fail("expected a number after \"" + keyword + "\".");
+			return value;
+		};
+		auto readVector = [&]() {
+			float x = readFloat(), y = readFloat();
+			return Eigen::Vector3f(x, y, readFloat());
+		};
+		auto readIndex = [&]() {
+			int value;
+			if (!(fields >> value) || value < 0) throw fail("expected a count or index (0 or more) after \"" + keyword + "\".");
+			return value;
+		};
+
+		if (keyword == "frames") {
+			animation.nFrames = readIndex();
+		}
+		else if (keyword == "camera") {
+			CameraKey key;
+			key.frame = readFloat();
+			key.camera.position = readVector();
+			key.camera.direction = readVector();
+			key.camera.up = readVector();
+			key.camera.horzFov = readFloat() * degrees;
+			animation.cameraKeys.push_back(key);
+		}
+		else if (keyword == "sphere") {
+			SphereKey key;
+			key.frame = readFloat();
+			int sphere = readIndex();
+			key.centre = readVector();
+			key.radius = readFloat();
+			sphereKeys[sphere].push_back(key);
+		}
+		else {
+			throw fail("unknown keyword \"" + keyword + "\".");
+		}
+		std::string extra;
+		if (fields >> extra) throw fail("unexpected \"" + extra + "\" at the end of the line.");
+	}
+
+	// Keys may be given in any order; a later key for the same frame replaces an earlier one.
+	auto byFrame = [](const auto& a, const auto& b) { return a.frame < b.frame; };
+	auto sortKeys = [&](auto& keys) {
+		std::stable_sort(keys.begin(), keys.end(), byFrame);
+		for (size_t i = keys.size(); i-- > 1;) {
+			if (keys[i - 1].frame == keys[i].frame) keys.erase(keys.begin() + (i - 1));
+		}
+	};
+	sortKeys(animation.cameraKeys);
+	for (auto& entry : sphereKeys) {
+		sortKeys(entry.second);
+		animation.sphereTracks.push_back({ entry.first, std::move(entry.second) });
+	}
+}
+
+/// <summary>
+/// Reads the animation file filename. Throws std::runtime_error if it can't be read.
+/// </summary>
+void readAnimationFile(const std::string& filename, Animation& animation)
+{
+	std::ifstream file(filename);
+	if (!file) throw std::runtime_error("Couldn't open " + filename);
+	readAnimationText(file, animation);
+}
+
+/// <summary>
+/// How to render a sequence, on top of the RenderSettings each frame uses.
+/// </summary>
+struct SequenceSettings {
+	int width = 512, height = 512;
+	std::string filenamePrefix = "output_"; // Frame k is saved as this, then k in 4 digits, then ".png".
+	float maxCostGrowth = 1.5f; // Rebuild the BVH rather than refit it past this (see Scene::refitBVH).
+	bool denoise = false;       // Denoise the frames (path tracing only).
+	bool serialPNG = false;     // Compress with lodepng's own compressor, on one thread.
+};
+
+/// <summary>
+/// What renderSequence did, and how long each part took (in total).
+/// </summary>
+struct SequenceStats {
+	int nFrames = 0;
+	int nRefits = 0, nRebuilds = 0;
+	double bvhSeconds = 0.0;        // Moving the spheres, and refitting or rebuilding.
+	double renderSeconds = 0.0;     // Rendering, denoising and tonemapping.
+	double encodeWaitSeconds = 0.0; // Waiting for the previous frame's PNG after rendering.
+};
+
+/// <summary>
+/// The filename frame is saved as.
+/// </summary>
+std::string sequenceFrameFilename(const SequenceSettings& sequence, int frame)
+{
+	std::ostringstream name;
+	name << sequence.filenamePrefix << std::setw(4) << std::setfill('0') << frame << ".png";
+	return name.str();
+}
+
+/// <summary>
+/// Renders animation's frames of scene, as seen from camera (if there are no camera
+/// keyframes), and saves each one as a PNG. The scene's BVH and light table must already
+/// be built. The spheres are left where they are in the last frame.
+///
+/// Each frame's PNG is compressed and saved by a task on the pool, which runs alongside
+/// the next frame's tiles. Two 8-bit images are kept, so one can be written while the
+/// next frame is tonemapped into the other, and at most one frame is being saved at once.
+/// Throws std::runtime_error if an animated sphere isn't in the scene, or a frame can't be
+/// saved.
+/// </summary>
+SequenceStats renderSequence(Scene& scene, const Animation& animation, const Camera& camera, const RenderSettings& settings,
+	const SequenceSettings& sequence, ThreadPool& pool)
+{
+	for (const SphereTrack& track : animation.sphereTracks) {
+		if (static_cast<size_t>(track.sphere) >= scene.spheres.size()) {
+			throw std::runtime_error("The animation moves sphere " + std::to_string(track.sphere) + ", but the scene only has "
+				+ std::to_string(scene.spheres.size()));
+		}
+	}
+	auto seconds = [](std::chrono::steady_clock::time_point start) {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	};
+
+	SequenceStats stats;
+	FloatImage framebuffer;
+	GBuffer gbuffer;
+	std::vector<uint8_t> images[2];
+	std::future<unsigned> saving;
+	std::string savingFilename;
+	auto finishSaving = [&]() {
+		if (!saving.valid()) return;
+		unsigned errorCode = saving.get();
+		if (errorCode) throw std::runtime_error("Couldn't save " + savingFilename + ": " + lodepng_error_text(errorCode));
+	};
+
+	// The saving task uses images, so it has to finish before they go, even if something throws.
+	struct WaitForSaving {
+		std::future<unsigned>& saving;
+		~WaitForSaving()
+		{
+			if (saving.valid()) saving.wait();
+		}
+	} waitForSaving{ saving };
+
+	for (int frame = 0; frame < animation.nFrames; ++frame) {
+		auto start = std::chrono::steady_clock::now();
+		if (animation.moveSpheres(static_cast<float>(frame), scene.spheres)) {
+			if (scene.refitBVH(sequence.maxCostGrowth, &pool)) ++stats.nRebuilds;
+			else ++stats.nRefits;
+		}
+		stats.bvhSeconds += seconds(start);
+
+		start = std::chrono::steady_clock::now();
+		PrimaryRayGenerator rays(animation.cameraAt(static_cast<float>(frame), camera), sequence.width, sequence.height);
+		renderFrame(scene, rays, settings, pool, framebuffer, sequence.denoise ? &gbuffer : nullptr);
+		if (sequence.denoise) denoise(framebuffer, gbuffer, DenoiseSettings(), &pool);
+		stats.renderSeconds += seconds(start);
+
+		// The image the last frame but one was tonemapped into is free by now, as that
+		// frame was saved before the last one started saving. The last frame may still be
+		// being saved from the other one.
+		start = std::chrono::steady_clock::now();
+		std::vector<uint8_t>& image = images[frame % 2];
+		tonemapToRGBA8(framebuffer, image, 1.f, &pool);
+		stats.renderSeconds += seconds(start);
+		start = std::chrono::steady_clock::now();
+		finishSaving();
+		stats.encodeWaitSeconds += seconds(start);
+
+		savingFilename = sequenceFrameFilename(sequence, frame);
+		unsigned width = sequence.width, height = sequence.height;
+		bool serialPNG = sequence.serialPNG;
+		saving = pool.submit([&image, &pool, filename = savingFilename, width, height, serialPNG] {
+			std::vector<unsigned char> png;
+			unsigned errorCode;
+			if (serialPNG) {
+				STATS_TIME(ENCODE_STAGE);
+				errorCode = lodepng::encode(png, image, width, height);
+			}
+			else errorCode = encodePNGParallel(png, image, width, height, pool);
+			if (!errorCode) errorCode = lodepng::save_file(png, filename);
+			return errorCode;
+		});
+		++stats.nFrames;
+	}
+	auto start = std::chrono::steady_clock::now();
+	finishSaving();
+	stats.encodeWaitSeconds += seconds(start);
+	return stats;
+}
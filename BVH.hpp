@@ -0,0 +1,540 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <vector>
+#include <Eigen/Dense>
+#include "Sphere.hpp"
+#include "SphereSoA.hpp"
+#include "Stats.hpp"
+#include "ThreadPool.hpp"
+
+/// <summary>
+/// Axis-aligned bounding box. A default constructed box is empty.
+/// </summary>
+struct AABB {
+	Eigen::Vector3f min = Eigen::Vector3f::Constant(FLT_MAX);
+	Eigen::Vector3f max = Eigen::Vector3f::Constant(-FLT_MAX);
+
+	void expand(const Eigen::Vector3f& p)
+	{
+		min = min.cwiseMin(p);
+		max = max.cwiseMax(p);
+	}
+
+	void expand(const AABB& box)
+	{
+		min = min.cwiseMin(box.min);
+		max = max.cwiseMax(box.max);
+	}
+
+	bool empty() const
+	{
+		return min.x() > max.x();
+	}
+
+	float surfaceArea() const
+	{
+		if (empty()) return 0.f;
+		Eigen::Vector3f d = max - min;
+		return 2.f * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+	}
+};
+
+AABB sphereBounds(const Sphere& sphere)
+{
+	AABB box;
+	box.min = sphere.centre - Eigen::Vector3f::Constant(sphere.radius);
+	box.max = sphere.centre + Eigen::Vector3f::Constant(sphere.radius);
+	return box;
+}
+
+/// <summary>
+/// Slab test of a ray against a box.
+/// </summary>
+/// <param name="invDir">Componentwise inverse of the ray direction.</param>
+/// <param name="maxT">Boxes entered beyond this distance count as a miss.</param>
+/// <returns>True if the ray passes through the box between 0 and maxT.</returns>
+bool rayAABBIntersection(const Eigen::Vector3f& origin, const Eigen::Vector3f& invDir, const AABB& box, float maxT)
+{
+	Eigen::Vector3f t0 = (box.min - origin).cwiseProduct(invDir);
+	Eigen::Vector3f t1 = (box.max - origin).cwiseProduct(invDir);
+	float tNear = std::max(t0.cwiseMin(t1).maxCoeff(), 0.f);
+	float tFar = std::min(t0.cwiseMax(t1).minCoeff(), maxT);
+	return tNear <= tFar;
+}
+
+/// <summary>
+/// The result of a closest-hit query.
+/// </summary>
+struct RayHit {
+	float t = FLT_MAX;
+	Eigen::Vector3f intersection = Eigen::Vector3f::Zero();
+	int sphere = -1; // Index into the sphere list, or -1 for no hit.
+};
+
+struct BVHBuildSettings {
+	int maxLeafSize = 4;         // Leaves never hold more spheres than this.
+	int nBins = 16;              // SAH bins per axis (at most 32).
+	float traversalCost = 1.f;   // Cost of visiting a node, relative to one ray-sphere test.
+	int parallelThreshold = 4096; // Nodes with more spheres than this build their children in parallel.
+};
+
+struct BVHNode {
+	AABB bounds;
+	int leftFirst; // Leaf: first index into the primitive list. Interior: left child (right child is leftFirst+1).
+	int count;     // Leaf: number of spheres (always > 0). Interior: 0.
+	int axis;      // Interior: the split axis, used to visit the nearer child first.
+};
+
+/// <summary>
+/// Bounding volume hierarchy over a list of spheres.
+/// Built top-down with a binned surface area heuristic (SAH); large subtrees are built
+/// in parallel on a ThreadPool. The sphere geometry is copied into a SphereSoA in leaf
+/// order, so each leaf is a contiguous run that the SIMD intersection kernel tests at once.
+/// Materials are not copied, so the same sphere list must be passed to the queries.
+/// </summary>
+class BVH {
+private:
+	std::vector<BVHNode> _nodes;
+	std::vector<int> _primIndices;
+	SphereSoA _geometry;
+	BVHBuildSettings _settings;
+	float _builtCost = 0.f; // sahCost() as built.
+
+	// Per-sphere data used only while building.
+	std::vector<AABB> _primBounds;
+	std::vector<Eigen::Vector3f> _centroids;
+
+	// Traversal stacks are fixed-size (stackSize), so tree depth is capped. Past this
+	// depth nodes are split at the median, which halves them every level.
+	static constexpr int maxSahDepth = 96;
+	static constexpr int maxBins = 32;
+
+	struct Bin {
+		AABB bounds;
+		int count = 0;
+	};
+
+	void computeBounds(int begin, int end, AABB& bounds, AABB& centroidBounds) const
+	{
+		for (int i = begin; i < end; ++i) {
+			bounds.expand(_primBounds[_primIndices[i]]);
+			centroidBounds.expand(_centroids[_primIndices[i]]);
+		}
+	}
+
+	int binIndex(const Eigen::Vector3f& centroid, const AABB& centroidBounds, int axis) const
+	{
+		float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+		int bin = static_cast<int>(_settings.nBins * (centroid[axis] - centroidBounds.min[axis]) / extent);
+		return std::min(std::max(bin, 0), _settings.nBins - 1);
+	}
+
+	void fillBins(int begin, int end, const AABB& centroidBounds, Bin* bins) const
+	{
+		for (int axis = 0; axis < 3; ++axis) {
+			if (centroidBounds.max[axis] <= centroidBounds.min[axis]) continue;
+			for (int i = begin; i < end; ++i) {
+				int prim = _primIndices[i];
+				Bin& bin = bins[axis * maxBins + binIndex(_centroids[prim], centroidBounds, axis)];
+				bin.bounds.expand(_primBounds[prim]);
+				++bin.count;
+			}
+		}
+	}
+
+	void buildNode(int nodeIdx, int begin, int end, int depth, std::atomic<int>& nodeCount, ThreadPool* pool)
+	{
+		BVHNode& node = _nodes[nodeIdx];
+		int count = end - begin;
+		int nBins = _settings.nBins;
+		bool parallel = pool && count > _settings.parallelThreshold;
+
+		// Bound the spheres (and their centres) in this node, and bin them along each axis.
+		AABB centroidBounds;
+		Bin bins[3 * maxBins];
+		if (parallel) {
+			int nChunks = pool->size() * 4;
+			int chunkSize = (count + nChunks - 1) / nChunks;
+			std::vector<AABB> chunkBounds(nChunks), chunkCentroids(nChunks);
+			pool->parallelFor(nChunks, [&](int c) {
+				computeBounds(begin + c * chunkSize, std::min(begin + (c + 1) * chunkSize, end), chunkBounds[c], chunkCentroids[c]);
+			});
+			node.bounds = AABB();
+			for (int c = 0; c < nChunks; ++c) {
+				node.bounds.expand(chunkBounds[c]);
+				centroidBounds.expand(chunkCentroids[c]);
+			}
+			std::vector<Bin> chunkBins(nChunks * 3 * maxBins);
+			pool->parallelFor(nChunks, [&](int c) {
+				fillBins(begin + c * chunkSize, std::min(begin + (c + 1) * chunkSize, end), centroidBounds, &chunkBins[c * 3 * maxBins]);
+			});
+			for (int c = 0; c < nChunks; ++c)
+				for (int b = 0; b < 3 * maxBins; ++b) {
+					bins[b].bounds.expand(chunkBins[c * 3 * maxBins + b].bounds);
+					bins[b].count += chunkBins[c * 3 * maxBins + b].count;
+				}
+		}
+		else {
+			node.bounds = AABB();
+			computeBounds(begin, end, node.bounds, centroidBounds);
+			fillBins(begin, end, centroidBounds, bins);
+		}
+
+		// Find the cheapest split plane between bins.
+		float bestCost = FLT_MAX;
+		int bestAxis = -1, bestSplit = 0;
+		if (depth < maxSahDepth) {
+			float nodeArea = node.bounds.surfaceArea();
+			float rightArea[maxBins];
+			int rightCount[maxBins];
+			for (int axis = 0; axis < 3; ++axis) {
+				if (centroidBounds.max[axis] <= centroidBounds.min[axis]) continue;
+				const Bin* axisBins = &bins[axis * maxBins];
+				AABB box;
+				int n = 0;
+				for (int b = nBins - 1; b > 0; --b) {
+					box.expand(axisBins[b].bounds);
+					n += axisBins[b].count;
+					rightArea[b] = box.surfaceArea();
+					rightCount[b] = n;
+				}
+				box = AABB();
+				n = 0;
+				for (int b = 0; b < nBins - 1; ++b) {
+					box.expand(axisBins[b].bounds);
+					n += axisBins[b].count;
+					if (n == 0 || rightCount[b + 1] == 0) continue;
+					float cost = _settings.traversalCost +
+						(box.surfaceArea() * n + rightArea[b + 1] * rightCount[b + 1]) / nodeArea;
+					if (cost < bestCost) {
+						bestCost = cost;
+						bestAxis = axis;
+						bestSplit = b + 1;
+					}
+				}
+			}
+		}
+
+		// Make a leaf if it's small enough and splitting doesn't pay off.
+		if (count <= _settings.maxLeafSize && (bestAxis < 0 || bestCost >= count)) {
+			node.leftFirst = begin;
+			node.count = count;
+			node.axis = 0;
+			return;
+		}
+
+		int mid;
+		if (bestAxis >= 0) {
+			mid = static_cast<int>(std::partition(_primIndices.begin() + begin, _primIndices.begin() + end, [&](int prim) {
+				return binIndex(_centroids[prim], centroidBounds, bestAxis) < bestSplit;
+			}) - _primIndices.begin());
+		}
+		else {
+			// No usable SAH split (all centres coincide, or the tree is already very deep):
+			// split at the median along the longest axis.
+			Eigen::Vector3f extent = centroidBounds.max - centroidBounds.min;
+			extent.maxCoeff(&bestAxis);
+			mid = begin + count / 2;
+			std::nth_element(_primIndices.begin() + begin, _primIndices.begin() + mid, _primIndices.begin() + end, [&](int a, int b) {
+				return _centroids[a][bestAxis] < _centroids[b][bestAxis];
+			});
+		}
+
+		int left = nodeCount.fetch_add(2);
+		node.leftFirst = left;
+		node.count = 0;
+		node.axis = bestAxis;
+
+		if (parallel) {
+			pool->parallelFor(2, [&](int child) {
+				if (child == 0) buildNode(left, begin, mid, depth + 1, nodeCount, pool);
+				else buildNode(left + 1, mid, end, depth + 1, nodeCount, pool);
+			});
+		}
+		else {
+			buildNode(left, begin, mid, depth + 1, nodeCount, pool);
+			buildNode(left + 1, mid, end, depth + 1, nodeCount, pool);
+		}
+	}
+
+public:
+	static constexpr int stackSize = 128;
+
+	BVH() = default;
+
+	BVH(const std::vector<Sphere>& spheres, ThreadPool* pool = nullptr, const BVHBuildSettings& settings = BVHBuildSettings())
+	{
+		build(spheres, pool, settings);
+	}
+
+	/// <summary>
+	/// (Re)builds the hierarchy over the given spheres.
+	/// </summary>
+	/// <param name="pool">If not null, large subtrees are built in parallel on this pool.</param>
+	void build(const std::vector<Sphere>& spheres, ThreadPool* pool = nullptr, const BVHBuildSettings& settings = BVHBuildSettings())
+	{
+		_settings = settings;
+		_settings.nBins = std::min(std::max(_settings.nBins, 2), maxBins);
+		int n = static_cast<int>(spheres.size());
+		_nodes.clear();
+		_primIndices.resize(n);
+		_primBounds.resize(n);
+		_centroids.resize(n);
+		if (n == 0) return;
+
+		auto prepare = [&](int i) {
+			_primIndices[i] = i;
+			_primBounds[i] = sphereBounds(spheres[i]);
+			_centroids[i] = spheres[i].centre;
+		};
+		if (pool && n > _settings.parallelThreshold) {
+			int nChunks = pool->size() * 4;
+			int chunkSize = (n + nChunks - 1) / nChunks;
+			pool->parallelFor(nChunks, [&](int c) {
+				for (int i = c * chunkSize; i < std::min((c + 1) * chunkSize, n); ++i) prepare(i);
+			});
+		}
+		else {
+			for (int i = 0; i < n; ++i) prepare(i);
+		}
+
+		// A binary tree with n leaves has at most 2n-1 nodes.
+		_nodes.resize(2 * n - 1);
+		std::atomic<int> nodeCount(1);
+		buildNode(0, 0, n, 0, nodeCount, pool);
+		_nodes.resize(nodeCount);
+
+		_primBounds = std::vector<AABB>();
+		_centroids = std::vector<Eigen::Vector3f>();
+
+		_geometry = SphereSoA(spheres, &_primIndices);
+		_builtCost = sahCost();
+	}
+
+	/// <summary>
+	/// Recomputes every node's bounds, and the copied geometry, from the spheres as they are
+	/// now, keeping the tree as it is. The spheres must be the ones it was built over, in the
+	/// same order. Children always come after their parents in the node list, so going
+	/// backwards does each node after its children.
+	/// </summary>
+	void refit(const std::vector<Sphere>& spheres)
+	{
+		for (int i = static_cast<int>(_nodes.size()) - 1; i >= 0; --i) {
+			BVHNode& node = _nodes[i];
+			node.bounds = AABB();
+			if (node.count > 0) {
+				for (int j = node.leftFirst; j < node.leftFirst + node.count; ++j) node.bounds.expand(sphereBounds(spheres[_primIndices[j]]));
+			}
+			else {
+				node.bounds.expand(_nodes[node.leftFirst].bounds);
+				node.bounds.expand(_nodes[node.leftFirst + 1].bounds);
+			}
+		}
+		_geometry = SphereSoA(spheres, &_primIndices);
+	}
+
+	/// <summary>
+	/// Restores a tree saved from the nodes() and primIndices() of one built over the same
+	/// spheres with the same settings (see BVHCache.hpp), and refits it to the spheres, which
+	/// gives exactly the BVH that was built. The tree is checked first: every sphere in
+	/// exactly one leaf, every node but the root the child of exactly one other, children
+	/// after their parents, and no deeper than the traversal stacks.
+	/// </summary>
+	/// <returns>False, leaving the BVH empty, if the tree isn't one over these spheres.</returns>
+	bool restore(const std::vector<Sphere>& spheres, const BVHNode* nodes, size_t nNodes, const int* primIndices, size_t nPrims,
+		const BVHBuildSettings& settings = BVHBuildSettings())
+	{
+		_nodes.clear();
+		_primIndices.clear();
+		_geometry = SphereSoA(spheres, &_primIndices);
+		size_t n = spheres.size();
+		if (nPrims != n || (n == 0 ? nNodes != 0 : nNodes == 0 || nNodes > 2 * n - 1)) return false;
+
+		std::vector<char> seen(n, 0);
+		for (size_t i = 0; i < n; ++i) {
+			int prim = primIndices[i];
+			if (prim < 0 || static_cast<size_t>(prim) >= n || seen[prim]) return false;
+			seen[prim] = 1;
+		}
+		std::fill(seen.begin(), seen.end(), 0); // Now which slots of primIndices are in a leaf.
+		std::vector<int> depth(nNodes, 0), parents(nNodes, 0);
+		size_t nInLeaves = 0;
+		for (size_t i = 0; i < nNodes; ++i) {
+			const BVHNode& node = nodes[i];
+			if (i > 0 && parents[i] != 1) return false;
+			if (node.count > 0) {
+				if (node.leftFirst < 0 || static_cast<size_t>(node.leftFirst) + node.count > n) return false;
+				for (int j = node.leftFirst; j < node.leftFirst + node.count; ++j) {
+					if (seen[j]) return false;
+					seen[j] = 1;
+				}
+				nInLeaves += node.count;
+			}
+			else {
+				if (node.count != 0 || node.leftFirst <= static_cast<int>(i) || static_cast<size_t>(node.leftFirst) + 1 >= nNodes) return false;
+				if (node.axis < 0 || node.axis > 2 || depth[i] + 1 >= stackSize) return false;
+				for (int child = node.leftFirst; child <= node.leftFirst + 1; ++child) {
+					depth[child] = depth[i] + 1;
+					++parents[child];
+				}
+			}
+		}
+		if (nInLeaves != n) return false;
+
+		_settings = settings;
+		_nodes.assign(nodes, nodes + nNodes);
+		_primIndices.assign(primIndices, primIndices + nPrims);
+		refit(spheres);
+		_builtCost = sahCost();
+		return true;
+	}
+
+	/// <summary>
+	/// The tree's SAH cost: roughly how many nodes a ray through the root's box visits,
+	/// weighted by traversalCost, plus how many spheres it tests. Each node counts in
+	/// proportion to its surface area, relative to the root's. Refitting after the spheres
+	/// move leaves the boxes bigger and more overlapped than a fresh build would make them,
+	/// which shows up as this growing compared with builtCost().
+	/// </summary>
+	float sahCost() const
+	{
+		if (_nodes.empty()) return 0.f;
+		double rootArea = _nodes[0].bounds.surfaceArea();
+		if (rootArea <= 0.0) return 0.f;
+		double cost = 0.0;
+		for (const BVHNode& node : _nodes) {
+			cost += node.bounds.surfaceArea() * (node.count > 0 ? static_cast<float>(node.count) : _settings.traversalCost);
+		}
+		return static_cast<float>(cost / rootArea);
+	}
+
+	/// <summary>
+	/// sahCost() when the tree was last built (or restored), before any refitting.
+	/// </summary>
+	float builtCost() const
+	{
+		return _builtCost;
+	}
+
+	const std::vector<BVHNode>& nodes() const
+	{
+		return _nodes;
+	}
+
+	const std::vector<int>& primIndices() const
+	{
+		return _primIndices;
+	}
+
+	/// <summary>
+	/// Sphere geometry in leaf order: entry i is sphere primIndices()[i].
+	/// </summary>
+	const SphereSoA& geometry() const
+	{
+		return _geometry;
+	}
+
+	/// <summary>
+	/// Finds the closest sphere hit by the ray with t > minT. The spheres aren't needed (the
+	/// BVH has its own copy of their geometry), but are taken to match anyHit.
+	/// </summary>
+	/// <returns>True if anything was hit, in which case hit is filled in.</returns>
+	bool closestHit(const Ray& ray, const std::vector<Sphere>& /*spheres*/, RayHit& hit, float minT = 0.001f) const
+	{
+		STATS_TIME(TRACE_STAGE);
+		hit = RayHit();
+		if (_nodes.empty()) return false;
+
+		Eigen::Vector3f invDir = ray.direction.cwiseInverse();
+		int stack[stackSize];
+		int stackTop = 0;
+		stack[stackTop++] = 0;
+
+		// Counted locally and added to the thread's stats once at the end.
+		uint64_t nodesVisited = 0, boxesMissed = 0, sphereTests = 0;
+		while (stackTop > 0) {
+			const BVHNode& node = _nodes[stack[--stackTop]];
+			++nodesVisited;
+			if (!rayAABBIntersection(ray.origin, invDir, node.bounds, hit.t)) {
+				++boxesMissed;
+				continue;
+			}
+
+			if (node.count > 0) {
+				sphereTests += node.count;
+				float t;
+				int i = raySphereIntersection(ray, _geometry, node.leftFirst, node.leftFirst + node.count, t, minT, hit.t);
+				if (i >= 0) {
+					hit.t = t;
+					hit.sphere = _primIndices[i];
+				}
+			}
+			else {
+				// Push the far child first, so the near child is visited first.
+				bool leftFirst = ray.direction[node.axis] >= 0.f;
+				stack[stackTop++] = leftFirst ? node.leftFirst + 1 : node.leftFirst;
+				stack[stackTop++] = leftFirst ? node.leftFirst : node.leftFirst + 1;
+			}
+		}
+		STATS_ADD(nodesVisited, nodesVisited);
+		STATS_ADD(boxesMissed, boxesMissed);
+		STATS_ADD(sphereTests, sphereTests);
+		if (hit.sphere < 0) return false;
+		hit.intersection = ray.origin + hit.t * ray.direction;
+		return true;
+	}
+
+	/// <summary>
+	/// Checks whether any sphere blocks the ray between minT and maxT, stopping at the
+	/// first one found.
+	/// </summary>
+	/// <param name="occludes">Called with each sphere that is hit; return false to ignore it
+	/// (e.g. for transparent spheres).</param>
+	template<typename Filter>
+	bool anyHit(const Ray& ray, const std::vector<Sphere>& spheres, float maxT, Filter&& occludes, float minT = 0.001f) const
+	{
+		if (_nodes.empty()) return false;
+
+		Eigen::Vector3f invDir = ray.direction.cwiseInverse();
+		int stack[stackSize];
+		int stackTop = 0;
+		stack[stackTop++] = 0;
+
+		uint64_t nodesVisited = 0, boxesMissed = 0, sphereTests = 0;
+		auto addStats = [&]() {
+			STATS_ADD(nodesVisited, nodesVisited);
+			STATS_ADD(boxesMissed, boxesMissed);
+			STATS_ADD(sphereTests, sphereTests);
+		};
+		while (stackTop > 0) {
+			const BVHNode& node = _nodes[stack[--stackTop]];
+			++nodesVisited;
+			if (!rayAABBIntersection(ray.origin, invDir, node.bounds, maxT)) {
+				++boxesMissed;
+				continue;
+			}
+
+			if (node.count > 0) {
+				// Walk the leaf's hits front to back until one is accepted by the filter.
+				float t, leafMinT = minT;
+				int i;
+				sphereTests += node.count;
+				while ((i = raySphereIntersection(ray, _geometry, node.leftFirst, node.leftFirst + node.count, t, leafMinT, maxT)) >= 0) {
+					if (occludes(spheres[_primIndices[i]])) {
+						addStats();
+						return true;
+					}
+					leafMinT = t;
+				}
+			}
+			else {
+				stack[stackTop++] = node.leftFirst + 1;
+				stack[stackTop++] = node.leftFirst;
+			}
+		}
+		addStats();
+		return false;
+	}
+};
@@ -0,0 +1,193 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "BVH.hpp"
+#include "Scene.hpp"
+#include "SceneFile.hpp"
+#include "Sphere.hpp"
+#include "ThreadPool.hpp"
+
+// Saving built BVHs, so a big scene that hasn't changed isn't rebuilt every run.
+//
+// A cache file holds a tree's nodes and the order of the spheres in its leaves, as they are
+// in memory, under a key: a hash of the spheres' geometry (centres and radii, in order) and
+// the build settings. Materials aren't in the key, as the tree doesn't depend on them.
+// Loading maps the file, and if the key matches the spheres being rendered, the tree is
+// checked and refitted to them (see BVH::restore); otherwise it's rebuilt and the cache
+// written again. Bounds and the SoA copy of the geometry always come from the spheres, so
+// the cache only has to be the right shape, and the BVH is the same as a fresh build.
+//
+// The shadow grids aren't cached: they depend on the lights too, and are much quicker to
+// build than the tree.
+
+const char bvhCacheMagic[8] = { 'S', 'P', 'H', 'S', 'B', 'V', 'H', 'C' };
+const uint32_t bvhCacheVersion = 1;
+
+/// <summary>
+/// The start of a BVH cache file. The arrays are at the given offsets from the start of
+/// the file.
+/// </summary>
+struct BVHCacheHeader {
+	char magic[8];
+	uint32_t version, byteOrder;
+	uint32_t headerSize, nodeSize; // sizeof each in the program that wrote the file.
+	uint64_t key;
+	uint64_t nSpheres;
+	uint64_t nNodes, nodesOffset;
+	uint64_t primIndicesOffset;
+};
+
+/// <summary>
+/// The cache key for a BVH over spheres with settings: a 64-bit hash of their geometry,
+/// in order, and of the settings that change the tree. With a pool, the spheres are hashed
+/// in chunks in parallel (and the chunks' hashes combined in order, so the key doesn't
+/// depend on the pool).
+/// </summary>
+uint64_t bvhCacheKey(const std::vector<Sphere>& spheres, const BVHBuildSettings& settings, ThreadPool* pool = nullptr)
+{
+	// MurmurHash3's 64-bit finaliser, and its way of taking in each word.
+	auto finalise = [](uint64_t h) {
+		h ^= h >> 33;
+		h *= 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 33;
+		h *= 0xC4CEB9FE1A85EC53ULL;
+		return h ^ (h >> 33);
+	};
+	auto add = [](uint64_t h, uint64_t word) {
+		word *= 0x87C37B91114253D5ULL;
+		word = (word << 31) | (word >> 33);
+		h ^= word * 0x4CF5AD432745937FULL;
+		h = (h << 27) | (h >> 37);
+		return h * 5 + 0x52DCE729;
+	};
+
+	const int chunkSize = 1 << 16;
+	int n = static_cast<int>(spheres.size());
+	int nChunks = (n + chunkSize - 1) / chunkSize;
+	std::vector<uint64_t> chunkHashes(nChunks);
+	auto hashChunk = [&](int c) {
+		uint64_t h = static_cast<uint64_t>(c);
+		for (int i = c * chunkSize; i < std::min(n, (c + 1) * chunkSize); ++i) {
+			uint32_t bits[4];
+			memcpy(bits, spheres[i].centre.data(), 3 * sizeof(float));
+			memcpy(bits + 3, &spheres[i].radius, sizeof(float));
+			h = add(h, bits[0] | static_cast<uint64_t>(bits[1]) << 32);
+			h = add(h, bits[2] | static_cast<uint64_t>(bits[3]) << 32);
+		}
+		chunkHashes[c] = finalise(h);
+	};
+	if (pool && nChunks > 1) pool->parallelFor(nChunks, hashChunk);
+	else for (int c = 0; c < nChunks; ++c) hashChunk(c);
+
+	uint32_t traversalCost;
+	memcpy(&traversalCost, &settings.traversalCost, sizeof(traversalCost));
+	uint64_t key = add(0, static_cast<uint64_t>(n));
+	key = add(key, static_cast<uint64_t>(settings.maxLeafSize) | static_cast<uint64_t>(settings.nBins) << 32);
+	key = add(key, traversalCost);
+	for (uint64_t chunkHash : chunkHashes) key = add(key, chunkHash);
+	return finalise(key);
+}
+
+/// <summary>
+/// Writes bvh, built over spheres with the given cache key, to filename. It's written to a
+/// temporary file first and renamed, so a reader never sees half of one. Throws
+/// std::runtime_error if it can't be written.
+/// </summary>
+void saveBVHCache(const std::string& filename, const BVH& bvh, uint64_t key)
+{
+	auto aligned = [](uint64_t offset) {
+		return (offset + sceneFileAlignment - 1) / sceneFileAlignment * sceneFileAlignment;
+	};
+	const std::vector<BVHNode>& nodes = bvh.nodes();
+	const std::vector<int>& primIndices = bvh.primIndices();
+	BVHCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, bvhCacheMagic, sizeof(bvhCacheMagic));
+	header.version = bvhCacheVersion;
+	header.byteOrder = sceneFileByteOrder;
+	header.headerSize = sizeof(BVHCacheHeader);
+	header.nodeSize = sizeof(BVHNode);
+	header.key = key;
+	header.nSpheres = primIndices.size();
+	header.nNodes = nodes.size();
+	header.nodesOffset = aligned(sizeof(BVHCacheHeader));
+	header.primIndicesOffset = aligned(header.nodesOffset + header.nNodes * sizeof(BVHNode));
+
+	std::string temporaryFilename = filename + ".tmp";
+	{
+		std::ofstream file(temporaryFilename, std::ios::binary);
+		const char padding[sceneFileAlignment] = {};
+		uint64_t written = 0;
+		auto write = [&](const void* data, uint64_t size) {
+			file.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+			written += size;
+		};
+		write(&header, sizeof(header));
+		write(padding, header.nodesOffset - written);
+		write(nodes.data(), header.nNodes * sizeof(BVHNode));
+		write(padding, header.primIndicesOffset - written);
+		write(primIndices.data(), header.nSpheres * sizeof(int));
+		if (!file) {
+			file.close();
+			std::remove(temporaryFilename.c_str());
+			throw std::runtime_error("Couldn't write " + temporaryFilename);
+		}
+	}
+	std::remove(filename.c_str()); // rename won't replace a file on Windows.
+	if (std::rename(temporaryFilename.c_str(), filename.c_str()) != 0) {
+		std::remove(temporaryFilename.c_str());
+		throw std::runtime_error("Couldn't rename " + temporaryFilename + " to " + filename);
+	}
+}
+
+/// <summary>
+/// Restores bvh from the cache in filename, if there is one for spheres with this key and
+/// settings and it checks out (see BVH::restore).
+/// </summary>
+/// <returns>False if there's no usable cache (bvh is then left empty or as it was).</returns>
+bool loadBVHCache(const std::string& filename, const std::vector<Sphere>& spheres, const BVHBuildSettings& settings, uint64_t key, BVH& bvh)
+{
+	MappedFile file;
+	try {
+		file = MappedFile(filename);
+	}
+	catch (const std::runtime_error&) {
+		return false;
+	}
+	if (file.size() < sizeof(BVHCacheHeader)) return false;
+	const BVHCacheHeader& header = *reinterpret_cast<const BVHCacheHeader*>(file.data());
+	if (memcmp(header.magic, bvhCacheMagic, sizeof(bvhCacheMagic)) != 0 || header.version != bvhCacheVersion
+		|| header.byteOrder != sceneFileByteOrder || header.headerSize != sizeof(BVHCacheHeader) || header.nodeSize != sizeof(BVHNode)) {
+		return false;
+	}
+	if (header.key != key || header.nSpheres != spheres.size()) return false;
+	auto arrayFits = [&](uint64_t offset, uint64_t count, uint64_t recordSize) {
+		return offset % sceneFileAlignment == 0 && offset <= file.size() && count <= (file.size() - offset) / recordSize;
+	};
+	if (!arrayFits(header.nodesOffset, header.nNodes, sizeof(BVHNode)) || !arrayFits(header.primIndicesOffset, header.nSpheres, sizeof(int))) return false;
+	return bvh.restore(spheres, reinterpret_cast<const BVHNode*>(file.data() + header.nodesOffset), static_cast<size_t>(header.nNodes),
+		reinterpret_cast<const int*>(file.data() + header.primIndicesOffset), static_cast<size_t>(header.nSpheres), settings);
+}
+
+/// <summary>
+/// Scene::buildBVH, but with the tree loaded from the cache in filename if it's there and
+/// matches the spheres, and otherwise built and saved there. Throws std::runtime_error if
+/// the cache needed writing and couldn't be (the scene is ready to render regardless).
+/// </summary>
+/// <returns>True if the tree came from the cache.</returns>
+bool buildBVHCached(Scene& scene, const std::string& filename, ThreadPool* pool = nullptr, const BVHBuildSettings& settings = BVHBuildSettings())
+{
+	uint64_t key = bvhCacheKey(scene.spheres, settings, pool);
+	bool loaded = loadBVHCache(filename, scene.spheres, settings, key, scene.bvh);
+	if (!loaded) scene.bvh.build(scene.spheres, pool, settings);
+	scene.updateShadowGrids();
+	scene.updateFeatures();
+	if (!loaded) saveBVHCache(filename, scene.bvh, key);
+	return loaded;
+}
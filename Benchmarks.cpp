@@ -0,0 +1,1290 @@
+// This define is necessary to get the M_PI constant.
+#define _USE_MATH_DEFINES
+#include <math.h>
+
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "Animation.hpp"
+#include "BVH.hpp"
+#include "BVHCache.hpp"
+#include "Denoise.hpp"
+#include "Framebuffer.hpp"
+#include "Image.hpp"
+#include "LinAlg.hpp"
+#include "Light.hpp"
+#include "ParallelDeflate.hpp"
+#include "RayPacket.hpp"
+#include "Relight.hpp"
+#include "Render.hpp"
+#include "Scene.hpp"
+#include "SceneFile.hpp"
+#include "Sphere.hpp"
+#include "ShadeBatch.hpp"
+#include "ShadowGrid.hpp"
+#include "Simd.hpp"
+#include "SphereSoA.hpp"
+#include "ThreadPool.hpp"
+#include "Tracer.hpp"
+
+// Performance benchmarks for the sphere tracer.
+// Run with --help for the options.
+//
+// There are two suites: "micro" times single functions and components (intersection
+// kernels, reflect/refract, lights, diffuse shading, specialized trace kernels, light
+// cuts, the BVH and its cache files, shadow grids, tonemapping, PNG encoding, loading
+// scene files), and "macro" renders whole frames of generated scenes at several
+// resolutions and sphere counts, anti-aliases them, path traces them (including a hall
+// of mirrors, to compare ways of ending paths), denoises the path traced frames, renders
+// an animation of moving spheres and relights a frame.
+// Everything is seeded, so runs on different commits measure the same work. Results are
+// printed, and with --json also written out for tracking regressions.
+
+using namespace Eigen;
+
+typedef std::chrono::steady_clock Clock;
+
+double secondsSince(Clock::time_point start)
+{
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Results go here as well as being printed, so they can be written out as JSON.
+struct BenchmarkResult {
+	std::string suite, name;
+	std::vector<std::pair<std::string, double>> params;  // What was measured, e.g. spheres, width.
+	std::vector<std::pair<std::string, double>> metrics; // e.g. rays_per_s, ns_per_ray, mb_per_s.
+};
+
+std::vector<BenchmarkResult> results;
+
+void record(const std::string& suite, const std::string& name,
+	const std::vector<std::pair<std::string, double>>& params,
+	const std::vector<std::pair<std::string, double>>& metrics)
+{
+	results.push_back({ suite, name, params, metrics });
+}
+
+std::string jsonString(const std::string& text)
+{
+	std::string quoted = "\"";
+	for (char c : text) {
+		if (c == '"' || c == '\\') quoted += '\\';
+		if (static_cast<unsigned char>(c) >= 0x20) quoted += c;
+	}
+	return quoted + "\"";
+}
+
+void writeJSON(const std::string& filename, const std::string& label, int nThreads)
+{
+	std::ofstream file(filename);
+	if (!file) throw std::runtime_error("Couldn't open " + filename + " for writing.");
+	file << std::setprecision(9);
+
+	auto writeValues = [&](const std::vector<std::pair<std::string, double>>& values) {
+		file << "{";
+		for (size_t i = 0; i < values.size(); ++i) {
+			file << (i ? ", " : "") << jsonString(values[i].first) << ": " << values[i].second;
+		}
+		file << "}";
+	};
+
+	file << "{\n"
+		<< "  \"label\": " << jsonString(label) << ",\n"
+		<< "  \"timestamp\": " << std::time(nullptr) << ",\n"
+		<< "  \"threads\": " << nThreads << ",\n"
+		<< "  \"simd\": " << jsonString(simdLevelNames[simdLevel]) << ",\n"
+		<< "  \"results\": [\n";
+	for (size_t i = 0; i < results.size(); ++i) {
+		const BenchmarkResult& result = results[i];
+		file << "    {\"suite\": " << jsonString(result.suite) << ", \"name\": " << jsonString(result.name) << ", \"params\": ";
+		writeValues(result.params);
+		file << ", \"metrics\": ";
+		writeValues(result.metrics);
+		file << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	file << "  ]\n}\n";
+}
+
+// Stops the compiler optimising away work whose result is otherwise unused.
+volatile float benchmarkSink;
+
+// Runs fn, which does nOps operations, repeats times and returns the fastest time per
+// operation in nanoseconds.
+template<typename F>
+double bestNsPerOp(int repeats, double nOps, F&& fn)
+{
+	double best = 1e300;
+	for (int i = 0; i < repeats; ++i) {
+		auto start = Clock::now();
+		fn();
+		best = std::min(best, secondsSince(start));
+	}
+	return best / nOps * 1e9;
+}
+
+// Prints one line of a benchmark's results, lined up with the others.
+void printLine(const std::string& label, const std::string& text)
+{
+	std::cout << "  " << label << ":" << std::string(label.size() < 19 ? 19 - label.size() : 1, ' ') << text << "\n";
+}
+
+std::string format(double value, const std::string& unit)
+{
+	std::ostringstream text;
+	text << value << " " << unit;
+	return text.str();
+}
+
+// Scatters n diffuse spheres at random inside a cube of side 100, sized so that the
+// spheres fill roughly the same fraction of the cube whatever n is.
+std::vector<Sphere> makeRandomSpheres(int n, unsigned seed)
+{
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<float> position(-50.f, 50.f);
+	std::uniform_real_distribution<float> scale(0.5f, 1.f);
+	float radius = 0.25f * 100.f / cbrtf(static_cast<float>(n));
+
+	std::vector<Sphere> spheres(n);
+	for (Sphere& sphere : spheres) {
+		sphere.centre = Vector3f(position(rng), position(rng), position(rng));
+		sphere.radius = radius * scale(rng);
+		sphere.material = Material::DIFFUSE;
+		sphere.colour = Vector3f(0.8f, 0.8f, 0.8f);
+		sphere.ior = 1.f;
+	}
+	return spheres;
+}
+
+// Rays starting at random points in the cube, pointing in random directions.
+std::vector<Ray> makeRandomRays(int n, unsigned seed)
+{
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<float> position(-50.f, 50.f);
+	std::normal_distribution<float> direction;
+
+	std::vector<Ray> rays(n);
+	for (Ray& ray : rays) {
+		ray.origin = Vector3f(position(rng), position(rng), position(rng));
+		ray.direction = Vector3f(direction(rng), direction(rng), direction(rng)).normalized();
+	}
+	return rays;
+}
+
+void benchmarkBVH(ThreadPool& pool, int nSpheres, int nRays)
+{
+	std::vector<Sphere> spheres = makeRandomSpheres(nSpheres, 1);
+	std::vector<Ray> rays = makeRandomRays(nRays, 2);
+
+	auto start = Clock::now();
+	BVH serialBVH(spheres);
+	double serialBuildTime = secondsSince(start);
+
+	start = Clock::now();
+	BVH bvh(spheres, &pool);
+	double parallelBuildTime = secondsSince(start);
+
+	// Closest-hit and any-hit queries, single threaded so the numbers are per core.
+	int nHits = 0;
+	start = Clock::now();
+	for (const Ray& ray : rays) {
+		RayHit hit;
+		nHits += bvh.closestHit(ray, spheres, hit);
+	}
+	double closestTime = secondsSince(start);
+
+	int nOccluded = 0;
+	start = Clock::now();
+	for (const Ray& ray : rays) {
+		nOccluded += bvh.anyHit(ray, spheres, FLT_MAX, [](const Sphere&) { return true; });
+	}
+	double anyTime = secondsSince(start);
+
+	std::cout << nSpheres << " spheres, " << bvh.nodes().size() << " nodes\n"
+		<< "  build (1 thread):   " << serialBuildTime * 1e3 << " ms\n"
+		<< "  build (" << pool.size() << " threads): " << parallelBuildTime * 1e3 << " ms\n"
+		<< "  closest hit:        " << nRays / closestTime * 1e-6 << " Mrays/s (" << nHits << " hits)\n"
+		<< "  any hit:            " << nRays / anyTime * 1e-6 << " Mrays/s (" << nOccluded << " occluded)\n";
+	record("micro", "bvh_build", { { "spheres", nSpheres }, { "threads", 1 } }, { { "ms", serialBuildTime * 1e3 } });
+	record("micro", "bvh_build", { { "spheres", nSpheres }, { "threads", pool.size() } }, { { "ms", parallelBuildTime * 1e3 } });
+	record("micro", "bvh_closest_hit", { { "spheres", nSpheres } }, { { "rays_per_s", nRays / closestTime }, { "ns_per_ray", closestTime / nRays * 1e9 } });
+	record("micro", "bvh_any_hit", { { "spheres", nSpheres } }, { { "rays_per_s", nRays / anyTime }, { "ns_per_ray", anyTime / nRays * 1e9 } });
+
+	// For small scenes, compare against testing every sphere.
+	if (nSpheres <= 10000) {
+		int nLinearRays = std::min(nRays, 10000000 / nSpheres);
+		start = Clock::now();
+		for (int i = 0; i < nLinearRays; ++i) {
+			float minT = FLT_MAX, t;
+			Vector3f intersection;
+			for (const Sphere& sphere : spheres) {
+				if (raySphereIntersection(rays[i], sphere, intersection, t) && t < minT) minT = t;
+			}
+		}
+		double linearTime = secondsSince(start);
+		std::cout << "  linear scan:        " << nLinearRays / linearTime * 1e-6 << " Mrays/s\n";
+		record("micro", "linear_scan", { { "spheres", nSpheres } }, { { "rays_per_s", nLinearRays / linearTime }, { "ns_per_ray", linearTime / nLinearRays * 1e9 } });
+	}
+	std::cout << std::endl;
+}
+
+// Shadow rays towards a directional light, from random points in the cube: bvh.anyHit
+// against the light's DirectionalShadowGrid. Also times rebuilding the grid, updating it
+// after 1% of the spheres have moved, and checks the two shadow tests agree.
+void benchmarkShadowGrid(ThreadPool& pool, int nSpheres, int nRays)
+{
+	std::vector<Sphere> spheres = makeRandomSpheres(nSpheres, 1);
+	for (int i = 19; i < nSpheres; i += 20) spheres[i].material = Material::REFRACTIVE;
+	BVH bvh(spheres, &pool);
+	Vector3f direction = Vector3f(1.f, -1.f, 0.5f).normalized();
+	std::vector<Ray> rays = makeRandomRays(nRays, 2);
+	for (Ray& ray : rays) ray.direction = -direction;
+	auto occludes = [](const Sphere& sphere) {
+		return sphere.material != Material::REFRACTIVE;
+	};
+
+	DirectionalShadowGrid grid;
+	auto start = Clock::now();
+	grid.update(spheres, direction);
+	double buildTime = secondsSince(start);
+
+	std::vector<char> bvhOccluded(nRays), gridOccluded(nRays);
+	start = Clock::now();
+	for (int i = 0; i < nRays; ++i) bvhOccluded[i] = bvh.anyHit(rays[i], spheres, FLT_MAX, occludes);
+	double bvhTime = secondsSince(start);
+	start = Clock::now();
+	for (int i = 0; i < nRays; ++i) gridOccluded[i] = grid.occluded(rays[i]);
+	double gridTime = secondsSince(start);
+	int nOccluded = 0, nMismatches = 0;
+	for (int i = 0; i < nRays; ++i) {
+		nOccluded += bvhOccluded[i];
+		nMismatches += bvhOccluded[i] != gridOccluded[i];
+	}
+
+	// Move 1% of the spheres, as in an animation, and update.
+	std::mt19937 rng(5);
+	std::uniform_real_distribution<float> offset(-1.f, 1.f);
+	for (int i = 0; i < nSpheres; i += 100) spheres[i].centre += Vector3f(offset(rng), offset(rng), offset(rng));
+	start = Clock::now();
+	grid.update(spheres, direction);
+	double updateTime = secondsSince(start);
+	BVH movedBVH(spheres, &pool);
+	for (const Ray& ray : rays) nMismatches += grid.occluded(ray) != movedBVH.anyHit(ray, spheres, FLT_MAX, occludes);
+
+	std::cout << "Directional shadows, " << nSpheres << " spheres (grid of " << grid.cellCount() << " cells, "
+		<< grid.candidateCount() << " entries, " << nOccluded << "/" << nRays << " occluded)\n";
+	printLine("grid build", format(buildTime * 1e3, "ms"));
+	printLine("grid update (1%)", format(updateTime * 1e3, "ms"));
+	printLine("bvh.anyHit", format(nRays / bvhTime * 1e-6, "Mrays/s"));
+	printLine("grid", format(nRays / gridTime * 1e-6, "Mrays/s") + " (" + format(bvhTime / gridTime, "x") + ")");
+	if (nMismatches) std::cout << "  MISMATCHES: " << nMismatches << "\n";
+	std::cout << std::endl;
+	record("micro", "shadow_grid_build", { { "spheres", nSpheres } }, { { "ms", buildTime * 1e3 } });
+	record("micro", "shadow_grid_update", { { "spheres", nSpheres }, { "moved", (nSpheres + 99) / 100 } }, { { "ms", updateTime * 1e3 } });
+	record("micro", "shadow_bvh_any_hit", { { "spheres", nSpheres } }, { { "rays_per_s", nRays / bvhTime } });
+	record("micro", "shadow_grid", { { "spheres", nSpheres } }, { { "rays_per_s", nRays / gridTime }, { "mismatches", nMismatches } });
+}
+
+// Brute-force nearest hit over every sphere: the AoS scalar reference against the SoA
+// kernels. Also checks that they all agree exactly.
+void benchmarkIntersectionKernels(int nSpheres, int nRays)
+{
+	std::vector<Sphere> spheres = makeRandomSpheres(nSpheres, 3);
+	std::vector<Ray> rays = makeRandomRays(nRays, 4);
+	SphereSoA soa(spheres);
+
+	std::vector<int> referenceIndex(nRays);
+	std::vector<float> referenceT(nRays);
+	auto start = Clock::now();
+	for (int r = 0; r < nRays; ++r) {
+		float minT = FLT_MAX, t;
+		int index = -1;
+		Vector3f intersection;
+		for (int i = 0; i < nSpheres; ++i) {
+			if (raySphereIntersection(rays[r], spheres[i], intersection, t) && t < minT) {
+				minT = t;
+				index = i;
+			}
+		}
+		referenceIndex[r] = index;
+		referenceT[r] = minT;
+	}
+	double referenceTime = secondsSince(start);
+
+	// Each kernel has a display name, and a short name for the results.
+	typedef int (*Kernel)(const Ray&, const SphereSoA&, int, int, float&, float, float);
+	std::vector<std::pair<std::string, std::pair<std::string, Kernel>>> kernels;
+	kernels.push_back({ "SoA scalar", { "soa_scalar", raySphereIntersectionScalar } });
+	// Only the kernels this CPU can run (and that simdLevel allows).
+#if SIMD_HAVE_AVX2
+	if (simdLevel >= SIMD_AVX2) kernels.push_back({ "SoA AVX2", { "soa_avx2", raySphereIntersectionAVX2 } });
+#endif
+#if SIMD_HAVE_AVX512
+	if (simdLevel >= SIMD_AVX512) kernels.push_back({ "SoA AVX-512", { "soa_avx512", raySphereIntersectionAVX512 } });
+#endif
+
+	double nTests = double(nRays) * nSpheres;
+	std::cout << "Ray-sphere kernels, " << nSpheres << " spheres\n"
+		<< "  AoS reference:      " << nTests / referenceTime * 1e-6 << " Mtests/s\n";
+	record("micro", "sphere_kernel_aos", { { "spheres", nSpheres } }, { { "tests_per_s", nTests / referenceTime }, { "ns_per_test", referenceTime / nTests * 1e9 } });
+	for (const auto& kernel : kernels) {
+		int nMismatches = 0;
+		start = Clock::now();
+		for (int r = 0; r < nRays; ++r) {
+			float t = FLT_MAX;
+			int index = kernel.second.second(rays[r], soa, 0, nSpheres, t, 0.001f, FLT_MAX);
+			nMismatches += index != referenceIndex[r] || (index >= 0 && t != referenceT[r]);
+		}
+		double time = secondsSince(start);
+		std::cout << "  " << kernel.first << std::string(20 - kernel.first.size(), ' ')
+			<< nTests / time * 1e-6 << " Mtests/s (" << nMismatches << " mismatches)\n";
+		record("micro", "sphere_kernel_" + kernel.second.first, { { "spheres", nSpheres } },
+			{ { "tests_per_s", nTests / time }, { "ns_per_test", time / nTests * 1e9 }, { "mismatches", nMismatches } });
+	}
+	std::cout << std::endl;
+}
+
+// Primary rays from a pinhole camera outside the cube, looking at its centre: one ray at
+// a time against 8x8 packets.
+void benchmarkPrimaryRays(ThreadPool& pool, int nSpheres, int resolution)
+{
+	std::vector<Sphere> spheres = makeRandomSpheres(nSpheres, 5);
+	BVH bvh(spheres, &pool);
+
+	Vector3f origin(0.f, 0.f, -150.f);
+	auto direction = [&](int x, int y) {
+		return Vector3f((x + 0.5f) / resolution - 0.5f, (y + 0.5f) / resolution - 0.5f, 1.f).normalized();
+	};
+
+	int nHits = 0;
+	auto start = Clock::now();
+	for (int y = 0; y < resolution; ++y)
+		for (int x = 0; x < resolution; ++x) {
+			RayHit hit;
+			nHits += bvh.closestHit(Ray{ origin, direction(x, y) }, spheres, hit);
+		}
+	double singleTime = secondsSince(start);
+
+	int nPacketHits = 0;
+	RayPacket packet;
+	RayHit hits[RayPacket::maxSize];
+	start = Clock::now();
+	for (int py = 0; py < resolution; py += 8)
+		for (int px = 0; px < resolution; px += 8) {
+			packet.reset(origin);
+			for (int y = py; y < std::min(py + 8, resolution); ++y)
+				for (int x = px; x < std::min(px + 8, resolution); ++x) {
+					packet.add(direction(x, y));
+				}
+			closestHitPacket(bvh, packet, hits);
+			for (int i = 0; i < packet.size; ++i) nPacketHits += hits[i].sphere >= 0;
+		}
+	double packetTime = secondsSince(start);
+
+	double nRays = double(resolution) * resolution;
+	std::cout << "Primary rays, " << nSpheres << " spheres, " << resolution << "x" << resolution << "\n"
+		<< "  single rays:        " << nRays / singleTime * 1e-6 << " Mrays/s (" << nHits << " hits)\n"
+		<< "  8x8 packets:        " << nRays / packetTime * 1e-6 << " Mrays/s (" << nPacketHits << " hits)\n"
+		<< std::endl;
+	record("micro", "primary_rays_single", { { "spheres", nSpheres }, { "width", resolution }, { "height", resolution } },
+		{ { "rays_per_s", nRays / singleTime }, { "ns_per_ray", singleTime / nRays * 1e9 } });
+	record("micro", "primary_rays_packets", { { "spheres", nSpheres }, { "width", resolution }, { "height", resolution }, { "packet_size", 8 } },
+		{ { "rays_per_s", nRays / packetTime }, { "ns_per_ray", packetTime / nRays * 1e9 } });
+}
+
+// Turning a linear float image into 8-bit pixels: a powf per channel (as pixels used to be
+// written) against the table-driven pass in tonemapToRGBA8.
+void benchmarkTonemap(ThreadPool& pool, int width, int height)
+{
+	FloatImage image(width, height);
+	std::mt19937 rng(6);
+	std::uniform_real_distribution<float> value(0.f, 1.2f);
+	for (int y = 0; y < height; ++y)
+		for (int x = 0; x < width; ++x) {
+			image.setPixel(x, y, Vector3f(value(rng), value(rng), value(rng)));
+		}
+
+	std::vector<uint8_t> reference(size_t(width) * height * 4);
+	auto start = Clock::now();
+	for (size_t i = 0; i < size_t(width) * height; ++i) {
+		reference[i * 4 + 0] = gammaQuantize(image.r[i]);
+		reference[i * 4 + 1] = gammaQuantize(image.g[i]);
+		reference[i * 4 + 2] = gammaQuantize(image.b[i]);
+		reference[i * 4 + 3] = 255;
+	}
+	double powfTime = secondsSince(start);
+
+	std::vector<uint8_t> rgba;
+	tonemapToRGBA8(image, rgba); // Builds the lookup tables.
+	start = Clock::now();
+	tonemapToRGBA8(image, rgba);
+	double tableTime = secondsSince(start);
+
+	start = Clock::now();
+	tonemapToRGBA8(image, rgba, 1.f, &pool);
+	double parallelTime = secondsSince(start);
+
+	double nPixels = double(width) * height;
+	std::cout << "Tonemap, " << width << "x" << height << "\n"
+		<< "  powf per channel:   " << nPixels / powfTime * 1e-6 << " Mpixels/s\n"
+		<< "  lookup tables:      " << nPixels / tableTime * 1e-6 << " Mpixels/s ("
+		<< (rgba == reference ? "matches" : "DOES NOT MATCH") << " powf)\n"
+		<< "  tables, " << pool.size() << " threads: " << nPixels / parallelTime * 1e-6 << " Mpixels/s\n"
+		<< std::endl;
+	// MB/s counts the RGBA bytes written.
+	std::vector<std::pair<std::string, double>> size = { { "width", width }, { "height", height } };
+	record("micro", "tonemap_powf", size, { { "mpixels_per_s", nPixels / powfTime * 1e-6 }, { "mb_per_s", nPixels * 4 / powfTime * 1e-6 } });
+	record("micro", "tonemap_tables", size, { { "mpixels_per_s", nPixels / tableTime * 1e-6 }, { "mb_per_s", nPixels * 4 / tableTime * 1e-6 } });
+	record("micro", "tonemap_tables_parallel", size, { { "mpixels_per_s", nPixels / parallelTime * 1e-6 }, { "mb_per_s", nPixels * 4 / parallelTime * 1e-6 } });
+}
+
+// PNG encoding of a smoothly shaded, slightly noisy image (roughly how hard rendered images
+// are to compress): lodepng's own compressor against the chunked parallel one.
+void benchmarkPNGEncode(ThreadPool& pool, int width, int height)
+{
+	std::vector<unsigned char> image(size_t(width) * height * 4);
+	std::mt19937 rng(7);
+	std::uniform_int_distribution<int> noise(0, 3);
+	for (int y = 0; y < height; ++y)
+		for (int x = 0; x < width; ++x) {
+			unsigned char* pixel = &image[(size_t(y) * width + x) * 4];
+			pixel[0] = static_cast<unsigned char>(x * 255 / width + noise(rng));
+			pixel[1] = static_cast<unsigned char>(y * 255 / height + noise(rng));
+			pixel[2] = static_cast<unsigned char>((x + y) * 127 / (width + height) + noise(rng));
+			pixel[3] = 255;
+		}
+
+	std::vector<unsigned char> png, parallelPNG;
+	auto start = Clock::now();
+	lodepng::encode(png, image, width, height);
+	double serialTime = secondsSince(start);
+
+	start = Clock::now();
+	unsigned error = encodePNGParallel(parallelPNG, image, width, height, pool);
+	double parallelTime = secondsSince(start);
+
+	// Check the parallel PNG decodes back to the same image.
+	std::vector<unsigned char> decoded;
+	unsigned decodedWidth, decodedHeight;
+	if (!error) error = lodepng::decode(decoded, decodedWidth, decodedHeight, parallelPNG);
+	bool matches = !error && decoded == image;
+
+	double megapixels = double(width) * height * 1e-6;
+	std::cout << "PNG encode, " << width << "x" << height << "\n"
+		<< "  lodepng:            " << megapixels / serialTime << " Mpixels/s (" << png.size() / 1024 << " KiB)\n"
+		<< "  parallel deflate:   " << megapixels / parallelTime << " Mpixels/s (" << parallelPNG.size() / 1024 << " KiB, "
+		<< pool.size() << " threads, " << (matches ? "decodes correctly" : "DOES NOT DECODE") << ")\n"
+		<< std::endl;
+	// MB/s counts the uncompressed RGBA bytes going in.
+	double megabytes = megapixels * 4;
+	std::vector<std::pair<std::string, double>> size = { { "width", width }, { "height", height } };
+	record("micro", "lodepng_encode", size, { { "mb_per_s", megabytes / serialTime }, { "compressed_bytes", double(png.size()) } });
+	record("micro", "png_encode_parallel", size, { { "mb_per_s", megabytes / parallelTime }, { "compressed_bytes", double(parallelPNG.size()) } });
+}
+
+// Loading a scene of random spheres from a binary scene file (just mapping it, and
+// copying it into a Scene) and from the same scene as text. The files are written to the
+// working directory and deleted afterwards.
+void benchmarkSceneLoading(int nSpheres)
+{
+	SceneDescription description;
+	description.spheres = makeRandomSpheres(nSpheres, 12);
+	description.lights.push_back({ Light::AMBIENT, Vector3f(0.1f, 0.1f, 0.1f), Vector3f::Zero(), Vector3f::Zero(), 0.f });
+	description.lights.push_back({ Light::DIRECTIONAL, Vector3f(0.4f, 0.4f, 0.4f), Vector3f::Zero(), Vector3f(1.f, -1.f, 0.f), 0.f });
+	const std::string binaryFilename = "benchmark_scene.bin", textFilename = "benchmark_scene.txt";
+	saveSceneBinary(binaryFilename, description);
+	saveSceneText(textFilename, description);
+	double megabytes = nSpheres * sizeof(Sphere) * 1e-6;
+
+	Scene scene;
+	Camera camera = description.camera;
+	double mapMs = bestNsPerOp(3, 1.0, [&] {
+		SceneFile file(binaryFilename);
+		benchmarkSink = file.spheres()[nSpheres - 1].radius;
+	}) * 1e-6;
+	double binaryMs = bestNsPerOp(3, 1.0, [&] {
+		loadScene(binaryFilename, scene, camera);
+	}) * 1e-6;
+	double textMs = bestNsPerOp(1, 1.0, [&] {
+		loadScene(textFilename, scene, camera);
+	}) * 1e-6;
+	std::remove(binaryFilename.c_str());
+	std::remove(textFilename.c_str());
+
+	std::cout << "Scene loading, " << nSpheres << " spheres\n";
+	printLine("map binary", format(mapMs, "ms"));
+	printLine("load binary", format(binaryMs, "ms") + ", " + format(megabytes / binaryMs * 1e3, "MB/s"));
+	printLine("load text", format(textMs, "ms"));
+	std::cout << std::endl;
+	record("micro", "scene_map_binary", { { "spheres", nSpheres } }, { { "ms", mapMs } });
+	record("micro", "scene_load_binary", { { "spheres", nSpheres } }, { { "ms", binaryMs }, { "mb_per_s", megabytes / binaryMs * 1e3 } });
+	record("micro", "scene_load_text", { { "spheres", nSpheres } }, { { "ms", textMs } });
+}
+
+// Building a BVH over random spheres, against loading it from a BVH cache file (hashing
+// the spheres for the key, mapping the file, checking the tree and refitting it), and
+// hashing on its own. The cache file is written to the working directory and deleted
+// afterwards.
+void benchmarkBVHCache(ThreadPool& pool, int nSpheres)
+{
+	std::vector<Sphere> spheres = makeRandomSpheres(nSpheres, 13);
+	BVHBuildSettings settings;
+	const std::string filename = "benchmark_scene.bvh";
+	BVH bvh;
+	bvh.build(spheres, &pool, settings);
+	uint64_t key = bvhCacheKey(spheres, settings, &pool);
+	saveBVHCache(filename, bvh, key);
+
+	double buildMs = bestNsPerOp(3, 1.0, [&] {
+		bvh.build(spheres, &pool, settings);
+	}) * 1e-6;
+	double hashMs = bestNsPerOp(3, 1.0, [&] {
+		benchmarkSink = static_cast<float>(bvhCacheKey(spheres, settings, &pool) & 0xFF);
+	}) * 1e-6;
+	bool loaded = true;
+	double loadMs = bestNsPerOp(3, 1.0, [&] {
+		loaded = loadBVHCache(filename, spheres, settings, bvhCacheKey(spheres, settings, &pool), bvh) && loaded;
+	}) * 1e-6;
+	std::remove(filename.c_str());
+
+	std::cout << "BVH cache, " << nSpheres << " spheres\n";
+	printLine("build", format(buildMs, "ms"));
+	printLine("load cached", format(loadMs, "ms") + (loaded ? "" : " (cache not used!)"));
+	printLine("hash spheres", format(hashMs, "ms"));
+	std::cout << std::endl;
+	std::vector<std::pair<std::string, double>> parameters = { { "spheres", nSpheres } };
+	record("micro", "bvh_cache_build", parameters, { { "ms", buildMs } });
+	record("micro", "bvh_cache_load", parameters, { { "ms", loadMs }, { "loaded", loaded ? 1.0 : 0.0 } });
+	record("micro", "bvh_cache_key", parameters, { { "ms", hashMs } });
+}
+
+// The small maths functions the tracer calls per ray or per hit: the AoS ray-sphere test,
+// reflect and refract. Inputs are generated up front and cycled through.
+void benchmarkMath(int nOps)
+{
+	const int nInputs = 4096;
+	std::mt19937 rng(8);
+	std::uniform_real_distribution<float> position(-2.f, 2.f);
+	std::normal_distribution<float> direction;
+	auto randomUnit = [&] { return Vector3f(direction(rng), direction(rng), direction(rng)).normalized(); };
+
+	// Rays from around a unit sphere at the origin, aimed near it, so about half hit.
+	Sphere sphere{ Vector3f::Zero(), 1.f, Material::DIFFUSE, Vector3f::Ones(), 1.f };
+	std::vector<Ray> rays(nInputs);
+	std::vector<Vector3f> incident(nInputs), normals(nInputs);
+	for (int i = 0; i < nInputs; ++i) {
+		Vector3f origin = randomUnit() * 3.f;
+		Vector3f target(position(rng), position(rng), position(rng));
+		rays[i] = Ray{ origin, (target * 0.5f - origin).normalized() };
+		normals[i] = randomUnit();
+		incident[i] = randomUnit();
+		// Make the incident direction point into the surface, as it does in the tracer.
+		if (incident[i].dot(normals[i]) > 0) incident[i] = -incident[i];
+	}
+
+	const int repeats = 3;
+	double intersectNs = bestNsPerOp(repeats, nOps, [&] {
+		float sum = 0.f, t;
+		Vector3f intersection;
+		for (int i = 0; i < nOps; ++i) {
+			if (raySphereIntersection(rays[i % nInputs], sphere, intersection, t)) sum += t;
+		}
+		benchmarkSink = sum;
+	});
+	double reflectNs = bestNsPerOp(repeats, nOps, [&] {
+		Vector3f sum = Vector3f::Zero();
+		for (int i = 0; i < nOps; ++i) {
+			sum += reflect(incident[i % nInputs], normals[i % nInputs]);
+		}
+		benchmarkSink = sum.sum();
+	});
+	double refractNs = bestNsPerOp(repeats, nOps, [&] {
+		Vector3f sum = Vector3f::Zero(), refracted;
+		for (int i = 0; i < nOps; ++i) {
+			if (refract(incident[i % nInputs], normals[i % nInputs], 1.f / 1.4f, refracted)) sum += refracted;
+		}
+		benchmarkSink = sum.sum();
+	});
+
+	std::cout << "Maths functions\n";
+	printLine("raySphereIntersection", format(intersectNs, "ns/test"));
+	printLine("reflect", format(reflectNs, "ns/call"));
+	printLine("refract", format(refractNs, "ns/call"));
+	std::cout << std::endl;
+	record("micro", "ray_sphere_intersection", {}, { { "ns_per_op", intersectNs }, { "ops_per_s", 1e9 / intersectNs } });
+	record("micro", "reflect", {}, { { "ns_per_op", reflectNs }, { "ops_per_s", 1e9 / reflectNs } });
+	record("micro", "refract", {}, { { "ns_per_op", refractNs }, { "ops_per_s", 1e9 / refractNs } });
+}
+
+// Evaluating each type of light at a surface point, through the Light base class as the
+// tracer does: getDirection (except for ambient lights) and getIntensityAt.
+void benchmarkLights(int nOps)
+{
+	const int nInputs = 4096;
+	std::mt19937 rng(9);
+	std::uniform_real_distribution<float> position(-10.f, 10.f);
+	std::vector<Vector3f> points(nInputs);
+	for (Vector3f& point : points) point = Vector3f(position(rng), position(rng), position(rng));
+
+	std::vector<std::pair<std::string, std::unique_ptr<Light>>> lights;
+	lights.emplace_back("ambient", std::unique_ptr<Light>(new AmbientLight(Vector3f(0.1f, 0.1f, 0.1f))));
+	lights.emplace_back("directional", std::unique_ptr<Light>(new DirectionalLight(Vector3f(0.4f, 0.4f, 0.4f), Vector3f(1.f, -1.f, 0.f))));
+	lights.emplace_back("point", std::unique_ptr<Light>(new PointLight(Vector3f(50.f, 50.f, 50.f), Vector3f(0.f, 20.f, 0.f))));
+	lights.emplace_back("spot", std::unique_ptr<Light>(new SpotLight(Vector3f(50.f, 50.f, 50.f), Vector3f(0.f, 20.f, 0.f), Vector3f(0.f, -1.f, 0.f), 0.5f)));
+
+	std::cout << "Light evaluation\n";
+	for (auto& entry : lights) {
+		Light* light = entry.second.get();
+		bool hasDirection = light->getType() != Light::AMBIENT;
+		double ns = bestNsPerOp(3, nOps, [&] {
+			Vector3f sum = Vector3f::Zero();
+			for (int i = 0; i < nOps; ++i) {
+				const Vector3f& point = points[i % nInputs];
+				if (hasDirection) sum += light->getDirection(point);
+				sum += light->getIntensityAt(point);
+			}
+			benchmarkSink = sum.sum();
+		});
+		printLine(entry.first, format(ns, "ns/evaluation"));
+		record("micro", "light_" + entry.first, {}, { { "ns_per_op", ns }, { "ops_per_s", 1e9 / ns } });
+	}
+	std::cout << std::endl;
+}
+
+// Writing pixels one at a time with setPixel from Image.hpp.
+void benchmarkSetPixel(int width, int height)
+{
+	std::vector<uint8_t> image(size_t(width) * height * 4);
+	double nPixels = double(width) * height;
+	double ns = bestNsPerOp(3, nPixels, [&] {
+		for (int y = 0; y < height; ++y)
+			for (int x = 0; x < width; ++x) {
+				Color color{ uint8_t(x), uint8_t(y), uint8_t(x + y), 255 };
+				setPixel(image, x, y, width, height, color);
+			}
+		benchmarkSink = image[image.size() / 2];
+	});
+	double mbPerS = 4 / ns * 1e3;
+	std::cout << "setPixel, " << width << "x" << height << "\n";
+	printLine("setPixel", format(ns, "ns/pixel") + " (" + format(mbPerS, "MB/s") + ")");
+	std::cout << std::endl;
+	record("micro", "set_pixel", { { "width", width }, { "height", height } }, { { "ns_per_pixel", ns }, { "mb_per_s", mbPerS } });
+}
+
+// A generated scene for the frame benchmarks: nSpheres random spheres filling a cube of
+// side 100 (every 10th a mirror, every 20th glass), lit by one light of each type, with
+// the camera just outside the cube looking at its centre.
+void makeBenchmarkScene(int nSpheres, Scene& scene, Camera& camera)
+{
+	scene.spheres = makeRandomSpheres(nSpheres, 10);
+	for (int i = 0; i < nSpheres; ++i) {
+		Sphere& sphere = scene.spheres[i];
+		sphere.colour = Vector3f(0.3f + 0.6f * ((i * 7) % 10) / 10.f, 0.3f + 0.6f * ((i * 3) % 10) / 10.f, 0.8f);
+		if (i % 20 == 19) {
+			sphere.material = Material::REFRACTIVE;
+			sphere.ior = 1.4f;
+		}
+		else if (i % 10 == 9) sphere.material = Material::MIRROR;
+	}
+
+	scene.lights.clear();
+	scene.lights.emplace_back(new AmbientLight(Vector3f(0.1f, 0.1f, 0.1f)));
+	scene.lights.emplace_back(new DirectionalLight(Vector3f(0.4f, 0.4f, 0.4f), Vector3f(1.f, -1.f, 0.5f)));
+	scene.lights.emplace_back(new PointLight(Vector3f(2000.f, 2000.f, 2000.f), Vector3f(0.f, 40.f, -60.f)));
+	scene.lights.emplace_back(new SpotLight(Vector3f(3000.f, 3000.f, 3000.f), Vector3f(-40.f, 0.f, -60.f), Vector3f(1.f, 0.f, 1.f).normalized(), 0.4f));
+	scene.buildLightTable();
+
+	camera = Camera{
+		Vector3f(0.f, 0.f, -110.f), // position
+		Vector3f(0.f, 0.f, 1.f),    // direction
+		Vector3f(0.f, 1.f, 0.f),    // up
+		float(M_PI_2)               // horzFov
+	};
+}
+
+// Direct lighting of diffuse hit points (the primary hits of a frame of the generated
+// scene), one at a time with shadeDiffuse, in batches of 64 with shadeDiffuseBatch, and
+// a tile's worth of batches at a time with shadeDiffuseBatches. All include the shadow
+// rays: one at a time with bvh.anyHit for shadeDiffuse, as a stream for the others.
+void benchmarkShading(ThreadPool& pool, int nSpheres, int resolution)
+{
+	Scene scene;
+	Camera camera;
+	makeBenchmarkScene(nSpheres, scene, camera);
+	scene.buildBVH(&pool);
+	PrimaryRayGenerator rays(camera, resolution, resolution);
+
+	std::vector<DiffuseHitBatch> batches(1);
+	for (int y = 0; y < resolution; ++y)
+		for (int x = 0; x < resolution; ++x) {
+			RayHit hit;
+			if (!scene.bvh.closestHit(rays.ray(x, y), scene.spheres, hit)) continue;
+			const Sphere& sphere = scene.spheres[hit.sphere];
+			if (sphere.material != Material::DIFFUSE) continue;
+			if (batches.back().full()) batches.emplace_back();
+			batches.back().add(sphere, hit.intersection);
+		}
+	double nPoints = double(batches.size() - 1) * DiffuseHitBatch::maxSize + batches.back().size;
+
+	double scalarNs = bestNsPerOp(3, nPoints, [&] {
+		Vector3f sum = Vector3f::Zero();
+		for (const DiffuseHitBatch& batch : batches)
+			for (int i = 0; i < batch.size; ++i) {
+				sum += shadeDiffuse(*batch.spheres[i], batch.point(i), scene);
+			}
+		benchmarkSink = sum.sum();
+	});
+	double batchNs = bestNsPerOp(3, nPoints, [&] {
+		Vector3f sum = Vector3f::Zero();
+		Vector3f colours[DiffuseHitBatch::maxSize];
+		for (DiffuseHitBatch& batch : batches) {
+			shadeDiffuseBatch(batch, scene, colours, 0, true, scene.features);
+			for (int i = 0; i < batch.size; ++i) sum += colours[i];
+		}
+		benchmarkSink = sum.sum();
+	});
+
+	// 16 batches at a time, as for a 32x32 tile, so the shadow ray streams are 16 times as long.
+	std::vector<Vector3f> tileColours(16 * DiffuseHitBatch::maxSize);
+	double tileNs = bestNsPerOp(3, nPoints, [&] {
+		Vector3f sum = Vector3f::Zero();
+		for (size_t b = 0; b < batches.size(); b += 16) {
+			int nBatches = static_cast<int>(std::min<size_t>(16, batches.size() - b));
+			shadeDiffuseBatches(&batches[b], nBatches, scene, tileColours.data(), 0, true, scene.features);
+			for (int i = 0; i < nBatches; ++i)
+				for (int j = 0; j < batches[b + i].size; ++j) {
+					sum += tileColours[i * DiffuseHitBatch::maxSize + j];
+				}
+		}
+		benchmarkSink = sum.sum();
+	});
+
+	std::cout << "Diffuse shading, " << nSpheres << " spheres, " << scene.lights.size() << " lights, " << nPoints << " points\n";
+	printLine("shadeDiffuse", format(scalarNs, "ns/point"));
+	printLine("shadeDiffuseBatch", format(batchNs, "ns/point") + " (" + format(scalarNs / batchNs, "x") + ")");
+	printLine("16 batches (tile)", format(tileNs, "ns/point") + " (" + format(scalarNs / tileNs, "x") + ")");
+	std::cout << std::endl;
+	record("micro", "shade_diffuse", { { "spheres", nSpheres }, { "points", nPoints } }, { { "ns_per_point", scalarNs } });
+	record("micro", "shade_diffuse_batch", { { "spheres", nSpheres }, { "points", nPoints } }, { { "ns_per_point", batchNs } });
+	record("micro", "shade_diffuse_tile", { { "spheres", nSpheres }, { "points", nPoints } }, { { "ns_per_point", tileNs } });
+}
+
+// Whole paths traced one at a time with traceRayIterative: the generic kernel against the
+// one specialized for the scene's features (see selectTraceKernel). Once on the generated
+// scene, which has every feature, and once on a simple version of it: all diffuse, with
+// just the ambient and directional lights.
+void benchmarkKernels(ThreadPool& pool, int nSpheres, int resolution)
+{
+	for (bool simple : { false, true }) {
+		Scene scene;
+		Camera camera;
+		makeBenchmarkScene(nSpheres, scene, camera);
+		if (simple) {
+			for (Sphere& sphere : scene.spheres) sphere.material = Material::DIFFUSE;
+			scene.lights.resize(2);
+			scene.buildLightTable();
+		}
+		scene.buildBVH(&pool);
+		PrimaryRayGenerator rays(camera, resolution, resolution);
+
+		double nRays = double(resolution) * resolution;
+		auto timeKernel = [&](TraceKernel trace) {
+			return bestNsPerOp(3, nRays, [&] {
+				Vector3f sum = Vector3f::Zero();
+				for (int y = 0; y < resolution; ++y)
+					for (int x = 0; x < resolution; ++x) {
+						sum += trace(rays.ray(x, y), scene, nullptr, 0.f);
+					}
+				benchmarkSink = sum.sum();
+			});
+		};
+		double genericNs = timeKernel(selectTraceKernel(allSceneFeatures));
+		double specializedNs = timeKernel(selectTraceKernel(scene.features));
+
+		std::cout << "Trace kernels, " << (simple ? "diffuse only, ambient + directional" : "every feature") << ", " << nSpheres << " spheres\n";
+		printLine("generic", format(genericNs, "ns/ray"));
+		printLine("specialized", format(specializedNs, "ns/ray") + " (" + format(genericNs / specializedNs, "x") + ")");
+		std::cout << std::endl;
+		record("micro", "trace_kernel_generic", { { "spheres", nSpheres }, { "simple", simple }, { "features", allSceneFeatures } }, { { "ns_per_ray", genericNs } });
+		record("micro", "trace_kernel_specialized", { { "spheres", nSpheres }, { "simple", simple }, { "features", scene.features } }, { { "ns_per_ray", specializedNs } });
+	}
+}
+
+// Direct lighting from many point and spot lights (scattered through the generated scene
+// with a total intensity independent of their number), every light exactly and with light
+// cuts. The exact version is slow, so it's only timed on a sample of the points.
+// Error is the RMS difference from the exact colours, relative to their RMS.
+void benchmarkLightCuts(ThreadPool& pool, int nSpheres, int nLights, int nPoints)
+{
+	Scene scene;
+	Camera camera;
+	makeBenchmarkScene(nSpheres, scene, camera);
+	scene.buildBVH(&pool);
+
+	std::mt19937 rng(3);
+	std::uniform_real_distribution<float> position(-60.f, 60.f), colour(0.5f, 1.f), angle(0.3f, 1.f);
+	std::normal_distribution<float> direction;
+	scene.lights.resize(1); // Keep the ambient light.
+	float power = 100000.f / nLights;
+	for (int i = 0; i < nLights; ++i) {
+		Vector3f location(position(rng), position(rng), position(rng));
+		Vector3f intensity = power * Vector3f(colour(rng), colour(rng), colour(rng));
+		if (i % 2) scene.lights.emplace_back(new PointLight(intensity, location));
+		else scene.lights.emplace_back(new SpotLight(intensity, location, Vector3f(direction(rng), direction(rng), direction(rng)), angle(rng)));
+	}
+	auto start = Clock::now();
+	scene.buildLightTable();
+	double buildTime = secondsSince(start);
+
+	std::vector<std::pair<const Sphere*, Vector3f>> points;
+	PrimaryRayGenerator rays(camera, 512, 512);
+	std::uniform_int_distribution<int> pixel(0, 511);
+	while (static_cast<int>(points.size()) < nPoints) {
+		RayHit hit;
+		if (!scene.bvh.closestHit(rays.ray(pixel(rng), pixel(rng)), scene.spheres, hit)) continue;
+		if (scene.spheres[hit.sphere].material != Material::DIFFUSE) continue;
+		points.push_back({ &scene.spheres[hit.sphere], hit.intersection });
+	}
+
+	std::vector<Vector3f> exact(nPoints), cut(nPoints);
+	auto shadeAll = [&](std::vector<Vector3f>& colours) {
+		for (int i = 0; i < nPoints; ++i) colours[i] = shadeDiffuse(*points[i].first, points[i].second, scene);
+		benchmarkSink = colours[0].sum();
+	};
+	scene.lightCuts.maxError = 0.f;
+	double exactNs = bestNsPerOp(1, nPoints, [&] { shadeAll(exact); });
+	scene.lightCuts.maxError = 0.02f;
+	double cutNs = bestNsPerOp(3, nPoints, [&] { shadeAll(cut); });
+	double squaredError = 0.0, squaredExact = 0.0;
+	for (int i = 0; i < nPoints; ++i) {
+		squaredError += (cut[i] - exact[i]).squaredNorm();
+		squaredExact += exact[i].squaredNorm();
+	}
+	double error = squaredExact > 0.0 ? sqrt(squaredError / squaredExact) : 0.0;
+
+	std::cout << "Many lights, " << nLights << " point/spot lights, " << nSpheres << " spheres, " << nPoints << " points (tree build " << buildTime * 1e3 << " ms)\n";
+	printLine("every light", format(exactNs, "ns/point"));
+	printLine("light cuts (2%)", format(cutNs, "ns/point") + " (" + format(exactNs / cutNs, "x") + ", error " + format(error * 100.0, "%") + ")");
+	std::cout << std::endl;
+	record("micro", "shade_all_lights", { { "lights", nLights }, { "points", nPoints } }, { { "ns_per_point", exactNs } });
+	record("micro", "shade_light_cuts", { { "lights", nLights }, { "points", nPoints } },
+		{ { "ns_per_point", cutNs }, { "relative_error", error }, { "tree_build_ms", buildTime * 1e3 } });
+}
+
+// Whole frames (primary rays, bounces, shadows and shading) of the generated scenes, at
+// square resolutions from 256 up to maxResolution. Rays/s counts primary rays (one per pixel).
+void benchmarkFrames(ThreadPool& pool, int maxResolution, const std::vector<int>& sphereCounts)
+{
+	for (int nSpheres : sphereCounts) {
+		Scene scene;
+		Camera camera;
+		makeBenchmarkScene(nSpheres, scene, camera);
+		auto start = Clock::now();
+		scene.buildBVH(&pool);
+		double buildTime = secondsSince(start);
+
+		std::cout << "Frames, " << nSpheres << " spheres (BVH build " << buildTime * 1e3 << " ms)\n";
+		for (int resolution = 256; resolution <= maxResolution; resolution *= 2) {
+			PrimaryRayGenerator rays(camera, resolution, resolution);
+			FloatImage framebuffer;
+			double nPixels = double(resolution) * resolution;
+			// The default tile renderer, then the same frame as a wavefront.
+			for (bool wavefront : { false, true }) {
+				RenderSettings settings;
+				settings.wavefront = wavefront;
+				double nsPerRay = bestNsPerOp(3, nPixels, [&] {
+					renderFrame(scene, rays, settings, pool, framebuffer);
+				});
+				double frameMs = nsPerRay * nPixels * 1e-6;
+				printLine(std::to_string(resolution) + "x" + std::to_string(resolution) + (wavefront ? " wavefront" : ""),
+					format(frameMs, "ms/frame") + ", " + format(1e3 / nsPerRay, "Mrays/s") + ", " + format(nsPerRay, "ns/ray"));
+				record("macro", wavefront ? "frame_wavefront" : "frame", { { "spheres", nSpheres }, { "width", resolution }, { "height", resolution }, { "threads", pool.size() } },
+					{ { "frame_ms", frameMs }, { "rays_per_s", 1e9 / nsPerRay }, { "ns_per_ray", nsPerRay }, { "bvh_build_ms", buildTime * 1e3 } });
+			}
+		}
+		std::cout << std::endl;
+	}
+}
+
+// Anti-aliased frames of the generated scene: 4 samples in every pixel against adaptive
+// sampling with a budget of 4 per pixel on average. Error is the RMS difference (in 8-bit
+// steps, after gamma correction) from 16 samples in every pixel.
+void benchmarkAntiAliasing(ThreadPool& pool, int nSpheres, int resolution)
+{
+	Scene scene;
+	Camera camera;
+	makeBenchmarkScene(nSpheres, scene, camera);
+	scene.buildBVH(&pool);
+	PrimaryRayGenerator rays(camera, resolution, resolution);
+
+	auto renderWith = [&](int minSamples, int maxSamples, std::vector<uint8_t>& rgba) {
+		RenderSettings settings;
+		settings.adaptive.minSamples = minSamples;
+		settings.adaptive.maxSamples = maxSamples;
+		settings.adaptive.budget = 4.f;
+		FloatImage framebuffer;
+		double ms = bestNsPerOp(2, 1.0, [&] {
+			renderFrame(scene, rays, settings, pool, framebuffer);
+		}) * 1e-6;
+		tonemapToRGBA8(framebuffer, rgba);
+		return ms;
+	};
+	std::vector<uint8_t> reference, rgba;
+	renderWith(16, 16, reference);
+	auto rmsError = [&] {
+		double sum = 0.0;
+		for (size_t i = 0; i < rgba.size(); ++i) {
+			if (i % 4 == 3) continue;
+			double difference = double(rgba[i]) - reference[i];
+			sum += difference * difference;
+		}
+		return sqrt(sum / (rgba.size() / 4 * 3));
+	};
+
+	std::cout << "Anti-aliasing, " << nSpheres << " spheres, " << resolution << "x" << resolution << ", error against 16 samples per pixel\n";
+	const char* names[] = { "uniform 4", "adaptive 4" };
+	const int minSamples[] = { 4, 2 }, maxSamples[] = { 4, 16 };
+	for (int i = 0; i < 2; ++i) {
+		double ms = renderWith(minSamples[i], maxSamples[i], rgba);
+		double error = rmsError();
+		printLine(names[i], format(ms, "ms/frame") + ", " + format(error, "RMS error"));
+		record("macro", i ? "frame_aa_adaptive" : "frame_aa_uniform", { { "spheres", nSpheres }, { "width", resolution }, { "height", resolution }, { "threads", pool.size() } },
+			{ { "frame_ms", ms }, { "rms_error", error } });
+	}
+	std::cout << std::endl;
+}
+
+// Path traced frames of the generated scene: samples (paths) per second, and a check that
+// the image comes out the same on one thread as on the pool.
+void benchmarkPathTracing(ThreadPool& pool, int nSpheres, int resolution, int samplesPerPixel)
+{
+	Scene scene;
+	Camera camera;
+	makeBenchmarkScene(nSpheres, scene, camera);
+	scene.buildBVH(&pool);
+	PrimaryRayGenerator rays(camera, resolution, resolution);
+	RenderSettings settings;
+	settings.pathTrace.samplesPerPixel = samplesPerPixel;
+
+	FloatImage framebuffer, serialFramebuffer;
+	double nSamples = double(resolution) * resolution * samplesPerPixel;
+	double nsPerSample = bestNsPerOp(2, nSamples, [&] {
+		renderFrame(scene, rays, settings, pool, framebuffer);
+	});
+	RenderSettings serialSettings = settings;
+	serialSettings.serial = true;
+	serialSettings.tileSize = 13;
+	renderFrame(scene, rays, serialSettings, pool, serialFramebuffer);
+	bool same = framebuffer.r == serialFramebuffer.r && framebuffer.g == serialFramebuffer.g && framebuffer.b == serialFramebuffer.b;
+
+	std::cout << "Path tracing, " << nSpheres << " spheres, " << resolution << "x" << resolution << ", " << samplesPerPixel << " spp\n";
+	printLine("frame", format(nsPerSample * nSamples * 1e-6, "ms/frame") + ", " + format(1e3 / nsPerSample, "Msamples/s")
+		+ (same ? " (same image on one thread)" : " (DIFFERENT image on one thread)"));
+	std::cout << std::endl;
+	record("macro", "path_trace", { { "spheres", nSpheres }, { "width", resolution }, { "height", resolution }, { "spp", samplesPerPixel }, { "threads", pool.size() } },
+		{ { "samples_per_s", 1e9 / nsPerSample }, { "ns_per_sample", nsPerSample }, { "deterministic", same } });
+}
+
+// A hall of mirrors: some of the generated scene's spheres (a quarter of them mirrors)
+// inside a big mirrored sphere, lit by a point light, with the camera inside as well, so
+// nearly every path bounces between mirrors until something ends it. Path traced with
+// the old fixed bounce limit, with it raised to 64, with Russian roulette (up to 64
+// bounces) and with roulette and a one 8-bit step cutoff. The mean pixel value shows the
+// bias: the fixed limit loses light, roulette shouldn't.
+void benchmarkPathTermination(ThreadPool& pool, int nSpheres, int resolution, int samplesPerPixel)
+{
+	Scene scene;
+	scene.spheres = makeRandomSpheres(nSpheres, 11);
+	for (int i = 0; i < nSpheres; ++i) {
+		Sphere& sphere = scene.spheres[i];
+		sphere.colour = Vector3f(0.3f + 0.6f * ((i * 7) % 10) / 10.f, 0.3f + 0.6f * ((i * 3) % 10) / 10.f, 0.8f);
+		if (i % 4 == 3) sphere.material = Material::MIRROR;
+	}
+	scene.spheres.push_back({ Vector3f(0.f, 0.f, 0.f), 100.f, Material::MIRROR, Vector3f(0.85f, 0.85f, 0.85f), 1.f });
+	scene.lights.clear();
+	scene.lights.emplace_back(new AmbientLight(Vector3f(0.1f, 0.1f, 0.1f)));
+	scene.lights.emplace_back(new PointLight(Vector3f(2000.f, 2000.f, 2000.f), Vector3f(0.f, 40.f, -60.f)));
+	scene.buildLightTable();
+	scene.buildBVH(&pool);
+	Camera camera{ Vector3f(0.f, 0.f, -90.f), Vector3f(0.f, 0.f, 1.f), Vector3f(0.f, 1.f, 0.f), float(M_PI_2) };
+	PrimaryRayGenerator rays(camera, resolution, resolution);
+
+	struct Termination {
+		const char* name;
+		int rouletteDepth, maxDepth;
+		float cutoff;
+	};
+	const Termination terminations[] = {
+		{ "fixed depth 5", -1, maxBounces, 0.f },
+		{ "fixed depth 64", -1, 64, 0.f },
+		{ "roulette", 2, 64, 0.f },
+		{ "roulette + cutoff", 2, 64, 1.f / 255.f },
+	};
+
+	std::cout << "Path termination, hall of mirrors, " << nSpheres << " spheres, " << resolution << "x" << resolution << ", " << samplesPerPixel << " spp\n";
+	double nSamples = double(resolution) * resolution * samplesPerPixel;
+	for (const Termination& termination : terminations) {
+		RenderSettings settings;
+		settings.pathTrace.samplesPerPixel = samplesPerPixel;
+		settings.pathTrace.rouletteDepth = termination.rouletteDepth;
+		settings.pathTrace.maxDepth = termination.maxDepth;
+		settings.pathTrace.cutoff = termination.cutoff;
+		FloatImage framebuffer;
+		double nsPerSample = bestNsPerOp(2, nSamples, [&] {
+			renderFrame(scene, rays, settings, pool, framebuffer);
+		});
+		double sum = 0.0;
+		for (int i = 0; i < framebuffer.width * framebuffer.height; ++i) sum += framebuffer.r[i] + framebuffer.g[i] + framebuffer.b[i];
+		double mean = sum / (3.0 * framebuffer.width * framebuffer.height);
+
+		printLine(termination.name, format(nsPerSample * nSamples * 1e-6, "ms/frame") + ", " + format(1e3 / nsPerSample, "Msamples/s")
+			+ ", " + format(mean, "mean pixel value"));
+		record("macro", "path_termination", { { "spheres", nSpheres }, { "width", resolution }, { "height", resolution }, { "spp", samplesPerPixel },
+			{ "roulette_depth", termination.rouletteDepth }, { "max_depth", termination.maxDepth }, { "cutoff", termination.cutoff }, { "threads", pool.size() } },
+			{ { "samples_per_s", 1e9 / nsPerSample }, { "ns_per_sample", nsPerSample }, { "mean", mean } });
+	}
+	std::cout << std::endl;
+}
+
+// Denoising a path traced frame of the generated scene with a few samples per pixel: the
+// time it takes per megapixel at each SIMD level this CPU has (which should all give the
+// same image), and the error (as in benchmarkAntiAliasing) against 64 samples per pixel,
+// before and after.
+void benchmarkDenoise(ThreadPool& pool, int nSpheres, int resolution, int samplesPerPixel)
+{
+	Scene scene;
+	Camera camera;
+	makeBenchmarkScene(nSpheres, scene, camera);
+	scene.buildBVH(&pool);
+	PrimaryRayGenerator rays(camera, resolution, resolution);
+
+	RenderSettings settings;
+	settings.pathTrace.samplesPerPixel = 64;
+	FloatImage framebuffer;
+	std::vector<uint8_t> reference, rgba;
+	renderFrame(scene, rays, settings, pool, framebuffer);
+	tonemapToRGBA8(framebuffer, reference);
+	auto rmsError = [&] {
+		tonemapToRGBA8(framebuffer, rgba);
+		double sum = 0.0;
+		for (size_t i = 0; i < rgba.size(); ++i) {
+			if (i % 4 == 3) continue;
+			double difference = double(rgba[i]) - reference[i];
+			sum += difference * difference;
+		}
+		return sqrt(sum / (rgba.size() / 4 * 3));
+	};
+
+	settings.pathTrace.samplesPerPixel = samplesPerPixel;
+	GBuffer gbuffer;
+	FloatImage noisy;
+	renderFrame(scene, rays, settings, pool, noisy, &gbuffer);
+	framebuffer = noisy;
+	double noisyError = rmsError();
+
+	std::cout << "Denoising, " << nSpheres << " spheres, " << resolution << "x" << resolution << ", " << samplesPerPixel
+		<< " spp, error against 64 spp (" << format(noisyError, "before") << ")\n";
+	double megapixels = double(resolution) * resolution * 1e-6;
+	SimdLevel bestLevel = simdLevel;
+	FloatImage first;
+	for (int level = SIMD_BASELINE; level <= bestLevel; ++level) {
+		if (!setSimdLevel(SimdLevel(level))) continue;
+		double ms = bestNsPerOp(3, 1.0, [&] {
+			framebuffer = noisy;
+			denoise(framebuffer, gbuffer, DenoiseSettings(), &pool);
+		}) * 1e-6;
+		if (first.width == 0) first = framebuffer;
+		bool same = framebuffer.r == first.r && framebuffer.g == first.g && framebuffer.b == first.b;
+		double error = rmsError();
+		printLine(simdLevelNames[level], format(ms / megapixels, "ms/Mpixel") + ", " + format(error, "RMS error")
+			+ (same ? "" : " (DIFFERENT image from " + std::string(simdLevelNames[SIMD_BASELINE]) + ")"));
+		record("macro", std::string("denoise_") + simdLevelNames[level], { { "spheres", nSpheres }, { "width", resolution }, { "height", resolution },
+			{ "spp", samplesPerPixel }, { "threads", pool.size() } },
+			{ { "ms_per_mpixel", ms / megapixels }, { "rms_error_before", noisyError }, { "rms_error", error }, { "same_image", same } });
+	}
+	setSimdLevel(bestLevel);
+	std::cout << std::endl;
+}
+
+// Rendering a short animation of the generated scene, with every sphere moving in a
+// straight line (up to 10 units, so they cross each other and the refitted BVH gets
+// worse), three ways: rebuilding the BVH every frame, refitting it until its SAH cost has
+// grown by half, and only ever refitting it. The frames are saved to the working directory
+// (as in SphereTracer --animation) and deleted afterwards.
+void benchmarkSequence(ThreadPool& pool, int nSpheres, int resolution, int nFrames)
+{
+	Scene scene;
+	Camera camera;
+	makeBenchmarkScene(nSpheres, scene, camera);
+	const std::vector<Sphere> start = scene.spheres;
+	Animation animation;
+	animation.nFrames = nFrames;
+	std::mt19937 rng(14);
+	std::uniform_real_distribution<float> offset(-5.f, 5.f);
+	for (int i = 0; i < nSpheres; ++i) {
+		Vector3f end = start[i].centre + Vector3f(offset(rng), offset(rng), offset(rng));
+		animation.sphereTracks.push_back({ i, { { 0.f, start[i].centre, start[i].radius }, { float(nFrames - 1), end, start[i].radius } } });
+	}
+	SequenceSettings sequence;
+	sequence.width = sequence.height = resolution;
+	sequence.filenamePrefix = "benchmark_frame_";
+
+	std::cout << "Animation, " << nSpheres << " moving spheres, " << resolution << "x" << resolution << ", " << nFrames << " frames\n";
+	const std::pair<const char*, float> policies[] = { { "rebuild", 0.f }, { "refit_rebuild", 1.5f }, { "refit", FLT_MAX } };
+	for (const auto& policy : policies) {
+		scene.spheres = start;
+		scene.buildBVH(&pool);
+		sequence.maxCostGrowth = policy.second;
+		auto begin = std::chrono::steady_clock::now();
+		SequenceStats stats = renderSequence(scene, animation, camera, RenderSettings(), sequence, pool);
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+		printLine(policy.first, format(ms / nFrames, "ms/frame") + ", BVH " + format(stats.bvhSeconds * 1e3 / nFrames, "ms/frame")
+			+ ", render " + format(stats.renderSeconds * 1e3 / nFrames, "ms/frame") + ", " + std::to_string(stats.nRebuilds) + " rebuilds");
+		record("macro", std::string("sequence_") + policy.first, { { "spheres", nSpheres }, { "width", resolution }, { "height", resolution },
+			{ "frames", nFrames }, { "threads", pool.size() } },
+			{ { "ms_per_frame", ms / nFrames }, { "bvh_ms_per_frame", stats.bvhSeconds * 1e3 / nFrames },
+			{ "render_ms_per_frame", stats.renderSeconds * 1e3 / nFrames }, { "encode_wait_ms_per_frame", stats.encodeWaitSeconds * 1e3 / nFrames },
+			{ "rebuilds", stats.nRebuilds } });
+	}
+	for (int frame = 0; frame < nFrames; ++frame) std::remove(sequenceFrameFilename(sequence, frame).c_str());
+	std::cout << std::endl;
+}
+
+// Relighting a frame of the generated scene: rendering it from scratch, against recording
+// its paths once (see Relight.hpp) and relighting them with the directional light turned
+// to a new direction each time, which should give exactly the image rendering it with
+// those lights does.
+void benchmarkRelight(ThreadPool& pool, int nSpheres, int resolution)
+{
+	Scene scene;
+	Camera camera;
+	makeBenchmarkScene(nSpheres, scene, camera);
+	scene.buildBVH(&pool);
+	PrimaryRayGenerator rays(camera, resolution, resolution);
+	RenderSettings settings;
+	FloatImage rendered, relit;
+	RelightBuffer buffer;
+	int turn = 0;
+	auto turnLight = [&] {
+		float angle = 0.3f * ++turn;
+		scene.lights[1].reset(new DirectionalLight(Vector3f(0.4f, 0.4f, 0.4f), Vector3f(cosf(angle), -1.f, sinf(angle))));
+		scene.buildLightTable();
+	};
+
+	double renderMs = bestNsPerOp(3, 1.0, [&] {
+		turnLight();
+		renderFrame(scene, rays, settings, pool, rendered);
+	}) * 1e-6;
+	double recordMs = bestNsPerOp(3, 1.0, [&] {
+		recordRelightBuffer(scene, rays, settings, pool, buffer);
+	}) * 1e-6;
+	double relightMs = bestNsPerOp(3, 1.0, [&] {
+		turnLight();
+		relight(scene, buffer, pool, relit);
+	}) * 1e-6;
+	renderFrame(scene, rays, settings, pool, rendered);
+	bool same = rendered.r == relit.r && rendered.g == relit.g && rendered.b == relit.b;
+
+	std::cout << "Relighting, " << nSpheres << " spheres, " << resolution << "x" << resolution << "\n";
+	printLine("render", format(renderMs, "ms"));
+	printLine("record paths", format(recordMs, "ms"));
+	printLine("relight", format(relightMs, "ms") + " (" + format(renderMs / relightMs, "x") + ")"
+		+ (same ? "" : " (DIFFERENT image from rendering)"));
+	std::cout << std::endl;
+	record("macro", "relight", { { "spheres", nSpheres }, { "width", resolution }, { "height", resolution }, { "threads", pool.size() } },
+		{ { "render_ms", renderMs }, { "record_ms", recordMs }, { "relight_ms", relightMs }, { "same_image", same } });
+}
+
+void printUsage()
+{
+	std::cout << "Usage: benchmarks [options]\n"
+		<< "  --suite S          Which benchmarks to run: micro, macro or all (default: all)\n"
+		<< "  --json FILE        Also write the results to FILE as JSON\n"
+		<< "  --label TEXT       Label stored in the JSON results (e.g. a commit hash)\n"
+		<< "  --threads N        Threads for the parallel benchmarks (default: one per hardware thread)\n"
+		<< "  --max-spheres N    Largest BVH benchmark scene, from 1k up by factors of 10 (default: 10000000)\n"
+		<< "  --rays N           Rays traced per BVH benchmark scene (default: 1000000)\n"
+		<< "  --max-resolution N Largest frame benchmark resolution, from 256 up by factors of 2 (default: 1024)\n"
+		<< "  --simd LEVEL       SIMD kernels to use: auto (the best this CPU has), " << simdLevelNames[SIMD_BASELINE] << ", avx2 or avx512\n";
+}
+
+int main(int argc, char** argv)
+{
+	std::string suite = "all", jsonFilename, label;
+	int nThreads = 0;
+	int maxSpheres = 10000000;
+	int nRays = 1000000;
+	int maxResolution = 1024;
+	std::string simdName = "auto";
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--suite" && i + 1 < argc) suite = argv[++i];
+		else if (arg == "--json" && i + 1 < argc) jsonFilename = argv[++i];
+		else if (arg == "--label" && i + 1 < argc) label = argv[++i];
+		else if (arg == "--threads" && i + 1 < argc) nThreads = std::stoi(argv[++i]);
+		else if (arg == "--max-spheres" && i + 1 < argc) maxSpheres = std::stoi(argv[++i]);
+		else if (arg == "--rays" && i + 1 < argc) nRays = std::stoi(argv[++i]);
+		else if (arg == "--max-resolution" && i + 1 < argc) maxResolution = std::stoi(argv[++i]);
+		else if (arg == "--simd" && i + 1 < argc) simdName = argv[++i];
+		else {
+			printUsage();
+			return 1;
+		}
+	}
+	if (suite != "micro" && suite != "macro" && suite != "all") {
+		printUsage();
+		return 1;
+	}
+
+	SimdLevel level;
+	if (!parseSimdLevel(simdName, level) || !setSimdLevel(level)) {
+		std::cout << "SIMD level " << simdName << " isn't available on this CPU (the best is " << simdLevelNames[maxSimdLevel()] << ")." << std::endl;
+		return 1;
+	}
+	std::cout << "SIMD kernels: " << simdLevelNames[simdLevel] << "\n" << std::endl;
+
+	ThreadPool pool(nThreads);
+	if (suite != "macro") {
+		benchmarkMath(10000000);
+		benchmarkLights(10000000);
+		benchmarkSetPixel(2048, 2048);
+		benchmarkIntersectionKernels(1000, std::max(nRays / 100, 1));
+		benchmarkPrimaryRays(pool, 100000, 1024);
+		benchmarkTonemap(pool, 4096, 4096);
+		benchmarkPNGEncode(pool, 2048, 2048);
+		benchmarkSceneLoading(std::min(maxSpheres, 1000000));
+		benchmarkBVHCache(pool, std::min(maxSpheres, 1000000));
+		for (int nSpheres = 1000; nSpheres <= maxSpheres; nSpheres *= 10) {
+			benchmarkBVH(pool, nSpheres, nRays);
+			benchmarkShadowGrid(pool, nSpheres, nRays);
+		}
+		benchmarkShading(pool, 1000, 512);
+		benchmarkKernels(pool, 1000, 256);
+		benchmarkLightCuts(pool, 1000, 1000, 2000);
+		benchmarkLightCuts(pool, 1000, 10000, 500);
+	}
+	if (suite != "micro") {
+		benchmarkFrames(pool, maxResolution, { 10, 1000, 100000 });
+		benchmarkAntiAliasing(pool, 1000, 256);
+		benchmarkPathTracing(pool, 1000, 256, 16);
+		benchmarkPathTermination(pool, 100, 128, 8);
+		benchmarkDenoise(pool, 1000, 256, 4);
+		benchmarkSequence(pool, 100000, 256, 16);
+		benchmarkRelight(pool, 1000, 512);
+	}
+
+	if (!jsonFilename.empty()) {
+		writeJSON(jsonFilename, label, pool.size());
+		std::cout << "Results written to " << jsonFilename << std::endl;
+	}
+	return 0;
+}
@@ -0,0 +1,422 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+#include "Framebuffer.hpp"
+#include "Simd.hpp"
+#include "SphereSoA.hpp"
+#include "Stats.hpp"
+#include "ThreadPool.hpp"
+
+// Denoising path traced frames, so a few samples per pixel look like many.
+//
+// This is the spatial part of SVGF (Schied et al., "Spatiotemporal Variance-Guided
+// Filtering"): an edge-aware a-trous wavelet filter. Each pass blurs the image with a 5x5
+// B3-spline kernel whose taps are spread out (1, 2, 4, 8, 16 pixels apart in successive
+// passes), so five passes cover a wide area for 125 taps a pixel. Each tap's weight is cut
+// down where the neighbour is on a different surface (its depth or normal differs) or
+// looks different by more than the pixel's noise can explain (its brightness differs by
+// several standard deviations of the pixel's estimated error). The guides come from where
+// each path's first ray hit (see GuideSample).
+//
+// The light is filtered, not the colour: the image is divided by the surface colour
+// (albedo) first and multiplied back afterwards, so the surfaces' colours stay sharp
+// however much the lighting is blurred.
+//
+// The passes run over bands of rows on the pool, 8 pixels at a time with AVX2 where the
+// CPU has it. The exponential is a polynomial that the scalar and AVX2 kernels evaluate
+// with the same operations, so every level gives the same image.
+
+/// <summary>
+/// Per-pixel guides for the denoiser, gathered while path tracing (see GuideSample), and
+/// the estimated variance of each pixel's mean luminance. Rows as in the framebuffer.
+/// </summary>
+struct GBuffer {
+	int width = 0, height = 0;
+	FloatImage albedo;
+	FloatImage normal; // x, y and z in r, g and b.
+	AlignedFloats depth, variance;
+
+	void resize(int newWidth, int newHeight)
+	{
+		width = newWidth;
+		height = newHeight;
+		albedo.resize(width, height);
+		normal.resize(width, height);
+		size_t n = (static_cast<size_t>(width) * height + 7) & ~size_t(7);
+		depth.assign(n, 0.f);
+		variance.assign(n, 0.f);
+	}
+};
+
+/// <summary>
+/// How hard to denoise.
+/// </summary>
+struct DenoiseSettings {
+	int iterations = 5;       // A-trous passes; the last one's taps are 2^(iterations - 1) pixels apart.
+	float colourSigma = 4.f;  // How many standard deviations of noise a neighbour's brightness may differ by.
+	float normalSigma = 64.f; // How sharply differences in normal cut a neighbour out.
+	float depthSigma = 1.f;   // How many times the local change in depth a neighbour's depth may differ by.
+};
+
+/// <summary>
+/// e^x for -20 <= x <= 0, to within a few ulps (Cephes' expf), and e^-20 below that: as good
+/// as nothing for a tap's weight, and it keeps the weights squared clear of denormals,
+/// which are very slow. denoiseExpAVX2 does exactly the same operations.
+/// </summary>
+inline float denoiseExp(float x)
+{
+	x = std::max(x, -20.f);
+	float n = floorf(x * 1.44269504f + 0.5f);
+	float r = x - n * 0.693359375f;
+	r = r - n * -2.12194440e-4f;
+	float p = 1.9875691500e-4f;
+	p = p * r + 1.3981999507e-3f;
+	p = p * r + 8.3334519073e-3f;
+	p = p * r + 4.1665795894e-2f;
+	p = p * r + 1.6666665459e-1f;
+	p = p * r + 5.0000001201e-1f;
+	p = p * (r * r) + r + 1.f;
+	int32_t bits = (static_cast<int32_t>(n) + 127) << 23;
+	float scale;
+	memcpy(&scale, &bits, sizeof(scale));
+	return p * scale;
+}
+
+/// <summary>
+/// One a-trous pass: what it reads and writes, and its taps.
+/// </summary>
+struct AtrousPass {
+	int width, height, step;
+	const float *r, *g, *b, *luminance, *variance, *blurredVariance;
+	const float *depth, *depthGradient, *normalX, *normalY, *normalZ;
+	float *outR, *outG, *outB, *outVariance;
+	float colourSigma, normalSigma, depthSigma;
+	float tapWeights[25], inverseTapDistances[25]; // Row by row, from offset (-2, -2); distances in steps, 0 for the centre.
+};
+
+/// <summary>
+/// Filters one pixel. Taps off the edge of the image are left out.
+/// </summary>
+inline void atrousPixel(const AtrousPass& pass, int x, int y)
+{
+	size_t p = static_cast<size_t>(y) * pass.width + x;
+	float depthP = pass.depth[p];
+	float depthScale = 1.f / (pass.depthGradient[p] * pass.depthSigma * pass.step + 1e-3f);
+	float nx = pass.normalX[p], ny = pass.normalY[p], nz = pass.normalZ[p];
+	float luminanceP = pass.luminance[p];
+	float luminanceScale = 1.f / (pass.colourSigma * sqrtf(pass.blurredVariance[p]) + 1e-4f);
+	float halfNormalSigma = 0.5f * pass.normalSigma;
+
+	float sumW = 0.f, sumR = 0.f, sumG = 0.f, sumB = 0.f, sumVariance = 0.f;
+	for (int j = -2; j <= 2; ++j) {
+		int yq = y + j * pass.step;
+		if (yq < 0 || yq >= pass.height) continue;
+		for (int i = -2; i <= 2; ++i) {
+			int xq = x + i * pass.step;
+			if (xq < 0 || xq >= pass.width) continue;
+			size_t q = static_cast<size_t>(yq) * pass.width + xq;
+			int k = (j + 2) * 5 + (i + 2);
+
+			// For unit normals, half the squared distance between them is 1 - cos(angle).
+			float dx = nx - pass.normalX[q], dy = ny - pass.normalY[q], dz = nz - pass.normalZ[q];
+			float depthTerm = fabsf(depthP - pass.depth[q]) * depthScale * pass.inverseTapDistances[k];
+			float normalTerm = halfNormalSigma * (dx * dx + dy * dy + dz * dz);
+			float luminanceTerm = fabsf(luminanceP - pass.luminance[q]) * luminanceScale;
+			float w = pass.tapWeights[k] * denoiseExp(-(depthTerm + normalTerm + luminanceTerm));
+
+			sumW += w;
+			sumR += w * pass.r[q];
+			sumG += w * pass.g[q];
+			sumB += w * pass.b[q];
+			sumVariance += w * w * pass.variance[q];
+		}
+	}
+	pass.outR[p] = sumR / sumW;
+	pass.outG[p] = sumG / sumW;
+	pass.outB[p] = sumB / sumW;
+	pass.outVariance[p] = sumVariance / (sumW * sumW);
+}
+
+#if SIMD_HAVE_AVX2
+
+SIMD_TARGET_AVX2 inline __m256 denoiseExpAVX2(__m256 x)
+{
+	x = _mm256_max_ps(x, _mm256_set1_ps(-20.f));
+	__m256 n = _mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504f)), _mm256_set1_ps(0.5f)));
+	__m256 r = _mm256_sub_ps(x, _mm256_mul_ps(n, _mm256_set1_ps(0.693359375f)));
+	r = _mm256_sub_ps(r, _mm256_mul_ps(n, _mm256_set1_ps(-2.12194440e-4f)));
+	__m256 p = _mm256_set1_ps(1.9875691500e-4f);
+	p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(1.3981999507e-3f));
+	p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(8.3334519073e-3f));
+	p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(4.1665795894e-2f));
+	p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(1.6666665459e-1f));
+	p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(5.0000001201e-1f));
+	p = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(p, _mm256_mul_ps(r, r)), r), _mm256_set1_ps(1.f));
+	__m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(n), _mm256_set1_epi32(127)), 23);
+	return _mm256_mul_ps(p, _mm256_castsi256_ps(bits));
+}
+
+/// <summary>
+/// Loads 8 floats from p, or (if all is false) just the lanes whose mask is set, with zeros
+/// in the others (which aren't read, so they may be off the end of the image).
+/// </summary>
+SIMD_TARGET_AVX2 SIMD_FORCE_INLINE __m256 loadTapAVX2(const float* p, __m256i mask, bool all)
+{
+	return all ? _mm256_loadu_ps(p) : _mm256_maskload_ps(p, mask);
+}
+
+/// <summary>
+/// atrousPixel for the whole of row y, 8 pixels at a time. Taps off the top and bottom are
+/// skipped for all 8 at once; near the sides, the lanes whose taps are off the image are
+/// masked out (adding zero leaves the sums as they would be without them, so this matches
+/// atrousPixel exactly).
+/// </summary>
+SIMD_TARGET_AVX2 void atrousRowAVX2(const AtrousPass& pass, int y)
+{
+	const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+	const __m256 signMask = _mm256_castsi256_ps(_mm256_set1_epi32(static_cast<int>(0x80000000u)));
+	const __m256 halfNormalSigma = _mm256_set1_ps(0.5f * pass.normalSigma);
+	const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i minusOne = _mm256_set1_epi32(-1), width = _mm256_set1_epi32(pass.width);
+	int reach = 2 * pass.step;
+	for (int x = 0; x < pass.width; x += 8) {
+		bool inside = x >= reach && x + 8 + reach <= pass.width; // Every tap of all 8 pixels.
+		__m256i xs = _mm256_add_epi32(_mm256_set1_epi32(x), lanes);
+		__m256i pixelMask = _mm256_cmpgt_epi32(width, xs);
+		bool whole = x + 8 <= pass.width;
+
+		ptrdiff_t p = static_cast<ptrdiff_t>(y) * pass.width + x;
+		__m256 depthP = loadTapAVX2(pass.depth + p, pixelMask, whole);
+		__m256 depthScale = _mm256_div_ps(_mm256_set1_ps(1.f), _mm256_add_ps(
+			_mm256_mul_ps(loadTapAVX2(pass.depthGradient + p, pixelMask, whole), _mm256_set1_ps(pass.depthSigma * pass.step)), _mm256_set1_ps(1e-3f)));
+		__m256 nx = loadTapAVX2(pass.normalX + p, pixelMask, whole);
+		__m256 ny = loadTapAVX2(pass.normalY + p, pixelMask, whole);
+		__m256 nz = loadTapAVX2(pass.normalZ + p, pixelMask, whole);
+		__m256 luminanceP = loadTapAVX2(pass.luminance + p, pixelMask, whole);
+		__m256 luminanceScale = _mm256_div_ps(_mm256_set1_ps(1.f), _mm256_add_ps(
+			_mm256_mul_ps(_mm256_set1_ps(pass.colourSigma), _mm256_sqrt_ps(loadTapAVX2(pass.blurredVariance + p, pixelMask, whole))), _mm256_set1_ps(1e-4f)));
+
+		__m256 sumW = _mm256_setzero_ps(), sumR = _mm256_setzero_ps(), sumG = _mm256_setzero_ps(), sumB = _mm256_setzero_ps();
+		__m256 sumVariance = _mm256_setzero_ps();
+		for (int j = -2; j <= 2; ++j) {
+			int yq = y + j * pass.step;
+			if (yq < 0 || yq >= pass.height) continue;
+			for (int i = -2; i <= 2; ++i) {
+				ptrdiff_t q = static_cast<ptrdiff_t>(yq) * pass.width + (x + i * pass.step);
+				int k = (j + 2) * 5 + (i + 2);
+				__m256i mask = minusOne;
+				if (!inside) {
+					__m256i xq = _mm256_add_epi32(xs, _mm256_set1_epi32(i * pass.step));
+					mask = _mm256_and_si256(_mm256_cmpgt_epi32(xq, minusOne), _mm256_cmpgt_epi32(width, xq));
+					if (_mm256_testz_si256(mask, mask)) continue;
+				}
+
+				__m256 dx = _mm256_sub_ps(nx, loadTapAVX2(pass.normalX + q, mask, inside));
+				__m256 dy = _mm256_sub_ps(ny, loadTapAVX2(pass.normalY + q, mask, inside));
+				__m256 dz = _mm256_sub_ps(nz, loadTapAVX2(pass.normalZ + q, mask, inside));
+				__m256 depthTerm = _mm256_mul_ps(_mm256_mul_ps(_mm256_and_ps(_mm256_sub_ps(depthP, loadTapAVX2(pass.depth + q, mask, inside)), absMask),
+					depthScale), _mm256_set1_ps(pass.inverseTapDistances[k]));
+				__m256 normalTerm = _mm256_mul_ps(halfNormalSigma,
+					_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz)));
+				__m256 luminanceTerm = _mm256_mul_ps(_mm256_and_ps(_mm256_sub_ps(luminanceP, loadTapAVX2(pass.luminance + q, mask, inside)), absMask), luminanceScale);
+				__m256 exponent = _mm256_xor_ps(_mm256_add_ps(_mm256_add_ps(depthTerm, normalTerm), luminanceTerm), signMask);
+				__m256 w = _mm256_mul_ps(_mm256_set1_ps(pass.tapWeights[k]), denoiseExpAVX2(exponent));
+				if (!inside) w = _mm256_and_ps(w, _mm256_castsi256_ps(mask));
+
+				sumW = _mm256_add_ps(sumW, w);
+				sumR = _mm256_add_ps(sumR, _mm256_mul_ps(w, loadTapAVX2(pass.r + q, mask, inside)));
+				sumG = _mm256_add_ps(sumG, _mm256_mul_ps(w, loadTapAVX2(pass.g + q, mask, inside)));
+				sumB = _mm256_add_ps(sumB, _mm256_mul_ps(w, loadTapAVX2(pass.b + q, mask, inside)));
+				sumVariance = _mm256_add_ps(sumVariance, _mm256_mul_ps(_mm256_mul_ps(w, w), loadTapAVX2(pass.variance + q, mask, inside)));
+			}
+		}
+		__m256 outR = _mm256_div_ps(sumR, sumW), outG = _mm256_div_ps(sumG, sumW), outB = _mm256_div_ps(sumB, sumW);
+		__m256 outVariance = _mm256_div_ps(sumVariance, _mm256_mul_ps(sumW, sumW));
+		if (whole) {
+			_mm256_storeu_ps(pass.outR + p, outR);
+			_mm256_storeu_ps(pass.outG + p, outG);
+			_mm256_storeu_ps(pass.outB + p, outB);
+			_mm256_storeu_ps(pass.outVariance + p, outVariance);
+		}
+		else {
+			_mm256_maskstore_ps(pass.outR + p, pixelMask, outR);
+			_mm256_maskstore_ps(pass.outG + p, pixelMask, outG);
+			_mm256_maskstore_ps(pass.outB + p, pixelMask, outB);
+			_mm256_maskstore_ps(pass.outVariance + p, pixelMask, outVariance);
+		}
+	}
+}
+
+#endif
+
+/// <summary>
+/// Filters row y, with the SIMD kernel if the CPU has it.
+/// </summary>
+void atrousRow(const AtrousPass& pass, int y)
+{
+#if SIMD_HAVE_AVX2
+	if (simdLevel >= SIMD_AVX2) {
+		atrousRowAVX2(pass, y);
+		return;
+	}
+#endif
+	for (int x = 0; x < pass.width; ++x) atrousPixel(pass, x, y);
+}
+
+/// <summary>
+/// The denoiser's working images, kept from frame to frame.
+/// </summary>
+struct DenoiseScratch {
+	FloatImage light[2]; // The image divided by the albedo, before and after each pass.
+	AlignedFloats variance[2], blurredVariance, luminance, depthGradient;
+};
+
+/// <summary>
+/// Denoises image (a path traced frame, with the gbuffer filled in by the same render) in
+/// place. With a pool, bands of rows are filtered in parallel.
+/// </summary>
+void denoise(FloatImage& image, const GBuffer& gbuffer, const DenoiseSettings& settings, ThreadPool* pool = nullptr)
+{
+	int width = image.width, height = image.height;
+	if (gbuffer.width != width || gbuffer.height != height) {
+		throw std::logic_error("The G-buffer isn't the same size as the image (render the frame with it).");
+	}
+	if (width == 0 || height == 0) return;
+
+	// The calling thread's, shared with the pool for this frame (a reference, as the pool's
+	// threads would otherwise see their own).
+	thread_local DenoiseScratch threadScratch;
+	DenoiseScratch& scratch = threadScratch;
+	size_t nPadded = image.r.size();
+	for (FloatImage& light : scratch.light) light.resize(width, height);
+	for (AlignedFloats* plane : { &scratch.variance[0], &scratch.variance[1], &scratch.blurredVariance, &scratch.luminance, &scratch.depthGradient }) {
+		plane->assign(nPadded, 0.f);
+	}
+
+	// Bands of 8 rows at a time.
+	const int bandRows = 8;
+	int nBands = (height + bandRows - 1) / bandRows;
+	auto forEachRow = [&](const std::function<void(int)>& fn) {
+		auto band = [&](int index) {
+			STATS_TIME(DENOISE_STAGE);
+			for (int y = index * bandRows; y < std::min(height, (index + 1) * bandRows); ++y) fn(y);
+		};
+		if (pool) pool->parallelFor(nBands, band);
+		else for (int i = 0; i < nBands; ++i) band(i);
+	};
+	auto luminance = [](float r, float g, float b) {
+		return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+	};
+	const float albedoEpsilon = 1e-3f;
+
+	// Divide out the albedo (and scale the variance to match), and find how fast the depth
+	// changes around each pixel.
+	forEachRow([&](int y) {
+		for (int x = 0; x < width; ++x) {
+			size_t i = static_cast<size_t>(y) * width + x;
+			float ar = gbuffer.albedo.r[i] + albedoEpsilon, ag = gbuffer.albedo.g[i] + albedoEpsilon, ab = gbuffer.albedo.b[i] + albedoEpsilon;
+			scratch.light[0].r[i] = image.r[i] / ar;
+			scratch.light[0].g[i] = image.g[i] / ag;
+			scratch.light[0].b[i] = image.b[i] / ab;
+			float albedoLuminance = luminance(ar, ag, ab);
+			scratch.variance[0][i] = gbuffer.variance[i] / (albedoLuminance * albedoLuminance);
+
+			float left = gbuffer.depth[x > 0 ? i - 1 : i], right = gbuffer.depth[x + 1 < width ? i + 1 : i];
+			float up = gbuffer.depth[y > 0 ? i - width : i], down = gbuffer.depth[y + 1 < height ? i + width : i];
+			scratch.depthGradient[i] = 0.5f * std::max(fabsf(right - left), fabsf(down - up));
+		}
+	});
+
+	AtrousPass pass;
+	pass.width = width;
+	pass.height = height;
+	pass.depth = gbuffer.depth.data();
+	pass.depthGradient = scratch.depthGradient.data();
+	pass.normalX = gbuffer.normal.r.data();
+	pass.normalY = gbuffer.normal.g.data();
+	pass.normalZ = gbuffer.normal.b.data();
+	pass.luminance = scratch.luminance.data();
+	pass.blurredVariance = scratch.blurredVariance.data();
+	pass.colourSigma = settings.colourSigma;
+	pass.normalSigma = settings.normalSigma;
+	pass.depthSigma = settings.depthSigma;
+	const float kernel[5] = { 1.f / 16.f, 1.f / 4.f, 3.f / 8.f, 1.f / 4.f, 1.f / 16.f };
+
+	int current = 0;
+	for (int iteration = 0; iteration < settings.iterations; ++iteration) {
+		FloatImage& in = scratch.light[current];
+		FloatImage& out = scratch.light[1 - current];
+		const AlignedFloats& variance = scratch.variance[current];
+
+		// The brightness the taps are compared on, and the variance blurred a little (as in
+		// SVGF), as one pixel's own estimate from a few samples is itself very noisy.
+		forEachRow([&](int y) {
+			size_t row = static_cast<size_t>(y) * width;
+			for (int x = 0; x < width; ++x) {
+				scratch.luminance[row + x] = luminance(in.r[row + x], in.g[row + x], in.b[row + x]);
+			}
+			auto blurEdge = [&](int x) {
+				float sum = 0.f, sumWeights = 0.f;
+				for (int j = -1; j <= 1; ++j)
+					for (int k = -1; k <= 1; ++k) {
+						int xq = x + k, yq = y + j;
+						if (xq < 0 || xq >= width || yq < 0 || yq >= height) continue;
+						float weight = (j == 0 ? 2.f : 1.f) * (k == 0 ? 2.f : 1.f);
+						sum += weight * variance[static_cast<size_t>(yq) * width + xq];
+						sumWeights += weight;
+					}
+				scratch.blurredVariance[row + x] = sum / sumWeights;
+			};
+			if (y == 0 || y + 1 == height || width < 3) {
+				for (int x = 0; x < width; ++x) blurEdge(x);
+				return;
+			}
+			// Away from the edges every tap is there, and the loop vectorizes.
+			const float *above = variance.data() + row - width, *middle = variance.data() + row, *below = variance.data() + row + width;
+			float* out = scratch.blurredVariance.data() + row;
+			for (int x = 1; x + 1 < width; ++x) {
+				out[x] = (above[x - 1] + 2.f * above[x] + above[x + 1]
+					+ 2.f * middle[x - 1] + 4.f * middle[x] + 2.f * middle[x + 1]
+					+ below[x - 1] + 2.f * below[x] + below[x + 1]) * (1.f / 16.f);
+			}
+			blurEdge(0);
+			blurEdge(width - 1);
+		});
+
+		pass.step = 1 << iteration;
+		pass.r = in.r.data();
+		pass.g = in.g.data();
+		pass.b = in.b.data();
+		pass.variance = variance.data();
+		pass.outR = out.r.data();
+		pass.outG = out.g.data();
+		pass.outB = out.b.data();
+		pass.outVariance = scratch.variance[1 - current].data();
+		for (int j = 0; j < 5; ++j)
+			for (int i = 0; i < 5; ++i) {
+				pass.tapWeights[j * 5 + i] = kernel[i] * kernel[j];
+				int distanceSquared = (i - 2) * (i - 2) + (j - 2) * (j - 2);
+				pass.inverseTapDistances[j * 5 + i] = distanceSquared == 0 ? 0.f : 1.f / sqrtf(static_cast<float>(distanceSquared));
+			}
+		forEachRow([&](int y) {
+			atrousRow(pass, y);
+		});
+		current = 1 - current;
+	}
+
+	// Put the albedo back.
+	const FloatImage& light = scratch.light[current];
+	forEachRow([&](int y) {
+		for (int x = 0; x < width; ++x) {
+			size_t i = static_cast<size_t>(y) * width + x;
+			image.r[i] = light.r[i] * (gbuffer.albedo.r[i] + albedoEpsilon);
+			image.g[i] = light.g[i] * (gbuffer.albedo.g[i] + albedoEpsilon);
+			image.b[i] = light.b[i] * (gbuffer.albedo.b[i] + albedoEpsilon);
+		}
+	});
+}
@@ -0,0 +1,236 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include <Eigen/Dense>
+#include "Simd.hpp"
+#include "SphereSoA.hpp"
+#include "Stats.hpp"
+#include "ThreadPool.hpp"
+
+/// <summary>
+/// Linear (not gamma-corrected) floating point RGB image, stored as one aligned plane per
+/// channel. Colours from the tracer are written or accumulated here, and only turned into
+/// 8-bit pixels once, by tonemapToRGBA8, when the whole image is done.
+///
+/// Row 0 is the top row of the image (the same as the 8-bit images we save).
+/// The planes are padded to a multiple of 8 floats and 64-byte aligned for SIMD loads.
+/// </summary>
+struct FloatImage {
+	int width = 0, height = 0;
+	AlignedFloats r, g, b;
+
+	FloatImage() = default;
+
+	FloatImage(int width, int height)
+	{
+		resize(width, height);
+	}
+
+	void resize(int newWidth, int newHeight)
+	{
+		width = newWidth;
+		height = newHeight;
+		size_t n = (static_cast<size_t>(width) * height + 7) & ~size_t(7);
+		r.assign(n, 0.f);
+		g.assign(n, 0.f);
+		b.assign(n, 0.f);
+	}
+
+	void clear()
+	{
+		std::fill(r.begin(), r.end(), 0.f);
+		std::fill(g.begin(), g.end(), 0.f);
+		std::fill(b.begin(), b.end(), 0.f);
+	}
+
+	void setPixel(int x, int y, const Eigen::Vector3f& colour)
+	{
+		size_t i = static_cast<size_t>(y) * width + x;
+		r[i] = colour.x();
+		g[i] = colour.y();
+		b[i] = colour.z();
+	}
+
+	/// <summary>
+	/// Adds one more sample's colour to a pixel. Divide by the number of samples when
+	/// tonemapping (see the scale argument of tonemapToRGBA8).
+	/// </summary>
+	void addSample(int x, int y, const Eigen::Vector3f& colour)
+	{
+		size_t i = static_cast<size_t>(y) * width + x;
+		r[i] += colour.x();
+		g[i] += colour.y();
+		b[i] += colour.z();
+	}
+
+	Eigen::Vector3f getPixel(int x, int y) const
+	{
+		size_t i = static_cast<size_t>(y) * width + x;
+		return Eigen::Vector3f(r[i], g[i], b[i]);
+	}
+};
+
+/// <summary>
+/// Gamma-corrects (gamma 2.2), clamps and quantizes one linear channel value to 8 bits.
+/// This is the reference for the table-driven conversion below - it costs a powf per call.
+/// </summary>
+uint8_t gammaQuantize(float value)
+{
+	return static_cast<uint8_t>(std::min(powf(value, 1 / 2.2f), 1.0f) * 255);
+}
+
+/// <summary>
+/// Lookup tables that give exactly the same result as gammaQuantize without calling powf.
+///
+/// gammaQuantize only ever increases with its input, so it is fully described by 255
+/// thresholds: the smallest floats that quantize to 1, 2, ... 255. The tables split the
+/// floats from 0 to 1 into buckets by the top bits of their bit patterns (sign, exponent
+/// and 7 bits of mantissa). Each bucket is narrow enough to contain at most one threshold,
+/// so a value's quantized result is its bucket's base, plus one if it's at or above the
+/// bucket's next threshold - two lookups and a comparison.
+/// </summary>
+struct GammaTable {
+	static constexpr int bucketShift = 16;
+	static constexpr int32_t oneBits = 0x3F800000; // Bit pattern of 1.f.
+	static constexpr int nBuckets = (oneBits >> bucketShift) + 1;
+
+	std::vector<int32_t> base; // Quantized value at the start of each bucket.
+	std::vector<float> next;   // The threshold for base + 1 (infinity once base is 255).
+
+	GammaTable()
+		:base(nBuckets), next(nBuckets)
+	{
+		// Find the thresholds. Positive floats sort in the same order as their bit
+		// patterns, so bisect on the bits.
+		std::vector<float> thresholds(257, 0.f);
+		for (int k = 1; k < 256; ++k) {
+			int32_t lo = 0, hi = oneBits;
+			while (lo < hi) {
+				int32_t mid = lo + (hi - lo) / 2;
+				if (gammaQuantize(fromBits(mid)) >= k) hi = mid;
+				else lo = mid + 1;
+			}
+			thresholds[k] = fromBits(lo);
+		}
+		thresholds[256] = INFINITY;
+
+		for (int i = 0; i < nBuckets; ++i) {
+			float bucketEnd = fromBits(std::min(((i + 1) << bucketShift) - 1, oneBits));
+			base[i] = gammaQuantize(fromBits(i << bucketShift));
+			next[i] = thresholds[base[i] + 1];
+			if (base[i] < 255 && thresholds[base[i] + 2] <= bucketEnd) {
+				throw std::logic_error("Gamma table buckets are too wide.");
+			}
+		}
+	}
+
+	static float fromBits(int32_t bits)
+	{
+		float x;
+		std::memcpy(&x, &bits, sizeof(float));
+		return x;
+	}
+
+	/// <summary>
+	/// Negative values give 0, values above 1 (including infinity) give 255.
+	/// </summary>
+	int quantize(float value) const
+	{
+		int32_t bits;
+		std::memcpy(&bits, &value, sizeof(float));
+		int bucket = std::min(std::max(bits, 0), oneBits) >> bucketShift;
+		return base[bucket] + (value >= next[bucket]);
+	}
+};
+
+const GammaTable& gammaTable()
+{
+	static const GammaTable table;
+	return table;
+}
+
+void tonemapRangeScalar(const FloatImage& image, uint8_t* rgba, size_t begin, size_t end, float scale)
+{
+	const GammaTable& table = gammaTable();
+	for (size_t i = begin; i < end; ++i) {
+		rgba[i * 4 + 0] = static_cast<uint8_t>(table.quantize(image.r[i] * scale));
+		rgba[i * 4 + 1] = static_cast<uint8_t>(table.quantize(image.g[i] * scale));
+		rgba[i * 4 + 2] = static_cast<uint8_t>(table.quantize(image.b[i] * scale));
+		rgba[i * 4 + 3] = 255;
+	}
+}
+
+#if SIMD_HAVE_AVX2
+
+SIMD_TARGET_AVX2 inline __m256i quantizeAVX2(const GammaTable& table, __m256 value)
+{
+	__m256i bits = _mm256_castps_si256(value);
+	bits = _mm256_min_epi32(_mm256_max_epi32(bits, _mm256_setzero_si256()), _mm256_set1_epi32(GammaTable::oneBits));
+	__m256i bucket = _mm256_srli_epi32(bits, GammaTable::bucketShift);
+	__m256i base = _mm256_i32gather_epi32(table.base.data(), bucket, 4);
+	__m256 next = _mm256_i32gather_ps(table.next.data(), bucket, 4);
+	// The comparison mask is -1 where value >= next, so subtracting it adds one.
+	return _mm256_sub_epi32(base, _mm256_castps_si256(_mm256_cmp_ps(value, next, _CMP_GE_OQ)));
+}
+
+/// <summary>
+/// Converts 8 pixels at a time: each channel is looked up with gathers, then the three
+/// 8-bit values and an opaque alpha are packed into one 32-bit RGBA pixel per lane.
+/// begin must be a multiple of 8; any leftover pixels at the end are done one at a time.
+/// </summary>
+SIMD_TARGET_AVX2 void tonemapRangeAVX2(const FloatImage& image, uint8_t* rgba, size_t begin, size_t end, float scale)
+{
+	const GammaTable& table = gammaTable();
+	__m256 scaleV = _mm256_set1_ps(scale);
+	__m256i alpha = _mm256_set1_epi32(static_cast<int>(0xFF000000u));
+	size_t i = begin;
+	for (; i + 8 <= end; i += 8) {
+		__m256i r = quantizeAVX2(table, _mm256_mul_ps(_mm256_load_ps(&image.r[i]), scaleV));
+		__m256i g = quantizeAVX2(table, _mm256_mul_ps(_mm256_load_ps(&image.g[i]), scaleV));
+		__m256i b = quantizeAVX2(table, _mm256_mul_ps(_mm256_load_ps(&image.b[i]), scaleV));
+		__m256i pixels = _mm256_or_si256(_mm256_or_si256(r, _mm256_slli_epi32(g, 8)),
+			_mm256_or_si256(_mm256_slli_epi32(b, 16), alpha));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(rgba + i * 4), pixels);
+	}
+	tonemapRangeScalar(image, rgba, i, end, scale);
+}
+
+#endif
+
+/// <summary>
+/// Turns the linear float image into gamma-corrected 8-bit RGBA (in the layout lodepng
+/// expects), multiplying every value by scale first - e.g. 1/nSamples to average
+/// accumulated samples. With a pool, bands of rows are converted in parallel.
+/// </summary>
+void tonemapToRGBA8(const FloatImage& image, std::vector<uint8_t>& rgba, float scale = 1.f, ThreadPool* pool = nullptr)
+{
+	size_t nPixels = static_cast<size_t>(image.width) * image.height;
+	rgba.resize(nPixels * 4);
+
+	auto convert = [&](size_t begin, size_t end) {
+		STATS_TIME(TONEMAP_STAGE);
+#if SIMD_HAVE_AVX2
+		if (simdLevel >= SIMD_AVX2) {
+			tonemapRangeAVX2(image, rgba.data(), begin, end, scale);
+			return;
+		}
+#endif
+		tonemapRangeScalar(image, rgba.data(), begin, end, scale);
+	};
+
+	// Bands of 64K pixels (a multiple of 8, so the SIMD loop stays aligned).
+	const size_t bandSize = 1 << 16;
+	int nBands = static_cast<int>((nPixels + bandSize - 1) / bandSize);
+	if (!pool || nBands <= 1) {
+		convert(0, nPixels);
+		return;
+	}
+	pool->parallelFor(nBands, [&](int band) {
+		size_t begin = band * bandSize;
+		convert(begin, std::min(begin + bandSize, nPixels));
+	});
+}
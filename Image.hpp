@@ -1,4 +1,7 @@
 #pragma once
+#include <cfloat>
+#include <stdexcept>
+#include <string>
 #include <vector>
 #include <lodepng.h>
 #include "Light.hpp"
@@ -2,6 +2,7 @@
 #include <Eigen/Dense>
 #include <vector>
 #include <fstream>
+#include <stdexcept>
 
 /// <summary>
 /// Abstract class representing a light source.
@@ -206,9 +207,25 @@ private:
 public:
 	SpotLight(const Eigen::Vector3f& intensity, const Eigen::Vector3f& location,
 		const Eigen::Vector3f& direction, float angle)
-		:Light(intensity), _location(location), _direction(direction), _cosAngle(cosf(angle))
+		:Light(intensity), _location(location), _direction(direction.normalized()), _cosAngle(cosf(angle))
 	{};
 
+	/// <summary>
+	/// Unit vector along the centre of the cone.
+	/// </summary>
+	Eigen::Vector3f getSpotDirection() const
+	{
+		return _direction;
+	}
+
+	/// <summary>
+	/// Cosine of the angle between the centre and the edge of the cone.
+	/// </summary>
+	float getCosAngle() const
+	{
+		return _cosAngle;
+	}
+
 	virtual Eigen::Vector3f getIntensityAt(const Eigen::Vector3f& surfaceLocation) override
 	{
 		// This is the trickiest one so far. Work out the direction from 
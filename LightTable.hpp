@@ -0,0 +1,88 @@
+#pragma once
+#include <cfloat>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include <Eigen/Dense>
+#include "Light.hpp"
+
+/// <summary>
+/// A light copied out of its Light object into plain data, so the tracer can evaluate it
+/// without any virtual calls. Which fields are used depends on the type.
+/// The maths is exactly that of the Light classes, so the colours come out the same.
+/// </summary>
+struct PackedLight {
+	Light::Type type;
+	Eigen::Vector3f intensity;
+	Eigen::Vector3f location;  // Point and spot lights.
+	Eigen::Vector3f direction; // Directional and spot lights (unit length).
+	float cosAngle;            // Spot lights: cosine of the cone's half angle.
+
+	/// <summary>
+	/// Unit direction the light arrives from at surfaceLocation (see Light::getDirection).
+	/// Not valid for ambient lights.
+	/// </summary>
+	Eigen::Vector3f directionAt(const Eigen::Vector3f& surfaceLocation) const
+	{
+		if (type == Light::DIRECTIONAL) return direction;
+		return (surfaceLocation - location).normalized();
+	}
+
+	/// <summary>
+	/// Distance from surfaceLocation to the light, or FLT_MAX for lights with no location.
+	/// </summary>
+	float distanceTo(const Eigen::Vector3f& surfaceLocation) const
+	{
+		if (type == Light::DIRECTIONAL || type == Light::AMBIENT) return FLT_MAX;
+		return (location - surfaceLocation).norm();
+	}
+
+	/// <summary>
+	/// Intensity of the light at a surface point (see Light::getIntensityAt), given the
+	/// point's directionAt and distanceTo.
+	/// </summary>
+	Eigen::Vector3f intensityAt(const Eigen::Vector3f& lightDirection, float distance) const
+	{
+		if (type == Light::AMBIENT || type == Light::DIRECTIONAL) return intensity;
+		if (type == Light::SPOT && lightDirection.dot(direction) < cosAngle) return Eigen::Vector3f::Zero();
+		return intensity / (distance * distance);
+	}
+};
+
+/// <summary>
+/// The scene's lights packed into one flat array, in the same order as the scene's list
+/// (the lights' contributions are added up in that order, so keeping it means the sums,
+/// and so the images, are bit-identical to adding them up through the Light objects).
+/// The Light classes are still how lights are set up; build this from them whenever they
+/// change.
+/// </summary>
+struct LightTable {
+	std::vector<PackedLight> lights;
+
+	void build(const std::vector<std::unique_ptr<Light>>& sceneLights)
+	{
+		lights.clear();
+		for (const auto& light : sceneLights) {
+			PackedLight packed;
+			packed.type = light->getType();
+			packed.intensity = light->getLightIntensity();
+			packed.location = Eigen::Vector3f::Zero();
+			packed.direction = Eigen::Vector3f::Zero();
+			packed.cosAngle = -1.f;
+			if (packed.type == Light::POINT || packed.type == Light::SPOT) packed.location = light->getLightLocation();
+			if (packed.type == Light::DIRECTIONAL) packed.direction = light->getDirection(Eigen::Vector3f::Zero());
+			if (packed.type == Light::SPOT) {
+				const SpotLight* spot = dynamic_cast<const SpotLight*>(light.get());
+				if (!spot) throw std::runtime_error("Light says it's a spot light, but isn't a SpotLight.");
+				packed.direction = spot->getSpotDirection();
+				packed.cosAngle = spot->getCosAngle();
+			}
+			lights.push_back(packed);
+		}
+	}
+
+	size_t size() const
+	{
+		return lights.size();
+	}
+};
@@ -0,0 +1,252 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+#include <Eigen/Dense>
+#include "BVH.hpp"
+#include "LightTable.hpp"
+
+// A light hierarchy for shading with thousands of point and spot lights, following
+// Lightcuts (Walter et al. 2005).
+//
+// The point and spot lights are put in a binary tree. Each node is a cluster of lights,
+// with one of them picked as its representative. Lighting a point with a cluster means
+// lighting it with the representative (one shadow ray), scaled up to the whole cluster's
+// intensity. Each point picks its own "cut" through the tree: starting from the root, the
+// cluster with the largest error bound is split into its children until every cluster's
+// bound is below a fraction of the total light at the point. Distant and dim groups of
+// lights stay as single clusters, so the work per point grows far slower than the number
+// of lights.
+//
+// The bounds also cull clusters exactly: a cluster that is entirely behind the surface, or
+// whose spot lights all point away from it, can't light the point and is dropped.
+
+struct LightCutSettings {
+	float maxError = 0.f;  // Allowed error of each cluster, relative to the point's total light. 0 means light every point and spot light exactly, without the tree.
+	int maxCutSize = 1000; // Never light a point with more clusters than this.
+};
+
+/// <summary>
+/// A cone of directions: every direction within angle (radians) of axis.
+/// </summary>
+struct LightCone {
+	Eigen::Vector3f axis;
+	float angle;
+};
+
+const float lightConePi = 3.14159265f;
+
+/// <summary>
+/// The smallest cone (more or less) holding both a and b.
+/// </summary>
+LightCone mergeLightCones(LightCone a, LightCone b)
+{
+	if (a.angle < b.angle) std::swap(a, b);
+	if (a.angle >= lightConePi) return a;
+	float between = acosf(std::min(std::max(a.axis.dot(b.axis), -1.f), 1.f));
+	if (between + b.angle <= a.angle) return a;
+	float angle = (a.angle + between + b.angle) * 0.5f;
+	Eigen::Vector3f across = b.axis - a.axis * a.axis.dot(b.axis);
+	if (angle >= lightConePi || across.squaredNorm() < 1e-12f) return { a.axis, lightConePi };
+	// Turn a's axis towards b's, just far enough for the cone to reach b's far edge.
+	float turn = angle - a.angle;
+	return { (a.axis * cosf(turn) + across.normalized() * sinf(turn)).normalized(), angle };
+}
+
+struct LightTreeNode {
+	AABB bounds;               // Of the lights' locations.
+	Eigen::Vector3f intensity; // Total intensity of the lights.
+	LightCone cone;            // Each light only shines in directions inside this (point lights make it the whole sphere).
+	int representative;        // Index (into LightTree::lights) of the light standing in for the cluster.
+	int left = -1, right = -1; // Children, or -1 for a leaf, which is just its representative.
+};
+
+class LightTree {
+	std::vector<PackedLight> _lights;
+	std::vector<LightTreeNode> _nodes;
+
+	struct CutEntry {
+		int node;
+		float error;             // Bound on how far out estimate could be (largest channel).
+		float visibility;        // Unshadowed, in-cone cos(theta) / distance^2 of the representative.
+		Eigen::Vector3f estimate;
+
+		bool operator<(const CutEntry& other) const
+		{
+			return error < other.error;
+		}
+	};
+
+	int build(std::vector<int>& order, int first, int last, std::mt19937& rng)
+	{
+		int index = static_cast<int>(_nodes.size());
+		_nodes.emplace_back();
+		if (last - first == 1) {
+			const PackedLight& light = _lights[order[first]];
+			LightTreeNode& leaf = _nodes[index];
+			leaf.bounds.expand(light.location);
+			leaf.intensity = light.intensity;
+			leaf.cone = light.type == Light::SPOT ? LightCone{ light.direction, acosf(light.cosAngle) } : LightCone{ Eigen::Vector3f::UnitZ(), lightConePi };
+			leaf.representative = order[first];
+			return index;
+		}
+
+		// Split at the median along the longest axis of the lights' locations.
+		AABB bounds;
+		for (int i = first; i < last; ++i) bounds.expand(_lights[order[i]].location);
+		int axis;
+		(bounds.max - bounds.min).maxCoeff(&axis);
+		int middle = (first + last) / 2;
+		std::nth_element(order.begin() + first, order.begin() + middle, order.begin() + last, [&](int a, int b) {
+			return _lights[a].location[axis] < _lights[b].location[axis];
+		});
+		int left = build(order, first, middle, rng);
+		int right = build(order, middle, last, rng);
+
+		// The representative is one of the children's, picked in proportion to their
+		// brightness (with a fixed seed, so the image is the same every time).
+		const LightTreeNode& l = _nodes[left];
+		const LightTreeNode& r = _nodes[right];
+		LightTreeNode node;
+		node.bounds = l.bounds;
+		node.bounds.expand(r.bounds);
+		node.intensity = l.intensity + r.intensity;
+		node.cone = mergeLightCones(l.cone, r.cone);
+		float leftWeight = l.intensity.sum(), totalWeight = leftWeight + r.intensity.sum();
+		node.representative = std::uniform_real_distribution<float>(0.f, totalWeight)(rng) < leftWeight ? l.representative : r.representative;
+		node.left = left;
+		node.right = right;
+		_nodes[index] = node;
+		return index;
+	}
+
+	/// <summary>
+	/// Upper bound on max(-lightDir.dot(normal), 0) / distance^2, times the spot cone test,
+	/// over all the lights in a node. Zero means none of them can light the point.
+	/// </summary>
+	float geometryBound(const LightTreeNode& node, const Eigen::Vector3f& point, const Eigen::Vector3f& normal) const
+	{
+		const AABB& box = node.bounds;
+		float minDistance = (point - point.cwiseMax(box.min).cwiseMin(box.max)).norm();
+
+		// (location - point).dot(normal) is largest at a corner of the box.
+		float maxFacing = -FLT_MAX;
+		for (int corner = 0; corner < 8; ++corner) {
+			Eigen::Vector3f c((corner & 1) ? box.max.x() : box.min.x(), (corner & 2) ? box.max.y() : box.min.y(), (corner & 4) ? box.max.z() : box.min.z());
+			maxFacing = std::max(maxFacing, (c - point).dot(normal));
+		}
+		if (maxFacing <= 0.f) return 0.f;
+
+		// Can any light in the box shine towards the point? (Measured from the centre of the
+		// box, allowing for the spread of the box as seen from the point.)
+		if (node.cone.angle < lightConePi) {
+			Eigen::Vector3f centre = (box.min + box.max) * 0.5f;
+			Eigen::Vector3f toPoint = point - centre;
+			float distance = toPoint.norm(), radius = (box.max - centre).norm();
+			if (distance > radius) {
+				float offAxis = acosf(std::min(std::max(toPoint.dot(node.cone.axis) / distance, -1.f), 1.f));
+				float spread = asinf(radius / distance);
+				if (offAxis - spread > node.cone.angle + 1e-4f) return 0.f;
+			}
+		}
+
+		if (minDistance <= 0.f) return FLT_MAX;
+		return std::min(maxFacing / minDistance, 1.f) / (minDistance * minDistance);
+	}
+
+	/// <summary>
+	/// cos(theta) / distance^2 for one light, or zero if the point is outside its cone,
+	/// facing away or in shadow.
+	/// </summary>
+	template<typename Visible>
+	float lightVisibility(const PackedLight& light, const Eigen::Vector3f& point, const Eigen::Vector3f& normal, Visible& visible) const
+	{
+		Eigen::Vector3f lightDir = light.directionAt(point);
+		if (light.type == Light::SPOT && lightDir.dot(light.direction) < light.cosAngle) return 0.f;
+		float dotProd = -lightDir.dot(normal);
+		if (dotProd <= 0.f) return 0.f;
+		float distance = light.distanceTo(point);
+		if (!visible(lightDir, distance)) return 0.f;
+		return dotProd / (distance * distance);
+	}
+
+public:
+	/// <summary>
+	/// Builds the tree over the point and spot lights in table (the others are left out).
+	/// </summary>
+	void build(const LightTable& table)
+	{
+		_lights.clear();
+		_nodes.clear();
+		for (const PackedLight& light : table.lights) {
+			if (light.type == Light::POINT || light.type == Light::SPOT) _lights.push_back(light);
+		}
+		if (_lights.empty()) return;
+		_nodes.reserve(2 * _lights.size() - 1);
+		std::vector<int> order(_lights.size());
+		for (size_t i = 0; i < order.size(); ++i) order[i] = static_cast<int>(i);
+		std::mt19937 rng(1);
+		build(order, 0, static_cast<int>(order.size()), rng);
+	}
+
+	bool empty() const
+	{
+		return _lights.empty();
+	}
+
+	size_t size() const
+	{
+		return _lights.size();
+	}
+
+	/// <summary>
+	/// Diffuse light reaching a point from all of the tree's lights, to within settings.maxError.
+	/// </summary>
+	/// <param name="albedo">Surface colour.</param>
+	/// <param name="visible">visible(lightDir, distance) traces the shadow ray: true if nothing
+	/// blocks the light arriving along lightDir from distance away.</param>
+	template<typename Visible>
+	Eigen::Vector3f illuminate(const Eigen::Vector3f& point, const Eigen::Vector3f& normal, const Eigen::Vector3f& albedo,
+		const LightCutSettings& settings, Visible&& visible) const
+	{
+		if (_nodes.empty()) return Eigen::Vector3f::Zero();
+
+		// Estimates of the leaves are exact, so only the other clusters go on the heap.
+		thread_local std::vector<CutEntry> heap;
+		heap.clear();
+		Eigen::Vector3f total = Eigen::Vector3f::Zero();
+		int cutSize = 0;
+
+		auto addCluster = [&](int index, int parentRepresentative, float parentVisibility) {
+			const LightTreeNode& node = _nodes[index];
+			bool leaf = node.left < 0;
+			float bound = leaf ? 1.f : geometryBound(node, point, normal);
+			if (bound == 0.f) return;
+			Eigen::Vector3f flux = albedo.cwiseProduct(node.intensity);
+			// One of the children shares its parent's representative, and its shadow ray.
+			float visibility = node.representative == parentRepresentative ? parentVisibility
+				: lightVisibility(_lights[node.representative], point, normal, visible);
+			Eigen::Vector3f estimate = flux * visibility;
+			total += estimate;
+			++cutSize;
+			if (leaf) return;
+			heap.push_back({ index, flux.maxCoeff() * bound, visibility, estimate });
+			std::push_heap(heap.begin(), heap.end());
+		};
+
+		addCluster(0, -1, 0.f);
+		while (!heap.empty() && cutSize < settings.maxCutSize) {
+			if (heap.front().error <= settings.maxError * total.maxCoeff()) break;
+			std::pop_heap(heap.begin(), heap.end());
+			CutEntry entry = heap.back();
+			heap.pop_back();
+			total -= entry.estimate;
+			--cutSize;
+			const LightTreeNode& node = _nodes[entry.node];
+			addCluster(node.left, node.representative, entry.visibility);
+			addCluster(node.right, node.representative, entry.visibility);
+		}
+		return total;
+	}
+};
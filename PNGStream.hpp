@@ -0,0 +1,292 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <lodepng.h>
+#include "ParallelDeflate.hpp"
+#include "Simd.hpp"
+#include "Stats.hpp"
+#include "ThreadPool.hpp"
+
+/// <summary>
+/// PNG filter type 0-4 (none, sub, up, average, Paeth) of row against up, the row above,
+/// with bpp bytes per pixel. Each filter has its own loop, so the compiler can vectorise it.
+/// </summary>
+/// <returns>lodepng's score for the filtered row: the sum of its bytes, taken as signed
+/// for types 1-4.</returns>
+SIMD_FORCE_INLINE size_t filterPNGRowBody(int type, const unsigned char* row, const unsigned char* up, size_t n, size_t bpp,
+	unsigned char* out)
+{
+	size_t start = std::min(bpp, n);
+	if (type == 0) {
+		size_t sum = 0;
+		for (size_t i = 0; i < n; ++i) {
+			out[i] = row[i];
+			sum += row[i];
+		}
+		return sum;
+	}
+	// The first pixel has no left neighbour (a = c = 0): sub leaves it alone, and Paeth
+	// picks the byte above, like up.
+	for (size_t i = 0; i < start; ++i) {
+		int predictor = type == 1 ? 0 : (type == 3 ? up[i] / 2 : up[i]);
+		out[i] = static_cast<unsigned char>(row[i] - predictor);
+	}
+	if (type == 1) {
+		for (size_t i = start; i < n; ++i) out[i] = static_cast<unsigned char>(row[i] - row[i - bpp]);
+	}
+	else if (type == 2) {
+		for (size_t i = start; i < n; ++i) out[i] = static_cast<unsigned char>(row[i] - up[i]);
+	}
+	else if (type == 3) {
+		for (size_t i = start; i < n; ++i) out[i] = static_cast<unsigned char>(row[i] - (row[i - bpp] + up[i]) / 2);
+	}
+	else {
+		for (size_t i = start; i < n; ++i) {
+			int a = row[i - bpp], b = up[i], c = up[i - bpp];
+			int pa = std::abs(b - c), pb = std::abs(a - c), pc = std::abs(a + b - 2 * c);
+			int predictor = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+			out[i] = static_cast<unsigned char>(row[i] - predictor);
+		}
+	}
+	size_t sum = 0;
+	for (size_t i = 0; i < n; ++i) sum += out[i] < 128 ? out[i] : 255u - out[i];
+	return sum;
+}
+
+size_t filterPNGRowScalar(int type, const unsigned char* row, const unsigned char* up, size_t n, size_t bpp, unsigned char* out)
+{
+	return filterPNGRowBody(type, row, up, n, bpp, out);
+}
+
+#if SIMD_HAVE_AVX2
+
+SIMD_TARGET_AVX2 size_t filterPNGRowAVX2(int type, const unsigned char* row, const unsigned char* up, size_t n, size_t bpp, unsigned char* out)
+{
+	return filterPNGRowBody(type, row, up, n, bpp, out);
+}
+
+#endif
+
+/// <summary>
+/// filterPNGRowBody, compiled for the widest instructions simdLevel allows.
+/// </summary>
+size_t filterPNGRow(int type, const unsigned char* row, const unsigned char* up, size_t n, size_t bpp, unsigned char* out)
+{
+#if SIMD_HAVE_AVX2
+	if (simdLevel >= SIMD_AVX2) return filterPNGRowAVX2(type, row, up, n, bpp, out);
+#endif
+	return filterPNGRowScalar(type, row, up, n, bpp, out);
+}
+
+/// <summary>
+/// Writes a PNG file a band of rows at a time, so the image can be saved while it's still
+/// being rendered, and without ever holding the whole image in memory.
+///
+/// Rows are filtered as they arrive (with the same per-row filter choice lodepng makes),
+/// and the filtered data is compressed in 64 KiB chunks, joined into one zlib stream as in
+/// ParallelDeflate.hpp. Each compressed chunk is written out as its own IDAT chunk as soon
+/// as it and all the chunks before it are done. With a thread pool the chunks are
+/// compressed on the pool while the caller carries on; there's a limit on how many can be
+/// waiting at once, so memory use stays bounded however big the image is.
+///
+/// Call writeRows and finish from outside the pool (e.g. the main thread), as they may
+/// wait for compression tasks to finish.
+/// </summary>
+class PNGStreamWriter {
+	std::ofstream _file;
+	unsigned _width, _height;
+	int _channels;
+	unsigned _rowsWritten = 0;
+	ThreadPool* _pool;
+	LodePNGCompressSettings _settings;
+
+	std::vector<unsigned char> _previousRow, _row, _filtered[5];
+	std::vector<unsigned char> _pending; // Filtered rows not yet handed out for compression.
+	std::vector<unsigned char> _idat;    // Start of the next IDAT chunk (the zlib header).
+	std::deque<std::pair<std::future<DeflatedChunk>, size_t>> _inFlight;
+	unsigned _adler = 1;
+	bool _finished = false;
+
+	void writeBytes(const unsigned char* data, size_t size)
+	{
+		_file.write(reinterpret_cast<const char*>(data), size);
+		if (!_file) throw std::runtime_error("Error writing PNG file.");
+	}
+
+	void writeUint32(uint32_t value)
+	{
+		unsigned char bytes[4] = {
+			static_cast<unsigned char>(value >> 24), static_cast<unsigned char>(value >> 16),
+			static_cast<unsigned char>(value >> 8), static_cast<unsigned char>(value)
+		};
+		writeBytes(bytes, 4);
+	}
+
+	void writeChunk(const char* type, const std::vector<unsigned char>& data)
+	{
+		// The CRC covers the chunk type and data.
+		std::vector<unsigned char> typeAndData(type, type + 4);
+		typeAndData.insert(typeAndData.end(), data.begin(), data.end());
+		writeUint32(static_cast<uint32_t>(data.size()));
+		writeBytes(typeAndData.data(), typeAndData.size());
+		writeUint32(lodepng_crc32(typeAndData.data(), typeAndData.size()));
+	}
+
+	/// <summary>
+	/// Filters _row with whichever filter gives the smallest sum of (signed) output bytes,
+	/// lodepng's default heuristic, and appends it to the pending data.
+	/// </summary>
+	void addFilteredRow()
+	{
+		STATS_TIME(ENCODE_STAGE);
+		size_t bestSum = 0;
+		int bestType = 0;
+		for (int type = 0; type < 5; ++type) {
+			size_t sum = filterPNGRow(type, _row.data(), _previousRow.data(), _row.size(), _channels, _filtered[type].data());
+			if (type == 0 || sum < bestSum) {
+				bestType = type;
+				bestSum = sum;
+			}
+		}
+		_pending.push_back(static_cast<unsigned char>(bestType));
+		_pending.insert(_pending.end(), _filtered[bestType].begin(), _filtered[bestType].end());
+		std::swap(_row, _previousRow);
+	}
+
+	void writeDeflatedChunk(DeflatedChunk chunk, size_t inputSize, bool last)
+	{
+		if (chunk.error) throw std::runtime_error("PNG compression failed.");
+		_adler = adler32Combine(_adler, chunk.adler, inputSize); // _adler starts as the checksum of no data.
+		_idat.insert(_idat.end(), chunk.data.begin(), chunk.data.end());
+		if (last) {
+			for (int shift = 24; shift >= 0; shift -= 8) _idat.push_back(static_cast<unsigned char>(_adler >> shift));
+		}
+		writeChunk("IDAT", _idat);
+		_idat.clear();
+	}
+
+	/// <summary>
+	/// Writes out compressed chunks, in order, while they're ready. If more than maxWaiting
+	/// are still in flight, waits for the oldest.
+	/// </summary>
+	void drain(size_t maxWaiting)
+	{
+		while (!_inFlight.empty()) {
+			auto& front = _inFlight.front();
+			bool ready = front.first.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+			if (!ready && _inFlight.size() <= maxWaiting) break;
+			writeDeflatedChunk(front.first.get(), front.second, false);
+			_inFlight.pop_front();
+		}
+	}
+
+	/// <summary>
+	/// Hands the first size bytes of the pending data out for compression.
+	/// </summary>
+	void compressPending(size_t size)
+	{
+		std::vector<unsigned char> input(_pending.begin(), _pending.begin() + size);
+		_pending.erase(_pending.begin(), _pending.begin() + size);
+		if (!_pool) {
+			DeflatedChunk chunk;
+			deflateChunk(input.data(), size, false, _settings, chunk);
+			writeDeflatedChunk(std::move(chunk), size, false);
+			return;
+		}
+		const LodePNGCompressSettings& settings = _settings;
+		_inFlight.emplace_back(_pool->submit([input = std::move(input), &settings] {
+			DeflatedChunk chunk;
+			deflateChunk(input.data(), input.size(), false, settings, chunk);
+			return chunk;
+		}), size);
+		drain(2 * static_cast<size_t>(_pool->size()) + 2);
+	}
+
+public:
+	/// <summary>
+	/// Starts writing a width x height, 8 bit per channel PNG. The rows passed in are always
+	/// RGBA, but unless alpha is true the alpha channel is dropped and an RGB PNG is written.
+	/// </summary>
+	PNGStreamWriter(const std::string& filename, unsigned width, unsigned height, ThreadPool* pool = nullptr, bool alpha = false)
+		:_file(filename, std::ios::binary), _width(width), _height(height), _channels(alpha ? 4 : 3), _pool(pool)
+	{
+		if (!_file) throw std::runtime_error("Couldn't open " + filename + " for writing.");
+		lodepng_compress_settings_init(&_settings);
+
+		size_t rowBytes = static_cast<size_t>(width) * _channels;
+		_previousRow.assign(rowBytes, 0);
+		_row.resize(rowBytes);
+		for (auto& filtered : _filtered) filtered.resize(rowBytes);
+
+		const unsigned char signature[] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+		writeBytes(signature, sizeof(signature));
+		std::vector<unsigned char> header;
+		for (uint32_t value : { width, height }) {
+			for (int shift = 24; shift >= 0; shift -= 8) header.push_back(static_cast<unsigned char>(value >> shift));
+		}
+		header.push_back(8);             // Bit depth
+		header.push_back(alpha ? 6 : 2); // Colour type: RGBA or RGB
+		header.push_back(0);             // Compression method (deflate)
+		header.push_back(0);             // Filter method (adaptive)
+		header.push_back(0);             // No interlacing
+		writeChunk("IHDR", header);
+
+		// zlib header (deflate, 32K window, no dictionary), sent with the first compressed chunk.
+		_idat = { 0x78, 0x01 };
+	}
+
+	~PNGStreamWriter()
+	{
+		// Don't leave tasks running that refer to this object.
+		for (auto& chunk : _inFlight) chunk.first.wait();
+	}
+
+	/// <summary>
+	/// Adds the next nRows rows of the image (top to bottom), as tightly packed RGBA.
+	/// </summary>
+	void writeRows(const uint8_t* rgba, int nRows)
+	{
+		if (_finished || _rowsWritten + nRows > _height) throw std::logic_error("Too many rows written to PNG.");
+		for (int y = 0; y < nRows; ++y) {
+			const uint8_t* in = rgba + static_cast<size_t>(y) * _width * 4;
+			for (unsigned x = 0; x < _width; ++x)
+				for (int c = 0; c < _channels; ++c) {
+					_row[x * _channels + c] = in[x * 4 + c];
+				}
+			addFilteredRow();
+		}
+		_rowsWritten += nRows;
+
+		while (_pending.size() >= parallelDeflateChunkSize) compressPending(parallelDeflateChunkSize);
+	}
+
+	/// <summary>
+	/// Compresses and writes whatever is left, then ends the file. All the rows must have
+	/// been written.
+	/// </summary>
+	void finish()
+	{
+		if (_finished) return;
+		if (_rowsWritten != _height) throw std::logic_error("PNG finished before all its rows were written.");
+		drain(0);
+
+		DeflatedChunk chunk;
+		deflateChunk(_pending.data(), _pending.size(), true, _settings, chunk);
+		writeDeflatedChunk(std::move(chunk), _pending.size(), true);
+		_pending.clear();
+
+		writeChunk("IEND", {});
+		_file.close();
+		if (!_file) throw std::runtime_error("Error writing PNG file.");
+		_finished = true;
+	}
+};
@@ -0,0 +1,198 @@
+#pragma once
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <lodepng.h>
+#include "Stats.hpp"
+#include "ThreadPool.hpp"
+
+// Parallel zlib compression for lodepng, in the style of pigz: the input is cut into chunks,
+// each chunk is deflated on its own (on the thread pool), and the compressed chunks are
+// joined back into one valid zlib stream.
+//
+// Joining works because a deflate stream is just a series of blocks, and only the last
+// one has its BFINAL bit set. For every chunk but the last we clear that bit, then end the
+// chunk with an empty "stored" block, which also pads the stream out to a whole byte so
+// the next chunk's blocks can simply be appended. The zlib checksum (Adler-32) of the
+// whole input is combined from the checksums of the chunks.
+
+/// <summary>
+/// Largest chunk compressed as one piece. lodepng_deflate puts inputs up to 64 KiB in a
+/// single block, so the BFINAL bit we need to clear is always the first bit of the output.
+/// </summary>
+const size_t parallelDeflateChunkSize = 65536;
+
+/// <summary>
+/// Adler-32 checksum of data, continuing from the checksum adler of any earlier data.
+/// </summary>
+unsigned adler32(const unsigned char* data, size_t size, unsigned adler = 1)
+{
+	const unsigned base = 65521;
+	unsigned s1 = adler & 0xFFFF, s2 = adler >> 16;
+	while (size > 0) {
+		// 5552 is the most bytes we can sum before s2 could overflow 32 bits.
+		size_t n = std::min(size, size_t(5552));
+		size -= n;
+		for (size_t i = 0; i < n; ++i) {
+			s1 += data[i];
+			s2 += s1;
+		}
+		data += n;
+		s1 %= base;
+		s2 %= base;
+	}
+	return (s2 << 16) | s1;
+}
+
+/// <summary>
+/// Adler-32 checksum of two pieces of data one after the other, given the checksum of
+/// each piece and the size of the second (the same maths as zlib's adler32_combine).
+/// </summary>
+unsigned adler32Combine(unsigned adler1, unsigned adler2, size_t size2)
+{
+	const unsigned base = 65521;
+	unsigned rem = static_cast<unsigned>(size2 % base);
+	unsigned s1 = adler1 & 0xFFFF;
+	unsigned s2 = (rem * s1) % base;
+	s1 += (adler2 & 0xFFFF) + base - 1;
+	s2 += (adler1 >> 16) + (adler2 >> 16) + base - rem;
+	if (s1 >= base) s1 -= base;
+	if (s1 >= base) s1 -= base;
+	if (s2 >= 2 * base) s2 -= 2 * base;
+	if (s2 >= base) s2 -= base;
+	return (s2 << 16) | s1;
+}
+
+struct DeflatedChunk {
+	std::vector<unsigned char> data;
+	unsigned adler = 1;
+	unsigned error = 0;
+};
+
+/// <summary>
+/// Buffers for inflatesToSize, kept by each thread so checking a chunk doesn't allocate.
+/// </summary>
+struct InflateScratch {
+	std::vector<unsigned char> input;
+	unsigned char* output = nullptr; // Allocated by lodepng, which grows it as it needs to.
+
+	~InflateScratch()
+	{
+		std::free(output);
+	}
+};
+
+/// <summary>
+/// Checks that data, followed by a final empty block, inflates back to size bytes.
+/// </summary>
+bool inflatesToSize(const std::vector<unsigned char>& data, size_t size)
+{
+	thread_local InflateScratch scratch;
+	// lodepng_inflate won't read a stored block that ends exactly at the end of its input,
+	// so this is followed by 4 bytes standing in for the checksum of a real zlib stream.
+	const unsigned char finalBlock[] = { 0x01, 0x00, 0x00, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0x00 };
+	scratch.input.assign(data.begin(), data.end());
+	scratch.input.insert(scratch.input.end(), finalBlock, finalBlock + sizeof(finalBlock));
+	// lodepng appends to the buffer it's given, so it's handed over as empty; it then
+	// reallocates the memory it already has rather than starting a new buffer.
+	size_t outSize = 0;
+	unsigned error = lodepng_inflate(&scratch.output, &outSize, scratch.input.data(), scratch.input.size(), &lodepng_default_decompress_settings);
+	return !error && outSize == size;
+}
+
+/// <summary>
+/// Deflates one chunk. Unless it's the last chunk, the result is left open (BFINAL clear)
+/// and byte-aligned, ready for the next chunk to be appended.
+/// </summary>
+void deflateChunk(const unsigned char* in, size_t size, bool last, const LodePNGCompressSettings& settings, DeflatedChunk& chunk)
+{
+	STATS_TIME(ENCODE_STAGE);
+	unsigned char* out = nullptr;
+	size_t outSize = 0;
+	chunk.error = lodepng_deflate(&out, &outSize, in, size, &settings);
+	if (!chunk.error) chunk.data.assign(out, out + outSize);
+	std::free(out);
+	if (chunk.error) return;
+	chunk.adler = adler32(in, size);
+	if (last) return;
+
+	// Clear BFINAL. This relies on lodepng's compressed blocks being at least 65536 bytes
+	// long, so the chunk is a single block; with btype 0 (no compression) it would be two
+	// stored blocks of at most 65535, and this would leave the second one final.
+	chunk.data[0] &= ~1;
+
+	// The empty stored block starts with a 3-bit header (all zero here), then skips to the
+	// next byte boundary and stores its length (0000) and the length's complement (FFFF).
+	// lodepng doesn't tell us how many padding bits follow the chunk's last block: if there
+	// are at least 3 the header fits in them, otherwise it needs one more byte. Only one of
+	// the two endings decodes, so try them.
+	const unsigned char syncAfterPadding[] = { 0x00, 0x00, 0xFF, 0xFF };
+	const unsigned char syncAfterExtraByte[] = { 0x00, 0x00, 0x00, 0xFF, 0xFF };
+	size_t chunkSize = chunk.data.size();
+	chunk.data.insert(chunk.data.end(), syncAfterPadding, syncAfterPadding + sizeof(syncAfterPadding));
+	if (inflatesToSize(chunk.data, size)) return;
+
+	chunk.data.resize(chunkSize);
+	chunk.data.insert(chunk.data.end(), syncAfterExtraByte, syncAfterExtraByte + sizeof(syncAfterExtraByte));
+	if (!inflatesToSize(chunk.data, size)) chunk.error = 1;
+}
+
+/// <summary>
+/// A drop-in replacement for lodepng's zlib compressor (set it as custom_zlib in the
+/// LodePNGCompressSettings) that deflates chunks of the input in parallel.
+/// settings->custom_context must point to the ThreadPool to use.
+/// </summary>
+unsigned parallelZlibCompress(unsigned char** out, size_t* outsize, const unsigned char* in, size_t insize, const LodePNGCompressSettings* settings)
+{
+	ThreadPool& pool = *static_cast<ThreadPool*>(const_cast<void*>(settings->custom_context));
+
+	int nChunks = static_cast<int>(std::max(size_t(1), (insize + parallelDeflateChunkSize - 1) / parallelDeflateChunkSize));
+	std::vector<DeflatedChunk> chunks(nChunks);
+	pool.parallelFor(nChunks, [&](int i) {
+		size_t begin = i * parallelDeflateChunkSize;
+		size_t size = std::min(parallelDeflateChunkSize, insize - begin);
+		deflateChunk(in + begin, size, i == nChunks - 1, *settings, chunks[i]);
+	});
+
+	// zlib header (deflate, 32K window, no dictionary), the chunks, then the checksum.
+	size_t totalSize = 2 + 4;
+	unsigned adler = 1;
+	for (int i = 0; i < nChunks; ++i) {
+		if (chunks[i].error) return chunks[i].error;
+		totalSize += chunks[i].data.size();
+		size_t chunkInputSize = std::min(parallelDeflateChunkSize, insize - i * parallelDeflateChunkSize);
+		adler = i == 0 ? chunks[i].adler : adler32Combine(adler, chunks[i].adler, chunkInputSize);
+	}
+
+	unsigned char* result = static_cast<unsigned char*>(std::malloc(totalSize));
+	if (!result) return 83; // lodepng's "memory allocation failed" error.
+	unsigned char* p = result;
+	*p++ = 0x78;
+	*p++ = 0x01;
+	for (const DeflatedChunk& chunk : chunks) {
+		std::copy(chunk.data.begin(), chunk.data.end(), p);
+		p += chunk.data.size();
+	}
+	*p++ = static_cast<unsigned char>(adler >> 24);
+	*p++ = static_cast<unsigned char>(adler >> 16);
+	*p++ = static_cast<unsigned char>(adler >> 8);
+	*p++ = static_cast<unsigned char>(adler);
+
+	*out = result;
+	*outsize = totalSize;
+	return 0;
+}
+
+/// <summary>
+/// Encodes an RGBA image as a PNG in memory, like lodepng::encode, but compressing the
+/// image data in parallel on the given pool.
+/// </summary>
+unsigned encodePNGParallel(std::vector<unsigned char>& png, const std::vector<unsigned char>& image, unsigned width, unsigned height, ThreadPool& pool)
+{
+	STATS_TIME(ENCODE_STAGE);
+	lodepng::State state;
+	state.encoder.zlibsettings.custom_zlib = parallelZlibCompress;
+	state.encoder.zlibsettings.custom_context = &pool;
+	return lodepng::encode(png, image, width, height, state);
+}
@@ -0,0 +1,289 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include <Eigen/Dense>
+#include "BVH.hpp"
+#include "LinAlg.hpp"
+#include "Scene.hpp"
+#include "ShadeBatch.hpp"
+#include "Sphere.hpp"
+#include "Stats.hpp"
+#include "Tracer.hpp"
+
+// Monte Carlo path tracing: many random paths per pixel, averaged, so light bounces between
+// diffuse surfaces (global illumination) as well as off mirrors and through glass.
+//
+// Each path starts at a random point in its pixel. At every diffuse hit it picks up the
+// direct light there (shadeDiffuse, with its shadow rays), weighted by the path's
+// throughput, then carries on in a random cosine-weighted direction with its throughput
+// tinted by the surface colour (the cosine and 1/pi of the Lambertian BRDF cancel against
+// the sampling density). Mirrors and glass bounce as in traceRay. A path that leaves the
+// scene, or runs out of bounces, picks up the ambient colour.
+//
+// The scene's ambient lights are left out of the direct light. In the classic tracer they
+// stand in for light bounced off other surfaces, which here the random bounces find for
+// real (with ambientColour as the light from the surroundings), so adding them at every
+// hit would count that light twice and make the image too bright.
+//
+// Rather than every path running to a fixed number of bounces, paths that can only bring
+// back a little more light are ended early with Russian roulette: after a few bounces a
+// path carries on with a probability equal to its throughput (its brightest channel),
+// and if it does its throughput is divided by that probability. On average each path
+// still finds the same light, so the image is unbiased, but dim paths (after a dark
+// surface, or deep in a hall of mirrors) mostly stop, and the rays go where they count.
+// The bounce limit is only a safety net, so it can be much higher than maxBounces.
+// Optionally, paths whose throughput drops below a cutoff end straight away, which is
+// slightly biased but saves the roulette's extra noise.
+//
+// Every path has its own random number stream, seeded from its pixel and sample number, so
+// the image only depends on the seed: not on the number of threads, the tile size or the
+// order the paths are traced in.
+//
+// Paths are traced a bounce at a time, like traceWavefront, so all the diffuse hits of a
+// bounce are lit together with shadeDiffuseBatches.
+
+/// <summary>
+/// How to path trace a frame.
+/// </summary>
+struct PathTraceSettings {
+	int samplesPerPixel = 0; // 0 for the ordinary one-ray-per-pixel tracer.
+	uint32_t seed = 1;       // Picks the random numbers.
+	int rouletteDepth = 2;   // Bounces before Russian roulette starts (negative for never).
+	float cutoff = 0.f;      // Paths whose throughput falls below this end there (0 for never).
+	int maxDepth = 64;       // Bounces before a path is cut off whatever its throughput.
+};
+
+/// <summary>
+/// PCG32 random number generator (O'Neill's pcg32_random_r): 64 bits of state, and a
+/// stream selector, so different paths get independent sequences.
+/// </summary>
+struct Pcg32 {
+	uint64_t state = 0, inc = 1;
+
+	Pcg32() = default;
+
+	Pcg32(uint64_t seed, uint64_t stream)
+		:state(0), inc((stream << 1) | 1)
+	{
+		nextUint();
+		state += seed;
+		nextUint();
+	}
+
+	uint32_t nextUint()
+	{
+		uint64_t old = state;
+		state = old * 6364136223846793005ULL + inc;
+		uint32_t xorShifted = static_cast<uint32_t>(((old >> 18) ^ old) >> 27);
+		uint32_t rot = static_cast<uint32_t>(old >> 59);
+		return (xorShifted >> rot) | (xorShifted << ((32 - rot) & 31));
+	}
+
+	/// <summary>
+	/// Uniform in [0, 1).
+	/// </summary>
+	float nextFloat()
+	{
+		return (nextUint() >> 8) * (1.f / 16777216.f);
+	}
+};
+
+/// <summary>
+/// SplitMix64 finaliser, to turn a pixel and sample number into a well-mixed seed.
+/// </summary>
+uint64_t mixBits(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+/// <summary>
+/// The random number stream for one sample of one pixel (numbered across the whole image).
+/// </summary>
+Pcg32 sampleRng(uint32_t seed, uint64_t pixel, int sample)
+{
+	return Pcg32(mixBits((pixel << 20) ^ static_cast<uint64_t>(sample)), mixBits(seed));
+}
+
+/// <summary>
+/// Random direction in the hemisphere around unit vector normal, with density cos(theta) / pi.
+/// </summary>
+Eigen::Vector3f sampleCosineHemisphere(const Eigen::Vector3f& normal, float u1, float u2)
+{
+	// An orthonormal basis around the normal (Duff et al., "Building an Orthonormal Basis, Revisited").
+	float sign = copysignf(1.f, normal.z());
+	float a = -1.f / (sign + normal.z());
+	float b = normal.x() * normal.y() * a;
+	Eigen::Vector3f tangent(1.f + sign * normal.x() * normal.x() * a, sign * b, -sign * normal.x());
+	Eigen::Vector3f bitangent(b, sign + normal.y() * normal.y() * a, -normal.y());
+
+	float r = sqrtf(u1), phi = 6.28318531f * u2;
+	return tangent * (r * cosf(phi)) + bitangent * (r * sinf(phi)) + normal * sqrtf(std::max(0.f, 1.f - u1));
+}
+
+/// <summary>
+/// One path being traced.
+/// </summary>
+struct MonteCarloPath {
+	Ray ray;
+	Eigen::Vector3f throughput; // What the light found from here on is multiplied by.
+	Pcg32 rng;
+	int index;                  // Which radiance it adds to.
+	RayType type;               // Of its current ray (only used for the stats).
+};
+
+// Depth given to paths that leave the scene, for the denoiser.
+const float missDepth = 1e6f;
+
+/// <summary>
+/// What a path's first ray hit, for guiding the denoiser: the colour of the surface, its
+/// normal (facing the ray) and how far away it was. Rays that leave the scene get white, no
+/// normal and missDepth.
+/// </summary>
+struct GuideSample {
+	Eigen::Vector3f albedo = Eigen::Vector3f::Zero();
+	Eigen::Vector3f normal = Eigen::Vector3f::Zero();
+	float depth = 0.f;
+};
+
+/// <summary>
+/// The path tracer's queues, kept from bounce to bounce (one set per thread).
+/// </summary>
+struct PathTraceQueues {
+	std::vector<MonteCarloPath> nextPaths;
+	std::vector<RayHit> hits;
+	std::vector<int> diffuse; // Indices into the paths.
+	std::vector<DiffuseHitBatch> diffuseBatches;
+	std::vector<Eigen::Vector3f> diffuseColours;
+};
+
+/// <summary>
+/// Decides whether a path goes on to bounce nextDepth, now its throughput has been updated
+/// for the bounce it just made. If not, the path is finished: radiance gets whatever it's
+/// owed, and false is returned.
+/// </summary>
+bool continuePath(MonteCarloPath& path, int nextDepth, const PathTraceSettings& settings, Eigen::Vector3f* radiance)
+{
+	float maxThroughput = path.throughput.maxCoeff();
+	// The rest of the path is taken to find the ambient colour, as at the bounce limit.
+	if (maxThroughput < settings.cutoff) {
+		STATS_ADD(contributionCutoffs, 1);
+		radiance[path.index] += coeffWiseMultiply(path.throughput, ambientColour);
+		return false;
+	}
+	if (settings.rouletteDepth >= 0 && nextDepth >= settings.rouletteDepth && maxThroughput < 1.f) {
+		if (path.rng.nextFloat() >= maxThroughput) {
+			STATS_ADD(rouletteKills, 1);
+			return false;
+		}
+		path.throughput /= maxThroughput;
+	}
+	return true;
+}
+
+/// <summary>
+/// Traces paths until they have all finished, adding the light each one finds to
+/// radiance[path.index] (which should start at zero). paths is used up.
+/// If guides isn't null, guides[path.index] is set to what the path's first ray hit.
+/// features picks the shading kernel (see shadeDiffuseBatches).
+/// </summary>
+void tracePaths(const Scene& scene, const PathTraceSettings& settings, std::vector<MonteCarloPath>& paths, Eigen::Vector3f* radiance,
+	GuideSample* guides = nullptr, int features = allSceneFeatures)
+{
+	thread_local PathTraceQueues queues;
+	for (int depth = 0; !paths.empty(); ++depth) {
+		if (depth > settings.maxDepth) {
+			for (const MonteCarloPath& path : paths) {
+				STATS_ADD(bounceLimitHits, 1);
+				radiance[path.index] += coeffWiseMultiply(path.throughput, ambientColour);
+			}
+			paths.clear();
+			break;
+		}
+
+		int nPaths = static_cast<int>(paths.size());
+		queues.hits.resize(nPaths);
+		for (int i = 0; i < nPaths; ++i) {
+			STATS_COUNT_RAY(paths[i].type, depth);
+			scene.bvh.closestHit(paths[i].ray, scene.spheres, queues.hits[i]);
+		}
+
+		std::vector<MonteCarloPath>& nextPaths = queues.nextPaths;
+		nextPaths.clear();
+		queues.diffuse.clear();
+		for (int i = 0; i < nPaths; ++i) {
+			MonteCarloPath& path = paths[i];
+			const RayHit& hit = queues.hits[i];
+			if (hit.sphere < 0) {
+				STATS_ADD(raysMissed, 1);
+				radiance[path.index] += coeffWiseMultiply(path.throughput, ambientColour);
+				if (guides && depth == 0) guides[path.index] = { Eigen::Vector3f::Ones(), Eigen::Vector3f::Zero(), missDepth };
+				continue;
+			}
+			const Sphere& hitSphere = scene.spheres[hit.sphere];
+			if (guides && depth == 0) {
+				Eigen::Vector3f normal = getSphereNormal(hitSphere, hit.intersection);
+				if (normal.dot(path.ray.direction) > 0.f) normal = -normal;
+				guides[path.index] = { hitSphere.colour, normal, (hit.intersection - path.ray.origin).norm() };
+			}
+			if (hitSphere.material == Material::DIFFUSE) {
+				queues.diffuse.push_back(i);
+			}
+			else if (hitSphere.material == Material::MIRROR) {
+				Eigen::Vector3f normal = getSphereNormal(hitSphere, hit.intersection);
+				path.ray = Ray{ hit.intersection, reflect(path.ray.direction, normal) };
+				path.throughput = coeffWiseMultiply(path.throughput, hitSphere.colour);
+				path.type = REFLECTED_RAY;
+				if (continuePath(path, depth + 1, settings, radiance)) nextPaths.push_back(path);
+			}
+			else if (hitSphere.material == Material::REFRACTIVE) {
+				Ray nextRay;
+				if (refractiveBounce(path.ray, hitSphere, hit.intersection, nextRay)) {
+					path.throughput = coeffWiseMultiply(path.throughput, hitSphere.colour);
+					path.type = REFRACTED_RAY;
+				}
+				else {
+					path.type = REFLECTED_RAY;
+				}
+				path.ray = nextRay;
+				if (continuePath(path, depth + 1, settings, radiance)) nextPaths.push_back(path);
+			}
+			else {
+				throw std::runtime_error("Unknown material type!");
+			}
+		}
+
+		// Direct light at all the diffuse hits at once, then a random bounce from each.
+		const std::vector<int>& diffuse = queues.diffuse;
+		int nBatches = (static_cast<int>(diffuse.size()) + DiffuseHitBatch::maxSize - 1) / DiffuseHitBatch::maxSize;
+		if (static_cast<int>(queues.diffuseBatches.size()) < nBatches) queues.diffuseBatches.resize(nBatches);
+		for (int b = 0; b < nBatches; ++b) queues.diffuseBatches[b].clear();
+		for (size_t j = 0; j < diffuse.size(); ++j) {
+			const RayHit& hit = queues.hits[diffuse[j]];
+			queues.diffuseBatches[j / DiffuseHitBatch::maxSize].add(scene.spheres[hit.sphere], hit.intersection);
+		}
+		queues.diffuseColours.resize(nBatches * DiffuseHitBatch::maxSize);
+		shadeDiffuseBatches(queues.diffuseBatches.data(), nBatches, scene, queues.diffuseColours.data(), depth, false, features);
+		for (size_t j = 0; j < diffuse.size(); ++j) {
+			MonteCarloPath& path = paths[diffuse[j]];
+			const RayHit& hit = queues.hits[diffuse[j]];
+			const Sphere& hitSphere = scene.spheres[hit.sphere];
+			radiance[path.index] += coeffWiseMultiply(path.throughput, queues.diffuseColours[j]);
+
+			Eigen::Vector3f normal = getSphereNormal(hitSphere, hit.intersection);
+			if (normal.dot(path.ray.direction) > 0.f) normal = -normal; // Hit from inside.
+			float u1 = path.rng.nextFloat(), u2 = path.rng.nextFloat();
+			path.ray = Ray{ hit.intersection, sampleCosineHemisphere(normal, u1, u2) };
+			path.throughput = coeffWiseMultiply(path.throughput, hitSphere.colour);
+			path.type = REFLECTED_RAY;
+			if (continuePath(path, depth + 1, settings, radiance)) nextPaths.push_back(path);
+		}
+		std::swap(paths, nextPaths);
+	}
+}
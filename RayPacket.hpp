@@ -0,0 +1,312 @@
+#pragma once
+#include <algorithm>
+#include <cfloat>
+#include <Eigen/Dense>
+#include "BVH.hpp"
+#include "Simd.hpp"
+#include "Sphere.hpp"
+#include "SphereSoA.hpp"
+#include "Stats.hpp"
+
+/// <summary>
+/// A bundle of up to 64 rays (e.g. an 8x8 block of primary rays) that share an origin,
+/// stored structure-of-arrays so the intersection code can run across rays in SIMD lanes.
+/// Rays are processed in groups of 8 lanes. Unused lanes in the last group have
+/// t = -FLT_MAX, so they never hit anything.
+/// </summary>
+struct RayPacket {
+	static constexpr int maxSize = 64;
+	static constexpr int groupSize = 8;
+
+	Eigen::Vector3f origin;
+	int size = 0;
+
+	alignas(32) float dx[maxSize], dy[maxSize], dz[maxSize];
+	alignas(32) float invDx[maxSize], invDy[maxSize], invDz[maxSize];
+	alignas(32) float a[maxSize]; // d.d, the "A" of the intersection quadratic.
+
+	// Results: distance and store index (in BVH leaf order) of the closest hit so far.
+	alignas(32) float t[maxSize];
+	alignas(32) int hitIndex[maxSize];
+
+	void reset(const Eigen::Vector3f& packetOrigin)
+	{
+		origin = packetOrigin;
+		size = 0;
+	}
+
+	void add(const Eigen::Vector3f& direction)
+	{
+		dx[size] = direction.x();
+		dy[size] = direction.y();
+		dz[size] = direction.z();
+		++size;
+	}
+
+	int nGroups() const
+	{
+		return (size + groupSize - 1) / groupSize;
+	}
+
+	Ray ray(int i) const
+	{
+		return Ray{ origin, Eigen::Vector3f(dx[i], dy[i], dz[i]) };
+	}
+};
+
+/// <summary>
+/// Four planes through the packet origin that bound every ray in the packet. A box wholly
+/// outside any of the planes can't be hit by any of the rays.
+/// </summary>
+struct PacketFrustum {
+	Eigen::Vector3f normals[4];
+	bool valid = false;
+};
+
+PacketFrustum makePacketFrustum(const RayPacket& packet)
+{
+	PacketFrustum frustum;
+	Eigen::Vector3f forward = Eigen::Vector3f::Zero();
+	for (int i = 0; i < packet.size; ++i) forward += Eigen::Vector3f(packet.dx[i], packet.dy[i], packet.dz[i]);
+	if (forward.squaredNorm() == 0.f) return frustum;
+	forward.normalize();
+	Eigen::Vector3f u = forward.unitOrthogonal();
+	Eigen::Vector3f v = forward.cross(u);
+
+	// Project every ray onto the plane one unit along "forward", and bound the projections.
+	float uMin = FLT_MAX, uMax = -FLT_MAX, vMin = FLT_MAX, vMax = -FLT_MAX;
+	for (int i = 0; i < packet.size; ++i) {
+		Eigen::Vector3f d(packet.dx[i], packet.dy[i], packet.dz[i]);
+		float s = d.dot(forward);
+		if (s <= 0.f) return frustum; // Too wide for a frustum; just don't cull.
+		uMin = std::min(uMin, d.dot(u) / s);
+		uMax = std::max(uMax, d.dot(u) / s);
+		vMin = std::min(vMin, d.dot(v) / s);
+		vMax = std::max(vMax, d.dot(v) / s);
+	}
+	// Widen slightly so rounding never culls a box that a boundary ray actually hits.
+	float eps = 1e-4f;
+	uMin -= eps * (1.f + fabsf(uMin));
+	uMax += eps * (1.f + fabsf(uMax));
+	vMin -= eps * (1.f + fabsf(vMin));
+	vMax += eps * (1.f + fabsf(vMax));
+
+	// Points p inside the frustum have n.(p - origin) >= 0 for all four normals.
+	frustum.normals[0] = u - uMin * forward;
+	frustum.normals[1] = uMax * forward - u;
+	frustum.normals[2] = v - vMin * forward;
+	frustum.normals[3] = vMax * forward - v;
+	frustum.valid = true;
+	return frustum;
+}
+
+bool frustumCullsBox(const PacketFrustum& frustum, const Eigen::Vector3f& origin, const AABB& box)
+{
+	if (!frustum.valid) return false;
+	for (const Eigen::Vector3f& n : frustum.normals) {
+		// The box corner furthest along the normal.
+		Eigen::Vector3f corner(
+			n.x() > 0.f ? box.max.x() : box.min.x(),
+			n.y() > 0.f ? box.max.y() : box.min.y(),
+			n.z() > 0.f ? box.max.z() : box.min.z());
+		if (n.dot(corner - origin) < 0.f) return true;
+	}
+	return false;
+}
+
+#if SIMD_HAVE_AVX2
+
+SIMD_TARGET_AVX2 int packetGroupHitsBoxAVX2(const RayPacket& packet, int g, const AABB& box)
+{
+	int first = g * RayPacket::groupSize;
+	__m256 tNear = _mm256_setzero_ps();
+	__m256 tFar = _mm256_load_ps(&packet.t[first]);
+	const float* invDir[3] = { packet.invDx, packet.invDy, packet.invDz };
+	for (int axis = 0; axis < 3; ++axis) {
+		__m256 inv = _mm256_load_ps(&invDir[axis][first]);
+		__m256 o = _mm256_set1_ps(packet.origin[axis]);
+		__m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.min[axis]), o), inv);
+		__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.max[axis]), o), inv);
+		tNear = _mm256_max_ps(tNear, _mm256_min_ps(t0, t1));
+		tFar = _mm256_min_ps(tFar, _mm256_max_ps(t0, t1));
+	}
+	return _mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ));
+}
+
+SIMD_TARGET_AVX2 void packetGroupIntersectSphereAVX2(RayPacket& packet, int g, int laneMask, const SphereSoA& geometry, int i, float minT)
+{
+	int first = g * RayPacket::groupSize;
+	float ocx = packet.origin.x() - geometry.cx[i];
+	float ocy = packet.origin.y() - geometry.cy[i];
+	float ocz = packet.origin.z() - geometry.cz[i];
+	float c = (ocx * ocx + (ocy * ocy + ocz * ocz)) - geometry.r2[i];
+	__m256 dx = _mm256_load_ps(&packet.dx[first]);
+	__m256 dy = _mm256_load_ps(&packet.dy[first]);
+	__m256 dz = _mm256_load_ps(&packet.dz[first]);
+	__m256 a = _mm256_load_ps(&packet.a[first]);
+	__m256 two = _mm256_set1_ps(2.f), four = _mm256_set1_ps(4.f), zero = _mm256_setzero_ps();
+	__m256 vMinT = _mm256_set1_ps(minT);
+
+	__m256 b = _mm256_mul_ps(two, _mm256_add_ps(_mm256_mul_ps(dx, _mm256_set1_ps(ocx)),
+		_mm256_add_ps(_mm256_mul_ps(dy, _mm256_set1_ps(ocy)), _mm256_mul_ps(dz, _mm256_set1_ps(ocz)))));
+	__m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(_mm256_mul_ps(four, a), _mm256_set1_ps(c)));
+	__m256i laneBits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+	__m256i active = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(laneMask), laneBits), laneBits);
+	__m256 valid = _mm256_and_ps(_mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ), _mm256_castsi256_ps(active));
+	if (_mm256_testz_ps(valid, valid)) return;
+
+	__m256 sqrtDiscriminant = _mm256_sqrt_ps(discriminant);
+	__m256 negB = _mm256_sub_ps(zero, b);
+	__m256 twoA = _mm256_mul_ps(two, a);
+	__m256 t1 = _mm256_div_ps(_mm256_sub_ps(negB, sqrtDiscriminant), twoA);
+	__m256 t2 = _mm256_div_ps(_mm256_add_ps(negB, sqrtDiscriminant), twoA);
+	__m256 hitT = _mm256_blendv_ps(t2, t1, _mm256_cmp_ps(t1, vMinT, _CMP_GT_OQ));
+	__m256 bestT = _mm256_load_ps(&packet.t[first]);
+	valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(hitT, vMinT, _CMP_GT_OQ), _mm256_cmp_ps(hitT, bestT, _CMP_LT_OQ)));
+	_mm256_store_ps(&packet.t[first], _mm256_blendv_ps(bestT, hitT, valid));
+	__m256i bestIndex = _mm256_load_si256(reinterpret_cast<const __m256i*>(&packet.hitIndex[first]));
+	bestIndex = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(bestIndex), _mm256_castsi256_ps(_mm256_set1_epi32(i)), valid));
+	_mm256_store_si256(reinterpret_cast<__m256i*>(&packet.hitIndex[first]), bestIndex);
+}
+
+#endif
+
+/// <summary>
+/// Slab test of one group of 8 rays against a box.
+/// </summary>
+/// <returns>Bit mask of the rays in the group that enter the box before their current closest hit.</returns>
+int packetGroupHitsBox(const RayPacket& packet, int g, const AABB& box)
+{
+#if SIMD_HAVE_AVX2
+	if (simdLevel >= SIMD_AVX2) return packetGroupHitsBoxAVX2(packet, g, box);
+#endif
+	int first = g * RayPacket::groupSize;
+	int mask = 0;
+	for (int l = 0; l < RayPacket::groupSize; ++l) {
+		Eigen::Vector3f invDir(packet.invDx[first + l], packet.invDy[first + l], packet.invDz[first + l]);
+		if (rayAABBIntersection(packet.origin, invDir, box, packet.t[first + l])) mask |= 1 << l;
+	}
+	return mask;
+}
+
+/// <summary>
+/// Intersects one group of 8 rays with sphere i of the store, keeping the closer hit.
+/// This is the same calculation as raySphereIntersection, with lanes over rays instead of
+/// over spheres, so each ray gets bit-identical t values.
+/// </summary>
+/// <param name="laneMask">Only rays with their bit set are updated.</param>
+void packetGroupIntersectSphere(RayPacket& packet, int g, int laneMask, const SphereSoA& geometry, int i, float minT)
+{
+#if SIMD_HAVE_AVX2
+	if (simdLevel >= SIMD_AVX2) {
+		packetGroupIntersectSphereAVX2(packet, g, laneMask, geometry, i, minT);
+		return;
+	}
+#endif
+	int first = g * RayPacket::groupSize;
+	float ocx = packet.origin.x() - geometry.cx[i];
+	float ocy = packet.origin.y() - geometry.cy[i];
+	float ocz = packet.origin.z() - geometry.cz[i];
+	float c = (ocx * ocx + (ocy * ocy + ocz * ocz)) - geometry.r2[i];
+	for (int r = first; r < first + RayPacket::groupSize; ++r) {
+		if (!(laneMask & (1 << (r - first)))) continue;
+		float b = 2.f * (packet.dx[r] * ocx + (packet.dy[r] * ocy + packet.dz[r] * ocz));
+		float discriminant = b * b - 4.f * packet.a[r] * c;
+		if (!(discriminant >= 0.f)) continue;
+		float sqrtDiscriminant = sqrtf(discriminant);
+		float t1 = (-b - sqrtDiscriminant) / (2.f * packet.a[r]);
+		float t2 = (-b + sqrtDiscriminant) / (2.f * packet.a[r]);
+		float hitT = t1 > minT ? t1 : t2;
+		if (hitT > minT && hitT < packet.t[r]) {
+			packet.t[r] = hitT;
+			packet.hitIndex[r] = i;
+		}
+	}
+}
+
+/// <summary>
+/// Finds the closest hit for every ray in the packet by walking the BVH once for the
+/// whole packet. Nodes outside the packet's frustum are skipped for all rays at once.
+/// Each ray only tests the spheres in leaves its own ray-box test accepts, just like
+/// bvh.closestHit, so the hits match tracing each ray separately.
+/// </summary>
+/// <param name="hits">Output array with one entry per ray in the packet.</param>
+void closestHitPacket(const BVH& bvh, RayPacket& packet, RayHit* hits, float minT = 0.001f)
+{
+	STATS_TIME(TRACE_STAGE);
+	for (int i = 0; i < packet.nGroups() * RayPacket::groupSize; ++i) {
+		bool active = i < packet.size;
+		if (!active) {
+			// Pad the last group with copies of the first ray that can never hit anything.
+			packet.dx[i] = packet.dx[0];
+			packet.dy[i] = packet.dy[0];
+			packet.dz[i] = packet.dz[0];
+		}
+		packet.invDx[i] = 1.f / packet.dx[i];
+		packet.invDy[i] = 1.f / packet.dy[i];
+		packet.invDz[i] = 1.f / packet.dz[i];
+		packet.a[i] = packet.dx[i] * packet.dx[i] + (packet.dy[i] * packet.dy[i] + packet.dz[i] * packet.dz[i]);
+		packet.t[i] = active ? FLT_MAX : -FLT_MAX;
+		packet.hitIndex[i] = -1;
+	}
+
+	const std::vector<BVHNode>& nodes = bvh.nodes();
+	if (!nodes.empty()) {
+		PacketFrustum frustum = makePacketFrustum(packet);
+		Eigen::Vector3f forward = Eigen::Vector3f::Zero();
+		for (int i = 0; i < packet.size; ++i) forward += Eigen::Vector3f(packet.dx[i], packet.dy[i], packet.dz[i]);
+
+		int stack[BVH::stackSize];
+		int stackTop = 0;
+		stack[stackTop++] = 0;
+		uint64_t nodesVisited = 0, frustumCulls = 0, boxesMissed = 0, sphereTests = 0;
+		while (stackTop > 0) {
+			const BVHNode& node = nodes[stack[--stackTop]];
+			++nodesVisited;
+			if (frustumCullsBox(frustum, packet.origin, node.bounds)) {
+				++frustumCulls;
+				continue;
+			}
+
+			int masks[RayPacket::maxSize / RayPacket::groupSize];
+			int anyHit = 0;
+			for (int g = 0; g < packet.nGroups(); ++g) {
+				masks[g] = packetGroupHitsBox(packet, g, node.bounds);
+				anyHit |= masks[g];
+			}
+			if (!anyHit) {
+				++boxesMissed;
+				continue;
+			}
+
+			if (node.count > 0) {
+				for (int i = node.leftFirst; i < node.leftFirst + node.count; ++i)
+					for (int g = 0; g < packet.nGroups(); ++g) {
+						if (masks[g]) packetGroupIntersectSphere(packet, g, masks[g], bvh.geometry(), i, minT);
+					}
+				// Counted per group tested, as the group's lanes are tested together.
+				int groupsTested = 0;
+				for (int g = 0; g < packet.nGroups(); ++g) groupsTested += masks[g] != 0;
+				sphereTests += static_cast<uint64_t>(node.count) * groupsTested * RayPacket::groupSize;
+			}
+			else {
+				bool leftFirst = forward[node.axis] >= 0.f;
+				stack[stackTop++] = leftFirst ? node.leftFirst + 1 : node.leftFirst;
+				stack[stackTop++] = leftFirst ? node.leftFirst : node.leftFirst + 1;
+			}
+		}
+		STATS_ADD(nodesVisited, nodesVisited);
+		STATS_ADD(frustumCulls, frustumCulls);
+		STATS_ADD(boxesMissed, boxesMissed);
+		STATS_ADD(sphereTests, sphereTests);
+	}
+
+	for (int i = 0; i < packet.size; ++i) {
+		hits[i] = RayHit();
+		if (packet.hitIndex[i] < 0) continue;
+		Ray ray = packet.ray(i);
+		hits[i].t = packet.t[i];
+		hits[i].sphere = bvh.primIndices()[packet.hitIndex[i]];
+		hits[i].intersection = ray.origin + hits[i].t * ray.direction;
+	}
+}
@@ -0,0 +1,206 @@
+#pragma once
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+#include <Eigen/Dense>
+#include "BVH.hpp"
+#include "Framebuffer.hpp"
+#include "LinAlg.hpp"
+#include "Render.hpp"
+#include "Scene.hpp"
+#include "ShadeBatch.hpp"
+#include "Sphere.hpp"
+#include "Stats.hpp"
+#include "ThreadPool.hpp"
+#include "Tiles.hpp"
+#include "Tracer.hpp"
+
+// Relighting: rendering the same view of the same spheres again with different lights,
+// without tracing the camera rays again.
+//
+// Where a pixel's path goes doesn't depend on the lights: it hits a sphere, bounces off
+// any mirrors and through any glass, and ends either on a diffuse sphere or with the
+// ambient colour (a miss, or the bounce limit). Only the lighting at the end does. So
+// recordRelightBuffer traces every pixel's path once and keeps where it ends, with the
+// point and normal ready for shading, and the colour filters picked up on the way; then
+// relight only has to shade those points (and trace their shadow rays) for the lights as
+// they are now, and filter the results.
+//
+// The spheres mustn't change in between, though the lights can change in any way (call
+// Scene::buildLightTable after changing them, as before rendering). The image is exactly
+// what renderFrame would draw with the same lights and no anti-aliasing or path tracing.
+
+/// <summary>
+/// A pixel whose camera ray doesn't hit a diffuse sphere: the rest of its path.
+/// </summary>
+struct RelightPath {
+	int pixel;              // Index in the tile, x + y * width counted from its corner.
+	int sphere;             // The diffuse sphere the path ends on, or -1 if it ends with the ambient colour.
+	int depth;              // Bounces before the end.
+	Eigen::Vector3f point;  // Where it hits that sphere.
+	int firstFilter, nFilters; // The colour filters picked up on the way, in RelightTile::filters.
+};
+
+/// <summary>
+/// The recorded paths of one tile's pixels.
+/// </summary>
+struct RelightTile {
+	Tile tile;
+	// The pixels whose camera rays hit diffuse spheres, which is most of them: their hit
+	// points, normals and colours, batched for shadeDiffuseBatches. Point i of batch b is
+	// pixel batchPixels[b * DiffuseHitBatch::maxSize + i].
+	std::vector<DiffuseHitBatch> batches;
+	std::vector<int> batchPixels;
+	std::vector<RelightPath> paths; // The other pixels.
+	std::vector<Eigen::Vector3f> filters;
+};
+
+/// <summary>
+/// Everything relight needs to know about a frame's paths (see the top of this file).
+/// </summary>
+struct RelightBuffer {
+	int width = 0, height = 0;
+	const Sphere* spheres = nullptr; // The scene's spheres when recorded, to check they haven't been replaced.
+	size_t nSpheres = 0;
+	std::vector<RelightTile> tiles;
+};
+
+/// <summary>
+/// Traces the path of every pixel of the frame (one ray through each, as renderFrame
+/// traces without anti-aliasing) and records where it ends in buffer. Paths end early
+/// at settings.contributionCutoff, as in renderFrame.
+/// </summary>
+void recordRelightBuffer(const Scene& scene, const PrimaryRayGenerator& rays, const RenderSettings& settings, ThreadPool& pool, RelightBuffer& buffer)
+{
+	buffer.width = rays.width;
+	buffer.height = rays.height;
+	buffer.spheres = scene.spheres.data();
+	buffer.nSpheres = scene.spheres.size();
+	std::vector<Tile> tiles = makeTiles(rays.width, rays.height, settings.tileSize);
+	buffer.tiles.resize(tiles.size());
+	float cutoff = settings.contributionCutoff;
+
+	pool.parallelFor(static_cast<int>(tiles.size()), [&](int t) {
+		RelightTile& record = buffer.tiles[t];
+		const Tile& tile = record.tile = tiles[t];
+		record.batches.clear();
+		record.batchPixels.clear();
+		record.paths.clear();
+		record.filters.clear();
+		int tileWidth = tile.x1 - tile.x0, n = tileWidth * (tile.y1 - tile.y0);
+		for (int i = 0; i < n; ++i) {
+			Ray ray = rays.ray(tile.x0 + i % tileWidth, tile.y0 + i / tileWidth);
+			STATS_COUNT_RAY(PRIMARY_RAY, 0);
+			RayHit hit;
+			scene.bvh.closestHit(ray, scene.spheres, hit);
+			if (hit.sphere >= 0 && scene.spheres[hit.sphere].material == Material::DIFFUSE) {
+				if (record.batches.empty() || record.batches.back().full()) {
+					record.batches.emplace_back();
+					record.batches.back().clear();
+				}
+				record.batches.back().add(scene.spheres[hit.sphere], hit.intersection);
+				record.batchPixels.push_back(i);
+				continue;
+			}
+
+			// Follow the path as traceRayIterative does, keeping its filters rather than
+			// multiplying them together, so resolving them later gives the same colour.
+			PathState path(ray);
+			RelightPath end{ i, -1, 0, Eigen::Vector3f::Zero(), static_cast<int>(record.filters.size()), 0 };
+			RayType type = PRIMARY_RAY;
+			while (true) {
+				if (path.depth > maxBounces) {
+					STATS_ADD(bounceLimitHits, 1);
+					break;
+				}
+				if (path.depth > 0) {
+					STATS_COUNT_RAY(type, path.depth);
+					hit = RayHit();
+					scene.bvh.closestHit(path.ray, scene.spheres, hit);
+				}
+				if (hit.sphere < 0) {
+					STATS_ADD(raysMissed, 1);
+					break;
+				}
+				const Sphere& hitSphere = scene.spheres[hit.sphere];
+				if (hitSphere.material == Material::DIFFUSE) {
+					end.sphere = hit.sphere;
+					end.point = hit.intersection;
+					break;
+				}
+				else if (hitSphere.material == Material::MIRROR) {
+					Eigen::Vector3f normal = getSphereNormal(hitSphere, hit.intersection);
+					path.ray = Ray{ hit.intersection, reflect(path.ray.direction, normal) };
+					path.addFilter(hitSphere.colour);
+					type = REFLECTED_RAY;
+				}
+				else if (hitSphere.material == Material::REFRACTIVE) {
+					Ray nextRay;
+					if (refractiveBounce(path.ray, hitSphere, hit.intersection, nextRay)) {
+						path.addFilter(hitSphere.colour);
+						type = REFRACTED_RAY;
+					}
+					else {
+						type = REFLECTED_RAY;
+					}
+					path.ray = nextRay;
+				}
+				else {
+					throw std::runtime_error("Unknown material type!");
+				}
+				if (path.throughput.maxCoeff() < cutoff) {
+					STATS_ADD(contributionCutoffs, 1);
+					break;
+				}
+				++path.depth;
+			}
+			end.depth = path.depth;
+			end.nFilters = path.nFilters;
+			record.filters.insert(record.filters.end(), path.filters, path.filters + path.nFilters);
+			record.paths.push_back(end);
+		}
+	});
+}
+
+/// <summary>
+/// Draws the frame recorded in buffer into framebuffer (resizing it to fit), lit by the
+/// scene's lights as they are now. Only the shading and its shadow rays are done again.
+/// The batches in buffer are padded as they're shaded, which is why it isn't const.
+/// </summary>
+/// <param name="genericKernels">Shade with the kernel for any scene, not the one
+/// specialized for its features (as RenderSettings::genericKernels).</param>
+void relight(const Scene& scene, RelightBuffer& buffer, ThreadPool& pool, FloatImage& framebuffer, bool genericKernels = false)
+{
+	if (scene.lightTable.size() != scene.lights.size()) {
+		throw std::logic_error("The scene's lights have changed since its light table was built (call buildLightTable).");
+	}
+	if (scene.spheres.data() != buffer.spheres || scene.spheres.size() != buffer.nSpheres) {
+		throw std::logic_error("The scene's spheres have changed since the relighting buffer was recorded (call recordRelightBuffer).");
+	}
+	int features = genericKernels ? allSceneFeatures : scene.features;
+	ShadeKernel shade = selectShadeKernel(features);
+	framebuffer.resize(buffer.width, buffer.height);
+	int height = buffer.height;
+
+	pool.parallelFor(static_cast<int>(buffer.tiles.size()), [&](int t) {
+		RelightTile& record = buffer.tiles[t];
+		const Tile& tile = record.tile;
+		int tileWidth = tile.x1 - tile.x0;
+		auto writePixel = [&](int i, const Eigen::Vector3f& colour) {
+			framebuffer.setPixel(tile.x0 + i % tileWidth, height - (tile.y0 + i / tileWidth) - 1, colour);
+		};
+
+		thread_local std::vector<Eigen::Vector3f> colours;
+		int nBatches = static_cast<int>(record.batches.size());
+		colours.resize(nBatches * DiffuseHitBatch::maxSize);
+		shadeDiffuseBatches(record.batches.data(), nBatches, scene, colours.data(), 0, true, features);
+		for (size_t j = 0; j < record.batchPixels.size(); ++j) writePixel(record.batchPixels[j], colours[j]);
+
+		for (const RelightPath& path : record.paths) {
+			Eigen::Vector3f colour = path.sphere >= 0 ? shade(scene.spheres[path.sphere], path.point, scene, path.depth, true) : ambientColour;
+			// As PathState::resolve: the filters go on innermost first.
+			for (int f = path.nFilters - 1; f >= 0; --f) colour = coeffWiseMultiply(record.filters[path.firstFilter + f], colour);
+			writePixel(path.pixel, colour);
+		}
+	});
+}
@@ -0,0 +1,389 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+#include <Eigen/Dense>
+#include "AdaptiveSampling.hpp"
+#include "Denoise.hpp"
+#include "Framebuffer.hpp"
+#include "PathTracer.hpp"
+#include "RayPacket.hpp"
+#include "Scene.hpp"
+#include "ShadeBatch.hpp"
+#include "Stats.hpp"
+#include "ThreadPool.hpp"
+#include "Tiles.hpp"
+#include "Tracer.hpp"
+#include "Wavefront.hpp"
+
+/// <summary>
+/// Makes the primary ray through each pixel of a width x height image, for a pinhole camera.
+/// Pixel (0, 0) is the bottom left of the image.
+/// </summary>
+struct PrimaryRayGenerator {
+	Camera camera;
+	int width, height;
+	Eigen::Vector3f across;
+	float minX, xStep, minY, yStep;
+
+	PrimaryRayGenerator(const Camera& camera, int width, int height)
+		:camera(camera), width(width), height(height)
+	{
+		float vertFov = (camera.horzFov * height) / width;
+		minX = -atanf(camera.horzFov * 0.5f);
+		xStep = -2.f * minX / width;
+		minY = -atanf(vertFov * 0.5f);
+		yStep = -2.f * minY / width;
+
+		across = -camera.direction.cross(camera.up).normalized();
+	}
+
+	Ray ray(int x, int y) const
+	{
+		return rayAt(static_cast<float>(x), static_cast<float>(y));
+	}
+
+	/// <summary>
+	/// The ray through any point of the image, in pixels: ray(x, y) goes through (x, y),
+	/// and the points of pixel (x, y) run from there up to (x + 1, y + 1).
+	/// </summary>
+	Ray rayAt(float x, float y) const
+	{
+		STATS_TIME(RAY_GENERATION_STAGE);
+		Ray ray;
+		ray.origin = camera.position;
+		ray.direction = camera.direction + minX * across + minY * camera.up;
+		ray.direction += across * x * xStep;
+		ray.direction += camera.up * y * yStep;
+		ray.direction.normalize();
+		return ray;
+	}
+};
+
+/// <summary>
+/// How to render a frame. None of these change the image, only how fast it's made (apart
+/// from contributionCutoff, which can change it very slightly, adaptive, which anti-aliases
+/// it, and pathTrace, which picks a different renderer).
+/// </summary>
+struct RenderSettings {
+	int tileSize = 32;      // Width and height of the tiles handed out to the threads.
+	bool serial = false;    // Render on the calling thread with a plain per-pixel loop.
+	int packetSize = 0;     // If 4 or 8, primary rays are traced in packetSize x packetSize packets.
+	bool recursive = false; // Use the recursive traceRay instead of traceRayIterative.
+	bool wavefront = false; // Trace each tile's rays as a wavefront (traceWavefront); overrides packetSize and recursive.
+	bool genericKernels = false; // Use the kernels that handle any scene, not the ones specialized for its features.
+	float contributionCutoff = 0.f; // End paths whose throughput falls below this (see traceRayIterative); not used by recursive.
+	AdaptiveSampling adaptive;   // With minSamples > 0, anti-alias the frame (see AdaptiveSampling.hpp); overrides packetSize, recursive and wavefront.
+	PathTraceSettings pathTrace; // With samplesPerPixel > 0, path trace the frame (see PathTracer.hpp); overrides everything else.
+};
+
+/// <summary>
+/// Works out the colours of n primary rays whose closest hits are already known (e.g. a
+/// whole tile's). Rays that stop at a diffuse sphere, which is most of them, are lit
+/// together with shadeDiffuseBatches, so all their shadow rays are traced as one stream;
+/// the rest are followed with trace (a traceRayIterative, see selectTraceKernel), with the
+/// given contribution cutoff. features picks the shading kernel, as trace was picked.
+/// </summary>
+void shadePrimaryHits(const Scene& scene, const Ray* rays, const RayHit* hits, int n, Eigen::Vector3f* colours,
+	TraceKernel trace = traceRayIterative<>, float cutoff = 0.f, int features = allSceneFeatures)
+{
+	thread_local std::vector<DiffuseHitBatch> batches;
+	thread_local std::vector<int> batchIndex;
+	thread_local std::vector<Eigen::Vector3f> batchColours;
+	int nBatches = 0;
+	batchIndex.clear();
+	for (int i = 0; i < n; ++i) {
+		const RayHit& hit = hits[i];
+		if (hit.sphere >= 0 && scene.spheres[hit.sphere].material == Material::DIFFUSE) {
+			STATS_COUNT_RAY(PRIMARY_RAY, 0);
+			if (nBatches == 0 || batches[nBatches - 1].full()) {
+				if (nBatches == static_cast<int>(batches.size())) batches.emplace_back();
+				batches[nBatches++].clear();
+			}
+			batchIndex.push_back(i);
+			batches[nBatches - 1].add(scene.spheres[hit.sphere], hit.intersection);
+		}
+		else {
+			colours[i] = trace(rays[i], scene, &hit, cutoff);
+		}
+	}
+	// Every batch but the last is full, so point j is at j in batchColours.
+	batchColours.resize(nBatches * DiffuseHitBatch::maxSize);
+	shadeDiffuseBatches(batches.data(), nBatches, scene, batchColours.data(), 0, true, features);
+	for (size_t j = 0; j < batchIndex.size(); ++j) colours[batchIndex[j]] = batchColours[j];
+}
+
+/// <summary>
+/// Renders the rows y0 <= y < y1 of the image (counting up from the bottom) into framebuffer.
+/// The framebuffer's row 0 is the image's row framebufferRow0 counting down from the top, so
+/// it can hold just a band of the image. When path tracing, gbuffer (if not null, and the
+/// same size as the framebuffer) gets the denoiser's guides. Adaptive anti-aliasing plans
+/// its samples over these rows only, so rendering a frame in bands gives a different image.
+/// </summary>
+void renderRows(const Scene& scene, const PrimaryRayGenerator& rays, const RenderSettings& settings, ThreadPool& pool,
+	FloatImage& framebuffer, int framebufferRow0, int y0, int y1, GBuffer* gbuffer = nullptr)
+{
+	if (scene.lightTable.size() != scene.lights.size()) {
+		throw std::logic_error("The scene's lights have changed since its light table was built (call buildLightTable).");
+	}
+
+	// The kernels compiled for just the features this scene has.
+	int features = settings.genericKernels ? allSceneFeatures : scene.features;
+	TraceKernel trace = selectTraceKernel(features);
+	float cutoff = settings.contributionCutoff;
+
+	int height = rays.height;
+	auto writePixel = [&](int x, int y, const Eigen::Vector3f& color) {
+		framebuffer.setPixel(x, height - y - 1 - framebufferRow0, color);
+	};
+
+	// Each pixel only depends on its own ray, so pixels can be rendered in any order (and on any
+	// thread) and the image comes out exactly the same.
+	auto renderPixel = [&](int x, int y) {
+		Ray ray = rays.ray(x, y);
+		writePixel(x, y, settings.recursive ? traceRay(ray, scene) : trace(ray, scene, nullptr, cutoff));
+	};
+
+	// A whole tile at a time: the primary rays are traced one by one, then all the hits are
+	// shaded together (see shadePrimaryHits).
+	auto renderTileRows = [&](const Tile& tile) {
+		thread_local std::vector<Ray> tileRays;
+		thread_local std::vector<RayHit> hits;
+		thread_local std::vector<Eigen::Vector3f> colours;
+		int tileWidth = tile.x1 - tile.x0, n = tileWidth * (tile.y1 - tile.y0);
+		tileRays.resize(n);
+		hits.resize(n);
+		colours.resize(n);
+		for (int i = 0; i < n; ++i) {
+			tileRays[i] = rays.ray(tile.x0 + i % tileWidth, tile.y0 + i / tileWidth);
+			scene.bvh.closestHit(tileRays[i], scene.spheres, hits[i]);
+		}
+		shadePrimaryHits(scene, tileRays.data(), hits.data(), n, colours.data(), trace, cutoff, features);
+		for (int i = 0; i < n; ++i) writePixel(tile.x0 + i % tileWidth, tile.y0 + i / tileWidth, colours[i]);
+	};
+
+	// Packet mode: primary rays for each packetSize x packetSize block of the tile are
+	// intersected together, then the whole tile is shaded as above (or, with
+	// settings.recursive, one ray at a time with shadeHit).
+	auto renderTilePackets = [&](const Tile& tile) {
+		int packetSize = settings.packetSize;
+		RayPacket packet;
+		RayHit packetHits[RayPacket::maxSize];
+		thread_local std::vector<Ray> tileRays;
+		thread_local std::vector<RayHit> hits;
+		thread_local std::vector<Eigen::Vector3f> colours;
+		thread_local std::vector<int> pixels; // x + y * width of each ray's pixel.
+		tileRays.clear();
+		hits.clear();
+		pixels.clear();
+		for (int py = tile.y0; py < tile.y1; py += packetSize)
+			for (int px = tile.x0; px < tile.x1; px += packetSize) {
+				int pxEnd = std::min(px + packetSize, tile.x1), pyEnd = std::min(py + packetSize, tile.y1);
+				packet.reset(rays.camera.position);
+				for (int y = py; y < pyEnd; ++y)
+					for (int x = px; x < pxEnd; ++x) {
+						packet.add(rays.ray(x, y).direction);
+						pixels.push_back(x + y * rays.width);
+					}
+				closestHitPacket(scene.bvh, packet, packetHits);
+
+				for (int i = 0; i < packet.size; ++i) {
+					tileRays.push_back(packet.ray(i));
+					hits.push_back(packetHits[i]);
+				}
+			}
+
+		int n = static_cast<int>(tileRays.size());
+		colours.resize(n);
+		if (settings.recursive) {
+			for (int i = 0; i < n; ++i) {
+				STATS_COUNT_RAY(PRIMARY_RAY, 0); // traceRay would have counted it.
+				colours[i] = shadeHit(tileRays[i], hits[i], scene, 0);
+			}
+		}
+		else shadePrimaryHits(scene, tileRays.data(), hits.data(), n, colours.data(), trace, cutoff, features);
+		for (int i = 0; i < n; ++i) writePixel(pixels[i] % rays.width, pixels[i] / rays.width, colours[i]);
+	};
+
+	// Wavefront mode: the tile's rays are traced together, a bounce at a time, with the
+	// hits of each bounce sorted by material (see traceWavefront).
+	auto renderTileWavefront = [&](const Tile& tile) {
+		thread_local std::vector<Ray> tileRays;
+		thread_local std::vector<Eigen::Vector3f> colours;
+		int tileWidth = tile.x1 - tile.x0, n = tileWidth * (tile.y1 - tile.y0);
+		tileRays.resize(n);
+		colours.resize(n);
+		for (int i = 0; i < n; ++i) tileRays[i] = rays.ray(tile.x0 + i % tileWidth, tile.y0 + i / tileWidth);
+		traceWavefront(scene, tileRays.data(), n, colours.data(), cutoff, features);
+		for (int i = 0; i < n; ++i) writePixel(tile.x0 + i % tileWidth, tile.y0 + i / tileWidth, colours[i]);
+	};
+
+	// Path tracing: all the samples of all the tile's pixels are traced together (see
+	// tracePaths), a few samples per pixel at a time to keep the queues a reasonable size.
+	// Each pixel's samples are added up in order, so the sums don't depend on the chunks.
+	// With a G-buffer, the samples' guides are averaged into it too, and the spread of
+	// their brightness gives the variance of the pixel's mean.
+	auto renderTilePathTraced = [&](const Tile& tile) {
+		const PathTraceSettings& pathTrace = settings.pathTrace;
+		const int maxPathsPerChunk = 1 << 14;
+		thread_local std::vector<MonteCarloPath> paths;
+		thread_local std::vector<Eigen::Vector3f> radiance, sums;
+		thread_local std::vector<GuideSample> guides, guideSums;
+		thread_local std::vector<float> luminanceSums, luminanceSquareSums;
+		int tileWidth = tile.x1 - tile.x0, nPixels = tileWidth * (tile.y1 - tile.y0);
+		int samplesPerChunk = std::max(1, std::min(pathTrace.samplesPerPixel, maxPathsPerChunk / nPixels));
+		sums.assign(nPixels, Eigen::Vector3f::Zero());
+		if (gbuffer) {
+			guideSums.assign(nPixels, GuideSample());
+			luminanceSums.assign(nPixels, 0.f);
+			luminanceSquareSums.assign(nPixels, 0.f);
+		}
+		for (int s0 = 0; s0 < pathTrace.samplesPerPixel; s0 += samplesPerChunk) {
+			int nSamples = std::min(samplesPerChunk, pathTrace.samplesPerPixel - s0);
+			paths.clear();
+			radiance.assign(static_cast<size_t>(nPixels) * nSamples, Eigen::Vector3f::Zero());
+			if (gbuffer) guides.assign(static_cast<size_t>(nPixels) * nSamples, GuideSample());
+			for (int i = 0; i < nPixels; ++i) {
+				int x = tile.x0 + i % tileWidth, y = tile.y0 + i / tileWidth;
+				for (int s = 0; s < nSamples; ++s) {
+					Pcg32 rng = sampleRng(pathTrace.seed, static_cast<uint64_t>(y) * rays.width + x, s0 + s);
+					float jitterX = rng.nextFloat(), jitterY = rng.nextFloat();
+					paths.push_back({ rays.rayAt(x + jitterX, y + jitterY), Eigen::Vector3f::Ones(), rng, i * nSamples + s, PRIMARY_RAY });
+				}
+			}
+			tracePaths(scene, pathTrace, paths, radiance.data(), gbuffer ? guides.data() : nullptr, features);
+			for (int i = 0; i < nPixels; ++i)
+				for (int s = 0; s < nSamples; ++s) {
+					sums[i] += radiance[i * nSamples + s];
+				}
+			if (!gbuffer) continue;
+			for (int i = 0; i < nPixels; ++i)
+				for (int s = 0; s < nSamples; ++s) {
+					const GuideSample& guide = guides[i * nSamples + s];
+					const Eigen::Vector3f& sample = radiance[i * nSamples + s];
+					float luminance = 0.2126f * sample.x() + 0.7152f * sample.y() + 0.0722f * sample.z();
+					guideSums[i].albedo += guide.albedo;
+					guideSums[i].normal += guide.normal;
+					guideSums[i].depth += guide.depth;
+					luminanceSums[i] += luminance;
+					luminanceSquareSums[i] += luminance * luminance;
+				}
+		}
+		float n = static_cast<float>(pathTrace.samplesPerPixel);
+		for (int i = 0; i < nPixels; ++i) {
+			int x = tile.x0 + i % tileWidth, y = tile.y0 + i / tileWidth;
+			writePixel(x, y, sums[i] / n);
+			if (!gbuffer) continue;
+			// With one sample there's no spread to go on, so the pixel is taken to be all noise.
+			float mean = luminanceSums[i] / n;
+			float variance = n > 1.f ? std::max(0.f, luminanceSquareSums[i] / n - mean * mean) / (n - 1.f) : mean * mean;
+			int row = height - y - 1 - framebufferRow0;
+			size_t index = static_cast<size_t>(row) * gbuffer->width + x;
+			gbuffer->albedo.setPixel(x, row, guideSums[i].albedo / n);
+			gbuffer->normal.setPixel(x, row, guideSums[i].normal.stableNormalized());
+			gbuffer->depth[index] = guideSums[i].depth / n;
+			gbuffer->variance[index] = variance;
+		}
+	};
+
+	// Adaptive anti-aliasing: each round adds the planned number of samples (see planSamples)
+	// to each pixel of the tile, traced and shaded together like renderTileRows.
+	const Tile region{ 0, y0, rays.width, y1 };
+	std::vector<PixelSamples> samples;
+	std::vector<int> extra; // Samples to add to each pixel this round.
+	auto renderTileSamples = [&](const Tile& tile) {
+		thread_local std::vector<Ray> tileRays;
+		thread_local std::vector<RayHit> hits;
+		thread_local std::vector<Eigen::Vector3f> colours;
+		thread_local std::vector<int> owners; // Which pixel each ray is for.
+		tileRays.clear();
+		owners.clear();
+		for (int y = tile.y0; y < tile.y1; ++y)
+			for (int x = tile.x0; x < tile.x1; ++x) {
+				int i = (y - y0) * rays.width + x;
+				for (int s = 0; s < extra[i]; ++s) {
+					Eigen::Vector2f offset = samplePosition(static_cast<uint64_t>(y) * rays.width + x, samples[i].n + s);
+					tileRays.push_back(rays.rayAt(x + offset.x(), y + offset.y()));
+					owners.push_back(i);
+				}
+			}
+		int n = static_cast<int>(tileRays.size());
+		hits.resize(n);
+		colours.resize(n);
+		for (int i = 0; i < n; ++i) scene.bvh.closestHit(tileRays[i], scene.spheres, hits[i]);
+		shadePrimaryHits(scene, tileRays.data(), hits.data(), n, colours.data(), trace, cutoff, features);
+		for (int i = 0; i < n; ++i) samples[owners[i]].add(colours[i]);
+	};
+
+	// Tiles in order on this thread, or over the pool.
+	auto forEachTile = [&](const auto& renderTile) {
+		if (settings.serial) {
+			for (const Tile& tile : makeTiles(region, settings.tileSize)) renderTile(tile);
+		}
+		else renderTiles(pool, region, settings.tileSize, renderTile);
+	};
+
+	if (settings.pathTrace.samplesPerPixel > 0) {
+		forEachTile(renderTilePathTraced);
+		STATS_ADD(pixelSamples[std::min(settings.pathTrace.samplesPerPixel, statsMaxSamples)], uint64_t(rays.width) * (y1 - y0));
+		return;
+	}
+	if (settings.adaptive.minSamples > 0) {
+		const AdaptiveSampling& adaptive = settings.adaptive;
+		int nPixels = rays.width * (y1 - y0);
+		int64_t budget = std::max(static_cast<int64_t>(adaptive.budget * nPixels), static_cast<int64_t>(adaptive.minSamples) * nPixels);
+		samples.assign(nPixels, PixelSamples());
+		extra.assign(nPixels, adaptive.minSamples);
+		for (int64_t handedOut = static_cast<int64_t>(adaptive.minSamples) * nPixels; handedOut > 0;) {
+			forEachTile(renderTileSamples);
+			budget -= handedOut;
+			handedOut = planSamples(samples, rays.width, y1 - y0, adaptive, budget, extra);
+		}
+		for (int i = 0; i < nPixels; ++i) {
+			writePixel(i % rays.width, y0 + i / rays.width, samples[i].mean());
+			STATS_ADD(pixelSamples[std::min(samples[i].n, statsMaxSamples)], 1);
+		}
+		return;
+	}
+	STATS_ADD(pixelSamples[1], uint64_t(rays.width) * (y1 - y0));
+	if (settings.serial) {
+		for (int x = 0; x < rays.width; ++x)
+			for (int y = y0; y < y1; ++y) {
+				renderPixel(x, y);
+			}
+		return;
+	}
+
+	// Tiles are handed out to the pool's worker threads, which write their pixels
+	// straight into the framebuffer (tiles never overlap, so no locking is needed).
+	renderTiles(pool, region, settings.tileSize, [&](const Tile& tile) {
+		if (settings.wavefront) {
+			renderTileWavefront(tile);
+			return;
+		}
+		if (settings.packetSize > 0) {
+			renderTilePackets(tile);
+			return;
+		}
+		if (!settings.recursive) {
+			renderTileRows(tile);
+			return;
+		}
+		for (int y = tile.y0; y < tile.y1; ++y)
+			for (int x = tile.x0; x < tile.x1; ++x) {
+				renderPixel(x, y);
+			}
+	});
+}
+
+/// <summary>
+/// Renders the whole image into framebuffer (resizing it, and gbuffer if there is one, to fit).
+/// </summary>
+void renderFrame(const Scene& scene, const PrimaryRayGenerator& rays, const RenderSettings& settings, ThreadPool& pool, FloatImage& framebuffer,
+	GBuffer* gbuffer = nullptr)
+{
+	framebuffer.resize(rays.width, rays.height);
+	if (gbuffer) gbuffer->resize(rays.width, rays.height);
+	renderRows(scene, rays, settings, pool, framebuffer, 0, 0, rays.height, gbuffer);
+}
@@ -0,0 +1,131 @@
+#pragma once
+#include <memory>
+#include <vector>
+#include <Eigen/Dense>
+#include "BVH.hpp"
+#include "Light.hpp"
+#include "LightTable.hpp"
+#include "LightTree.hpp"
+#include "ShadowGrid.hpp"
+#include "Sphere.hpp"
+
+struct Camera {
+	Eigen::Vector3f position, direction, up;
+	float horzFov;
+};
+
+/// <summary>
+/// Things a scene may or may not have, as bit flags. The tracing kernels are instantiated
+/// for each combination (see selectTraceKernel), and a scene is traced with the one for
+/// exactly the features it has, so the code for everything else is compiled out.
+/// </summary>
+enum SceneFeature {
+	MIRROR_SPHERES = 1,     // Any MIRROR spheres.
+	REFRACTIVE_SPHERES = 2, // Any REFRACTIVE spheres.
+	LOCAL_LIGHTS = 4,       // Any point or spot lights (otherwise just ambient and directional).
+	allSceneFeatures = 7
+};
+
+/// <summary>
+/// Everything the tracer needs to know about the world: the spheres, the lights, and the
+/// BVH built over the spheres. Passed around by reference so the tracing functions don't
+/// need a separate argument for each container.
+/// </summary>
+struct Scene {
+	std::vector<Sphere> spheres;
+	std::vector<std::unique_ptr<Light>> lights;
+	BVH bvh;
+	LightTable lightTable; // The lights, packed for shading.
+	LightTree lightTree;   // The point and spot lights, for shading with light cuts.
+	LightCutSettings lightCuts;
+	std::vector<DirectionalShadowGrid> shadowGrids; // One per light in lightTable; only the directional lights' are built.
+	int features = allSceneFeatures; // SceneFeature flags, as of the last buildBVH / buildLightTable.
+
+	/// <summary>
+	/// True if the point and spot lights are to be looked up in lightTree rather than
+	/// shaded one by one.
+	/// </summary>
+	bool useLightCuts() const
+	{
+		return lightCuts.maxError > 0.f && !lightTree.empty();
+	}
+
+	/// <summary>
+	/// Rebuilds the BVH (and updates the shadow grids). Call this after changing the spheres.
+	/// </summary>
+	void buildBVH(ThreadPool* pool = nullptr)
+	{
+		bvh.build(spheres, pool);
+		updateShadowGrids();
+		updateFeatures();
+	}
+
+	/// <summary>
+	/// Brings the BVH (and the shadow grids) up to date after spheres have moved or changed
+	/// size, but not been added, removed or reordered. Refitting the tree is much quicker
+	/// than rebuilding it, so it's only rebuilt if refitting has left its SAH cost more than
+	/// maxCostGrowth times what it was when it was built.
+	/// </summary>
+	/// <returns>True if the BVH was rebuilt.</returns>
+	bool refitBVH(float maxCostGrowth, ThreadPool* pool = nullptr)
+	{
+		bool rebuild = bvh.primIndices().size() != spheres.size();
+		if (!rebuild) {
+			bvh.refit(spheres);
+			rebuild = bvh.sahCost() > maxCostGrowth * bvh.builtCost();
+		}
+		if (rebuild) bvh.build(spheres, pool);
+		updateShadowGrids();
+		updateFeatures();
+		return rebuild;
+	}
+
+	/// <summary>
+	/// Repacks the lights into lightTable and lightTree (and updates the shadow grids). Call
+	/// this after changing the lights.
+	/// </summary>
+	void buildLightTable()
+	{
+		lightTable.build(lights);
+		lightTree.build(lightTable);
+		updateShadowGrids();
+		updateFeatures();
+	}
+
+	/// <summary>
+	/// Works out which SceneFeatures the spheres and lights use.
+	/// </summary>
+	void updateFeatures()
+	{
+		features = 0;
+		for (const Sphere& sphere : spheres) {
+			if (sphere.material == Material::MIRROR) features |= MIRROR_SPHERES;
+			else if (sphere.material == Material::REFRACTIVE) features |= REFRACTIVE_SPHERES;
+		}
+		for (const PackedLight& light : lightTable.lights) {
+			if (light.type == Light::POINT || light.type == Light::SPOT) features |= LOCAL_LIGHTS;
+		}
+	}
+
+	/// <summary>
+	/// Brings each directional light's DirectionalShadowGrid up to date with the spheres and
+	/// the light's direction. Only the spheres that have changed are redone, so this is cheap
+	/// when not much has moved.
+	/// </summary>
+	void updateShadowGrids()
+	{
+		shadowGrids.resize(lightTable.size());
+		for (size_t i = 0; i < lightTable.size(); ++i) {
+			if (lightTable.lights[i].type == Light::DIRECTIONAL) shadowGrids[i].update(spheres, lightTable.lights[i].direction);
+			else shadowGrids[i].clear();
+		}
+	}
+
+	/// <summary>
+	/// The shadow grid for light i of lightTable, or null if it doesn't have one.
+	/// </summary>
+	const DirectionalShadowGrid* shadowGrid(size_t i) const
+	{
+		return i < shadowGrids.size() && !shadowGrids[i].empty() ? &shadowGrids[i] : nullptr;
+	}
+};
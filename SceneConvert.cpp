@@ -0,0 +1,47 @@
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include "SceneFile.hpp"
+
+// Converts scene files between the text format (for writing by hand) and the binary one
+// (for loading quickly). See SceneFile.hpp for both.
+
+void printUsage()
+{
+	std::cout << "Usage: SceneConvert [options] INPUT OUTPUT\n"
+		<< "Reads a scene file (text or binary) and writes it as a binary scene file.\n"
+		<< "  --text          Write it as text instead\n";
+}
+
+int main(int argc, char** argv)
+{
+	bool text = false;
+	std::string inputFilename, outputFilename;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--text") text = true;
+		else if (!arg.empty() && arg[0] != '-' && inputFilename.empty()) inputFilename = arg;
+		else if (!arg.empty() && arg[0] != '-' && outputFilename.empty()) outputFilename = arg;
+		else {
+			printUsage();
+			return 1;
+		}
+	}
+	if (outputFilename.empty()) {
+		printUsage();
+		return 1;
+	}
+
+	SceneDescription scene;
+	try {
+		readSceneFile(inputFilename, scene);
+		if (text) saveSceneText(outputFilename, scene);
+		else saveSceneBinary(outputFilename, scene);
+	}
+	catch (const std::runtime_error& error) {
+		std::cout << error.what() << std::endl;
+		return 1;
+	}
+	std::cout << "Wrote " << scene.spheres.size() << " spheres and " << scene.lights.size() << " lights to " << outputFilename << std::endl;
+	return 0;
+}
@@ -0,0 +1,514 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <Eigen/Dense>
+#include "Light.hpp"
+#include "Scene.hpp"
+#include "Sphere.hpp"
+
+// Loading and saving scenes, so they don't have to be compiled in.
+//
+// There are two formats. The binary one is for big scenes: a header, then the spheres
+// exactly as they are in memory (Sphere records), then the lights (SceneLight records).
+// Loading one maps the file into memory, checks the header, and points at the arrays in
+// it (see SceneFile); putting the spheres in a Scene is then a single copy, with nothing
+// to parse. Since the records are this program's own structs, a file only loads into a
+// build with the same layout (the header records the sizes and byte order, and is
+// checked).
+//
+// The text one is for writing scenes by hand, and is converted to binary with
+// SceneConvert. One thing per line, numbers separated by spaces, # to the end of a line
+// is a comment, angles in degrees:
+//
+//   camera px py pz  dx dy dz  ux uy uz  fov       position, direction, up, horizontal fov
+//   ambient r g b
+//   directional r g b  dx dy dz                    dx dy dz: the way the light travels
+//   point r g b  x y z
+//   spot r g b  x y z  dx dy dz  angle             angle: from the middle of the cone to its edge
+//   sphere x y z  radius  material  r g b  [ior]   material: diffuse, mirror or refractive
+
+/// <summary>
+/// A whole file mapped read-only into memory, for as long as this object lives.
+/// </summary>
+class MappedFile {
+private:
+	const uint8_t* _data = nullptr;
+	size_t _size = 0;
+#ifdef _WIN32
+	HANDLE _file = INVALID_HANDLE_VALUE, _mapping = nullptr;
+#endif
+
+	void close()
+	{
+#ifdef _WIN32
+		if (_data) UnmapViewOfFile(_data);
+		if (_mapping) CloseHandle(_mapping);
+		if (_file != INVALID_HANDLE_VALUE) CloseHandle(_file);
+		_file = INVALID_HANDLE_VALUE;
+		_mapping = nullptr;
+#else
+		if (_data) munmap(const_cast<uint8_t*>(_data), _size);
+#endif
+		_data = nullptr;
+		_size = 0;
+	}
+
+public:
+	MappedFile() = default;
+
+	/// <summary>
+	/// Maps filename. Throws std::runtime_error if it can't be opened or is empty.
+	/// </summary>
+	explicit MappedFile(const std::string& filename)
+	{
+#ifdef _WIN32
+		_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (_file == INVALID_HANDLE_VALUE) throw std::runtime_error("Couldn't open " + filename);
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(_file, &size) || size.QuadPart == 0) {
+			close();
+			throw std::runtime_error(filename + " is empty.");
+		}
+		_mapping = CreateFileMappingA(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		_data = _mapping ? static_cast<const uint8_t*>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+		if (!_data) {
+			close();
+			throw std::runtime_error("Couldn't map " + filename + " into memory.");
+		}
+		_size = static_cast<size_t>(size.QuadPart);
+#else
+		int fd = open(filename.c_str(), O_RDONLY);
+		if (fd < 0) throw std::runtime_error("Couldn't open " + filename);
+		struct stat info;
+		if (fstat(fd, &info) != 0 || info.st_size == 0) {
+			::close(fd);
+			throw std::runtime_error(filename + " is empty.");
+		}
+		void* data = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd); // The mapping keeps the file open.
+		if (data == MAP_FAILED) throw std::runtime_error("Couldn't map " + filename + " into memory.");
+		_data = static_cast<const uint8_t*>(data);
+		_size = static_cast<size_t>(info.st_size);
+#endif
+	}
+
+	MappedFile(MappedFile&& other) noexcept
+	{
+		*this = std::move(other);
+	}
+
+	MappedFile& operator=(MappedFile&& other) noexcept
+	{
+		if (this != &other) {
+			close();
+			std::swap(_data, other._data);
+			std::swap(_size, other._size);
+#ifdef _WIN32
+			std::swap(_file, other._file);
+			std::swap(_mapping, other._mapping);
+#endif
+		}
+		return *this;
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile()
+	{
+		close();
+	}
+
+	const uint8_t* data() const
+	{
+		return _data;
+	}
+
+	size_t size() const
+	{
+		return _size;
+	}
+};
+
+const char sceneFileMagic[8] = { 'S', 'P', 'H', 'S', 'C', 'E', 'N', 'E' };
+const uint32_t sceneFileVersion = 1;
+const uint32_t sceneFileByteOrder = 0x01020304; // Reads back differently on a machine of the other endianness.
+const size_t sceneFileAlignment = 64;            // Of each array in the file.
+
+/// <summary>
+/// A light as a scene file gives it: what its constructor takes. (The Light classes only
+/// keep their directions normalized, and normalizing again can change them by a bit, so
+/// the file keeps what it was given.)
+/// </summary>
+struct SceneLight {
+	Light::Type type;
+	Eigen::Vector3f intensity;
+	Eigen::Vector3f location;  // Point and spot lights.
+	Eigen::Vector3f direction; // Directional and spot lights.
+	float angle;               // Spot lights: from the middle of the cone to its edge, in radians.
+
+	/// <summary>
+	/// Makes the light.
+	/// </summary>
+	std::unique_ptr<Light> makeLight() const
+	{
+		switch (type) {
+		case Light::AMBIENT: return std::unique_ptr<Light>(new AmbientLight(intensity));
+		case Light::DIRECTIONAL: return std::unique_ptr<Light>(new DirectionalLight(intensity, direction));
+		case Light::POINT: return std::unique_ptr<Light>(new PointLight(intensity, location));
+		case Light::SPOT: return std::unique_ptr<Light>(new SpotLight(intensity, location, direction, angle));
+		}
+		throw std::runtime_error("Unknown light type!");
+	}
+};
+
+/// <summary>
+/// Everything in a scene file.
+/// </summary>
+struct SceneDescription {
+	Camera camera{ Eigen::Vector3f(0.f, 0.f, 0.f), Eigen::Vector3f(0.f, 0.f, 1.f), Eigen::Vector3f(0.f, 1.f, 0.f), 1.57079633f }; // SphereTracer's.
+	std::vector<Sphere> spheres;
+	std::vector<SceneLight> lights;
+};
+
+/// <summary>
+/// The start of a binary scene file. The arrays are at the given offsets from the start
+/// of the file.
+/// </summary>
+struct SceneFileHeader {
+	char magic[8];
+	uint32_t version, byteOrder;
+	uint32_t headerSize, sphereSize, lightSize; // sizeof each record in the program that wrote the file.
+	uint32_t reserved;
+	uint64_t nSpheres, spheresOffset;
+	uint64_t nLights, lightsOffset;
+	Camera camera;
+};
+
+/// <summary>
+/// A binary scene file, mapped into memory, with its arrays found. Nothing is copied, so
+/// the arrays are only valid while this lives.
+/// </summary>
+class SceneFile {
+private:
+	MappedFile _file;
+	const SceneFileHeader* _header = nullptr;
+	const Sphere* _spheres = nullptr;
+	const SceneLight* _lights = nullptr;
+
+public:
+	/// <summary>
+	/// Maps filename and checks its header. Throws std::runtime_error if it isn't a scene
+	/// file this build can read.
+	/// </summary>
+	explicit SceneFile(const std::string& filename)
+		:_file(filename)
+	{
+		if (_file.size() < sizeof(sceneFileMagic) || memcmp(_file.data(), sceneFileMagic, sizeof(sceneFileMagic)) != 0) {
+			throw std::runtime_error(filename + " isn't a binary scene file.");
+		}
+		if (_file.size() < sizeof(SceneFileHeader)) throw std::runtime_error(filename + " is truncated or corrupt.");
+		_header = reinterpret_cast<const SceneFileHeader*>(_file.data());
+		if (_header->version != sceneFileVersion) {
+			throw std::runtime_error(filename + " is scene file version " + std::to_string(_header->version)
+				+ "; this build reads version " + std::to_string(sceneFileVersion) + ".");
+		}
+		if (_header->byteOrder != sceneFileByteOrder || _header->headerSize != sizeof(SceneFileHeader)
+			|| _header->sphereSize != sizeof(Sphere) || _header->lightSize != sizeof(SceneLight)) {
+			throw std::runtime_error(filename + " was written by a build with a different memory layout (convert it again from text).");
+		}
+		auto arrayFits = [&](uint64_t offset, uint64_t count, uint64_t recordSize) {
+			return offset % sceneFileAlignment == 0 && offset <= _file.size() && count <= (_file.size() - offset) / recordSize;
+		};
+		if (!arrayFits(_header->spheresOffset, _header->nSpheres, sizeof(Sphere)) || !arrayFits(_header->lightsOffset, _header->nLights, sizeof(SceneLight))) {
+			throw std::runtime_error(filename + " is truncated or corrupt.");
+		}
+		_spheres = reinterpret_cast<const Sphere*>(_file.data() + _header->spheresOffset);
+		_lights = reinterpret_cast<const SceneLight*>(_file.data() + _header->lightsOffset);
+	}
+
+	const Camera& camera() const
+	{
+		return _header->camera;
+	}
+
+	size_t sphereCount() const
+	{
+		return static_cast<size_t>(_header->nSpheres);
+	}
+
+	const Sphere* spheres() const
+	{
+		return _spheres;
+	}
+
+	size_t lightCount() const
+	{
+		return static_cast<size_t>(_header->nLights);
+	}
+
+	const SceneLight* lights() const
+	{
+		return _lights;
+	}
+};
+
+/// <summary>
+/// True if a sphere can be rendered: a material the tracer knows, and a finite radius
+/// greater than zero. The binary format's records are taken as they are, so they're
+/// checked with this before use.
+/// </summary>
+bool validSphere(const Sphere& sphere)
+{
+	bool knownMaterial = sphere.material == Material::DIFFUSE || sphere.material == Material::MIRROR || sphere.material == Material::REFRACTIVE;
+	return knownMaterial && std::isfinite(sphere.radius) && sphere.radius > 0.f;
+}
+
+/// <summary>
+/// True if filename starts like a binary scene file (otherwise it's taken to be text).
+/// </summary>
+bool isBinarySceneFile(const std::string& filename)
+{
+	std::ifstream file(filename, std::ios::binary);
+	char magic[sizeof(sceneFileMagic)] = {};
+	file.read(magic, sizeof(magic));
+	return file && memcmp(magic, sceneFileMagic, sizeof(magic)) == 0;
+}
+
+/// <summary>
+/// Reads a text scene (see the top of this file). The camera is left as it is if there's
+/// no camera line. Throws std::runtime_error, with the line number, if a line doesn't
+/// make sense.
+/// </summary>
+void readSceneText(std::istream& in, SceneDescription& scene)
+{
+	const float degrees = 3.14159265358979f / 180.f;
+	scene.spheres.clear();
+	scene.lights.clear();
+	std::string line;
+	for (int lineNumber = 1; std::getline(in, line); ++lineNumber) {
+		size_t comment = line.find('#');
+		if (comment != std::string::npos) line.erase(comment);
+		std::istringstream fields(line);
+		std::string keyword;
+		if (!(fields >> keyword)) continue;
+
+		auto fail = [&](const std::string& problem) {
+			return std::runtime_error("Scene line " + std::to_string(lineNumber) + ": " + problem);
+		};
+		auto readFloat = [&]() {
+			float value;
+			if (!(fields >> value)) throw fail("expected a number after \"" + keyword + "\".");
+			return value;
+		};
+		auto readVector = [&]() {
+			float x = readFloat(), y = readFloat();
+			return Eigen::Vector3f(x, y, readFloat());
+		};
+
+		if (keyword == "camera") {
+			scene.camera.position = readVector();
+			scene.camera.direction = readVector();
+			scene.camera.up = readVector();
+			scene.camera.horzFov = readFloat() * degrees;
+		}
+		else if (keyword == "ambient" || keyword == "directional" || keyword == "point" || keyword == "spot") {
+			SceneLight light{ Light::AMBIENT, Eigen::Vector3f::Zero(), Eigen::Vector3f::Zero(), Eigen::Vector3f::Zero(), 0.f };
+			light.intensity = readVector();
+			if (keyword == "directional") {
+				light.type = Light::DIRECTIONAL;
+				light.direction = readVector();
+			}
+			else if (keyword == "point") {
+				light.type = Light::POINT;
+				light.location = readVector();
+			}
+			else if (keyword == "spot") {
+				light.type = Light::SPOT;
+				light.location = readVector();
+				light.direction = readVector();
+				light.angle = readFloat() * degrees;
+			}
+			scene.lights.push_back(light);
+		}
+		else if (keyword == "sphere") {
+			Sphere sphere;
+			sphere.centre = readVector();
+			sphere.radius = readFloat();
+			if (!(std::isfinite(sphere.radius) && sphere.radius > 0.f)) throw fail("the radius must be greater than zero.");
+			std::string material;
+			fields >> material;
+			if (material == "diffuse") sphere.material = Material::DIFFUSE;
+			else if (material == "mirror") sphere.material = Material::MIRROR;
+			else if (material == "refractive") sphere.material = Material::REFRACTIVE;
+			else throw fail("unknown material \"" + material + "\" (diffuse, mirror or refractive).");
+			sphere.colour = readVector();
+			if (!(fields >> sphere.ior)) {
+				if (!fields.eof()) throw fail("expected an index of refraction.");
+				sphere.ior = 1.f;
+			}
+			scene.spheres.push_back(sphere);
+		}
+		else {
+			throw fail("unknown keyword \"" + keyword + "\".");
+		}
+		std::string extra;
+		if (fields >> extra) throw fail("unexpected \"" + extra + "\" at the end of the line.");
+	}
+}
+
+/// <summary>
+/// Writes a scene as text (see the top of this file), with enough digits that reading it
+/// back gives the same numbers.
+/// </summary>
+void writeSceneText(std::ostream& out, const SceneDescription& scene)
+{
+	const float degrees = 3.14159265358979f / 180.f;
+	const char* materialNames[] = { "diffuse", "mirror", "refractive" };
+	auto vector = [](const Eigen::Vector3f& v) {
+		std::ostringstream text;
+		text << std::setprecision(9) << v.x() << " " << v.y() << " " << v.z();
+		return text.str();
+	};
+	const Camera& camera = scene.camera;
+	out << std::setprecision(9);
+	out << "camera " << vector(camera.position) << "  " << vector(camera.direction) << "  " << vector(camera.up) << "  " << camera.horzFov / degrees << "\n";
+	for (const SceneLight& light : scene.lights) {
+		switch (light.type) {
+		case Light::AMBIENT: out << "ambient " << vector(light.intensity) << "\n"; break;
+		case Light::DIRECTIONAL: out << "directional " << vector(light.intensity) << "  " << vector(light.direction) << "\n"; break;
+		case Light::POINT: out << "point " << vector(light.intensity) << "  " << vector(light.location) << "\n"; break;
+		case Light::SPOT:
+			out << "spot " << vector(light.intensity) << "  " << vector(light.location) << "  " << vector(light.direction)
+				<< "  " << light.angle / degrees << "\n";
+			break;
+		}
+	}
+	for (const Sphere& sphere : scene.spheres) {
+		if (!validSphere(sphere)) throw std::runtime_error("Can't write a sphere with an unknown material or a bad radius.");
+		out << "sphere " << vector(sphere.centre) << "  " << sphere.radius << "  " << materialNames[sphere.material] << "  " << vector(sphere.colour);
+		if (sphere.material == Material::REFRACTIVE) out << "  " << sphere.ior;
+		out << "\n";
+	}
+}
+
+/// <summary>
+/// Writes a scene to filename as a binary scene file. Throws std::runtime_error if it
+/// can't be written.
+/// </summary>
+void saveSceneBinary(const std::string& filename, const SceneDescription& scene)
+{
+	auto aligned = [](uint64_t offset) {
+		return (offset + sceneFileAlignment - 1) / sceneFileAlignment * sceneFileAlignment;
+	};
+	SceneFileHeader header{};
+	memcpy(header.magic, sceneFileMagic, sizeof(sceneFileMagic));
+	header.version = sceneFileVersion;
+	header.byteOrder = sceneFileByteOrder;
+	header.headerSize = sizeof(SceneFileHeader);
+	header.sphereSize = sizeof(Sphere);
+	header.lightSize = sizeof(SceneLight);
+	header.nSpheres = scene.spheres.size();
+	header.spheresOffset = aligned(sizeof(SceneFileHeader));
+	header.nLights = scene.lights.size();
+	header.lightsOffset = aligned(header.spheresOffset + header.nSpheres * sizeof(Sphere));
+	header.camera = scene.camera;
+
+	std::ofstream file(filename, std::ios::binary);
+	const char padding[sceneFileAlignment] = {};
+	uint64_t written = 0;
+	auto write = [&](const void* data, uint64_t size) {
+		file.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+		written += size;
+	};
+	write(&header, sizeof(header));
+	write(padding, header.spheresOffset - written);
+	write(scene.spheres.data(), header.nSpheres * sizeof(Sphere));
+	write(padding, header.lightsOffset - written);
+	write(scene.lights.data(), header.nLights * sizeof(SceneLight));
+	if (!file) throw std::runtime_error("Couldn't write " + filename);
+}
+
+/// <summary>
+/// Writes a scene to filename as text. Throws std::runtime_error if it can't be written.
+/// </summary>
+void saveSceneText(const std::string& filename, const SceneDescription& scene)
+{
+	std::ofstream file(filename);
+	writeSceneText(file, scene);
+	if (!file) throw std::runtime_error("Couldn't write " + filename);
+}
+
+/// <summary>
+/// Reads a scene file, binary or text. Throws std::runtime_error if it can't be read, or
+/// if a binary file has a sphere that isn't validSphere.
+/// </summary>
+void readSceneFile(const std::string& filename, SceneDescription& scene)
+{
+	if (isBinarySceneFile(filename)) {
+		SceneFile file(filename);
+		for (size_t i = 0; i < file.sphereCount(); ++i) {
+			if (!validSphere(file.spheres()[i])) throw std::runtime_error(filename + " is truncated or corrupt.");
+		}
+		scene.camera = file.camera();
+		scene.spheres.assign(file.spheres(), file.spheres() + file.sphereCount());
+		scene.lights.assign(file.lights(), file.lights() + file.lightCount());
+	}
+	else {
+		std::ifstream file(filename);
+		if (!file) throw std::runtime_error("Couldn't open " + filename);
+		readSceneText(file, scene);
+	}
+}
+
+/// <summary>
+/// Loads a scene file (binary or text) into scene's spheres and lights, and camera (left
+/// as it is if a text scene has no camera line). The caller builds the BVH and light table,
+/// as after changing them by hand. Throws std::runtime_error if the file can't be read.
+/// </summary>
+void loadScene(const std::string& filename, Scene& scene, Camera& camera)
+{
+	SceneDescription description;
+	description.camera = camera;
+	readSceneFile(filename, description);
+	camera = description.camera;
+	scene.spheres = std::move(description.spheres);
+	scene.lights.clear();
+	for (const SceneLight& light : description.lights) scene.lights.push_back(light.makeLight());
+}
+
+/// <summary>
+/// Replaces scene's lights with the ones in a scene file (binary or text), ignoring its
+/// spheres and camera, e.g. to relight a scene. The caller rebuilds the light table.
+/// Throws std::runtime_error if the file can't be read.
+/// </summary>
+void loadSceneLights(const std::string& filename, Scene& scene)
+{
+	SceneDescription description;
+	readSceneFile(filename, description);
+	scene.lights.clear();
+	for (const SceneLight& light : description.lights) scene.lights.push_back(light.makeLight());
+}
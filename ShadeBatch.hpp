@@ -0,0 +1,278 @@
+#pragma once
+#include <algorithm>
+#include <cfloat>
+#include <vector>
+#include <Eigen/Dense>
+#include "LightTable.hpp"
+#include "Scene.hpp"
+#include "Simd.hpp"
+#include "Sphere.hpp"
+#include "ShadowStream.hpp"
+#include "Stats.hpp"
+#include "Tracer.hpp"
+
+/// <summary>
+/// Points on diffuse spheres, collected so shadeDiffuseBatch can light them together.
+/// Stored as structure-of-arrays so 8 points fit in each AVX2 register.
+/// </summary>
+struct DiffuseHitBatch {
+	static constexpr int maxSize = 64;
+
+	int size = 0;
+	alignas(32) float px[maxSize], py[maxSize], pz[maxSize]; // Hit point
+	alignas(32) float nx[maxSize], ny[maxSize], nz[maxSize]; // Surface normal
+	alignas(32) float r[maxSize], g[maxSize], b[maxSize];    // Sphere colour
+	const Sphere* spheres[maxSize];
+	Eigen::Vector3f points[maxSize];                          // Hit point again, for the scalar code
+
+	void clear()
+	{
+		size = 0;
+	}
+
+	bool full() const
+	{
+		return size == maxSize;
+	}
+
+	void add(const Sphere& sphere, const Eigen::Vector3f& point)
+	{
+		Eigen::Vector3f normal = getSphereNormal(sphere, point);
+		px[size] = point.x(); py[size] = point.y(); pz[size] = point.z();
+		nx[size] = normal.x(); ny[size] = normal.y(); nz[size] = normal.z();
+		r[size] = sphere.colour.x(); g[size] = sphere.colour.y(); b[size] = sphere.colour.z();
+		spheres[size] = &sphere;
+		points[size] = point;
+		++size;
+	}
+
+	const Eigen::Vector3f& point(int i) const
+	{
+		return points[i];
+	}
+};
+
+/// <summary>
+/// Light that reaches one point of a batch from one light, unless its shadow ray is blocked.
+/// </summary>
+struct LightSample {
+	int point;     // Index of the colour it adds to.
+	int shadowRay; // Index into the shadow ray stream, or -1 if nothing blocks it (ambient lights, or already tested).
+	float r, g, b;
+};
+
+/// <summary>
+/// Working space for shadeDiffuseBatches: every light sample of the points being shaded, and
+/// the shadow rays they are waiting on.
+/// </summary>
+struct DiffuseShadingStream {
+	// The stream is traced and emptied when it reaches this many rays (so scenes with lots of
+	// lights don't need lots of memory).
+	static constexpr int maxShadowRays = 1 << 16;
+
+	ShadowRayStream shadowRays;
+	std::vector<LightSample> samples;
+};
+
+/// <summary>
+/// Traces the stream's shadow rays, then adds the light of each unblocked sample to its
+/// point's colour, and empties the stream. The samples are added in the order they were
+/// queued, which for each point is the order of the lights.
+/// </summary>
+void flushLightSamples(const Scene& scene, DiffuseShadingStream& stream, Eigen::Vector3f* colours)
+{
+	traceShadowRays(scene.bvh, scene.spheres, stream.shadowRays);
+	for (const LightSample& sample : stream.samples) {
+		if (sample.shadowRay >= 0 && stream.shadowRays.occluded[sample.shadowRay]) {
+			STATS_ADD(shadowsOccluded, 1);
+			continue;
+		}
+		Eigen::Vector3f& colour = colours[sample.point];
+		colour = Eigen::Vector3f(colour.x() + sample.r, colour.y() + sample.g, colour.z() + sample.b);
+	}
+	stream.shadowRays.clear();
+	stream.samples.clear();
+}
+
+#if SIMD_HAVE_AVX2
+
+/// <summary>
+/// First pass of shadeDiffuseBatches for one batch, 8 points at a time against every light
+/// in the table: works out the light each would get if unshadowed, exactly as shadeDiffuse
+/// does, and queues it with its shadow ray. Samples that would add nothing (the light is
+/// behind the surface, or the point is outside a spot light's cone) are dropped without a
+/// shadow ray.
+/// </summary>
+/// <param name="firstPoint">Index of the batch's first point in the colours array.</param>
+/// <param name="ambient">False to leave out the ambient lights (see shadeDiffuse).</param>
+SIMD_TARGET_AVX2 void queueLightSamplesAVX2(DiffuseHitBatch& batch, int firstPoint, const Scene& scene, DiffuseShadingStream& stream, Eigen::Vector3f* colours, int depth,
+	bool ambient)
+{
+	// Pad the last group with copies of the first point, so every lane holds real numbers.
+	for (int i = batch.size; i < ((batch.size + 7) & ~7); ++i) {
+		batch.px[i] = batch.px[0]; batch.py[i] = batch.py[0]; batch.pz[i] = batch.pz[0];
+		batch.nx[i] = batch.nx[0]; batch.ny[i] = batch.ny[0]; batch.nz[i] = batch.nz[0];
+		batch.r[i] = batch.r[0]; batch.g[i] = batch.g[0]; batch.b[i] = batch.b[0];
+	}
+
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 signBit = _mm256_set1_ps(-0.f);
+
+	for (int first = 0; first < batch.size; first += 8) {
+		int nLanes = std::min(8, batch.size - first);
+		__m256 px = _mm256_load_ps(batch.px + first), py = _mm256_load_ps(batch.py + first), pz = _mm256_load_ps(batch.pz + first);
+		__m256 nx = _mm256_load_ps(batch.nx + first), ny = _mm256_load_ps(batch.ny + first), nz = _mm256_load_ps(batch.nz + first);
+		__m256 albedoR = _mm256_load_ps(batch.r + first), albedoG = _mm256_load_ps(batch.g + first), albedoB = _mm256_load_ps(batch.b + first);
+		alignas(32) float laneR[8], laneG[8], laneB[8];
+
+		for (size_t lightIndex = 0; lightIndex < scene.lightTable.size(); ++lightIndex) {
+			const PackedLight& light = scene.lightTable.lights[lightIndex];
+			__m256 intensityR = _mm256_set1_ps(light.intensity.x());
+			__m256 intensityG = _mm256_set1_ps(light.intensity.y());
+			__m256 intensityB = _mm256_set1_ps(light.intensity.z());
+			if (light.type == Light::AMBIENT) {
+				if (!ambient) continue;
+				_mm256_store_ps(laneR, _mm256_mul_ps(albedoR, intensityR));
+				_mm256_store_ps(laneG, _mm256_mul_ps(albedoG, intensityG));
+				_mm256_store_ps(laneB, _mm256_mul_ps(albedoB, intensityB));
+				for (int lane = 0; lane < nLanes; ++lane) {
+					stream.samples.push_back({ firstPoint + first + lane, -1, laneR[lane], laneG[lane], laneB[lane] });
+				}
+				continue;
+			}
+
+			// Direction the light arrives from, and how far away it is.
+			__m256 dirX, dirY, dirZ, distance;
+			if (light.type == Light::DIRECTIONAL) {
+				dirX = _mm256_set1_ps(light.direction.x());
+				dirY = _mm256_set1_ps(light.direction.y());
+				dirZ = _mm256_set1_ps(light.direction.z());
+				distance = _mm256_set1_ps(FLT_MAX);
+			}
+			else {
+				__m256 tx = _mm256_sub_ps(px, _mm256_set1_ps(light.location.x()));
+				__m256 ty = _mm256_sub_ps(py, _mm256_set1_ps(light.location.y()));
+				__m256 tz = _mm256_sub_ps(pz, _mm256_set1_ps(light.location.z()));
+				__m256 squaredNorm = _mm256_add_ps(_mm256_mul_ps(tx, tx), _mm256_add_ps(_mm256_mul_ps(ty, ty), _mm256_mul_ps(tz, tz)));
+				distance = _mm256_sqrt_ps(squaredNorm);
+				// Like Eigen's normalized(), a zero vector is left as it is.
+				__m256 nonZero = _mm256_cmp_ps(squaredNorm, zero, _CMP_GT_OQ);
+				dirX = _mm256_blendv_ps(tx, _mm256_div_ps(tx, distance), nonZero);
+				dirY = _mm256_blendv_ps(ty, _mm256_div_ps(ty, distance), nonZero);
+				dirZ = _mm256_blendv_ps(tz, _mm256_div_ps(tz, distance), nonZero);
+			}
+
+			// dotProd = max(-lightDir.dot(normal), 0), with std::max's handling of NaNs.
+			__m256 dotProd = _mm256_xor_ps(signBit, _mm256_add_ps(_mm256_mul_ps(dirX, nx),
+				_mm256_add_ps(_mm256_mul_ps(dirY, ny), _mm256_mul_ps(dirZ, nz))));
+			dotProd = _mm256_max_ps(zero, dotProd);
+
+			if (light.type != Light::DIRECTIONAL) {
+				__m256 distanceSquared = _mm256_mul_ps(distance, distance);
+				intensityR = _mm256_div_ps(intensityR, distanceSquared);
+				intensityG = _mm256_div_ps(intensityG, distanceSquared);
+				intensityB = _mm256_div_ps(intensityB, distanceSquared);
+				if (light.type == Light::SPOT) {
+					__m256 cosTheta = _mm256_add_ps(_mm256_mul_ps(dirX, _mm256_set1_ps(light.direction.x())),
+						_mm256_add_ps(_mm256_mul_ps(dirY, _mm256_set1_ps(light.direction.y())), _mm256_mul_ps(dirZ, _mm256_set1_ps(light.direction.z()))));
+					__m256 outsideCone = _mm256_cmp_ps(cosTheta, _mm256_set1_ps(light.cosAngle), _CMP_LT_OQ);
+					intensityR = _mm256_andnot_ps(outsideCone, intensityR);
+					intensityG = _mm256_andnot_ps(outsideCone, intensityG);
+					intensityB = _mm256_andnot_ps(outsideCone, intensityB);
+				}
+			}
+
+			__m256 contributionR = _mm256_mul_ps(_mm256_mul_ps(albedoR, dotProd), intensityR);
+			__m256 contributionG = _mm256_mul_ps(_mm256_mul_ps(albedoG, dotProd), intensityG);
+			__m256 contributionB = _mm256_mul_ps(_mm256_mul_ps(albedoB, dotProd), intensityB);
+			// Adding zero wouldn't change the colour, so those samples need no shadow ray.
+			__m256 allZero = _mm256_and_ps(_mm256_cmp_ps(contributionR, zero, _CMP_EQ_OQ),
+				_mm256_and_ps(_mm256_cmp_ps(contributionG, zero, _CMP_EQ_OQ), _mm256_cmp_ps(contributionB, zero, _CMP_EQ_OQ)));
+			int needed = ~_mm256_movemask_ps(allZero) & ((1 << nLanes) - 1);
+			if (!needed) continue;
+
+			alignas(32) float laneDirX[8], laneDirY[8], laneDirZ[8], laneDistance[8];
+			_mm256_store_ps(laneDirX, _mm256_xor_ps(signBit, dirX));
+			_mm256_store_ps(laneDirY, _mm256_xor_ps(signBit, dirY));
+			_mm256_store_ps(laneDirZ, _mm256_xor_ps(signBit, dirZ));
+			_mm256_store_ps(laneDistance, distance);
+			_mm256_store_ps(laneR, contributionR);
+			_mm256_store_ps(laneG, contributionG);
+			_mm256_store_ps(laneB, contributionB);
+			// A directional light's shadow grid answers straight away, so those samples don't
+			// need to wait for the stream.
+			const DirectionalShadowGrid* grid = scene.shadowGrid(lightIndex);
+			for (int lane = 0; lane < nLanes; ++lane) {
+				if (!(needed & (1 << lane))) continue;
+				if (grid) {
+					STATS_COUNT_RAY(SHADOW_RAY, depth);
+					if (grid->occluded(Ray{ batch.point(first + lane), Eigen::Vector3f(laneDirX[lane], laneDirY[lane], laneDirZ[lane]) })) {
+						STATS_ADD(shadowsOccluded, 1);
+					}
+					else stream.samples.push_back({ firstPoint + first + lane, -1, laneR[lane], laneG[lane], laneB[lane] });
+					continue;
+				}
+				int ray = stream.shadowRays.add(batch.point(first + lane), Eigen::Vector3f(laneDirX[lane], laneDirY[lane], laneDirZ[lane]), laneDistance[lane]);
+				STATS_COUNT_RAY(SHADOW_RAY, depth);
+				stream.samples.push_back({ firstPoint + first + lane, ray, laneR[lane], laneG[lane], laneB[lane] });
+			}
+			if (stream.shadowRays.size >= DiffuseShadingStream::maxShadowRays) flushLightSamples(scene, stream, colours);
+		}
+	}
+}
+
+#endif
+
+/// <summary>
+/// Direct lighting for every point in a list of batches, exactly as shadeDiffuse would work
+/// it out for each one. The point i of batch b gets colour colours[b * DiffuseHitBatch::maxSize + i].
+///
+/// With AVX2 this is done in two passes. The first works out what each light would add to
+/// each point, and collects the shadow rays into one stream. The stream is then traced in
+/// one go with traceShadowRays, and the second pass adds up the light that got through.
+/// Batching the whole tile's shadow rays like this lets the any-hit kernel run 8 at a
+/// time, instead of interleaving single rays with the shading.
+/// </summary>
+/// <param name="depth">Number of bounces before these hits (only used for the stats).</param>
+/// <param name="ambient">False to leave out the ambient lights, as for the path tracer
+/// (see shadeDiffuse).</param>
+/// <param name="features">SceneFeatures the scene may have, to pick the shadeDiffuse kernel
+/// used without AVX2 or with light cuts (see selectShadeKernel): scene.features for the
+/// specialized one.</param>
+void shadeDiffuseBatches(DiffuseHitBatch* batches, int nBatches, const Scene& scene, Eigen::Vector3f* colours, int depth = 0, bool ambient = true,
+	int features = allSceneFeatures)
+{
+#if SIMD_HAVE_AVX2
+	// Each point takes its own cut through the light tree, so with light cuts the points
+	// are done one at a time.
+	if (simdLevel >= SIMD_AVX2 && !scene.useLightCuts()) {
+		STATS_TIME(SHADE_STAGE);
+		thread_local DiffuseShadingStream stream;
+		for (int b = 0; b < nBatches; ++b)
+			for (int i = 0; i < batches[b].size; ++i) {
+				colours[b * DiffuseHitBatch::maxSize + i] = Eigen::Vector3f::Zero();
+			}
+		for (int b = 0; b < nBatches; ++b) {
+			if (batches[b].size > 0) queueLightSamplesAVX2(batches[b], b * DiffuseHitBatch::maxSize, scene, stream, colours, depth, ambient);
+		}
+		flushLightSamples(scene, stream, colours);
+		return;
+	}
+#endif
+	ShadeKernel shade = selectShadeKernel(features);
+	for (int b = 0; b < nBatches; ++b) {
+		const DiffuseHitBatch& batch = batches[b];
+		for (int i = 0; i < batch.size; ++i) {
+			colours[b * DiffuseHitBatch::maxSize + i] = shade(*batch.spheres[i], batch.point(i), scene, depth, ambient);
+		}
+	}
+}
+
+/// <summary>
+/// shadeDiffuseBatches for a single batch: colours[i] is set for point i.
+/// </summary>
+void shadeDiffuseBatch(DiffuseHitBatch& batch, const Scene& scene, Eigen::Vector3f* colours, int depth = 0, bool ambient = true,
+	int features = allSceneFeatures)
+{
+	shadeDiffuseBatches(&batch, 1, scene, colours, depth, ambient, features);
+}
@@ -0,0 +1,223 @@
+#pragma once
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+#include <Eigen/Dense>
+#include "Sphere.hpp"
+#include "SphereSoA.hpp"
+#include "Stats.hpp"
+
+/// <summary>
+/// Shadow test for a directional light, whose shadow rays all run parallel to each other.
+///
+/// Every sphere that can cast a shadow (i.e. isn't REFRACTIVE) is projected along the light
+/// direction onto a plane, where it becomes a disk, and a uniform grid over the plane lists
+/// the disks touching each cell. A shadow ray can only hit spheres whose disk contains the
+/// ray's own projection, so a query just looks up the cell under the ray's origin and tests
+/// the few spheres listed there. The candidates are stored in a SphereSoA, cell by cell, so
+/// they go through the same SIMD raySphereIntersection as the BVH leaves and the answers
+/// are the same as bvh.anyHit's.
+///
+/// update keeps the grid in step with the spheres and the light. If the direction changes
+/// (or spheres are added or removed) the grid is rebuilt; if just a few spheres have changed,
+/// their old entries are switched off and their new positions go in a short list that every
+/// query also tests, until too many have moved and a rebuild is worth it.
+/// </summary>
+class DirectionalShadowGrid {
+	Eigen::Vector3f _direction = Eigen::Vector3f::Zero(); // Of the light (unit length), as built.
+	Eigen::Vector3f _u = Eigen::Vector3f::Zero(), _v = Eigen::Vector3f::Zero(); // Basis of the plane the spheres are projected onto.
+	float _minU = 0.f, _minV = 0.f, _invCellSize = 0.f;
+	int _nu = 0, _nv = 0;
+
+	std::vector<int> _cellStart;     // Cell c's candidates are [_cellStart[c], _cellStart[c + 1]).
+	SphereSoA _candidates;
+	std::vector<int> _sphereSlots;   // The candidate slots of each sphere, sphere by sphere
+	std::vector<int> _sphereStart;   // (sphere i's are [_sphereStart[i], _sphereStart[i + 1])).
+
+	// What each sphere's shadow depended on when the grid was built: its centre and radius,
+	// or a radius of -1 if it didn't cast one (so moving it doesn't matter).
+	struct Caster {
+		Eigen::Vector3f centre;
+		float radius;
+	};
+	std::vector<Caster> _built;
+	std::vector<int> _changed;       // Spheres that have changed since then.
+	SphereSoA _moved;                // The current geometry of the changed spheres that cast shadows.
+	int _nMoved = 0;
+
+	static bool castsShadow(const Sphere& sphere)
+	{
+		return sphere.material != Material::REFRACTIVE;
+	}
+
+	static Caster caster(const Sphere& sphere)
+	{
+		return castsShadow(sphere) ? Caster{ sphere.centre, sphere.radius } : Caster{ Eigen::Vector3f::Zero(), -1.f };
+	}
+
+	static bool sameShadow(const Sphere& sphere, const Caster& built)
+	{
+		Caster now = caster(sphere);
+		return now.centre == built.centre && now.radius == built.radius;
+	}
+
+	/// <summary>
+	/// Range of cells covered by a sphere's disk, widened a little so rounding can never leave
+	/// out a cell whose rays hit the sphere.
+	/// </summary>
+	void cellRange(const Sphere& sphere, int& u0, int& u1, int& v0, int& v1) const
+	{
+		float pu = sphere.centre.dot(_u), pv = sphere.centre.dot(_v);
+		float r = sphere.radius * 1.001f + 1e-4f * (1.f + fabsf(pu) + fabsf(pv));
+		u0 = std::max(0, static_cast<int>(floorf((pu - r - _minU) * _invCellSize)));
+		u1 = std::min(_nu - 1, static_cast<int>(floorf((pu + r - _minU) * _invCellSize)));
+		v0 = std::max(0, static_cast<int>(floorf((pv - r - _minV) * _invCellSize)));
+		v1 = std::min(_nv - 1, static_cast<int>(floorf((pv + r - _minV) * _invCellSize)));
+	}
+
+	void build(const std::vector<Sphere>& spheres, const Eigen::Vector3f& direction)
+	{
+		_direction = direction;
+		_u = direction.unitOrthogonal();
+		_v = direction.cross(_u);
+		_built.resize(spheres.size());
+		for (size_t i = 0; i < spheres.size(); ++i) _built[i] = caster(spheres[i]);
+		_changed.clear();
+		_nMoved = 0;
+		int n = static_cast<int>(spheres.size());
+
+		// Size the grid so there is about one cell per sphere.
+		float minU = FLT_MAX, maxU = -FLT_MAX, minV = FLT_MAX, maxV = -FLT_MAX;
+		int nCasters = 0;
+		for (const Sphere& sphere : spheres) {
+			if (!castsShadow(sphere)) continue;
+			float pu = sphere.centre.dot(_u), pv = sphere.centre.dot(_v);
+			minU = std::min(minU, pu - sphere.radius);
+			maxU = std::max(maxU, pu + sphere.radius);
+			minV = std::min(minV, pv - sphere.radius);
+			maxV = std::max(maxV, pv + sphere.radius);
+			++nCasters;
+		}
+		if (nCasters == 0) {
+			_nu = _nv = 0;
+			_cellStart.assign(1, 0);
+			_sphereStart.assign(n + 1, 0);
+			_sphereSlots.clear();
+			_candidates.resize(0);
+			return;
+		}
+		float cellSize = std::max(sqrtf((maxU - minU) * (maxV - minV) / nCasters), 1e-6f * (maxU - minU + maxV - minV) + FLT_MIN);
+		_nu = std::min(2048, std::max(1, static_cast<int>(ceilf((maxU - minU) / cellSize))));
+		_nv = std::min(2048, std::max(1, static_cast<int>(ceilf((maxV - minV) / cellSize))));
+		_minU = minU;
+		_minV = minV;
+		_invCellSize = 1.f / std::max(std::max((maxU - minU) / _nu, (maxV - minV) / _nv), FLT_MIN);
+
+		// Count the candidates in each cell, then fill them in.
+		_cellStart.assign(_nu * _nv + 1, 0);
+		_sphereStart.assign(n + 1, 0);
+		for (int i = 0; i < n; ++i) {
+			if (!castsShadow(spheres[i])) continue;
+			int u0, u1, v0, v1;
+			cellRange(spheres[i], u0, u1, v0, v1);
+			for (int v = v0; v <= v1; ++v)
+				for (int u = u0; u <= u1; ++u) {
+					++_cellStart[v * _nu + u + 1];
+				}
+			_sphereStart[i + 1] = std::max(0, u1 - u0 + 1) * std::max(0, v1 - v0 + 1);
+		}
+		for (int c = 0; c < _nu * _nv; ++c) _cellStart[c + 1] += _cellStart[c];
+		for (int i = 0; i < n; ++i) _sphereStart[i + 1] += _sphereStart[i];
+
+		std::vector<int> fill(_cellStart.begin(), _cellStart.end() - 1);
+		_candidates.resize(_cellStart.back());
+		_sphereSlots.resize(_sphereStart.back());
+		for (int i = 0; i < n; ++i) {
+			if (!castsShadow(spheres[i])) continue;
+			int u0, u1, v0, v1, slot = _sphereStart[i];
+			cellRange(spheres[i], u0, u1, v0, v1);
+			for (int v = v0; v <= v1; ++v)
+				for (int u = u0; u <= u1; ++u) {
+					int candidate = fill[v * _nu + u]++;
+					_candidates.set(candidate, spheres[i].centre, spheres[i].radius);
+					_sphereSlots[slot++] = candidate;
+				}
+		}
+	}
+
+public:
+	/// <summary>
+	/// Brings the grid up to date with the spheres and the light's direction (which must be
+	/// unit length).
+	/// </summary>
+	void update(const std::vector<Sphere>& spheres, const Eigen::Vector3f& direction)
+	{
+		if (direction != _direction || spheres.size() != _built.size() || _cellStart.empty()) {
+			build(spheres, direction);
+			return;
+		}
+
+		// Switch the entries of spheres that had changed back on, then find the ones that
+		// have changed now (including any that have changed back).
+		for (int i : _changed) {
+			const Caster& sphere = _built[i];
+			for (int slot = _sphereStart[i]; slot < _sphereStart[i + 1]; ++slot) _candidates.set(_sphereSlots[slot], sphere.centre, sphere.radius);
+		}
+		_changed.clear();
+		for (size_t i = 0; i < spheres.size(); ++i) {
+			if (!sameShadow(spheres[i], _built[i])) _changed.push_back(static_cast<int>(i));
+		}
+		if (_changed.size() > std::max<size_t>(64, spheres.size() / 16)) {
+			build(spheres, direction);
+			return;
+		}
+
+		// Spheres whose disk is switched off (by making it impossible to hit) are tested
+		// from the moved list instead.
+		_moved.resize(static_cast<int>(_changed.size()));
+		_nMoved = 0;
+		for (int i : _changed) {
+			for (int slot = _sphereStart[i]; slot < _sphereStart[i + 1]; ++slot) _candidates.r2[_sphereSlots[slot]] = -FLT_MAX;
+			if (castsShadow(spheres[i])) _moved.set(_nMoved++, spheres[i].centre, spheres[i].radius);
+		}
+	}
+
+	void clear()
+	{
+		*this = DirectionalShadowGrid();
+	}
+
+	bool empty() const
+	{
+		return _cellStart.empty();
+	}
+
+	/// <summary>
+	/// Same as bvh.anyHit(ray, spheres, FLT_MAX, [not REFRACTIVE], minT), for a ray heading
+	/// towards the light (ray.direction must be exactly -direction).
+	/// </summary>
+	bool occluded(const Ray& ray, float minT = 0.001f) const
+	{
+		float t;
+		float pu = ray.origin.dot(_u), pv = ray.origin.dot(_v);
+		float u = floorf((pu - _minU) * _invCellSize), v = floorf((pv - _minV) * _invCellSize);
+		if (u >= 0.f && v >= 0.f && u < _nu && v < _nv) {
+			int cell = static_cast<int>(v) * _nu + static_cast<int>(u);
+			STATS_ADD(sphereTests, _cellStart[cell + 1] - _cellStart[cell]);
+			if (raySphereIntersection(ray, _candidates, _cellStart[cell], _cellStart[cell + 1], t, minT) >= 0) return true;
+		}
+		STATS_ADD(sphereTests, _nMoved);
+		return _nMoved > 0 && raySphereIntersection(ray, _moved, 0, _nMoved, t, minT) >= 0;
+	}
+
+	int cellCount() const
+	{
+		return _nu * _nv;
+	}
+
+	int candidateCount() const
+	{
+		return _cellStart.empty() ? 0 : _cellStart.back();
+	}
+};
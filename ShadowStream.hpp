@@ -0,0 +1,200 @@
+#pragma once
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <vector>
+#include <Eigen/Dense>
+#include "BVH.hpp"
+#include "Simd.hpp"
+#include "Sphere.hpp"
+#include "SphereSoA.hpp"
+#include "Stats.hpp"
+
+/// <summary>
+/// A list of shadow rays to be traced together with traceShadowRays, stored
+/// structure-of-arrays so groups of 8 can be loaded straight into AVX2 registers.
+/// Unlike a RayPacket the rays needn't share an origin, and there can be any number of them.
+/// </summary>
+struct ShadowRayStream {
+	static constexpr int groupSize = 8;
+
+	int size = 0;
+	AlignedFloats ox, oy, oz;
+	AlignedFloats dx, dy, dz;
+	AlignedFloats maxT;            // The ray is only blocked by hits closer than this.
+	std::vector<uint8_t> occluded; // Results, filled in by traceShadowRays.
+
+	void clear()
+	{
+		size = 0;
+		ox.clear(); oy.clear(); oz.clear();
+		dx.clear(); dy.clear(); dz.clear();
+		maxT.clear();
+	}
+
+	/// <returns>The ray's index, for looking up its result.</returns>
+	int add(const Eigen::Vector3f& origin, const Eigen::Vector3f& direction, float distance)
+	{
+		ox.push_back(origin.x()); oy.push_back(origin.y()); oz.push_back(origin.z());
+		dx.push_back(direction.x()); dy.push_back(direction.y()); dz.push_back(direction.z());
+		maxT.push_back(distance);
+		return size++;
+	}
+
+	int nGroups() const
+	{
+		return (size + groupSize - 1) / groupSize;
+	}
+
+	Ray ray(int i) const
+	{
+		return Ray{ Eigen::Vector3f(ox[i], oy[i], oz[i]), Eigen::Vector3f(dx[i], dy[i], dz[i]) };
+	}
+
+	/// <summary>
+	/// Pads the arrays to a whole number of groups with copies of the first ray that can't
+	/// be blocked by anything (maxT = -FLT_MAX). size is unchanged.
+	/// </summary>
+	void pad()
+	{
+		int padded = nGroups() * groupSize;
+		for (int i = static_cast<int>(ox.size()); i < padded; ++i) {
+			ox.push_back(ox[0]); oy.push_back(oy[0]); oz.push_back(oz[0]);
+			dx.push_back(dx[0]); dy.push_back(dy[0]); dz.push_back(dz[0]);
+			maxT.push_back(-FLT_MAX);
+		}
+	}
+};
+
+#if SIMD_HAVE_AVX2
+
+/// <summary>
+/// Finds which rays of one group of 8 hit sphere i of the store between minT and their maxT.
+/// The same calculation as raySphereIntersection, with lanes over rays, so the answers
+/// match tracing each ray on its own.
+/// </summary>
+/// <returns>Bit mask of the rays that hit it.</returns>
+SIMD_TARGET_AVX2 int shadowGroupHitsSphere(__m256 ox, __m256 oy, __m256 oz, __m256 dx, __m256 dy, __m256 dz, __m256 a, __m256 maxT,
+	const SphereSoA& geometry, int i, float minT)
+{
+	const __m256 two = _mm256_set1_ps(2.f), four = _mm256_set1_ps(4.f), zero = _mm256_setzero_ps();
+	__m256 ocx = _mm256_sub_ps(ox, _mm256_set1_ps(geometry.cx[i]));
+	__m256 ocy = _mm256_sub_ps(oy, _mm256_set1_ps(geometry.cy[i]));
+	__m256 ocz = _mm256_sub_ps(oz, _mm256_set1_ps(geometry.cz[i]));
+	__m256 b = _mm256_mul_ps(two, _mm256_add_ps(_mm256_mul_ps(dx, ocx),
+		_mm256_add_ps(_mm256_mul_ps(dy, ocy), _mm256_mul_ps(dz, ocz))));
+	__m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx),
+		_mm256_add_ps(_mm256_mul_ps(ocy, ocy), _mm256_mul_ps(ocz, ocz))), _mm256_set1_ps(geometry.r2[i]));
+	__m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(_mm256_mul_ps(four, a), c));
+	__m256 valid = _mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ);
+	if (_mm256_testz_ps(valid, valid)) return 0;
+
+	__m256 vMinT = _mm256_set1_ps(minT);
+	__m256 sqrtDiscriminant = _mm256_sqrt_ps(discriminant);
+	__m256 negB = _mm256_xor_ps(b, _mm256_set1_ps(-0.f));
+	__m256 twoA = _mm256_mul_ps(two, a);
+	__m256 t1 = _mm256_div_ps(_mm256_sub_ps(negB, sqrtDiscriminant), twoA);
+	__m256 t2 = _mm256_div_ps(_mm256_add_ps(negB, sqrtDiscriminant), twoA);
+	__m256 hitT = _mm256_blendv_ps(t2, t1, _mm256_cmp_ps(t1, vMinT, _CMP_GT_OQ));
+	valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(hitT, vMinT, _CMP_GT_OQ), _mm256_cmp_ps(hitT, maxT, _CMP_LT_OQ)));
+	return _mm256_movemask_ps(valid);
+}
+
+#endif
+
+#if SIMD_HAVE_AVX2
+
+/// <summary>
+/// traceShadowRays with AVX2: each group of 8 rays walks the BVH together, testing boxes
+/// and spheres for all 8 lanes at once. Rays drop out of the group as soon as something
+/// blocks them, and the group stops when all of them have.
+/// </summary>
+SIMD_TARGET_AVX2 void traceShadowRaysAVX2(const BVH& bvh, const std::vector<Sphere>& spheres, ShadowRayStream& stream, float minT)
+{
+	const std::vector<BVHNode>& nodes = bvh.nodes();
+	auto occludes = [&](int i) {
+		return spheres[bvh.primIndices()[i]].material != Material::REFRACTIVE;
+	};
+	stream.pad();
+	const SphereSoA& geometry = bvh.geometry();
+	const __m256 one = _mm256_set1_ps(1.f), zero = _mm256_setzero_ps();
+	uint64_t nodesVisited = 0, boxesMissed = 0, sphereTests = 0;
+	for (int g = 0; g < stream.nGroups(); ++g) {
+		int first = g * ShadowRayStream::groupSize;
+		__m256 o[3] = { _mm256_load_ps(&stream.ox[first]), _mm256_load_ps(&stream.oy[first]), _mm256_load_ps(&stream.oz[first]) };
+		__m256 d[3] = { _mm256_load_ps(&stream.dx[first]), _mm256_load_ps(&stream.dy[first]), _mm256_load_ps(&stream.dz[first]) };
+		__m256 invDir[3] = { _mm256_div_ps(one, d[0]), _mm256_div_ps(one, d[1]), _mm256_div_ps(one, d[2]) };
+		__m256 a = _mm256_add_ps(_mm256_mul_ps(d[0], d[0]), _mm256_add_ps(_mm256_mul_ps(d[1], d[1]), _mm256_mul_ps(d[2], d[2])));
+		__m256 maxT = _mm256_load_ps(&stream.maxT[first]);
+		int active = stream.size - first >= ShadowRayStream::groupSize ? 0xff : (1 << (stream.size - first)) - 1;
+		int occluded = 0;
+
+		int stack[BVH::stackSize];
+		int stackTop = 0;
+		stack[stackTop++] = 0;
+		while (stackTop > 0 && active) {
+			const BVHNode& node = nodes[stack[--stackTop]];
+			++nodesVisited;
+			__m256 tNear = zero, tFar = maxT;
+			for (int axis = 0; axis < 3; ++axis) {
+				__m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.bounds.min[axis]), o[axis]), invDir[axis]);
+				__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.bounds.max[axis]), o[axis]), invDir[axis]);
+				tNear = _mm256_max_ps(tNear, _mm256_min_ps(t0, t1));
+				tFar = _mm256_min_ps(tFar, _mm256_max_ps(t0, t1));
+			}
+			int mask = _mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ)) & active;
+			if (!mask) {
+				++boxesMissed;
+				continue;
+			}
+
+			if (node.count > 0) {
+				for (int i = node.leftFirst; i < node.leftFirst + node.count && mask; ++i) {
+					if (!occludes(i)) continue;
+					sphereTests += ShadowRayStream::groupSize; // As for packets, counted per group.
+					int hit = shadowGroupHitsSphere(o[0], o[1], o[2], d[0], d[1], d[2], a, maxT, geometry, i, minT) & mask;
+					occluded |= hit;
+					mask &= ~hit;
+					active &= ~hit;
+				}
+			}
+			else {
+				stack[stackTop++] = node.leftFirst + 1;
+				stack[stackTop++] = node.leftFirst;
+			}
+		}
+		for (int lane = 0; lane < ShadowRayStream::groupSize; ++lane) {
+			if (occluded & (1 << lane)) stream.occluded[first + lane] = 1;
+		}
+	}
+	STATS_ADD(nodesVisited, nodesVisited);
+	STATS_ADD(boxesMissed, boxesMissed);
+	STATS_ADD(sphereTests, sphereTests);
+}
+
+#endif
+
+/// <summary>
+/// Any-hit queries for every ray in the stream: stream.occluded[i] is set if ray i is
+/// blocked before its maxT. REFRACTIVE spheres let the light through, as in shadeDiffuse.
+///
+/// With AVX2 the rays go through traceShadowRaysAVX2, 8 at a time; otherwise through
+/// bvh.anyHit one at a time. Either way the results are exactly those of bvh.anyHit.
+/// </summary>
+void traceShadowRays(const BVH& bvh, const std::vector<Sphere>& spheres, ShadowRayStream& stream, float minT = 0.001f)
+{
+	stream.occluded.assign(stream.size, 0);
+	if (bvh.nodes().empty() || stream.size == 0) return;
+
+#if SIMD_HAVE_AVX2
+	if (simdLevel >= SIMD_AVX2) {
+		traceShadowRaysAVX2(bvh, spheres, stream, minT);
+		return;
+	}
+#endif
+	for (int i = 0; i < stream.size; ++i) {
+		stream.occluded[i] = bvh.anyHit(stream.ray(i), spheres, stream.maxT[i], [](const Sphere& sphere) {
+			return sphere.material != Material::REFRACTIVE;
+		}, minT);
+	}
+}
@@ -0,0 +1,146 @@
+#pragma once
+#include <string>
+
+// Picking the SIMD kernels at run time.
+//
+// The hot kernels (ray-sphere intersection, packet and shadow ray traversal, diffuse
+// shading, tonemapping, PNG filtering) are compiled for more than one instruction set in
+// the same binary, and simdLevel says which of them to run. It starts out as the best
+// level the CPU supports, so one build runs well on every machine, and setSimdLevel can
+// force a lower one (SphereTracer --simd) to compare them.
+//
+// With GCC and Clang on x86 the AVX2 and AVX-512 versions are compiled with target
+// attributes (SIMD_TARGET_AVX2 / SIMD_TARGET_AVX512), so the rest of the program only
+// needs the baseline instruction set (SSE4.2 in the CMake build). MSVC can use the
+// intrinsics without any flags, so there the attributes are empty. If the whole build
+// is for AVX2 or AVX-512 anyway, the levels it implies are always available.
+//
+// Every level gives bit-identical images; only the speed changes.
+
+enum SimdLevel {
+	SIMD_BASELINE, // Whatever the build targets, e.g. SSE4.2; the scalar kernels.
+	SIMD_AVX2,
+	SIMD_AVX512,
+	nSimdLevels
+};
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_HAVE_AVX2 1
+#define SIMD_HAVE_AVX512 1
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+#define SIMD_TARGET_AVX512 __attribute__((target("avx512f,avx2")))
+#define SIMD_FORCE_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define SIMD_HAVE_AVX2 1
+#define SIMD_HAVE_AVX512 1
+#define SIMD_TARGET_AVX2
+#define SIMD_TARGET_AVX512
+#define SIMD_FORCE_INLINE __forceinline
+#include <intrin.h>
+#else
+// Elsewhere, only what the whole build is compiled for.
+#if defined(__AVX2__)
+#define SIMD_HAVE_AVX2 1
+#else
+#define SIMD_HAVE_AVX2 0
+#endif
+#if defined(__AVX512F__)
+#define SIMD_HAVE_AVX512 1
+#else
+#define SIMD_HAVE_AVX512 0
+#endif
+#define SIMD_TARGET_AVX2
+#define SIMD_TARGET_AVX512
+#define SIMD_FORCE_INLINE inline
+#endif
+
+#if SIMD_HAVE_AVX2 || SIMD_HAVE_AVX512
+#include <immintrin.h>
+#endif
+
+const char* const simdLevelNames[nSimdLevels] = {
+#if defined(__SSE4_2__)
+	"sse4.2",
+#else
+	"baseline",
+#endif
+	"avx2", "avx512"
+};
+
+/// <summary>
+/// The best SimdLevel this CPU (and OS) can run.
+/// </summary>
+SimdLevel detectSimdLevel()
+{
+#if defined(__AVX512F__)
+	return SIMD_AVX512;
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2")) return SIMD_AVX512;
+	if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+	return SIMD_BASELINE;
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) return SIMD_BASELINE;
+	__cpuid(info, 1);
+	bool osSavesAVX = (info[2] & (1 << 27)) && (_xgetbv(0) & 0x6) == 0x6; // OSXSAVE, and XMM/YMM state enabled.
+	if (!osSavesAVX) return SIMD_BASELINE;
+	__cpuidex(info, 7, 0);
+	bool avx2 = (info[1] & (1 << 5)) != 0, avx512f = (info[1] & (1 << 16)) != 0;
+	if (avx2 && avx512f && (_xgetbv(0) & 0xe6) == 0xe6) return SIMD_AVX512; // And the AVX-512 state.
+	return avx2 ? SIMD_AVX2 : SIMD_BASELINE;
+#elif defined(__AVX2__)
+	return SIMD_AVX2;
+#else
+	return SIMD_BASELINE;
+#endif
+}
+
+/// <summary>
+/// The best SimdLevel that can actually be used: supported by the CPU, with kernels
+/// compiled in.
+/// </summary>
+SimdLevel maxSimdLevel()
+{
+	static const SimdLevel level = [] {
+		SimdLevel detected = detectSimdLevel();
+		if (detected >= SIMD_AVX512 && !SIMD_HAVE_AVX512) detected = SIMD_AVX2;
+		if (detected >= SIMD_AVX2 && !SIMD_HAVE_AVX2) detected = SIMD_BASELINE;
+		return detected;
+	}();
+	return level;
+}
+
+// Which kernels to run. Read on every kernel call, so only change it between frames.
+SimdLevel simdLevel = maxSimdLevel();
+
+/// <summary>
+/// Forces the kernels for a given level (or, with maxSimdLevel(), the best again).
+/// </summary>
+/// <returns>False, leaving simdLevel alone, if this CPU can't run them.</returns>
+bool setSimdLevel(SimdLevel level)
+{
+	if (level < SIMD_BASELINE || level > maxSimdLevel()) return false;
+	simdLevel = level;
+	return true;
+}
+
+/// <summary>
+/// Looks up a level by its name in simdLevelNames (or "auto" for maxSimdLevel()).
+/// </summary>
+/// <returns>False if there is no such level.</returns>
+bool parseSimdLevel(const std::string& name, SimdLevel& level)
+{
+	if (name == "auto") {
+		level = maxSimdLevel();
+		return true;
+	}
+	for (int i = 0; i < nSimdLevels; ++i) {
+		if (name == simdLevelNames[i]) {
+			level = static_cast<SimdLevel>(i);
+			return true;
+		}
+	}
+	return false;
+}
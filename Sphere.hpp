@@ -0,0 +1,69 @@
+#pragma once
+#include <Eigen/Dense>
+
+struct Ray {
+	Eigen::Vector3f origin, direction;
+};
+
+enum Material {
+	DIFFUSE, MIRROR, REFRACTIVE
+};
+
+struct Sphere {
+	// Geometric properties
+	Eigen::Vector3f centre;
+	float radius;
+
+	// Material properties
+	Material material;
+	Eigen::Vector3f colour;
+	float ior; // Index of refraction (only used for refractive spheres).
+};
+
+
+bool raySphereIntersection(const Ray& ray, const Sphere& sphere, Eigen::Vector3f& intersection, float& t, float minT=0.001f)
+{
+	// Task 1: Add Ray-Sphere intersection
+	// *** YOUR CODE HERE ***
+	// Find the intersection point between the ray and the sphere.
+	// If an intersection exists, set the value of "intersection" and "t", and return true!
+	// If no intersection is found, or the value of t is below minT, return false.
+
+	// Steps:
+	// 1. Find the value of A, B and C from the lecture slides.
+	// 2. Find the value of the discriminant B^2 - 4AC
+	// 3. If the discriminant is less than 0, return false (no solutions).
+	// 4. Otherwise, find the two solutions for t (t1 and t2, for example).
+	// 5. Find the smallest solution for t that's bigger than minT.
+	//   a. If such a t exists, set the value of "intersection" and "t" and return true.
+	//   b. If no such t exists, return false.
+	Eigen::Vector3f oc = ray.origin - sphere.centre;
+	float a = ray.direction.dot(ray.direction);
+	float b = 2.f * ray.direction.dot(oc);
+	float c = oc.dot(oc) - sphere.radius * sphere.radius;
+
+	float discriminant = b * b - 4.f * a * c;
+	if (discriminant < 0.f) return false;
+
+	float sqrtDiscriminant = sqrtf(discriminant);
+	float t1 = (-b - sqrtDiscriminant) / (2.f * a);
+	float t2 = (-b + sqrtDiscriminant) / (2.f * a);
+
+	if (t1 > minT) t = t1;
+	else if (t2 > minT) t = t2;
+	else return false;
+
+	intersection = ray.origin + t * ray.direction;
+	return true;
+	// *** END YOUR CODE ***
+}
+
+Eigen::Vector3f getSphereNormal(const Sphere& sphere, const Eigen::Vector3f& location) {
+	// Task 2: Find the sphere normal
+	// *** YOUR CODE HERE ***
+	// Find the value of the normal to the sphere at the given location.
+	// This should only need one line of code!
+	// See the slides for more detail.
+	return (location - sphere.centre).normalized();
+	// *** END YOUR CODE ***
+}
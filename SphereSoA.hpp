@@ -0,0 +1,275 @@
+#pragma once
+#include <cfloat>
+#include <cstddef>
+#include <new>
+#include <vector>
+#include <Eigen/Dense>
+#include "Simd.hpp"
+#include "Sphere.hpp"
+
+/// <summary>
+/// Minimal allocator giving std::vector storage aligned to Alignment bytes.
+/// </summary>
+template<typename T, std::size_t Alignment>
+struct AlignedAllocator {
+	typedef T value_type;
+
+	template<typename U>
+	struct rebind {
+		typedef AlignedAllocator<U, Alignment> other;
+	};
+
+	AlignedAllocator() = default;
+	template<typename U>
+	AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+	T* allocate(std::size_t n)
+	{
+		return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+	}
+
+	void deallocate(T* p, std::size_t)
+	{
+		::operator delete(p, std::align_val_t(Alignment));
+	}
+
+	template<typename U>
+	bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+	template<typename U>
+	bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+};
+
+typedef std::vector<float, AlignedAllocator<float, 64>> AlignedFloats;
+
+/// <summary>
+/// Structure-of-arrays copy of just the sphere geometry: centres and squared radii, each in
+/// its own 64-byte aligned array. Intersection loops only touch these arrays, so no
+/// material data is pulled into the cache, and 8 or 16 spheres can be loaded at once.
+///
+/// The arrays are padded past size() with spheres that can never be hit, so SIMD loops
+/// may read a whole vector beyond the last real sphere.
+/// </summary>
+struct SphereSoA {
+	static constexpr int padding = 16;
+
+	AlignedFloats cx, cy, cz, r2;
+
+	SphereSoA() = default;
+
+	/// <summary>
+	/// Copies the geometry of the given spheres. If order is not null, entry i of the
+	/// store holds sphere order[i] (e.g. to match the leaf order of a BVH).
+	/// </summary>
+	explicit SphereSoA(const std::vector<Sphere>& spheres, const std::vector<int>* order = nullptr)
+	{
+		int n = static_cast<int>(order ? order->size() : spheres.size());
+		resize(n);
+		for (int i = 0; i < n; ++i) {
+			const Sphere& sphere = spheres[order ? (*order)[i] : i];
+			set(i, sphere.centre, sphere.radius);
+		}
+	}
+
+	int size() const
+	{
+		return static_cast<int>(cx.size()) - padding;
+	}
+
+	void resize(int n)
+	{
+		// Padding spheres have a huge negative squared radius, so the discriminant is
+		// always negative and they are never hit.
+		cx.assign(n + padding, 0.f);
+		cy.assign(n + padding, 0.f);
+		cz.assign(n + padding, 0.f);
+		r2.assign(n + padding, -FLT_MAX);
+	}
+
+	void set(int i, const Eigen::Vector3f& centre, float radius)
+	{
+		cx[i] = centre.x();
+		cy[i] = centre.y();
+		cz[i] = centre.z();
+		r2[i] = radius * radius;
+	}
+};
+
+// Ray-sphere intersection against a range of the SoA store.
+// The scalar raySphereIntersection in Sphere.hpp is the reference: every version below
+// evaluates the same expressions in the same order, so they return bit-identical t values.
+// (This relies on the compiler not fusing multiplies and adds, see -ffp-contract in
+// CMakeLists.txt.)
+
+/// <summary>
+/// Scalar version of raySphereIntersection over spheres [begin, end) of the store.
+/// Finds the nearest t > minT and below maxT.
+/// </summary>
+/// <returns>Store index of the nearest sphere hit, or -1. t is only set on a hit.</returns>
+int raySphereIntersectionScalar(const Ray& ray, const SphereSoA& soa, int begin, int end, float& t, float minT = 0.001f, float maxT = FLT_MAX)
+{
+	const Eigen::Vector3f& o = ray.origin;
+	const Eigen::Vector3f& d = ray.direction;
+	float a = d.x() * d.x() + (d.y() * d.y() + d.z() * d.z());
+	int bestIndex = -1;
+	float bestT = maxT;
+	for (int i = begin; i < end; ++i) {
+		float ocx = o.x() - soa.cx[i], ocy = o.y() - soa.cy[i], ocz = o.z() - soa.cz[i];
+		float b = 2.f * (d.x() * ocx + (d.y() * ocy + d.z() * ocz));
+		float c = (ocx * ocx + (ocy * ocy + ocz * ocz)) - soa.r2[i];
+		float discriminant = b * b - 4.f * a * c;
+		if (!(discriminant >= 0.f)) continue;
+		float sqrtDiscriminant = sqrtf(discriminant);
+		float t1 = (-b - sqrtDiscriminant) / (2.f * a);
+		float t2 = (-b + sqrtDiscriminant) / (2.f * a);
+		float hitT = t1 > minT ? t1 : t2;
+		if (hitT > minT && hitT < bestT) {
+			bestT = hitT;
+			bestIndex = i;
+		}
+	}
+	if (bestIndex >= 0) t = bestT;
+	return bestIndex;
+}
+
+#if SIMD_HAVE_AVX512
+
+/// <summary>
+/// AVX-512 version of raySphereIntersectionScalar, testing 16 spheres per step.
+/// </summary>
+SIMD_TARGET_AVX512 int raySphereIntersectionAVX512(const Ray& ray, const SphereSoA& soa, int begin, int end, float& t, float minT = 0.001f, float maxT = FLT_MAX)
+{
+	const Eigen::Vector3f& o = ray.origin;
+	const Eigen::Vector3f& d = ray.direction;
+	float a = d.x() * d.x() + (d.y() * d.y() + d.z() * d.z());
+
+	__m512 ox = _mm512_set1_ps(o.x()), oy = _mm512_set1_ps(o.y()), oz = _mm512_set1_ps(o.z());
+	__m512 dx = _mm512_set1_ps(d.x()), dy = _mm512_set1_ps(d.y()), dz = _mm512_set1_ps(d.z());
+	__m512 twoA = _mm512_set1_ps(2.f * a), fourA = _mm512_set1_ps(4.f * a);
+	__m512 two = _mm512_set1_ps(2.f), zero = _mm512_setzero_ps(), vMinT = _mm512_set1_ps(minT);
+	__m512i lane = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	__m512i vEnd = _mm512_set1_epi32(end);
+
+	__m512 bestT = _mm512_set1_ps(maxT);
+	__m512i bestIndex = _mm512_set1_epi32(-1);
+
+	for (int i = begin; i < end; i += 16) {
+		__m512i index = _mm512_add_epi32(_mm512_set1_epi32(i), lane);
+		__m512 ocx = _mm512_sub_ps(ox, _mm512_loadu_ps(&soa.cx[i]));
+		__m512 ocy = _mm512_sub_ps(oy, _mm512_loadu_ps(&soa.cy[i]));
+		__m512 ocz = _mm512_sub_ps(oz, _mm512_loadu_ps(&soa.cz[i]));
+		__m512 b = _mm512_mul_ps(two, _mm512_add_ps(_mm512_mul_ps(dx, ocx),
+			_mm512_add_ps(_mm512_mul_ps(dy, ocy), _mm512_mul_ps(dz, ocz))));
+		__m512 c = _mm512_sub_ps(_mm512_add_ps(_mm512_mul_ps(ocx, ocx),
+			_mm512_add_ps(_mm512_mul_ps(ocy, ocy), _mm512_mul_ps(ocz, ocz))), _mm512_loadu_ps(&soa.r2[i]));
+		__m512 discriminant = _mm512_sub_ps(_mm512_mul_ps(b, b), _mm512_mul_ps(fourA, c));
+		__mmask16 valid = _mm512_cmp_ps_mask(discriminant, zero, _CMP_GE_OQ) & _mm512_cmplt_epi32_mask(index, vEnd);
+		if (!valid) continue;
+
+		__m512 sqrtDiscriminant = _mm512_sqrt_ps(discriminant);
+		__m512 negB = _mm512_sub_ps(zero, b);
+		__m512 t1 = _mm512_div_ps(_mm512_sub_ps(negB, sqrtDiscriminant), twoA);
+		__m512 t2 = _mm512_div_ps(_mm512_add_ps(negB, sqrtDiscriminant), twoA);
+		__m512 hitT = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(t1, vMinT, _CMP_GT_OQ), t2, t1);
+		valid &= _mm512_cmp_ps_mask(hitT, vMinT, _CMP_GT_OQ) & _mm512_cmp_ps_mask(hitT, bestT, _CMP_LT_OQ);
+		bestT = _mm512_mask_blend_ps(valid, bestT, hitT);
+		bestIndex = _mm512_mask_blend_epi32(valid, bestIndex, index);
+	}
+
+	alignas(64) float laneT[16];
+	alignas(64) int laneIndex[16];
+	_mm512_store_ps(laneT, bestT);
+	_mm512_store_si512(laneIndex, bestIndex);
+	int result = -1;
+	float resultT = maxT;
+	for (int l = 0; l < 16; ++l) {
+		// Ties go to the lowest index, matching a front-to-back scalar loop.
+		if (laneIndex[l] >= 0 && (laneT[l] < resultT || (laneT[l] == resultT && laneIndex[l] < result))) {
+			resultT = laneT[l];
+			result = laneIndex[l];
+		}
+	}
+	if (result >= 0) t = resultT;
+	return result;
+}
+
+#endif
+
+#if SIMD_HAVE_AVX2
+
+/// <summary>
+/// AVX2 version of raySphereIntersectionScalar, testing 8 spheres per step.
+/// </summary>
+SIMD_TARGET_AVX2 int raySphereIntersectionAVX2(const Ray& ray, const SphereSoA& soa, int begin, int end, float& t, float minT = 0.001f, float maxT = FLT_MAX)
+{
+	const Eigen::Vector3f& o = ray.origin;
+	const Eigen::Vector3f& d = ray.direction;
+	float a = d.x() * d.x() + (d.y() * d.y() + d.z() * d.z());
+
+	__m256 ox = _mm256_set1_ps(o.x()), oy = _mm256_set1_ps(o.y()), oz = _mm256_set1_ps(o.z());
+	__m256 dx = _mm256_set1_ps(d.x()), dy = _mm256_set1_ps(d.y()), dz = _mm256_set1_ps(d.z());
+	__m256 twoA = _mm256_set1_ps(2.f * a), fourA = _mm256_set1_ps(4.f * a);
+	__m256 two = _mm256_set1_ps(2.f), zero = _mm256_setzero_ps(), vMinT = _mm256_set1_ps(minT);
+	__m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i vEnd = _mm256_set1_epi32(end);
+
+	__m256 bestT = _mm256_set1_ps(maxT);
+	__m256i bestIndex = _mm256_set1_epi32(-1);
+
+	for (int i = begin; i < end; i += 8) {
+		__m256i index = _mm256_add_epi32(_mm256_set1_epi32(i), lane);
+		__m256 ocx = _mm256_sub_ps(ox, _mm256_loadu_ps(&soa.cx[i]));
+		__m256 ocy = _mm256_sub_ps(oy, _mm256_loadu_ps(&soa.cy[i]));
+		__m256 ocz = _mm256_sub_ps(oz, _mm256_loadu_ps(&soa.cz[i]));
+		__m256 b = _mm256_mul_ps(two, _mm256_add_ps(_mm256_mul_ps(dx, ocx),
+			_mm256_add_ps(_mm256_mul_ps(dy, ocy), _mm256_mul_ps(dz, ocz))));
+		__m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx),
+			_mm256_add_ps(_mm256_mul_ps(ocy, ocy), _mm256_mul_ps(ocz, ocz))), _mm256_loadu_ps(&soa.r2[i]));
+		__m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(fourA, c));
+		__m256 valid = _mm256_and_ps(_mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ),
+			_mm256_castsi256_ps(_mm256_cmpgt_epi32(vEnd, index)));
+		if (_mm256_testz_ps(valid, valid)) continue;
+
+		__m256 sqrtDiscriminant = _mm256_sqrt_ps(discriminant);
+		__m256 negB = _mm256_sub_ps(zero, b);
+		__m256 t1 = _mm256_div_ps(_mm256_sub_ps(negB, sqrtDiscriminant), twoA);
+		__m256 t2 = _mm256_div_ps(_mm256_add_ps(negB, sqrtDiscriminant), twoA);
+		__m256 hitT = _mm256_blendv_ps(t2, t1, _mm256_cmp_ps(t1, vMinT, _CMP_GT_OQ));
+		valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(hitT, vMinT, _CMP_GT_OQ), _mm256_cmp_ps(hitT, bestT, _CMP_LT_OQ)));
+		bestT = _mm256_blendv_ps(bestT, hitT, valid);
+		bestIndex = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(bestIndex), _mm256_castsi256_ps(index), valid));
+	}
+
+	alignas(32) float laneT[8];
+	alignas(32) int laneIndex[8];
+	_mm256_store_ps(laneT, bestT);
+	_mm256_store_si256(reinterpret_cast<__m256i*>(laneIndex), bestIndex);
+	int result = -1;
+	float resultT = maxT;
+	for (int l = 0; l < 8; ++l) {
+		// Ties go to the lowest index, matching a front-to-back scalar loop.
+		if (laneIndex[l] >= 0 && (laneT[l] < resultT || (laneT[l] == resultT && laneIndex[l] < result))) {
+			resultT = laneT[l];
+			result = laneIndex[l];
+		}
+	}
+	if (result >= 0) t = resultT;
+	return result;
+}
+
+#endif
+
+/// <summary>
+/// Finds the nearest sphere in [begin, end) of the store hit by the ray, with minT < t < maxT,
+/// using the widest SIMD kernel simdLevel allows.
+/// </summary>
+/// <returns>Store index of the nearest sphere hit, or -1. t is only set on a hit.</returns>
+int raySphereIntersection(const Ray& ray, const SphereSoA& soa, int begin, int end, float& t, float minT = 0.001f, float maxT = FLT_MAX)
+{
+#if SIMD_HAVE_AVX512
+	if (simdLevel >= SIMD_AVX512) return raySphereIntersectionAVX512(ray, soa, begin, end, t, minT, maxT);
+#endif
+#if SIMD_HAVE_AVX2
+	if (simdLevel >= SIMD_AVX2) return raySphereIntersectionAVX2(ray, soa, begin, end, t, minT, maxT);
+#endif
+	return raySphereIntersectionScalar(ray, soa, begin, end, t, minT, maxT);
+}
@@ -2,15 +2,39 @@
 #define _USE_MATH_DEFINES
 #include <math.h>
 
+#include <cfloat>
+#include <chrono>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
 #include <lodepng.h>
+#include "Animation.hpp"
+#include "BVHCache.hpp"
+#include "Denoise.hpp"
+#include "Framebuffer.hpp"
 #include "Image.hpp"
 #include "LinAlg.hpp"
 #include "Light.hpp"
+#include "ParallelDeflate.hpp"
+#include "PNGStream.hpp"
+#include "Relight.hpp"
+#include "Render.hpp"
+#include "Scene.hpp"
+#include "SceneFile.hpp"
+#include "Simd.hpp"
+#include "Sphere.hpp"
+#include "Stats.hpp"
+#include "ThreadPool.hpp"
+#include "Tracer.hpp"
 
 // =========== Week 9 Lab ==============
 // Let's make our ultimate Sphere tracer!
 //
+// The intersection and normal code (tasks 1-2) is in Sphere.hpp, and the tracing code
+// (tasks 4, 6, 8 and 9) is in Tracer.hpp.
+//
 // Task 1: Add Ray-Sphere intersection
 // Task 2: Find the sphere normal
 // Task 3: Try raytracing your scene - you should see your first raytraced spheres!
@@ -34,323 +58,389 @@
 // is generally a really bad idea (it can lead to hard-to-find bugs very easily).
 using namespace Eigen;
 
-// ***** Important Constants *****
-
-// This colour is the default one used if e.g. we don't hit anything,
-// or we exceed the maximum bounce limit.
-const Vector3f ambientColour(0.1f, 0.1f, 0.1f); 
-
-// Maximum number of bounces (includes both reflection and refraction).
-// This limit ensures we don't carry on bouncing forever!
-const int maxBounces = 5;
-
-struct Ray {
-	Vector3f origin, direction;
-};
-
-enum Material {
-	DIFFUSE, MIRROR, REFRACTIVE
-};
-
-struct Sphere {
-	// Geometric properties
-	Vector3f centre;
-	float radius;
-
-	// Material properties
-	Material material;
-	Vector3f colour;
-	float ior; // Index of refraction (only used for refractive spheres).
-};
-
-struct Camera {
-	Vector3f position, direction, up;
-	float horzFov;
-};
-
-
-bool raySphereIntersection(const Ray& ray, const Sphere& sphere, Vector3f& intersection, float& t, float minT=0.001f)
+void printUsage()
 {
-	// Task 1: Add Ray-Sphere intersection
-	// *** YOUR CODE HERE ***
-	// Find the intersection point between the ray and the sphere. 
-	// If an intersection exists, set the value of "intersection" and "t", and return true!
-	// If no intersection is found, or the value of t is below minT, return false.
-
-	// Steps:
-	// 1. Find the value of A, B and C from the lecture slides.
-	// 2. Find the value of the discriminant B^2 - 4AC
-	// 3. If the discriminant is less than 0, return false (no solutions).
-	// 4. Otherwise, find the two solutions for t (t1 and t2, for example).
-	// 5. Find the smallest solution for t that's bigger than minT.
-	//   a. If such a t exists, set the value of "intersection" and "t" and return true.
-	//   b. If no such t exists, return false.
-
-	// Remove this existing code, that just always returns false.
-	return false;
-	// *** END YOUR CODE ***
-} 
-
-Vector3f getSphereNormal(const Sphere& sphere, const Vector3f& location) {
-	// Task 2: Find the sphere normal
-	// *** YOUR CODE HERE ***
-	// Find the value of the normal to the sphere at the given location.
-	// This should only need one line of code!
-	// See the slides for more detail.
-	// 
-	// Remove this existing code that just returns 0.
-	return Vector3f::Zero();
-	// *** END YOUR CODE ***
+	std::cout << "Usage: SphereTracer [options]\n"
+		<< "  --threads N     Number of render threads (default: one per hardware thread)\n"
+		<< "  --tile-size N   Width and height of render tiles in pixels (default: 32)\n"
+		<< "  --serial        Render on the main thread with a plain per-pixel loop\n"
+		<< "  --packets N     Trace primary rays in N x N packets (N = 4 or 8)\n"
+		<< "  --recursive     Use the recursive traceRay instead of the iterative path loop\n"
+		<< "  --wavefront     Trace each tile's rays a bounce at a time, shading hits grouped by material\n"
+		<< "  --generic-kernels Trace with the kernels for any scene, not ones specialized for this scene\n"
+		<< "  --aa B          Anti-alias adaptively, with at most B samples per pixel on average (e.g. 4)\n"
+		<< "  --aa-samples MIN MAX Samples every pixel starts with, and the most any pixel gets (default: 2 16)\n"
+		<< "  --aa-threshold T Error (0-1, roughly gamma-encoded) below which a pixel is done (default: 0.002)\n"
+		<< "  --spp N         Path trace, with N random samples per pixel (global illumination)\n"
+		<< "  --seed S        Path tracing random seed (default: 1)\n"
+		<< "  --roulette-depth N Path tracing: bounces before Russian roulette starts (default: 2; -1 for never)\n"
+		<< "  --max-depth N   Path tracing: most bounces any path makes (default: 64)\n"
+		<< "  --cutoff T      End paths once their throughput is below T, e.g. 0.004 (about one 8-bit\n"
+		<< "                  step; slightly biased, default 0: never)\n"
+		<< "  --denoise       Denoise the path traced image (edge-aware a-trous filter)\n"
+		<< "  --serial-png    Compress the PNG on one thread with lodepng's own compressor\n"
+		<< "  --stream-png    Render in bands of rows, writing each band to the PNG as it finishes\n"
+		<< "  --size W H      Image width and height in pixels (default: 512 512)\n"
+		<< "  --scene FILE    Render the scene in FILE (binary, or text: see SceneFile.hpp) instead of\n"
+		<< "                  the built-in one\n"
+		<< "  --bvh-cache FILE Load the BVH from FILE if it was saved for these spheres, otherwise build\n"
+		<< "                  it and save it there (default with --scene: the scene file's name + .bvh)\n"
+		<< "  --no-bvh-cache  Always build the BVH, and don't save it\n"
+		<< "  --animation FILE Render the frames of the keyframed animation in FILE (see Animation.hpp),\n"
+		<< "                  saved as output_0000.png, output_0001.png, ...\n"
+		<< "  --rebuild-threshold R Animation: refit the BVH as spheres move, until that has made it R\n"
+		<< "                  times as costly to trace as when it was built, then rebuild it (default: 1.5)\n"
+		<< "  --relight FILE  After rendering, render the same view again lit by the lights in scene file\n"
+		<< "                  FILE instead (its spheres are ignored), saved as output_relit_1.png; can be\n"
+		<< "                  given more than once. Only the lighting is redone, not the camera rays\n"
+		<< "  --light-error E Light point and spot lights with light cuts, to within E of each point's\n"
+		<< "                  total light (e.g. 0.02; default 0: every light exactly)\n"
+		<< "  --simd LEVEL    SIMD kernels to use: auto (default: the best this CPU has), " << simdLevelNames[SIMD_BASELINE] << ",\n"
+		<< "                  avx2 or avx512\n"
+		<< "  --stats         Print ray counts and stage timings, and write them to stats.json\n"
+		<< "  --stats-file F  Write the --stats JSON to F instead\n";
 }
 
-bool refract(const Vector3f& incident, const Vector3f& norm, float eta, Vector3f& refracted)
+int main(int argc, char** argv)
 {
-	// *** YOUR CODE HERE ***
-	// Find the refracted ray! Set the refracted variable to equal the refracted direction.
-	// If a ray is refracted, return true. If Total Internal Reflection (TIR) occurs, return false.
-	// If you return false you don't need to set the value of "refracted"!
-
-
-	// Steps:
-	// 1. Find the value of the "k" from the lecture slides.
-	// 2. If k < 0, return false (TIR occurs).
-	// 3. Otherwise, find the refracted ray and return true.
-
-	// This existing code just always returns false.
-	// Remove it when you write your own code!
-	return false;
-	// *** END YOUR CODE
-}
-
-Vector3f traceRay(const Ray& ray, const std::vector<Sphere>& spheres, const std::vector<std::unique_ptr<Light>>& lights, int bounce=0)
-{
-	// First, if we get to too many bounces, we need to exit and do something reasonable 
-	// I've chosen to return the ambient default colour.
-	if (bounce > maxBounces) return ambientColour;
-
-	// Task 8: Look at the sphere intersection testing code here to prep for task 9.
-	// Keep track of the minimum t thus far,
-	// where our closest hit location is,
-	// and the closest sphere we've hit.
-	float minHitT = FLT_MAX;
-	Vector3f hitIntersection;
-	const Sphere* hitSphere = nullptr;
-
-	// Intersect each sphere, and if the hit is closer and valid,
-	// update the closest hit info.
-	for (const Sphere& sphere : spheres) {
-		float t;
-		Vector3f intersection;
-		if (raySphereIntersection(ray, sphere, intersection, t)) {
-			if (t < minHitT) {
-				minHitT = t;
-				hitSphere = &sphere;
-				hitIntersection = intersection;
-			}
+	std::string outputFilename = "output.png";
+	std::string sceneFilename, bvhCacheFilename;
+	bool bvhCache = true;
+	std::string animationFilename;
+	SequenceSettings sequence;
+	std::vector<std::string> relightFilenames;
+
+	int nThreads = 0;
+	RenderSettings settings;
+	bool serialPNG = false;
+	bool streamPNG = false;
+	int width = 512, height = 512;
+	float lightError = 0.f;
+	std::string simdName = "auto";
+	bool denoiseImage = false;
+	bool aa = false;
+	int aaMinSamples = 2;
+	bool stats = false;
+	std::string statsFilename = "stats.json";
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--threads" && i + 1 < argc) nThreads = std::stoi(argv[++i]);
+		else if (arg == "--tile-size" && i + 1 < argc) settings.tileSize = std::stoi(argv[++i]);
+		else if (arg == "--serial") settings.serial = true;
+		else if (arg == "--packets" && i + 1 < argc) settings.packetSize = std::stoi(argv[++i]);
+		else if (arg == "--recursive") settings.recursive = true;
+		else if (arg == "--wavefront") settings.wavefront = true;
+		else if (arg == "--generic-kernels") settings.genericKernels = true;
+		else if (arg == "--aa" && i + 1 < argc) {
+			settings.adaptive.budget = std::stof(argv[++i]);
+			aa = true;
+		}
+		else if (arg == "--aa-samples" && i + 2 < argc) {
+			aaMinSamples = std::stoi(argv[++i]);
+			settings.adaptive.maxSamples = std::stoi(argv[++i]);
+		}
+		else if (arg == "--aa-threshold" && i + 1 < argc) settings.adaptive.threshold = std::stof(argv[++i]);
+		else if (arg == "--spp" && i + 1 < argc) settings.pathTrace.samplesPerPixel = std::stoi(argv[++i]);
+		else if (arg == "--seed" && i + 1 < argc) settings.pathTrace.seed = static_cast<uint32_t>(std::stoul(argv[++i]));
+		else if (arg == "--roulette-depth" && i + 1 < argc) settings.pathTrace.rouletteDepth = std::stoi(argv[++i]);
+		else if (arg == "--max-depth" && i + 1 < argc) settings.pathTrace.maxDepth = std::stoi(argv[++i]);
+		else if (arg == "--cutoff" && i + 1 < argc) settings.contributionCutoff = settings.pathTrace.cutoff = std::stof(argv[++i]);
+		else if (arg == "--denoise") denoiseImage = true;
+		else if (arg == "--serial-png") serialPNG = true;
+		else if (arg == "--stream-png") streamPNG = true;
+		else if (arg == "--light-error" && i + 1 < argc) lightError = std::stof(argv[++i]);
+		else if (arg == "--simd" && i + 1 < argc) simdName = argv[++i];
+		else if (arg == "--stats") stats = true;
+		else if (arg == "--stats-file" && i + 1 < argc) statsFilename = argv[++i];
+		else if (arg == "--scene" && i + 1 < argc) sceneFilename = argv[++i];
+		else if (arg == "--bvh-cache" && i + 1 < argc) bvhCacheFilename = argv[++i];
+		else if (arg == "--no-bvh-cache") bvhCache = false;
+		else if (arg == "--animation" && i + 1 < argc) animationFilename = argv[++i];
+		else if (arg == "--rebuild-threshold" && i + 1 < argc) sequence.maxCostGrowth = std::stof(argv[++i]);
+		else if (arg == "--relight" && i + 1 < argc) relightFilenames.push_back(argv[++i]);
+		else if (arg == "--size" && i + 2 < argc) {
+			width = std::stoi(argv[++i]);
+			height = std::stoi(argv[++i]);
+		}
+		else {
+			printUsage();
+			return 1;
 		}
 	}
-
-	// If we didn't hit anything, exit early and return the default colour.
-	if (!hitSphere) {
-		return ambientColour;
+	if (settings.tileSize <= 0) {
+		std::cout << "Tile size must be positive." << std::endl;
+		return 1;
 	}
-
-	// If we hit a diffuse material, do lighting calculations!
-	// These are currently pretty much what we did for rasterisation before - do the dot product,
-	// and a coefft-wise product with the albedo.
-	else if (hitSphere->material == Material::DIFFUSE) {
-		Vector3f color = Vector3f::Zero();
-
-		for (const auto& light : lights) {
-			if (light->getType() == Light::AMBIENT) {
-				// Ambient lighting.
-				// No need for a shadow test here!
-				color += coeffWiseMultiply(hitSphere->colour, light->getLightIntensity());
-			}
-			else {
-				Vector3f lightDir = light->getDirection(hitIntersection);
-				// shadow test
-				bool inShadow = false;
-
-				// Task 9: Add shadow testing, trace and check it works!
-				// *** YOUR CODE HERE ***
-				// Add shadow testing to cast pixel-perfect shadows!
-				// I've found the direction from the light to the surface, and 
-				// set up an inShadow variable above. You should set this inShadow to true
-				// if you find a sphere is blocking the light from the surface.
-
-				// The overall code will be similar to the sphere intersection code above, with a few 
-				// changes:
-				// 1. You don't need to keep track of the closest hit this time - the minute you find
-				//    a blocking object, exit the for loop early and set inShadow to true.
-				// 2. If the light is DIRECTIONAL, distance doesn't matter. If it's a POINT or SPOT light, 
-				//    things should only block the light source if the hit location is closer than the light.
-				// 3. Optional: should REFRACTIVE spheres cast shadows? Maybe ignore hits from REFRACTIVE spheres.
-				//              If you want to be really fancy, you could coefft-wise multiply by the colour of
-				//              the refractive sphere.
-
-				// Steps:
-				// 1. Construct a shadow ray, from the hit location, pointing towards the light.
-				// 2. For loop over all the spheres, testing for intersection.
-				//		a. If there is a hit, check the sphere type isn't REFRACTIVE
-				//		b. If the light is DIRECTIONAL, the point is definitely in shadow
-				//      c. If it's not, compare the value of t to the distance from hitIntersection to the light
-				//			the point is only in shadow if the value of t is less than this distance.
-				// *** END YOUR CODE ***
-
-				// If we're in shadow, this light source doesn't contribute to the colour so continue to the next.
-				if (inShadow) continue;
-
-				// Normal diffuse lighting calculations
-				float dotProd = -lightDir.dot(getSphereNormal(*hitSphere, hitIntersection));
-				dotProd = std::max(dotProd, 0.f);
-				Vector3f reflectance = hitSphere->colour * dotProd;
-				color += coeffWiseMultiply(reflectance, light->getIntensityAt(hitIntersection));
-			}
-		}
-		return color;
+	if (settings.packetSize != 0 && settings.packetSize != 4 && settings.packetSize != 8) {
+		std::cout << "Packet size must be 4 or 8." << std::endl;
+		return 1;
 	}
-	else if (hitSphere->material == Material::MIRROR) {
-		// Task 4: Add mirror reflection
-		// *** YOUR CODE HERE ***
-		// 1. Find the reflected ray, and call traceRay again recursively
-		// 2. Return the resulting colour.
-		// Optional extra task: coefft-wise multiply this returned colour with this 
-		// sphere's own colour. This will allow you to simulate coloured mirrors.
-		// REMINDER: don't forget to increase the value of bounce by 1 when you call traceRay
-		// again recursively! This will make sure you don't exceed the maxBounces bounce count.
-
-		// This existing code throws an error as mirror spheres haven't been implemented yet.
-		// Remove it when you've implemented mirrors!
-		throw std::runtime_error("Mirror material not implemented!");
-		//*** END YOUR CODE
+	if (aa) settings.adaptive.minSamples = aaMinSamples;
+	if (aaMinSamples < 1 || settings.adaptive.maxSamples < aaMinSamples) {
+		std::cout << "Anti-aliasing samples must be at least 1, with MAX no less than MIN." << std::endl;
+		return 1;
 	}
-	else if (hitSphere->material == Material::REFRACTIVE) {
-		// I've handled a few fiddly bits of the refraction code for you here:
-		float eta; // This is n1/n2, the ratio of IORs.
-		Vector3f normal = getSphereNormal(*hitSphere, hitIntersection);
-
-		// Check if we're going into a sphere, or coming out of a sphere.
-		bool enteringSphere = ray.direction.dot(normal) < 0;
-
-		// The below code to find eta assumes all spheres are surrounded by air.
-		// If you plan to set up scenes with spheres that intersect or surround each other, this will need revising!
-
-		// If we're entering the sphere, we assume we're coming from free air so n1=1, n2=the IOR of the sphere.
-		if (enteringSphere) eta = 1.f / hitSphere->ior;
-
-		// If we're leaving the sphere, we assume we're going from the sphere into air, so n1=IOR, n2=1
-		else eta = hitSphere->ior;
-
-		// Finally, if we're leaving the sphere the normal will need flipping so our refract() function works
-		// correctly.
-		if (!enteringSphere) normal = -normal;
-
-		// Task 6: Add refraction
-		// *** YOUR CODE HERE ***
-
-		// Remove this line when you've implemented refraction!
-		throw std::runtime_error("Mirror material not implemented!");
-
-		// Handle refraction, and total internal reflection!
-		// Steps:
-		// 1. Try to refract the incoming ray in the normal, using the value of eta calculated above.
-		// 2. If refract returns true:
-		//		a. Construct a refracted ray
-		//      b. Call traceRay to find the colour. Don't forget to use bounce+1!
-		//      c. Optional: Coefft-wise multiply the result with this hit sphere's colour (this will allow you to 
-		//         make coloured glass).
-		// 3. If refract returns false:
-		//      a. Total Internal Reflection has occured!
-		//      b. Find the reflected direction, and make a reflected ray.
-		//      c. Trace the reflected ray. Again, make sure to use bounce+1!
-
-		// *** END YOUR CODE ***
+	if (settings.pathTrace.samplesPerPixel < 0) {
+		std::cout << "Samples per pixel can't be negative." << std::endl;
+		return 1;
 	}
-}
-
-int main()
-{
-	std::string outputFilename = "output.png";
-
-	const int width = 512, height = 512;
-	const int nChannels = 4;
-
-	std::vector<uint8_t> imageBuffer(height*width*nChannels);
-
-	// This line sets the image to black initially.
-	Color black{ 0,0,0,255 };
-	for (int r = 0; r < height; ++r) {
-		for (int c = 0; c < width; ++c) {
-			setPixel(imageBuffer, c, r, width, height, black);
-		}
+	if (denoiseImage && (settings.pathTrace.samplesPerPixel == 0 || streamPNG)) {
+		std::cout << "--denoise needs --spp, and can't be used with --stream-png." << std::endl;
+		return 1;
+	}
+	if (aa && streamPNG) {
+		// Adaptive sampling spreads its budget over the rows being rendered, so the image
+		// would depend on where the bands start and end.
+		std::cout << "--aa can't be used with --stream-png." << std::endl;
+		return 1;
+	}
+	if (!animationFilename.empty() && streamPNG) {
+		std::cout << "--animation can't be used with --stream-png." << std::endl;
+		return 1;
+	}
+	if (!relightFilenames.empty() && (aa || settings.pathTrace.samplesPerPixel > 0 || streamPNG || !animationFilename.empty())) {
+		std::cout << "--relight can't be used with --aa, --spp, --stream-png or --animation." << std::endl;
+		return 1;
+	}
+	if (sequence.maxCostGrowth < 1.f) {
+		std::cout << "Rebuild threshold must be at least 1." << std::endl;
+		return 1;
+	}
+	if (settings.pathTrace.maxDepth < 0) {
+		std::cout << "Max depth can't be negative." << std::endl;
+		return 1;
+	}
+	if (settings.contributionCutoff < 0.f) {
+		std::cout << "Cutoff can't be negative." << std::endl;
+		return 1;
+	}
+	if (width <= 0 || height <= 0) {
+		std::cout << "Image size must be positive." << std::endl;
+		return 1;
+	}
+	if (lightError < 0.f) {
+		std::cout << "Light error can't be negative." << std::endl;
+		return 1;
+	}
+	SimdLevel level;
+	if (!parseSimdLevel(simdName, level)) {
+		printUsage();
+		return 1;
+	}
+	if (!setSimdLevel(level)) {
+		std::cout << "This CPU can't run the " << simdName << " kernels (the best it has is " << simdLevelNames[maxSimdLevel()] << ")." << std::endl;
+		return 1;
 	}
 
-	std::vector<std::unique_ptr<Light>> lights;
-	lights.emplace_back(new AmbientLight(Vector3f(0.1f, 0.1f, 0.1f)));
-	lights.emplace_back(new DirectionalLight(Vector3f(0.4f, 0.4f, 0.4f), Vector3f(1.f, -1.f, 0.0f)));
-
-	// This code sets up a scene with a bunch of spheres.
-	// I've initially set up the scene with diffuse spheres only. Once you've implemented 
-	// MIRROR and REFRACTIVE spheres, you can uncomment these or add your own!
-	std::vector<Sphere> spheres;
-	spheres.push_back({ Vector3f(2.f, 0.f, 4.f), 1.f, Material::DIFFUSE, Vector3f(0.f, 0.8f, 0.8f) });
-	spheres.push_back({ Vector3f(-2.f, 0.f, 4.f), 0.5f, Material::DIFFUSE, Vector3f(0.8f, 0.f, 0.8f) });
-	spheres.push_back({ Vector3f(0.f, 2.f, 4.f), 0.5f, Material::DIFFUSE, Vector3f(0.8f, 0.8f, 0.f) });
-	spheres.push_back({ Vector3f(0.f, -2.f, 4.f), 0.5f, Material::DIFFUSE, Vector3f(0.2f, 0.2f, 0.8f) });
-	spheres.push_back({ Vector3f(0.f, 1.f, 6.f), 0.3f, Material::DIFFUSE, Vector3f(0.8f, 0.8f, 0.f) });
-	// Task 5: Add a mirror reflective sphere to your scene, and raytrace again!
-	//spheres.push_back({ Vector3f(2.f, 2.f, 4.f), 0.5f, Material::MIRROR, Vector3f(0.9f, 0.9f, 0.9f) });
-	// Task 7: Add a refractive sphere to your scene, and raytrace again!
-	//spheres.push_back({ Vector3f(0.f, 0.f, 3.f), 0.5f, Material::REFRACTIVE, Vector3f(0.9f, 0.8f, 0.8f), 1.4f });
+	// The tracer writes linear colours into this float image (starting black). Gamma
+	// correction and conversion to 8 bits happen once at the end, in tonemapToRGBA8.
+	FloatImage framebuffer;
+	GBuffer gbuffer;
+	std::vector<uint8_t> imageBuffer;
 
+	Scene scene;
 	Camera camera{
 		Vector3f(0.f, 0.f, 0.f), // position
 		Vector3f(0.f, 0.f, 1.f), // direction
 		Vector3f(0.f, 1.f, 0.f), // up
 		M_PI_2 // horzFov
 	};
+	double sceneLoadSeconds = 0.0;
+	if (!sceneFilename.empty()) {
+		auto loadStart = std::chrono::steady_clock::now();
+		try {
+			loadScene(sceneFilename, scene, camera);
+		}
+		catch (const std::runtime_error& error) {
+			std::cout << error.what() << std::endl;
+			return 1;
+		}
+		sceneLoadSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - loadStart).count();
+	}
+	else {
+		std::vector<std::unique_ptr<Light>>& lights = scene.lights;
+		lights.emplace_back(new AmbientLight(Vector3f(0.1f, 0.1f, 0.1f)));
+		lights.emplace_back(new DirectionalLight(Vector3f(0.4f, 0.4f, 0.4f), Vector3f(1.f, -1.f, 0.0f)));
+
+		// This code sets up a scene with a bunch of spheres.
+		// The MIRROR and REFRACTIVE spheres are enabled now those materials are implemented -
+		// comment them out or add your own!
+		std::vector<Sphere>& spheres = scene.spheres;
+		spheres.push_back({ Vector3f(2.f, 0.f, 4.f), 1.f, Material::DIFFUSE, Vector3f(0.f, 0.8f, 0.8f) });
+		spheres.push_back({ Vector3f(-2.f, 0.f, 4.f), 0.5f, Material::DIFFUSE, Vector3f(0.8f, 0.f, 0.8f) });
+		spheres.push_back({ Vector3f(0.f, 2.f, 4.f), 0.5f, Material::DIFFUSE, Vector3f(0.8f, 0.8f, 0.f) });
+		spheres.push_back({ Vector3f(0.f, -2.f, 4.f), 0.5f, Material::DIFFUSE, Vector3f(0.2f, 0.2f, 0.8f) });
+		spheres.push_back({ Vector3f(0.f, 1.f, 6.f), 0.3f, Material::DIFFUSE, Vector3f(0.8f, 0.8f, 0.f) });
+		// Task 5: Add a mirror reflective sphere to your scene, and raytrace again!
+		spheres.push_back({ Vector3f(2.f, 2.f, 4.f), 0.5f, Material::MIRROR, Vector3f(0.9f, 0.9f, 0.9f) });
+		// Task 7: Add a refractive sphere to your scene, and raytrace again!
+		spheres.push_back({ Vector3f(0.f, 0.f, 3.f), 0.5f, Material::REFRACTIVE, Vector3f(0.9f, 0.8f, 0.8f), 1.4f });
+	}
+	Animation animation;
+	if (!animationFilename.empty()) {
+		try {
+			readAnimationFile(animationFilename, animation);
+		}
+		catch (const std::runtime_error& error) {
+			std::cout << error.what() << std::endl;
+			return 1;
+		}
+	}
+	PrimaryRayGenerator rays(camera, width, height);
+
+	ThreadPool pool(nThreads);
+	if (!bvhCache) bvhCacheFilename.clear();
+	else if (bvhCacheFilename.empty() && !sceneFilename.empty()) bvhCacheFilename = sceneFilename + ".bvh";
+	bool bvhFromCache = false;
+	auto bvhStart = std::chrono::steady_clock::now();
+	if (!bvhCacheFilename.empty()) {
+		try {
+			bvhFromCache = buildBVHCached(scene, bvhCacheFilename, &pool);
+		}
+		catch (const std::runtime_error& error) {
+			std::cout << error.what() << " (the BVH won't be cached)" << std::endl;
+		}
+	}
+	else {
+		scene.buildBVH(&pool);
+	}
+	double bvhSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - bvhStart).count();
+	scene.buildLightTable();
+	scene.lightCuts.maxError = lightError;
+
+	// The stats cover everything from here to the PNG being saved.
+	if (stats && !SPHERETRACER_STATS) {
+		std::cout << "This build has no stats: reconfigure with -DSPHERETRACER_STATS=ON." << std::endl;
+		stats = false;
+	}
+	statsTimersEnabled() = stats;
+	resetStats();
+	auto frameStart = std::chrono::steady_clock::now();
+	double denoiseSeconds = 0.0;
+	double relightRecordSeconds = 0.0;
+	std::vector<double> relightSeconds;
+	auto reportStats = [&]() {
+		if (!stats) return;
+		double frameSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - frameStart).count();
+		RenderStats frameStats = collectStats();
+		printStats(std::cout, frameStats, frameSeconds);
+		std::cout << "SIMD kernels: " << simdLevelNames[simdLevel] << std::endl;
+		if (!sceneFilename.empty()) {
+			std::cout << "Scene loading: " << sceneLoadSeconds * 1e3 << " ms (" << scene.spheres.size() << " spheres)" << std::endl;
+		}
+		std::cout << "BVH: " << bvhSeconds * 1e3 << " ms (" << (bvhFromCache ? "loaded from " + bvhCacheFilename
+			: bvhCacheFilename.empty() ? std::string("built") : "built, and saved to " + bvhCacheFilename) << ")" << std::endl;
+		if (denoiseImage && animationFilename.empty()) {
+			std::cout << "Denoising: " << denoiseSeconds * 1e3 << " ms (" << denoiseSeconds * 1e3 / (width * 1e-6 * height) << " ms per megapixel)" << std::endl;
+		}
+		if (!relightFilenames.empty()) {
+			std::cout << "Relighting: recording paths " << relightRecordSeconds * 1e3 << " ms, relighting";
+			for (double seconds : relightSeconds) std::cout << " " << seconds * 1e3;
+			std::cout << " ms" << std::endl;
+		}
+		if (!writeStatsJSON(statsFilename, frameStats, frameSeconds, width, height, pool.size())) {
+			std::cout << "Couldn't write " << statsFilename << std::endl;
+		}
+	};
 
-	float vertFov = (camera.horzFov * height) / width;
-	float minX = -atanf(camera.horzFov * 0.5f);
-	float xStep = -2.f * minX / width;
-	float minY = -atanf(vertFov * 0.5f);
-	float yStep = -2.f * minY / width;
-
-	Vector3f across = -camera.direction.cross(camera.up).normalized();
-
-	for (int x = 0; x < width; ++x)
-		for (int y = 0; y < height; ++y) {
-			Ray ray;
-			ray.origin = camera.position;
-			ray.direction = camera.direction + minX * across + minY * camera.up;
-			ray.direction += across * x * xStep;
-			ray.direction += camera.up * y * yStep;
-			ray.direction.normalize();
-
-			//ray.origin = Vector3f::Zero();
-			//ray.direction = Vector3f(0.f, 0.f, 1.f);
-
-			Vector3f color = traceRay(ray, spheres, lights);
+	if (!animationFilename.empty()) {
+		sequence.width = width;
+		sequence.height = height;
+		sequence.filenamePrefix = outputFilename.substr(0, outputFilename.rfind('.')) + "_";
+		sequence.denoise = denoiseImage;
+		sequence.serialPNG = serialPNG;
+		SequenceStats sequenceStats;
+		try {
+			sequenceStats = renderSequence(scene, animation, camera, settings, sequence, pool);
+		}
+		catch (const std::runtime_error& error) {
+			std::cout << error.what() << std::endl;
+			return 1;
+		}
+		reportStats();
+		if (stats) {
+			std::cout << "Animation: " << sequenceStats.nFrames << " frames, BVH refitted " << sequenceStats.nRefits << " times and rebuilt "
+				<< sequenceStats.nRebuilds << " times (" << sequenceStats.bvhSeconds * 1e3 << " ms), rendering " << sequenceStats.renderSeconds * 1e3
+				<< " ms, waiting for PNGs " << sequenceStats.encodeWaitSeconds * 1e3 << " ms" << std::endl;
+		}
+		return 0;
+	}
 
-			Color c;
-			// Gamma-correcting colours.
-			c.r = std::min(powf(color.x(), 1 / 2.2f), 1.0f) * 255;
-			c.g = std::min(powf(color.y(), 1 / 2.2f), 1.0f) * 255;
-			c.b = std::min(powf(color.z(), 1 / 2.2f), 1.0f) * 255;
-			c.a = 255;
-			setPixel(imageBuffer, x, height-y-1, width, height, c);
+	if (streamPNG) {
+		// Render from the top of the image down, a band at a time, and pass each finished band
+		// to the PNG writer. Its compression runs on the pool alongside the next band's tiles.
+		// Bands are made tall enough to give every thread a couple of tiles, and the
+		// framebuffer only ever holds one band.
+		int tileSize = settings.tileSize;
+		int tilesPerRow = (width + tileSize - 1) / tileSize;
+		int bandHeight = tileSize * std::max(1, (2 * pool.size() + tilesPerRow - 1) / tilesPerRow);
+		PNGStreamWriter writer(outputFilename, width, height, &pool);
+		for (int row0 = 0; row0 < height; row0 += bandHeight) {
+			int row1 = std::min(row0 + bandHeight, height);
+			framebuffer.resize(width, row1 - row0);
+			renderRows(scene, rays, settings, pool, framebuffer, row0, height - row1, height - row0);
+			tonemapToRGBA8(framebuffer, imageBuffer, 1.f, &pool);
+			writer.writeRows(imageBuffer.data(), row1 - row0);
 		}
-	
+		writer.finish();
+		reportStats();
+		return 0;
+	}
 
+	// With --relight, every pixel's path is recorded first, and the frame drawn from that
+	// (the same image renderFrame draws), so it can be drawn again with other lights.
+	RelightBuffer relightBuffer;
+	if (!relightFilenames.empty()) {
+		auto recordStart = std::chrono::steady_clock::now();
+		recordRelightBuffer(scene, rays, settings, pool, relightBuffer);
+		relightRecordSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - recordStart).count();
+		auto relightStart = std::chrono::steady_clock::now();
+		relight(scene, relightBuffer, pool, framebuffer, settings.genericKernels);
+		relightSeconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - relightStart).count());
+	}
+	else renderFrame(scene, rays, settings, pool, framebuffer, denoiseImage ? &gbuffer : nullptr);
+	if (denoiseImage) {
+		auto denoiseStart = std::chrono::steady_clock::now();
+		denoise(framebuffer, gbuffer, DenoiseSettings(), &pool);
+		denoiseSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - denoiseStart).count();
+	}
 
-	// Save the image to png.
-	int errorCode;
-	errorCode = lodepng::encode(outputFilename, imageBuffer, width, height);
-	if (errorCode) { // check the error code, in case an error occurred.
-		std::cout << "lodepng error encoding image: " << lodepng_error_text(errorCode) << std::endl;
+	// Gamma-correct and quantize, then save the image to png.
+	// By default the PNG compression is split into chunks that are deflated on the pool.
+	auto savePNG = [&](const std::string& filename) {
+		tonemapToRGBA8(framebuffer, imageBuffer, 1.f, &pool);
+		std::vector<unsigned char> png;
+		int errorCode;
+		if (serialPNG) {
+			STATS_TIME(ENCODE_STAGE);
+			errorCode = lodepng::encode(png, imageBuffer, width, height);
+		}
+		else errorCode = encodePNGParallel(png, imageBuffer, width, height, pool);
+		if (!errorCode) errorCode = lodepng::save_file(png, filename);
+		if (errorCode) { // check the error code, in case an error occurred.
+			std::cout << "lodepng error encoding image: " << lodepng_error_text(errorCode) << std::endl;
+		}
 		return errorCode;
+	};
+	if (int errorCode = savePNG(outputFilename)) return errorCode;
+
+	// Relight the frame with each set of lights in turn.
+	for (size_t i = 0; i < relightFilenames.size(); ++i) {
+		try {
+			loadSceneLights(relightFilenames[i], scene);
+		}
+		catch (const std::runtime_error& error) {
+			std::cout << error.what() << std::endl;
+			return 1;
+		}
+		auto relightStart = std::chrono::steady_clock::now();
+		scene.buildLightTable();
+		relight(scene, relightBuffer, pool, framebuffer, settings.genericKernels);
+		relightSeconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - relightStart).count());
+		std::string filename = outputFilename.substr(0, outputFilename.rfind('.')) + "_relit_" + std::to_string(i + 1) + ".png";
+		if (int errorCode = savePNG(filename)) return errorCode;
 	}
 
+	reportStats();
 	return 0;
 }
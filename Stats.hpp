@@ -0,0 +1,339 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Performance counters for the renderer's hot paths: how many rays of each kind were
+// traced (and at what depth), how much work the BVH did for them, how often the cheap
+// early-outs fired, and how long each stage of making a frame took.
+//
+// The counters are only compiled in if SPHERETRACER_STATS is defined to 1 (the CMake
+// option of the same name). Otherwise STATS_ADD, STATS_COUNT_RAY and STATS_TIME expand to
+// nothing, so the instrumented code is exactly what it was before.
+//
+// Each thread counts into its own RenderStats, so the hot paths never share a cache line
+// or take a lock; collectStats adds them all up at the end of a frame.
+
+#ifndef SPHERETRACER_STATS
+#define SPHERETRACER_STATS 0
+#endif
+
+enum RayType {
+	PRIMARY_RAY, REFLECTED_RAY, REFRACTED_RAY, SHADOW_RAY, nRayTypes
+};
+
+enum RenderStage {
+	RAY_GENERATION_STAGE, TRACE_STAGE, SHADE_STAGE, DENOISE_STAGE, TONEMAP_STAGE, ENCODE_STAGE, nRenderStages
+};
+
+const char* const rayTypeNames[nRayTypes] = { "primary", "reflected", "refracted", "shadow" };
+const char* const renderStageNames[nRenderStages] = { "ray_generation", "trace", "shade", "denoise", "tonemap", "encode" };
+
+// Rays are counted by depth (number of bounces before them) up to this; deeper rays are
+// counted in the last bucket.
+const int statsMaxDepth = 8;
+const int statsMaxSamples = 64; // Pixels with more samples than this are counted with it.
+
+struct RenderStats {
+	uint64_t rays[nRayTypes][statsMaxDepth] = {};
+
+	uint64_t nodesVisited = 0;     // BVH nodes popped off the traversal stack.
+	uint64_t sphereTests = 0;      // Ray-sphere intersection tests (one per ray per sphere).
+
+	// Early-outs.
+	uint64_t boxesMissed = 0;      // BVH nodes skipped because the ray missed their box.
+	uint64_t frustumCulls = 0;     // BVH nodes skipped because a whole packet missed them.
+	uint64_t shadowsOccluded = 0;  // Shadow rays stopped at the first blocker.
+	uint64_t raysMissed = 0;       // Rays that left the scene without hitting anything.
+	uint64_t bounceLimitHits = 0;  // Paths cut off at the bounce limit.
+	uint64_t rouletteKills = 0;    // Paths ended by Russian roulette (path tracing).
+	uint64_t contributionCutoffs = 0; // Paths ended because they could no longer add much.
+
+	// Number of pixels that got each number of samples (rays through the pixel).
+	uint64_t pixelSamples[statsMaxSamples + 1] = {};
+
+	// Time spent in each stage, summed over all the threads doing it.
+	uint64_t stageNanoseconds[nRenderStages] = {};
+
+	uint64_t raysOfType(int type) const
+	{
+		uint64_t total = 0;
+		for (int depth = 0; depth < statsMaxDepth; ++depth) total += rays[type][depth];
+		return total;
+	}
+
+	uint64_t totalPixels() const
+	{
+		uint64_t total = 0;
+		for (int n = 0; n <= statsMaxSamples; ++n) total += pixelSamples[n];
+		return total;
+	}
+
+	double meanSamplesPerPixel() const
+	{
+		double samples = 0.0;
+		for (int n = 0; n <= statsMaxSamples; ++n) samples += double(n) * pixelSamples[n];
+		return totalPixels() ? samples / totalPixels() : 0.0;
+	}
+
+	uint64_t totalRays() const
+	{
+		uint64_t total = 0;
+		for (int type = 0; type < nRayTypes; ++type) total += raysOfType(type);
+		return total;
+	}
+
+	void merge(const RenderStats& other)
+	{
+		for (int type = 0; type < nRayTypes; ++type)
+			for (int depth = 0; depth < statsMaxDepth; ++depth) {
+				rays[type][depth] += other.rays[type][depth];
+			}
+		nodesVisited += other.nodesVisited;
+		sphereTests += other.sphereTests;
+		boxesMissed += other.boxesMissed;
+		frustumCulls += other.frustumCulls;
+		shadowsOccluded += other.shadowsOccluded;
+		raysMissed += other.raysMissed;
+		bounceLimitHits += other.bounceLimitHits;
+		rouletteKills += other.rouletteKills;
+		contributionCutoffs += other.contributionCutoffs;
+		for (int n = 0; n <= statsMaxSamples; ++n) pixelSamples[n] += other.pixelSamples[n];
+		for (int stage = 0; stage < nRenderStages; ++stage) stageNanoseconds[stage] += other.stageNanoseconds[stage];
+	}
+};
+
+/// <summary>
+/// Keeps track of every thread's counters, so they can be added up.
+/// </summary>
+struct StatsRegistry {
+	std::mutex mutex;
+	std::vector<RenderStats*> threads;
+	RenderStats exited; // Counts from threads that have since finished.
+};
+
+StatsRegistry& statsRegistry()
+{
+	static StatsRegistry registry;
+	return registry;
+}
+
+/// <summary>
+/// One thread's counters, registered for as long as the thread runs.
+/// </summary>
+struct ThreadStats {
+	RenderStats stats;
+	bool timing[nRenderStages] = {}; // Which stages have a StageTimer running on this thread.
+
+	ThreadStats()
+	{
+		StatsRegistry& registry = statsRegistry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		registry.threads.push_back(&stats);
+	}
+
+	~ThreadStats()
+	{
+		StatsRegistry& registry = statsRegistry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		registry.exited.merge(stats);
+		registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), &stats));
+	}
+};
+
+ThreadStats& currentThreadStats()
+{
+	thread_local ThreadStats stats;
+	return stats;
+}
+
+/// <summary>
+/// The calling thread's counters.
+/// </summary>
+RenderStats& threadStats()
+{
+	return currentThreadStats().stats;
+}
+
+/// <summary>
+/// Stage timers are only switched on when someone wants the report, as reading the clock
+/// costs about as much as generating a ray. The counters are always on (when compiled in).
+/// </summary>
+bool& statsTimersEnabled()
+{
+	static bool enabled = false;
+	return enabled;
+}
+
+/// <summary>
+/// Adds up the counters of every thread. Only call this while nothing is rendering (e.g.
+/// between frames), as the threads' counters aren't synchronised.
+/// </summary>
+RenderStats collectStats()
+{
+	StatsRegistry& registry = statsRegistry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	RenderStats total = registry.exited;
+	for (const RenderStats* stats : registry.threads) total.merge(*stats);
+	return total;
+}
+
+/// <summary>
+/// Zeroes every thread's counters. Again, only call this while nothing is rendering.
+/// </summary>
+void resetStats()
+{
+	StatsRegistry& registry = statsRegistry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	registry.exited = RenderStats();
+	for (RenderStats* stats : registry.threads) *stats = RenderStats();
+}
+
+/// <summary>
+/// Adds the time from its construction to its destruction to a stage's total, if the
+/// stage timers are enabled. A timer started while the same stage is already being timed
+/// on this thread does nothing, so time is never counted twice (e.g. when a thread waiting
+/// on a parallelFor runs some of its tasks).
+/// </summary>
+class StageTimer {
+	ThreadStats* _thread = nullptr;
+	RenderStage _stage;
+	std::chrono::steady_clock::time_point _start;
+
+public:
+	explicit StageTimer(RenderStage stage)
+		:_stage(stage)
+	{
+		if (!statsTimersEnabled()) return;
+		ThreadStats& thread = currentThreadStats();
+		if (thread.timing[stage]) return;
+		thread.timing[stage] = true;
+		_thread = &thread;
+		_start = std::chrono::steady_clock::now();
+	}
+
+	~StageTimer()
+	{
+		if (!_thread) return;
+		auto elapsed = std::chrono::steady_clock::now() - _start;
+		_thread->stats.stageNanoseconds[_stage] += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+		_thread->timing[_stage] = false;
+	}
+
+	StageTimer(const StageTimer&) = delete;
+	StageTimer& operator=(const StageTimer&) = delete;
+};
+
+void countRay(RayType type, int depth)
+{
+	++threadStats().rays[type][std::min(depth, statsMaxDepth - 1)];
+}
+
+#define STATS_CONCAT_INNER(a, b) a##b
+#define STATS_CONCAT(a, b) STATS_CONCAT_INNER(a, b)
+
+#if SPHERETRACER_STATS
+#define STATS_ADD(counter, n) (threadStats().counter += (n))
+#define STATS_COUNT_RAY(type, depth) countRay(type, depth)
+#define STATS_TIME(stage) StageTimer STATS_CONCAT(stageTimer, __LINE__)(stage)
+#else
+#define STATS_ADD(counter, n) ((void)sizeof(n))
+#define STATS_COUNT_RAY(type, depth) ((void)sizeof(type), (void)sizeof(depth))
+#define STATS_TIME(stage) ((void)0)
+#endif
+
+/// <summary>
+/// Prints a human-readable report of a frame's counters.
+/// </summary>
+/// <param name="frameSeconds">Wall-clock time for the whole frame.</param>
+void printStats(std::ostream& out, const RenderStats& stats, double frameSeconds)
+{
+	uint64_t totalRays = stats.totalRays();
+	auto perRay = [&](uint64_t count) {
+		return totalRays > 0 ? static_cast<double>(count) / totalRays : 0.0;
+	};
+	std::ios::fmtflags flags = out.flags();
+	out << std::fixed << std::setprecision(3);
+
+	out << "Rays: " << totalRays << " (" << (frameSeconds > 0 ? totalRays / frameSeconds * 1e-6 : 0.0) << " Mrays/s)\n";
+	for (int type = 0; type < nRayTypes; ++type) {
+		out << "  " << std::left << std::setw(10) << rayTypeNames[type] << std::right << std::setw(12) << stats.raysOfType(type) << "  by depth:";
+		for (int depth = 0; depth < statsMaxDepth; ++depth) out << ' ' << stats.rays[type][depth];
+		out << '\n';
+	}
+	out << "Samples per pixel:  " << stats.meanSamplesPerPixel() << " mean, by samples:";
+	for (int n = 0; n <= statsMaxSamples; ++n) {
+		if (stats.pixelSamples[n]) out << ' ' << n << (n == statsMaxSamples ? "+" : "") << ':' << stats.pixelSamples[n];
+	}
+	out << '\n';
+	out << "BVH nodes visited:  " << stats.nodesVisited << " (" << perRay(stats.nodesVisited) << " per ray)\n";
+	out << "Ray-sphere tests:   " << stats.sphereTests << " (" << perRay(stats.sphereTests) << " per ray)\n";
+	out << "Early-outs:\n";
+	out << "  boxes missed      " << stats.boxesMissed << '\n';
+	out << "  packet culls      " << stats.frustumCulls << '\n';
+	out << "  shadows occluded  " << stats.shadowsOccluded << '\n';
+	out << "  rays missed       " << stats.raysMissed << '\n';
+	out << "  bounce limit      " << stats.bounceLimitHits << '\n';
+	out << "  roulette          " << stats.rouletteKills << '\n';
+	out << "  cutoff            " << stats.contributionCutoffs << '\n';
+	out << "Stage times (thread-seconds):\n";
+	for (int stage = 0; stage < nRenderStages; ++stage) {
+		out << "  " << std::left << std::setw(16) << renderStageNames[stage] << std::right << stats.stageNanoseconds[stage] * 1e-9 << '\n';
+	}
+	out << "Frame time: " << frameSeconds << " s" << std::endl;
+	out.flags(flags);
+}
+
+/// <summary>
+/// Writes a frame's counters to a JSON file.
+/// </summary>
+/// <returns>False if the file couldn't be written.</returns>
+bool writeStatsJSON(const std::string& filename, const RenderStats& stats, double frameSeconds, int width, int height, int nThreads)
+{
+	std::ofstream out(filename);
+	out << "{\n";
+	out << "  \"width\": " << width << ",\n";
+	out << "  \"height\": " << height << ",\n";
+	out << "  \"threads\": " << nThreads << ",\n";
+	out << "  \"frame_seconds\": " << frameSeconds << ",\n";
+	out << "  \"rays\": {\n";
+	for (int type = 0; type < nRayTypes; ++type) {
+		out << "    \"" << rayTypeNames[type] << "\": { \"total\": " << stats.raysOfType(type) << ", \"by_depth\": [";
+		for (int depth = 0; depth < statsMaxDepth; ++depth) out << (depth ? ", " : "") << stats.rays[type][depth];
+		out << "] }" << (type + 1 < nRayTypes ? "," : "") << '\n';
+	}
+	out << "  },\n";
+	out << "  \"total_rays\": " << stats.totalRays() << ",\n";
+	out << "  \"samples_per_pixel\": { \"mean\": " << stats.meanSamplesPerPixel() << ", \"pixels_by_samples\": {";
+	bool first = true;
+	for (int n = 0; n <= statsMaxSamples; ++n) {
+		if (!stats.pixelSamples[n]) continue;
+		out << (first ? " " : ", ") << '"' << n << (n == statsMaxSamples ? "+" : "") << "\": " << stats.pixelSamples[n];
+		first = false;
+	}
+	out << " } },\n";
+	out << "  \"bvh_nodes_visited\": " << stats.nodesVisited << ",\n";
+	out << "  \"ray_sphere_tests\": " << stats.sphereTests << ",\n";
+	out << "  \"early_outs\": {\n";
+	out << "    \"boxes_missed\": " << stats.boxesMissed << ",\n";
+	out << "    \"packet_culls\": " << stats.frustumCulls << ",\n";
+	out << "    \"shadows_occluded\": " << stats.shadowsOccluded << ",\n";
+	out << "    \"rays_missed\": " << stats.raysMissed << ",\n";
+	out << "    \"bounce_limit\": " << stats.bounceLimitHits << ",\n";
+	out << "    \"roulette\": " << stats.rouletteKills << ",\n";
+	out << "    \"contribution_cutoff\": " << stats.contributionCutoffs << '\n';
+	out << "  },\n";
+	out << "  \"stage_seconds\": {\n";
+	for (int stage = 0; stage < nRenderStages; ++stage) {
+		out << "    \"" << renderStageNames[stage] << "\": " << stats.stageNanoseconds[stage] * 1e-9 << (stage + 1 < nRenderStages ? "," : "") << '\n';
+	}
+	out << "  }\n";
+	out << "}\n";
+	return static_cast<bool>(out);
+}
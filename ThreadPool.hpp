@@ -0,0 +1,180 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// <summary>
+/// A fixed-size pool of worker threads using work stealing.
+/// Each worker has its own task queue. Workers take tasks from the back of their own
+/// queue, and when it is empty they steal from the front of the other workers' queues.
+/// Threads waiting on a parallelFor also run tasks while they wait, so parallelFor
+/// can safely be called from inside another task.
+/// </summary>
+class ThreadPool {
+private:
+	struct Queue {
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	std::vector<std::unique_ptr<Queue>> _queues;
+	std::vector<std::thread> _workers;
+
+	std::mutex _sleepMutex;
+	std::condition_variable _wake;
+	std::atomic<int> _pending{ 0 };
+	std::atomic<unsigned> _nextQueue{ 0 };
+	bool _stop = false;
+
+	// Which pool (if any) the current thread is a worker of, and its queue index.
+	inline static thread_local const ThreadPool* _currentPool = nullptr;
+	inline static thread_local int _currentIndex = 0;
+
+	void push(std::function<void()> task, int queueIdx)
+	{
+		{
+			std::lock_guard<std::mutex> lock(_queues[queueIdx]->mutex);
+			_queues[queueIdx]->tasks.push_back(std::move(task));
+		}
+		{
+			std::lock_guard<std::mutex> lock(_sleepMutex);
+			++_pending;
+		}
+		_wake.notify_one();
+	}
+
+	bool tryRunTask(int home)
+	{
+		std::function<void()> task;
+		int n = static_cast<int>(_queues.size());
+		for (int i = 0; i < n && !task; ++i) {
+			Queue& queue = *_queues[(home + i) % n];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (queue.tasks.empty()) continue;
+			// Own queue: LIFO for locality. Other queues: steal the oldest task.
+			if (i == 0) {
+				task = std::move(queue.tasks.back());
+				queue.tasks.pop_back();
+			}
+			else {
+				task = std::move(queue.tasks.front());
+				queue.tasks.pop_front();
+			}
+		}
+		if (!task) return false;
+		--_pending;
+		task();
+		return true;
+	}
+
+	int homeQueue() const
+	{
+		return _currentPool == this ? _currentIndex : 0;
+	}
+
+	void workerLoop(int index)
+	{
+		_currentPool = this;
+		_currentIndex = index;
+		while (true) {
+			if (tryRunTask(index)) continue;
+			std::unique_lock<std::mutex> lock(_sleepMutex);
+			_wake.wait(lock, [this] { return _stop || _pending > 0; });
+			if (_stop && _pending == 0) return;
+		}
+	}
+
+public:
+	/// <summary>
+	/// Start the pool.
+	/// </summary>
+	/// <param name="nThreads">Number of worker threads. 0 uses one per hardware thread.</param>
+	explicit ThreadPool(int nThreads = 0)
+	{
+		if (nThreads <= 0) nThreads = std::max(1u, std::thread::hardware_concurrency());
+		for (int i = 0; i < nThreads; ++i) {
+			_queues.emplace_back(new Queue);
+		}
+		for (int i = 0; i < nThreads; ++i) {
+			_workers.emplace_back(&ThreadPool::workerLoop, this, i);
+		}
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_sleepMutex);
+			_stop = true;
+		}
+		_wake.notify_all();
+		for (std::thread& worker : _workers) {
+			worker.join();
+		}
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	int size() const
+	{
+		return static_cast<int>(_workers.size());
+	}
+
+	/// <summary>
+	/// Calls fn(i) for every i in [0, n), spread over the pool, and waits for them all
+	/// to finish. The calling thread helps run tasks while it waits.
+	/// If any call throws, the first exception is rethrown here.
+	/// </summary>
+	void parallelFor(int n, const std::function<void(int)>& fn)
+	{
+		if (n <= 0) return;
+		std::atomic<int> remaining(n);
+		std::exception_ptr error;
+		std::mutex errorMutex;
+
+		int nQueues = static_cast<int>(_queues.size());
+		unsigned first = _nextQueue.fetch_add(1);
+		for (int i = 0; i < n; ++i) {
+			push([&, i] {
+				try {
+					fn(i);
+				}
+				catch (...) {
+					std::lock_guard<std::mutex> lock(errorMutex);
+					if (!error) error = std::current_exception();
+				}
+				--remaining;
+			}, (first + i) % nQueues);
+		}
+
+		int home = homeQueue();
+		while (remaining > 0) {
+			if (!tryRunTask(home)) std::this_thread::yield();
+		}
+		if (error) std::rethrow_exception(error);
+	}
+
+	/// <summary>
+	/// Queues a single task and returns a future for its result.
+	/// Don't block on the future from inside a pool task unless other workers are free
+	/// to run it.
+	/// </summary>
+	template<typename F>
+	auto submit(F&& f) -> std::future<decltype(f())>
+	{
+		using Result = decltype(f());
+		auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(f));
+		std::future<Result> result = task->get_future();
+		int nQueues = static_cast<int>(_queues.size());
+		push([task] { (*task)(); }, _nextQueue.fetch_add(1) % nQueues);
+		return result;
+	}
+};
@@ -0,0 +1,51 @@
+#pragma once
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "ThreadPool.hpp"
+
+/// <summary>
+/// A rectangular block of pixels, covering x in [x0, x1) and y in [y0, y1).
+/// </summary>
+struct Tile {
+	int x0, y0, x1, y1;
+};
+
+/// <summary>
+/// Splits a region of an image into tiles of (at most) tileSize x tileSize pixels,
+/// in row-major order. Tiles on the right and bottom edges are clipped to the region.
+/// </summary>
+std::vector<Tile> makeTiles(const Tile& region, int tileSize)
+{
+	std::vector<Tile> tiles;
+	for (int y0 = region.y0; y0 < region.y1; y0 += tileSize)
+		for (int x0 = region.x0; x0 < region.x1; x0 += tileSize) {
+			tiles.push_back({ x0, y0, std::min(x0 + tileSize, region.x1), std::min(y0 + tileSize, region.y1) });
+		}
+	return tiles;
+}
+
+std::vector<Tile> makeTiles(int width, int height, int tileSize)
+{
+	return makeTiles(Tile{ 0, 0, width, height }, tileSize);
+}
+
+/// <summary>
+/// Calls renderTile(tile) for every tile of a region of the image, spreading the tiles
+/// over the thread pool. Each tile is rendered by exactly one thread, so renderTile can
+/// write its pixels straight into a shared image buffer without locking.
+/// </summary>
+template<typename F>
+void renderTiles(ThreadPool& pool, const Tile& region, int tileSize, F&& renderTile)
+{
+	std::vector<Tile> tiles = makeTiles(region, tileSize);
+	pool.parallelFor(static_cast<int>(tiles.size()), [&](int i) {
+		renderTile(tiles[i]);
+	});
+}
+
+template<typename F>
+void renderTiles(ThreadPool& pool, int width, int height, int tileSize, F&& renderTile)
+{
+	renderTiles(pool, Tile{ 0, 0, width, height }, tileSize, std::forward<F>(renderTile));
+}
@@ -0,0 +1,387 @@
+#pragma once
+#include <algorithm>
+#include <cfloat>
+#include <stdexcept>
+#include <Eigen/Dense>
+#include "BVH.hpp"
+#include "LinAlg.hpp"
+#include "Light.hpp"
+#include "Scene.hpp"
+#include "Sphere.hpp"
+#include "Stats.hpp"
+
+// ***** Important Constants *****
+
+// This colour is the default one used if e.g. we don't hit anything,
+// or we exceed the maximum bounce limit.
+const Eigen::Vector3f ambientColour(0.1f, 0.1f, 0.1f);
+
+// Maximum number of bounces (includes both reflection and refraction).
+// This limit ensures we don't carry on bouncing forever!
+// (The path tracer ends most paths earlier with Russian roulette, see PathTraceSettings.)
+const int maxBounces = 5;
+
+
+bool refract(const Eigen::Vector3f& incident, const Eigen::Vector3f& norm, float eta, Eigen::Vector3f& refracted)
+{
+	// *** YOUR CODE HERE ***
+	// Find the refracted ray! Set the refracted variable to equal the refracted direction.
+	// If a ray is refracted, return true. If Total Internal Reflection (TIR) occurs, return false.
+	// If you return false you don't need to set the value of "refracted"!
+
+
+	// Steps:
+	// 1. Find the value of the "k" from the lecture slides.
+	// 2. If k < 0, return false (TIR occurs).
+	// 3. Otherwise, find the refracted ray and return true.
+	float cosI = norm.dot(incident);
+	float k = 1.f - eta * eta * (1.f - cosI * cosI);
+	if (k < 0.f) return false;
+
+	refracted = eta * incident - (eta * cosI + sqrtf(k)) * norm;
+	return true;
+	// *** END YOUR CODE
+}
+
+// Direct lighting at a point on a diffuse sphere: ambient light, plus every other light
+// that isn't blocked by a shadow ray. depth is the number of bounces the path has made,
+// which is only used to count the shadow rays. With ambient false the ambient lights are
+// left out (the path tracer finds that light by bouncing, so it mustn't be added twice).
+// The lights are read from the scene's packed light table rather than through the Light
+// objects, which saves several virtual calls per light.
+// Features says which SceneFeatures the scene may have; the default handles any scene, and
+// with fewer the branches for the missing ones are compiled out (the colours are the same).
+template <int Features = allSceneFeatures>
+Eigen::Vector3f shadeDiffuse(const Sphere& hitSphere, const Eigen::Vector3f& hitIntersection, const Scene& scene, int depth = 0, bool ambient = true)
+{
+	constexpr bool localLights = (Features & LOCAL_LIGHTS) != 0;
+	STATS_TIME(SHADE_STAGE);
+	// These are currently pretty much what we did for rasterisation before - do the dot product,
+	// and a coefft-wise product with the albedo.
+	Eigen::Vector3f color = Eigen::Vector3f::Zero();
+	auto occludes = [](const Sphere& sphere) {
+		return !(Features & REFRACTIVE_SPHERES) || sphere.material != Material::REFRACTIVE;
+	};
+
+	// With many point and spot lights, they're looked up in the light tree instead (see
+	// LightTree.hpp), and only the ambient and directional lights are done below.
+	bool lightCuts = localLights && scene.useLightCuts();
+	if (lightCuts) {
+		color = scene.lightTree.illuminate(hitIntersection, getSphereNormal(hitSphere, hitIntersection), hitSphere.colour, scene.lightCuts,
+			[&](const Eigen::Vector3f& lightDir, float lightDistance) {
+				bool inShadow = scene.bvh.anyHit(Ray{ hitIntersection, -lightDir }, scene.spheres, lightDistance, occludes);
+				STATS_COUNT_RAY(SHADOW_RAY, depth);
+				if (inShadow) STATS_ADD(shadowsOccluded, 1);
+				return !inShadow;
+			});
+	}
+
+	for (size_t lightIndex = 0; lightIndex < scene.lightTable.size(); ++lightIndex) {
+		const PackedLight& light = scene.lightTable.lights[lightIndex];
+		if (lightCuts && (light.type == Light::POINT || light.type == Light::SPOT)) continue;
+		if (light.type == Light::AMBIENT) {
+			// Ambient lighting.
+			// No need for a shadow test here!
+			if (ambient) color += coeffWiseMultiply(hitSphere.colour, light.intensity);
+		}
+		else {
+			// Without local lights this must be a directional light.
+			Eigen::Vector3f lightDir = localLights ? light.directionAt(hitIntersection) : light.direction;
+			// shadow test
+			bool inShadow = false;
+
+			// Task 9: Add shadow testing, trace and check it works!
+			// *** YOUR CODE HERE ***
+			// Add shadow testing to cast pixel-perfect shadows!
+			// I've found the direction from the light to the surface, and
+			// set up an inShadow variable above. You should set this inShadow to true
+			// if you find a sphere is blocking the light from the surface.
+
+			// The overall code will be similar to the sphere intersection code above, with a few
+			// changes:
+			// 1. You don't need to keep track of the closest hit this time - the minute you find
+			//    a blocking object, exit the for loop early and set inShadow to true.
+			// 2. If the light is DIRECTIONAL, distance doesn't matter. If it's a POINT or SPOT light,
+			//    things should only block the light source if the hit location is closer than the light.
+			// 3. Optional: should REFRACTIVE spheres cast shadows? Maybe ignore hits from REFRACTIVE spheres.
+			//              If you want to be really fancy, you could coefft-wise multiply by the colour of
+			//              the refractive sphere.
+
+			// Steps:
+			// 1. Construct a shadow ray, from the hit location, pointing towards the light.
+			// 2. For loop over all the spheres, testing for intersection.
+			//		a. If there is a hit, check the sphere type isn't REFRACTIVE
+			//		b. If the light is DIRECTIONAL, the point is definitely in shadow
+			//      c. If it's not, compare the value of t to the distance from hitIntersection to the light
+			//			the point is only in shadow if the value of t is less than this distance.
+			Ray shadowRay{ hitIntersection, -lightDir };
+			float lightDistance = localLights ? light.distanceTo(hitIntersection) : FLT_MAX; // FLT_MAX for directional lights.
+			// Directional lights have a grid of the spheres that might be in the way (see ShadowGrid.hpp).
+			if (const DirectionalShadowGrid* grid = scene.shadowGrid(lightIndex)) inShadow = grid->occluded(shadowRay);
+			else inShadow = scene.bvh.anyHit(shadowRay, scene.spheres, lightDistance, occludes);
+			STATS_COUNT_RAY(SHADOW_RAY, depth);
+			if (inShadow) STATS_ADD(shadowsOccluded, 1);
+			// *** END YOUR CODE ***
+
+			// If we're in shadow, this light source doesn't contribute to the colour so continue to the next.
+			if (inShadow) continue;
+
+			// Normal diffuse lighting calculations
+			float dotProd = -lightDir.dot(getSphereNormal(hitSphere, hitIntersection));
+			dotProd = std::max(dotProd, 0.f);
+			Eigen::Vector3f reflectance = hitSphere.colour * dotProd;
+			color += coeffWiseMultiply(reflectance, localLights ? light.intensityAt(lightDir, lightDistance) : light.intensity);
+		}
+	}
+	return color;
+}
+
+// Works out which way a ray goes after hitting a refractive sphere: refracted through the
+// surface, or reflected if total internal reflection occurs.
+// Returns true if the ray was refracted (so it should be tinted by the sphere's colour).
+bool refractiveBounce(const Ray& ray, const Sphere& hitSphere, const Eigen::Vector3f& hitIntersection, Ray& nextRay)
+{
+	// I've handled a few fiddly bits of the refraction code for you here:
+	float eta; // This is n1/n2, the ratio of IORs.
+	Eigen::Vector3f normal = getSphereNormal(hitSphere, hitIntersection);
+
+	// Check if we're going into a sphere, or coming out of a sphere.
+	bool enteringSphere = ray.direction.dot(normal) < 0;
+
+	// The below code to find eta assumes all spheres are surrounded by air.
+	// If you plan to set up scenes with spheres that intersect or surround each other, this will need revising!
+
+	// If we're entering the sphere, we assume we're coming from free air so n1=1, n2=the IOR of the sphere.
+	if (enteringSphere) eta = 1.f / hitSphere.ior;
+
+	// If we're leaving the sphere, we assume we're going from the sphere into air, so n1=IOR, n2=1
+	else eta = hitSphere.ior;
+
+	// Finally, if we're leaving the sphere the normal will need flipping so our refract() function works
+	// correctly.
+	if (!enteringSphere) normal = -normal;
+
+	// Task 6: Add refraction
+	// *** YOUR CODE HERE ***
+
+	// Handle refraction, and total internal reflection!
+	// Steps:
+	// 1. Try to refract the incoming ray in the normal, using the value of eta calculated above.
+	// 2. If refract returns true:
+	//		a. Construct a refracted ray
+	//      b. Call traceRay to find the colour. Don't forget to use bounce+1!
+	//      c. Optional: Coefft-wise multiply the result with this hit sphere's colour (this will allow you to
+	//         make coloured glass).
+	// 3. If refract returns false:
+	//      a. Total Internal Reflection has occured!
+	//      b. Find the reflected direction, and make a reflected ray.
+	//      c. Trace the reflected ray. Again, make sure to use bounce+1!
+	Eigen::Vector3f refracted;
+	if (refract(ray.direction, normal, eta, refracted)) {
+		nextRay = Ray{ hitIntersection, refracted };
+		return true;
+	}
+	nextRay = Ray{ hitIntersection, reflect(ray.direction, normal) };
+	return false;
+	// *** END YOUR CODE ***
+}
+
+Eigen::Vector3f traceRay(const Ray& ray, const Scene& scene, int bounce = 0, RayType type = PRIMARY_RAY);
+
+// Works out the colour seen along a ray, given its closest hit (found by traceRay, or by
+// closestHitPacket for a whole packet of primary rays at once).
+// Any reflected or refracted rays are traced one at a time with traceRay.
+Eigen::Vector3f shadeHit(const Ray& ray, const RayHit& hit, const Scene& scene, int bounce)
+{
+	const Sphere* hitSphere = hit.sphere >= 0 ? &scene.spheres[hit.sphere] : nullptr;
+	Eigen::Vector3f hitIntersection = hit.intersection;
+
+	// If we didn't hit anything, exit early and return the default colour.
+	if (!hitSphere) {
+		STATS_ADD(raysMissed, 1);
+		return ambientColour;
+	}
+
+	// If we hit a diffuse material, do lighting calculations!
+	else if (hitSphere->material == Material::DIFFUSE) {
+		return shadeDiffuse(*hitSphere, hitIntersection, scene, bounce);
+	}
+	else if (hitSphere->material == Material::MIRROR) {
+		// Task 4: Add mirror reflection
+		// *** YOUR CODE HERE ***
+		// 1. Find the reflected ray, and call traceRay again recursively
+		// 2. Return the resulting colour.
+		// Optional extra task: coefft-wise multiply this returned colour with this
+		// sphere's own colour. This will allow you to simulate coloured mirrors.
+		// REMINDER: don't forget to increase the value of bounce by 1 when you call traceRay
+		// again recursively! This will make sure you don't exceed the maxBounces bounce count.
+		Eigen::Vector3f normal = getSphereNormal(*hitSphere, hitIntersection);
+		Ray reflectedRay{ hitIntersection, reflect(ray.direction, normal) };
+		return coeffWiseMultiply(hitSphere->colour, traceRay(reflectedRay, scene, bounce + 1, REFLECTED_RAY));
+		//*** END YOUR CODE
+	}
+	else if (hitSphere->material == Material::REFRACTIVE) {
+		Ray nextRay;
+		if (refractiveBounce(ray, *hitSphere, hitIntersection, nextRay)) {
+			return coeffWiseMultiply(hitSphere->colour, traceRay(nextRay, scene, bounce + 1, REFRACTED_RAY));
+		}
+		return traceRay(nextRay, scene, bounce + 1, REFLECTED_RAY);
+	}
+	throw std::runtime_error("Unknown material type!");
+}
+
+Eigen::Vector3f traceRay(const Ray& ray, const Scene& scene, int bounce, RayType type)
+{
+	// First, if we get to too many bounces, we need to exit and do something reasonable
+	// I've chosen to return the ambient default colour.
+	if (bounce > maxBounces) {
+		STATS_ADD(bounceLimitHits, 1);
+		return ambientColour;
+	}
+	STATS_COUNT_RAY(type, bounce);
+
+	// Task 8: Look at the sphere intersection testing code here to prep for task 9.
+	// The BVH finds the closest sphere the ray hits (the smallest valid t), and where
+	// the hit is. It only tests the spheres in boxes the ray passes through, rather than
+	// looping over every sphere.
+	RayHit hit;
+	scene.bvh.closestHit(ray, scene.spheres, hit);
+	return shadeHit(ray, hit, scene, bounce);
+}
+
+/// <summary>
+/// The state of one path through the scene, carried from bounce to bounce by the iterative
+/// integrator instead of living in recursive call frames.
+/// </summary>
+struct PathState {
+	Ray ray;                    // The ray to trace next.
+	Eigen::Vector3f throughput; // Product of the colour filters (tinted mirrors/glass) so far.
+	int depth;                  // Number of bounces so far.
+
+	// The filter picked up at each bounce. traceRay applies these innermost-first as the
+	// recursion unwinds; replaying them in the same order gives bit-identical colours.
+	Eigen::Vector3f filters[maxBounces + 1];
+	int nFilters;
+
+	explicit PathState(const Ray& startRay)
+		:ray(startRay), throughput(Eigen::Vector3f::Ones()), depth(0), nFilters(0)
+	{
+		// Only the first nFilters are used, but copying a path copies them all. (Eigen's
+		// vectors don't zero themselves, so filters{} wouldn't do.)
+		for (Eigen::Vector3f& filter : filters) filter.setZero();
+	}
+
+	void addFilter(const Eigen::Vector3f& filter)
+	{
+		filters[nFilters++] = filter;
+		throughput = coeffWiseMultiply(throughput, filter);
+	}
+
+	/// <summary>
+	/// The final colour of the path, given the light found at its end.
+	/// </summary>
+	Eigen::Vector3f resolve(Eigen::Vector3f radiance) const
+	{
+		for (int i = nFilters - 1; i >= 0; --i) {
+			radiance = coeffWiseMultiply(filters[i], radiance);
+		}
+		return radiance;
+	}
+};
+
+/// <summary>
+/// Iterative version of traceRay: follows mirror and refractive bounces in a loop, keeping
+/// the path's state in a PathState instead of recursing. Gives exactly the same colours
+/// as traceRay.
+/// </summary>
+/// <param name="primaryHit">If not null, the already-found closest hit of ray (e.g. from a
+/// packet trace), so the first intersection test can be skipped.</param>
+/// <param name="cutoff">A path whose throughput drops below this in every channel ends
+/// there, as if it had hit the bounce limit. 0 never cuts a path off, giving traceRay's
+/// colours exactly; about 1/255 (one 8-bit step) stops long chains of dark mirrors or
+/// glass early, and the image barely changes.</param>
+/// <typeparam name="Features">SceneFeatures the scene may have (see shadeDiffuse). Without
+/// mirrors or glass every path ends at its first hit, so the bounce loop is compiled out.</typeparam>
+template <int Features = allSceneFeatures>
+Eigen::Vector3f traceRayIterative(const Ray& ray, const Scene& scene, const RayHit* primaryHit = nullptr, float cutoff = 0.f)
+{
+	PathState path(ray);
+	RayType type = PRIMARY_RAY; // Only used for the stats.
+	while (true) {
+		if (path.depth > maxBounces) {
+			STATS_ADD(bounceLimitHits, 1);
+			return path.resolve(ambientColour);
+		}
+		STATS_COUNT_RAY(type, path.depth);
+
+		RayHit hit;
+		if (path.depth == 0 && primaryHit) hit = *primaryHit;
+		else scene.bvh.closestHit(path.ray, scene.spheres, hit);
+
+		if (hit.sphere < 0) {
+			STATS_ADD(raysMissed, 1);
+			return path.resolve(ambientColour);
+		}
+
+		const Sphere& hitSphere = scene.spheres[hit.sphere];
+		if (hitSphere.material == Material::DIFFUSE) {
+			return path.resolve(shadeDiffuse<Features>(hitSphere, hit.intersection, scene, path.depth));
+		}
+		else if ((Features & MIRROR_SPHERES) && hitSphere.material == Material::MIRROR) {
+			Eigen::Vector3f normal = getSphereNormal(hitSphere, hit.intersection);
+			path.ray = Ray{ hit.intersection, reflect(path.ray.direction, normal) };
+			path.addFilter(hitSphere.colour);
+			type = REFLECTED_RAY;
+		}
+		else if ((Features & REFRACTIVE_SPHERES) && hitSphere.material == Material::REFRACTIVE) {
+			Ray nextRay;
+			if (refractiveBounce(path.ray, hitSphere, hit.intersection, nextRay)) {
+				path.addFilter(hitSphere.colour);
+				type = REFRACTED_RAY;
+			}
+			else {
+				type = REFLECTED_RAY;
+			}
+			path.ray = nextRay;
+		}
+		else if (hitSphere.material == Material::MIRROR || hitSphere.material == Material::REFRACTIVE) {
+			throw std::logic_error("The scene's spheres have changed since its features were worked out (call buildBVH).");
+		}
+		else {
+			throw std::runtime_error("Unknown material type!");
+		}
+		if (path.throughput.maxCoeff() < cutoff) {
+			STATS_ADD(contributionCutoffs, 1);
+			return path.resolve(ambientColour);
+		}
+		++path.depth;
+	}
+}
+
+typedef Eigen::Vector3f (*TraceKernel)(const Ray& ray, const Scene& scene, const RayHit* primaryHit, float cutoff);
+typedef Eigen::Vector3f (*ShadeKernel)(const Sphere& hitSphere, const Eigen::Vector3f& hitIntersection, const Scene& scene, int depth, bool ambient);
+
+/// <summary>
+/// The traceRayIterative instantiated for exactly the given SceneFeatures (e.g. a scene's
+/// features), out of the ones compiled ahead of time for every combination.
+/// </summary>
+TraceKernel selectTraceKernel(int features)
+{
+	static const TraceKernel kernels[allSceneFeatures + 1] = {
+		traceRayIterative<0>, traceRayIterative<1>, traceRayIterative<2>, traceRayIterative<3>,
+		traceRayIterative<4>, traceRayIterative<5>, traceRayIterative<6>, traceRayIterative<7>
+	};
+	return kernels[features & allSceneFeatures];
+}
+
+/// <summary>
+/// The shadeDiffuse instantiated for exactly the given SceneFeatures.
+/// </summary>
+ShadeKernel selectShadeKernel(int features)
+{
+	static const ShadeKernel kernels[allSceneFeatures + 1] = {
+		shadeDiffuse<0>, shadeDiffuse<1>, shadeDiffuse<2>, shadeDiffuse<3>,
+		shadeDiffuse<4>, shadeDiffuse<5>, shadeDiffuse<6>, shadeDiffuse<7>
+	};
+	return kernels[features & allSceneFeatures];
+}
@@ -0,0 +1,156 @@
+#pragma once
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include <Eigen/Dense>
+#include "BVH.hpp"
+#include "Scene.hpp"
+#include "ShadeBatch.hpp"
+#include "Sphere.hpp"
+#include "Stats.hpp"
+#include "Tracer.hpp"
+
+// Wavefront path tracing: instead of following each path to its end before starting the
+// next (traceRayIterative), a whole batch of paths is advanced one bounce at a time, in
+// stages:
+//
+//   1. find the closest hit of every ray in the queue,
+//   2. bucket the hits by material (misses get a bucket of their own),
+//   3. run each material's shading kernel over its whole bucket: diffuse hits are lit
+//      together with shadeDiffuseBatches (SIMD, with one shadow ray stream), mirrors and
+//      glass work out their next rays,
+//   4. the next rays form the queue for the next bounce.
+//
+// So each kernel runs over a long run of hits that all take the same branches, rather
+// than every ray switching between materials. Paths keep their state in a PathState, and
+// finish with exactly the colour traceRayIterative would have given them.
+
+const int nMaterials = REFRACTIVE + 1;
+
+/// <summary>
+/// A path waiting in a wavefront queue.
+/// </summary>
+struct WavefrontPath {
+	PathState state;
+	int pixel;    // Which colour it ends up in.
+	RayType type; // Of its current ray (only used for the stats).
+};
+
+/// <summary>
+/// The wavefront's queues. They're kept from bounce to bounce (and tile to tile, one set
+/// per thread), so after the first few tiles nothing is allocated.
+/// </summary>
+struct WavefrontQueues {
+	std::vector<WavefrontPath> paths, nextPaths;
+	std::vector<RayHit> hits;
+	std::vector<int> misses;
+	std::vector<int> byMaterial[nMaterials]; // Indices into paths.
+	std::vector<DiffuseHitBatch> diffuseBatches;
+	std::vector<Eigen::Vector3f> diffuseColours;
+};
+
+/// <summary>
+/// Traces n rays as a wavefront; colours[i] gets the colour seen along rays[i], the same as
+/// traceRayIterative(rays[i], scene, nullptr, cutoff). features picks the shading kernel
+/// (see shadeDiffuseBatches).
+/// </summary>
+void traceWavefront(const Scene& scene, const Ray* rays, int n, Eigen::Vector3f* colours, float cutoff = 0.f, int features = allSceneFeatures)
+{
+	thread_local WavefrontQueues queues;
+	std::vector<WavefrontPath>& paths = queues.paths;
+	paths.clear();
+	for (int i = 0; i < n; ++i) paths.push_back({ PathState(rays[i]), i, PRIMARY_RAY });
+
+	for (int depth = 0; !paths.empty(); ++depth) {
+		if (depth > maxBounces) {
+			for (const WavefrontPath& path : paths) {
+				STATS_ADD(bounceLimitHits, 1);
+				colours[path.pixel] = path.state.resolve(ambientColour);
+			}
+			break;
+		}
+
+		// Closest hits.
+		int nPaths = static_cast<int>(paths.size());
+		queues.hits.resize(nPaths);
+		for (int i = 0; i < nPaths; ++i) {
+			STATS_COUNT_RAY(paths[i].type, depth);
+			scene.bvh.closestHit(paths[i].state.ray, scene.spheres, queues.hits[i]);
+		}
+
+		// Bucket by material.
+		queues.misses.clear();
+		for (std::vector<int>& bucket : queues.byMaterial) bucket.clear();
+		for (int i = 0; i < nPaths; ++i) {
+			const RayHit& hit = queues.hits[i];
+			if (hit.sphere < 0) {
+				queues.misses.push_back(i);
+				continue;
+			}
+			int material = scene.spheres[hit.sphere].material;
+			if (material < 0 || material >= nMaterials) throw std::runtime_error("Unknown material type!");
+			queues.byMaterial[material].push_back(i);
+		}
+
+		for (int i : queues.misses) {
+			STATS_ADD(raysMissed, 1);
+			colours[paths[i].pixel] = paths[i].state.resolve(ambientColour);
+		}
+
+		// Diffuse: the paths end here.
+		const std::vector<int>& diffuse = queues.byMaterial[DIFFUSE];
+		int nBatches = (static_cast<int>(diffuse.size()) + DiffuseHitBatch::maxSize - 1) / DiffuseHitBatch::maxSize;
+		if (static_cast<int>(queues.diffuseBatches.size()) < nBatches) queues.diffuseBatches.resize(nBatches);
+		for (int b = 0; b < nBatches; ++b) queues.diffuseBatches[b].clear();
+		for (size_t j = 0; j < diffuse.size(); ++j) {
+			const RayHit& hit = queues.hits[diffuse[j]];
+			queues.diffuseBatches[j / DiffuseHitBatch::maxSize].add(scene.spheres[hit.sphere], hit.intersection);
+		}
+		queues.diffuseColours.resize(nBatches * DiffuseHitBatch::maxSize);
+		shadeDiffuseBatches(queues.diffuseBatches.data(), nBatches, scene, queues.diffuseColours.data(), depth, true, features);
+		for (size_t j = 0; j < diffuse.size(); ++j) {
+			const WavefrontPath& path = paths[diffuse[j]];
+			colours[path.pixel] = path.state.resolve(queues.diffuseColours[j]);
+		}
+
+		// Mirrors and glass: on to the next bounce, unless too little light could get back
+		// along the path to be worth it.
+		std::vector<WavefrontPath>& nextPaths = queues.nextPaths;
+		nextPaths.clear();
+		auto carryOn = [&](const WavefrontPath& path) {
+			if (path.state.throughput.maxCoeff() < cutoff) {
+				STATS_ADD(contributionCutoffs, 1);
+				colours[path.pixel] = path.state.resolve(ambientColour);
+			}
+			else nextPaths.push_back(path);
+		};
+		for (int i : queues.byMaterial[MIRROR]) {
+			WavefrontPath path = paths[i];
+			const RayHit& hit = queues.hits[i];
+			const Sphere& hitSphere = scene.spheres[hit.sphere];
+			Eigen::Vector3f normal = getSphereNormal(hitSphere, hit.intersection);
+			path.state.ray = Ray{ hit.intersection, reflect(path.state.ray.direction, normal) };
+			path.state.addFilter(hitSphere.colour);
+			path.state.depth = depth + 1;
+			path.type = REFLECTED_RAY;
+			carryOn(path);
+		}
+		for (int i : queues.byMaterial[REFRACTIVE]) {
+			WavefrontPath path = paths[i];
+			const RayHit& hit = queues.hits[i];
+			const Sphere& hitSphere = scene.spheres[hit.sphere];
+			Ray nextRay;
+			if (refractiveBounce(path.state.ray, hitSphere, hit.intersection, nextRay)) {
+				path.state.addFilter(hitSphere.colour);
+				path.type = REFRACTED_RAY;
+			}
+			else {
+				path.type = REFLECTED_RAY;
+			}
+			path.state.ray = nextRay;
+			path.state.depth = depth + 1;
+			carryOn(path);
+		}
+		std::swap(paths, nextPaths);
+	}
+}